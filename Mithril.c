@@ -1,37 +1,299 @@
 //
 // Created by syvon on 5/23/17.
 //
+// for vmsplice, pipe2 and the size of the pipes
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <termios.h>
 #include <unistd.h>
 #include <asm/errno.h>
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <memory.h>
+#include <malloc.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <regex.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <limits.h>
+
+#include "Mithril.h"
+
+// how much we read at once when following a file
+#define FOLLOW_READ_SIZE (1 << 20)
+// and how much in one tick, a file growing faster waits for the next ticks
+#define FOLLOW_TICK_BYTES (8 << 20)
+
+// what a save writes at once, the rows go there one after the other
+#define SAVE_BUFFER_SIZE (1 << 20)
+
+// a line whose hash has these bits at 0 ends a chunk, so about 64 lines per chunk
+#define CHUNK_BOUNDARY_MASK 63
+#define CHUNK_MAX_LINES 1024
+
+// background tabs that were not looked at for that long are hibernated
+#define HIBERNATE_AFTER_SECONDS 600
+// and when the background tabs use more than that, the oldest ones are hibernated
+#define HIBERNATE_BUDGET_MB 256
+
+// files at least that big keep the rows far from the cursor compressed
+#define COLD_MIN_MB 64
+// how many rows around the cursor stay hot
+#define COLD_WINDOW_ROWS 4096
+// how many rows are compressed together
+#define COLD_BLOCK_ROWS 64
+// and at most that many bytes (the rows know their offset in the block as an int)
+#define COLD_BLOCK_MAX_BYTES (1 << 30)
+// how many decompressed blocks we keep around
+#define COLD_CACHE_BLOCKS 16
+// how many rows an idle tick looks at when cooling
+#define COLD_SCAN_ROWS 65536
+
+// files at least that big get a line index in the cache directory
+#define INDEX_MIN_MB 32
+// how many pieces of the file the validity key of an index reads, and how big
+#define INDEX_SAMPLES 16
+#define INDEX_SAMPLE_BYTES 4096
+
+// the loaded rows are carved from arenas that big
+#define ARENA_SIZE (1 << 20)
+
+// the most threads reading files in the background
+#define LOAD_MAX_WORKERS 8
+
+// how many tabs on each side of the current one are read in the background
+#define PREFETCH_TABS 1
+
+// the rows whose colours are kept, more than a screen
+#define HL_CACHE_ROWS 256
+// the most rows above the screen lexed to draw a frame, the idle ticks lex the others
+#define HL_DRAW_ROWS 16384
+#define HL_SCAN_ROWS 16384
+// longer rows are not highlighted
+#define HL_MAX_ROW_BYTES (1 << 20)
+// the rows whose display columns are kept, more than a screen
+#define COL_CACHE_ROWS 256
+// rows at least that long find their columns a chunk at a time
+#define COL_LONG_ROW (64 * 1024)
+#define COL_CHUNK (4 * 1024)
+// how many rows an idle tick counts the screen lines of, when the rows wrap
+#define WRAP_SCAN_ROWS 16384
+// the rows summed together, the sums of the screen lines are a tree over them
+#define WRAP_BLOCK_ROWS 256
+
+// the most threads sorting or filtering the rows, each gets at least that many rows
+#define TRANSFORM_MAX_WORKERS 8
+#define TRANSFORM_MIN_ROWS 65536
+// the rows tied on their prefixes are sorted on their whole keys up to that many, even cold
+#define TIE_WHOLE_ROWS 64
+
+// what goes to a command at once, and what is read back from it
+#define PIPE_BUFFER_SIZE (256 * 1024)
+// rows at least that long go to the pipe from where they are, without a copy
+#define PIPE_SPLICE_MIN (64 * 1024)
+// how often the screen shows how far a command got
+#define PIPE_PROGRESS_MS 250
+
+// the columns left of the rows that mark how they differ from the file
+#define DIFF_GUTTER_COLS 2
+// a diff needing more edits than that is shown as a single change
+#define DIFF_MAX_EDITS 1024
+// spans of rows at least that long are matched by chunks first, then diffed between them
+#define DIFF_CHUNK_MIN_ROWS 4096
+
+// how many of the last edits the performance overlay averages
+#define PERF_WINDOW 32
+
+// how many keys the input thread reads ahead of the core, a power of two
+#define KEY_QUEUE_SIZE 1024
+
+/*** performance overlay ***/
+
+enum EditOperation {
+    EDIT_INSERT = 0,
+    EDIT_NEWLINE,
+    EDIT_BACKSPACE,
+    EDIT_DELETE,
+    NUM_EDIT_OPERATIONS,
+    EDIT_NONE = NUM_EDIT_OPERATIONS
+};
+
+/**
+ * What the performance overlay shows, about
+ * the last frame and the last edits
+ */
+struct PerfStats {
+    int shown;
+    uint64_t keyNanos; // when the key being handled was read, 0 once it is painted
+    uint64_t inputToPaint;
+    uint64_t frameBuild;
+    size_t frameBytes;
+    unsigned long syscalls; // reads and writes of the terminal, since the last frame
+    unsigned long frameSyscalls;
+    unsigned long allocations; // since the last frame, the threads reading files count too
+    unsigned long frameAllocations;
+    uint64_t editNanos[NUM_EDIT_OPERATIONS][PERF_WINDOW];
+    int editCount[NUM_EDIT_OPERATIONS];
+};
+
+struct PerfStats perf;
+
+uint64_t perfNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void *countedMalloc(size_t size) {
+    __atomic_add_fetch(&perf.allocations, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+void *countedCalloc(size_t count, size_t size) {
+    __atomic_add_fetch(&perf.allocations, 1, __ATOMIC_RELAXED);
+    return calloc(count, size);
+}
+
+void *countedRealloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&perf.allocations, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+}
 
-#define VERSION "1.0.0"
-
-// allows to get the keycode of a ctrl+something key, that macro thing
-// is definetly new to me
-#define CTRL_KEY(k) ((k) & 0x1f)
-
-enum EditorKey {
-    BACKSPACE = 127,
-    ARROW_LEFT = 1000,
-    ARROW_RIGHT,
-    ARROW_UP,
-    ARROW_DOWN,
-    DEL_KEY,
-    HOME_KEY,
-    END_KEY,
-    PG_UP,
-    PG_DOWN,
-    MOVE_TAB_LEFT,
-    MOVE_TAB_RIGHT
+// from here, the allocations of the editor are counted
+#define malloc(size) countedMalloc(size)
+#define calloc(count, size) countedCalloc(count, size)
+#define realloc(ptr, size) countedRealloc(ptr, size)
+
+/*** memory accounting ***/
+
+// what malloc keeps in front of each block
+#define MALLOC_HEADER sizeof(size_t)
+
+/**
+ * The buffers of the editor itself, the rows are
+ * counted in their documents
+ */
+struct EditorMemory {
+    struct MemAccount frame;
+    struct MemAccount message;
+    struct MemAccount cursors;
+    struct MemAccount yank; // the yank buffer, its rows and their array
+    struct MemAccount shared; // what the closed documents left to the copied rows
+    struct MemAccount undo; // the rows the last transform took out, and where the rows were
 };
 
+struct EditorMemory editorMemory;
+
+/**
+ * Adds (sign 1) or removes (sign -1) a block from an account
+ * @param payload what was asked for the block
+ */
+void memCount(struct MemAccount *account, void *ptr, size_t payload, int sign) {
+    if (NULL == account || NULL == ptr) {
+        return;
+    }
+
+    size_t usable = malloc_usable_size(ptr);
+
+    if (sign > 0) {
+        account->payload += payload;
+        account->usable += usable;
+        ++account->blocks;
+
+        if (account->usable > account->peak) {
+            account->peak = account->usable;
+        }
+    } else {
+        account->payload -= payload;
+        account->usable -= usable;
+        --account->blocks;
+    }
+}
+
+void *memAlloc(struct MemAccount *account, size_t size) {
+    void *ptr = malloc(size);
+    memCount(account, ptr, size, 1);
+    return ptr;
+}
+
+void *memRealloc(struct MemAccount *account, void *ptr, size_t oldSize, size_t size) {
+    memCount(account, ptr, oldSize, -1);
+
+    void *newPtr = realloc(ptr, size);
+
+    if (newPtr) {
+        memCount(account, newPtr, size, 1);
+    } else {
+        memCount(account, ptr, oldSize, 1);
+    }
+
+    return newPtr;
+}
+
+void memFree(struct MemAccount *account, void *ptr, size_t size) {
+    memCount(account, ptr, size, -1);
+    free(ptr);
+}
+
+void memSum(struct MemAccount *into, struct MemAccount *from) {
+    into->payload += from->payload;
+    into->usable += from->usable;
+    into->blocks += from->blocks;
+
+    if (into->usable > into->peak) {
+        into->peak = into->usable;
+    }
+}
+
+/**
+ * Moves what an account counts into another one
+ */
+void memMerge(struct MemAccount *into, struct MemAccount *from) {
+    memSum(into, from);
+    memset(from, 0, sizeof(struct MemAccount));
+}
+
+size_t memAllocated(struct MemAccount *account) {
+    return account->usable + (size_t) account->blocks * MALLOC_HEADER;
+}
+
+/**
+ * @return 1 when the bytes of the row are a malloc of its own,
+ * not inline, in an arena or in a cold block
+ */
+int rowHasOwnBlock(struct Row *row) {
+    return row->coldOffset != ROW_INLINE && NULL == row->cold && NULL == row->arena;
+}
+
+/**
+ * Counts a hot row as it is now. The edits take it out of
+ * the account before changing it, and put it back after.
+ */
+void memAddRow(struct MemAccount *account, struct Row *row) {
+    if (rowHasOwnBlock(row)) {
+        memCount(account, row->rawContent, (size_t) row->rawSize + 1, 1);
+    }
+}
+
+void memRemoveRow(struct MemAccount *account, struct Row *row) {
+    if (rowHasOwnBlock(row)) {
+        memCount(account, row->rawContent, (size_t) row->rawSize + 1, -1);
+    }
+}
+
 void fatal(char *message) {
     write(STDOUT_FILENO, "\x1b[2J", 4); //send an escape sequence to erase the screen
     write(STDOUT_FILENO, "\x1b[H", 3); //resends the cursor at the top of the screen
@@ -39,64 +301,74 @@ void fatal(char *message) {
     exit(1);
 }
 
+struct Environment env;
+
+struct Session currentSession;
+
+
+int editorPollWatchers();
+
+void editorHibernateTabs();
+
+void editorCoolDocuments();
+
+void editorSweepArenas();
+
+void editorCollectPrefetched();
+
+int editorHighlightIdle();
+
+int editorWrapIdle();
+
+int editorPollResize();
+
+int editorIdle() {
+    editorCollectPrefetched();
+
+    int refresh = editorPollResize();
+    refresh |= editorPollWatchers();
+    refresh |= editorHighlightIdle();
+    refresh |= editorWrapIdle();
+
+    editorHibernateTabs();
+    editorCoolDocuments();
+    editorSweepArenas();
+
+    return refresh;
+}
+
 /**
- * A text row
- * We use rawSize and rawContent
- * to be able to render some
- * characters differently (like tabs)
+ * Reads one byte of input, from the terminal or the input hook
  */
-struct Row {
-    int rawSize;
-    char *rawContent;
-};
+ssize_t readInput(char *c) {
+    __atomic_add_fetch(&perf.syscalls, 1, __ATOMIC_RELAXED);
 
-struct Tab {
-    char *fileName;
-    int numRows;
-    int changesCount;
-    struct Row *rows;
-};
+    if (env.readInput) {
+        return env.readInput(c);
+    }
+
+    return read(STDIN_FILENO, c, 1);
+}
 
 /**
- * A struct that
- * contains the environnement
- * settings like the available rows
+ * Writes to the terminal, or to the output hook
  */
-struct Environment {
-    int screenRows;
-    int screenCols;
-    int usableTextScreenRows;
-    /*** The user's terminal settings ***/
-    struct termios orig_termios;
+ssize_t editorWrite(const char *buf, size_t len) {
+    __atomic_add_fetch(&perf.syscalls, 1, __ATOMIC_RELAXED);
 
-};
+    if (env.writeOutput) {
+        return env.writeOutput(buf, len);
+    }
 
-struct Environment env;
+    return write(STDOUT_FILENO, buf, len);
+}
 
-/**
- * A struct to store
- * the current session
- * of editing
- */
-struct Session {
-    /*** Cursor positioning ***/
-    int colOffset;
-    int rowOffset;
-    int cursorRow;
-    int cursorCol;
-    /*** tabs that the user can open ***/
-    int currentTabIdx;
-    int numTabs;
-    struct Tab *tabs;
-    /*** message editor row ***/
-    int messageLength;
-    struct Row messageRow;
-    /*** mvmt locked ***/
-    int locked;
-};
+int decodeKey(char cRead);
 
-struct Session currentSession;
+int popKey(int *key);
 
+// a key read while something long was running, given before the others
+int keyAhead = -1;
 
 /**
  *
@@ -105,21 +377,50 @@ struct Session currentSession;
 int readKey() {
     int lenRead;
     char cRead;
-    while ((lenRead = read(STDIN_FILENO, &cRead, 1) != 1)) {
-        if (lenRead == -1 && errno != EAGAIN) {
+    int key;
+
+    if (keyAhead != -1) {
+        key = keyAhead;
+        keyAhead = -1;
+        return key;
+    }
+
+    // the input thread already read and decoded it
+    if (popKey(&key)) {
+        return key;
+    }
+
+    while ((lenRead = (int) readInput(&cRead)) != 1) {
+        if (lenRead == -1 && errno != EAGAIN && errno != EINTR) {
             fatal("read");
             return -1;
         }
+
+        // the read timed out, a good time to look at the opened files
+        if (editorIdle()) {
+            editorRefreshScreen();
+        }
     }
 
+    perf.keyNanos = perfNow();
+
+    return decodeKey(cRead);
+}
+
+/**
+ * Reads the rest of a key from its first byte,
+ * the special keys are escape sequences
+ * @return the key
+ */
+int decodeKey(char cRead) {
     if (cRead == '\x1b') {
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+        if (readInput(&seq[0]) != 1) {
             return '\x1b';
         }
 
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+        if (readInput(&seq[1]) != 1) {
             return '\x1b';
         }
 
@@ -128,7 +429,7 @@ int readKey() {
 
             if (seq[1] >= '0' && seq[1] <= '9') {
 
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+                if (readInput(&seq[2]) != 1) {
                     return '\x1b';
                 }
 
@@ -156,11 +457,11 @@ int readKey() {
                     }
                 } else if (seq[2] == ';') {
 
-                    if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+                    if (readInput(&seq[0]) != 1) {
                         return '\x1b';
                     }
 
-                    if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+                    if (readInput(&seq[1]) != 1) {
                         return '\x1b';
                     }
 
@@ -205,6 +506,254 @@ int readKey() {
 }
 
 
+/*** input and render threads ***/
+
+/**
+ * The keys the input thread decoded, waiting for the core. A single
+ * thread pushes and a single one pops, so the head and the tail are
+ * each written by one of them and nothing is locked.
+ */
+struct KeyQueue {
+    int running;
+    int keys[KEY_QUEUE_SIZE];
+    uint64_t readNanos[KEY_QUEUE_SIZE]; // when each key was read, for the performance overlay
+    size_t head; // the next key pushed goes there, only the input thread writes it
+    char pad[64]; // not on the cache line of head, the threads would fight over it
+    size_t tail; // the next key popped, only the core writes it
+    int wakeFd; // an eventfd, counts the keys pushed while the core may be waiting
+    pthread_t thread;
+};
+
+struct KeyQueue keyQueue;
+
+/**
+ * A frame the core built, painted by the render thread. The core never waits for the
+ * terminal: a frame still waiting when the next one is built is replaced by it.
+ */
+struct Painter {
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // a frame is waiting, or one was painted
+    char *pending; // the frame to paint next, NULL when there is none
+    size_t pendingLen;
+    uint64_t pendingKeyNanos; // when the key the pending frame answers was read, 0 for none
+    int painting;
+    pthread_t thread;
+};
+
+struct Painter painter = {.lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER};
+
+/**
+ * Gives a key to the core, waiting when the core is a whole queue behind
+ * @param readNanos when it was read
+ */
+void pushKey(int key, uint64_t readNanos) {
+    size_t head = keyQueue.head;
+
+    while (head - __atomic_load_n(&keyQueue.tail, __ATOMIC_ACQUIRE) == KEY_QUEUE_SIZE) {
+        struct timespec wait = {0, 1000000};
+        nanosleep(&wait, NULL);
+    }
+
+    keyQueue.keys[head % KEY_QUEUE_SIZE] = key;
+    keyQueue.readNanos[head % KEY_QUEUE_SIZE] = readNanos;
+    __atomic_store_n(&keyQueue.head, head + 1, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+
+    if (write(keyQueue.wakeFd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        fatal("Failed to wake up the core (pushKey)");
+    }
+}
+
+/**
+ * Reads and decodes the keys, whatever the core is busy with
+ */
+void *inputWorker(void *arg) {
+    (void) arg;
+
+    for (;;) {
+        char c;
+        ssize_t lenRead = readInput(&c);
+
+        if (lenRead == 1) {
+            uint64_t readNanos = perfNow();
+            pushKey(decodeKey(c), readNanos);
+        } else if (lenRead == -1 && errno != EAGAIN && errno != EINTR) {
+            fatal("read");
+        }
+    }
+}
+
+/**
+ * Takes the next key the input thread decoded, the idle ticks run while there is none
+ * @param key where it goes
+ * @return 0 when there is no input thread, the core reads the keys itself
+ */
+int popKey(int *key) {
+    if (!keyQueue.running) {
+        return 0;
+    }
+
+    size_t tail = keyQueue.tail;
+
+    while (tail == __atomic_load_n(&keyQueue.head, __ATOMIC_ACQUIRE)) {
+        struct pollfd wake = {.fd = keyQueue.wakeFd, .events = POLLIN};
+        uint64_t count;
+
+        // a tenth of a second without a key, like a read of the terminal timing out
+        if (poll(&wake, 1, 100) == 1) {
+            if (read(keyQueue.wakeFd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                fatal("Failed to wait for the keys (popKey)");
+            }
+        } else if (editorIdle()) {
+            editorRefreshScreen();
+        }
+    }
+
+    *key = keyQueue.keys[tail % KEY_QUEUE_SIZE];
+    perf.keyNanos = keyQueue.readNanos[tail % KEY_QUEUE_SIZE];
+    __atomic_store_n(&keyQueue.tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+int editorKeysPending() {
+    return keyQueue.running && keyQueue.tail != __atomic_load_n(&keyQueue.head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Takes the next key only when it is that one, so something long can be
+ * stopped while it runs. The other keys wait for it to be done.
+ * @return 1 when the key was taken
+ */
+int popKeyIf(int key) {
+    // without the input thread, a key that is already there is read, and kept for later when it is another one
+    if (!keyQueue.running) {
+        char c;
+        struct pollfd in = {.fd = STDIN_FILENO, .events = POLLIN};
+
+        if (keyAhead == -1 && (env.readInput || poll(&in, 1, 0) == 1) && readInput(&c) == 1) {
+            keyAhead = decodeKey(c);
+        }
+
+        if (keyAhead != key) {
+            return 0;
+        }
+
+        keyAhead = -1;
+        return 1;
+    }
+
+    size_t tail = keyQueue.tail;
+
+    if (!editorKeysPending() || keyQueue.keys[tail % KEY_QUEUE_SIZE] != key) {
+        return 0;
+    }
+
+    __atomic_store_n(&keyQueue.tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Writes the frames to the terminal, as slow as it is
+ */
+void *paintWorker(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&painter.lock);
+
+    for (;;) {
+        while (NULL == painter.pending) {
+            pthread_cond_wait(&painter.changed, &painter.lock);
+        }
+
+        char *frame = painter.pending;
+        size_t len = painter.pendingLen;
+        uint64_t keyNanos = painter.pendingKeyNanos;
+
+        painter.pending = NULL;
+        painter.pendingKeyNanos = 0;
+        painter.painting = 1;
+        pthread_mutex_unlock(&painter.lock);
+
+        for (size_t done = 0; done < len;) {
+            ssize_t written = editorWrite(frame + done, len - done);
+
+            if (written == -1 && errno != EINTR && errno != EAGAIN) {
+                break;
+            }
+
+            done += written > 0 ? (size_t) written : 0;
+        }
+
+        free(frame);
+
+        // the key is only painted now that the frame is on the terminal
+        if (keyNanos) {
+            __atomic_store_n(&perf.inputToPaint, perfNow() - keyNanos, __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(&painter.lock);
+        painter.painting = 0;
+        pthread_cond_broadcast(&painter.changed);
+    }
+}
+
+/**
+ * Hands a frame to the render thread, it is its own from now on
+ * @param keyNanos when the key the frame answers was read, 0 for none
+ * @return 0 when there is no render thread, the core paints the frame itself
+ */
+int publishFrame(char *frame, size_t len, uint64_t keyNanos) {
+    if (!painter.running) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&painter.lock);
+
+    // not painted yet, the new frame shows all of it anyway
+    char *skipped = painter.pending;
+
+    painter.pending = frame;
+    painter.pendingLen = len;
+
+    // the skipped frame's key is answered by this one, and it waited longer
+    if (!skipped || !painter.pendingKeyNanos) {
+        painter.pendingKeyNanos = keyNanos;
+    }
+    pthread_cond_broadcast(&painter.changed);
+    pthread_mutex_unlock(&painter.lock);
+
+    free(skipped);
+    return 1;
+}
+
+/**
+ * Waits until the frames handed to the render thread are on the terminal
+ */
+void editorPaintWait() {
+    pthread_mutex_lock(&painter.lock);
+
+    while (painter.running && (painter.pending || painter.painting)) {
+        pthread_cond_wait(&painter.changed, &painter.lock);
+    }
+
+    pthread_mutex_unlock(&painter.lock);
+}
+
+void editorStartThreads() {
+    keyQueue.wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    // without them, the core reads the keys and paints the frames as before
+    if (keyQueue.wakeFd == -1) {
+        return;
+    }
+
+    painter.running = pthread_create(&painter.thread, NULL, paintWorker, NULL) == 0;
+    keyQueue.running = pthread_create(&keyQueue.thread, NULL, inputWorker, NULL) == 0;
+}
+
 /**
  * Get the current tab being edited
  * @return a pointer on the tab or NULL if none
@@ -222,6 +771,16 @@ struct Tab *getCurrentTab() {
     return tab;
 }
 
+/**
+ * Get the document of the current tab
+ * @return a pointer on the document or NULL if none
+ */
+struct Document *getCurrentDoc() {
+    struct Tab *tab = getCurrentTab();
+
+    return tab ? tab->doc : NULL;
+}
+
 /**
  * Gets the current row being edited
  * @return a pointer on the row or NULL if none
@@ -233,12 +792,12 @@ struct Row *getCurrentRow() {
         return &currentSession.messageRow;
     }
 
-    struct Tab *currentTab = getCurrentTab();
-    if (currentTab) {
-        int realRowIdx = (currentSession.cursorRow);
+    struct Document *doc = getCurrentDoc();
+    if (doc) {
+        int64_t realRowIdx = (currentSession.cursorRow);
 
-        if ((realRowIdx > -1) && (realRowIdx < currentTab->numRows)) {
-            row = &currentTab->rows[realRowIdx];
+        if ((realRowIdx > -1) && (realRowIdx < doc->numRows)) {
+            row = &doc->rows[realRowIdx];
         } else {
             row = NULL;
         }
@@ -249,6 +808,28 @@ struct Row *getCurrentRow() {
     return row;
 }
 
+/**
+ * @return the account of the row the edits go to, the
+ * message row when a prompt is shown
+ */
+struct MemAccount *currentRowAccount() {
+    if (currentSession.locked) {
+        return &editorMemory.message;
+    }
+
+    return &getCurrentDoc()->rowMemory;
+}
+
+/**
+ * The current row was edited, that is a change of the document
+ * unless it is the message row (what is typed in a prompt)
+ */
+void currentRowCountChange(struct Document *doc) {
+    if (!currentSession.locked) {
+        ++doc->changesCount;
+    }
+}
+
 /**
  * Gets the position of the cursor
  * @param rows an int pointer towards the var we want to fill with the number of rows
@@ -304,42 +885,307 @@ int getWindowSize(int *rows, int *cols) {
 }
 
 
-/*** row operations ***/
+char *rowChars(struct Row *row);
 
-void rowClearTabs(struct Row *row) {
-    int tabs = 0;
-    int j;
+void rowMakeHot(struct Row *row);
 
-    for (j = 0; j < row->rawSize; ++j) {
-        if (row->rawContent[j] == '\t') {
-            ++tabs;
-        }
-    }
+void docFreeRow(struct Document *doc, struct Row *row);
 
-    if (tabs > 0) {
-        char *newContent = malloc((size_t) ((row->rawSize + 1) + (tabs * 7) + 1));
+/*** arenas ***/
 
-        int idx = 0;
+/**
+ * A big block the loaded rows of a document are carved from,
+ * so loading does not malloc every row. The rows being copied
+ * move there too, to be shared. It goes away once none of
+ * its rows use it anymore.
+ */
+struct Arena {
+    struct Arena *next;
+    size_t used;
+    size_t live; // the bytes of the rows still in it
+    char bytes[];
+};
 
-        for (j = 0; j < row->rawSize; ++j) {
+// the arenas of the closed documents whose rows were copied, and are still used
+struct Arena *sharedArenas;
 
-            if (row->rawContent[j] == '\t') {
-                newContent[idx++] = ' ';// add one because the tab takes at least one space
-                while (idx % 8 != 0) { // go to a tab stop (each 8 char is a tab col)
-                    newContent[idx++] = ' ';
-                }
-            } else {
-                newContent[idx++] = row->rawContent[j];
-            }
+/**
+ * @param arena set to the arena the bytes come from
+ * @return room for size bytes in the arenas of the document, NULL
+ * when the row should better be allocated on its own
+ */
+char *docArenaAlloc(struct Document *doc, size_t size, struct Arena **arena) {
+    if (size > ARENA_SIZE / 8) {
+        return NULL;
+    }
+
+    struct Arena *current = doc->arenas;
+
+    if (NULL == current || current->used + size > ARENA_SIZE) {
+        current = memAlloc(&doc->arenaMemory, sizeof(struct Arena) + ARENA_SIZE);
+
+        if (NULL == current) {
+            return NULL;
         }
 
+        current->used = 0;
+        current->live = 0;
+        current->next = doc->arenas;
+        doc->arenas = current;
+    }
+
+    char *bytes = current->bytes + current->used;
+    current->used += size;
+    current->live += size;
+    *arena = current;
+
+    return bytes;
+}
+
+/**
+ * Moves the rows of a range that have bytes of their own to the arenas, so
+ * they can be shared instead of copied. The bytes are moved, not doubled,
+ * and a row too long for an arena keeps them.
+ */
+void docRowsToArenas(struct Document *doc, int64_t from, int64_t to) {
+    for (int64_t i = from; i < to; ++i) {
+        struct Row *row = &doc->rows[i];
+        struct Arena *arena = NULL;
+        char *bytes;
+
+        if (!rowHasOwnBlock(row) || NULL == (bytes = docArenaAlloc(doc, (size_t) row->rawSize + 1, &arena))) {
+            continue;
+        }
+
+        memRemoveRow(&doc->rowMemory, row);
+        memcpy(bytes, row->rawContent, (size_t) row->rawSize + 1);
         free(row->rawContent);
-        row->rawContent = newContent;
+        row->rawContent = bytes;
+        row->arena = arena;
+    }
+}
+
+/**
+ * The row stops using its arena
+ */
+void rowLeaveArena(struct Row *row) {
+    row->arena->live -= (size_t) row->rawSize + 1;
+    row->arena = NULL;
+}
+
+/**
+ * Frees the arenas of a list none of the rows use anymore
+ * @param link where the list starts
+ * @param account what counts the arenas
+ */
+void arenasSweep(struct Arena **link, struct MemAccount *account) {
+    while (*link) {
+        struct Arena *arena = *link;
+
+        if (arena->live == 0) {
+            *link = arena->next;
+            memFree(account, arena, sizeof(struct Arena) + ARENA_SIZE);
+        } else {
+            link = &arena->next;
+        }
+    }
+}
+
+void docSweepArenas(struct Document *doc) {
+    arenasSweep(&doc->arenas, &doc->arenaMemory);
+}
+
+/**
+ * The edited rows left their arenas, the ones that
+ * are not used anymore can go
+ */
+void editorSweepArenas() {
+    for (int d = 0; d < currentSession.numDocs; ++d) {
+        docSweepArenas(currentSession.docs[d]);
+    }
+
+    arenasSweep(&sharedArenas, &editorMemory.shared);
+}
+
+/**
+ * Gives the arenas of a document (a scratch one) to another one
+ */
+void docTakeArenas(struct Document *doc, struct Document *from) {
+    if (NULL == from->arenas) {
+        return;
+    }
+
+    struct Arena *last = from->arenas;
+
+    while (last->next) {
+        last = last->next;
+    }
+
+    last->next = doc->arenas;
+    doc->arenas = from->arenas;
+    from->arenas = NULL;
+
+    memMerge(&doc->arenaMemory, &from->arenaMemory);
+}
+
+/*** row operations ***/
+
+void currentRowSpliced(int64_t at, int64_t removed, int64_t inserted);
+
+void docRowChanged(struct Document *doc, int64_t row);
+
+void docRowsInserted(struct Document *doc, int64_t at, int64_t count);
+
+void docRowsRemoved(struct Document *doc, int64_t at, int64_t count);
+
+void docRowsReset(struct Document *doc);
+
+struct ColumnMap *currentColumnMap();
+
+int64_t cursorColumn();
+
+int64_t cursorColumnEnd();
+
+int64_t nextCharEnd(const char *s, int64_t len, int64_t pos);
+
+int64_t prevCharStart(const char *s, int64_t len, int64_t pos);
+
+int rowIsInline(struct Row *row) {
+    return row->coldOffset == ROW_INLINE;
+}
+
+/**
+ * Gives a hot row room for size bytes and its '\0', in the row
+ * itself when they fit. The bytes it had are kept (as much as fits),
+ * rawSize is up to the caller.
+ * @param row the row, rowMakeHot must have been called
+ * @param size the number of bytes
+ * @return the bytes of the row
+ */
+char *rowResize(struct Row *row, int64_t size) {
+    int64_t kept = (size < row->rawSize ? size : row->rawSize) + 1;
+
+    if (rowIsInline(row)) {
+        if ((size_t) size < ROW_INLINE_SIZE) {
+            return row->inlineContent;
+        }
+
+        char *content = malloc((size_t) size + 1);
+
+        if (NULL == content) {
+            fatal("Failed to grow a row (rowResize)");
+            return NULL;
+        }
+
+        memcpy(content, row->inlineContent, (size_t) kept);
+        row->coldOffset = 0;
+        row->rawContent = content;
+        row->cold = NULL;
+        row->arena = NULL;
+
+        return content;
+    }
+
+    if ((size_t) size < ROW_INLINE_SIZE) {
+        char *content = row->rawContent;
+
+        // the pointer is overwritten by the bytes
+        if (content) {
+            memcpy(row->inlineContent, content, (size_t) kept);
+            free(content);
+        } else {
+            row->inlineContent[0] = '\0';
+        }
+
+        row->coldOffset = ROW_INLINE;
+        return row->inlineContent;
+    }
+
+    char *content = realloc(row->rawContent, (size_t) size + 1);
+
+    if (NULL == content) {
+        fatal("Failed to resize a row (rowResize)");
+        return NULL;
+    }
+
+    row->rawContent = content;
+    return content;
+}
+
+/**
+ * Fills a new row, in the row itself when it is short enough
+ */
+void rowSetChars(struct Row *row, const char *s, size_t len) {
+    row->rawSize = (int64_t) len;
+    row->cold = NULL;
+    row->arena = NULL;
+
+    char *content;
+
+    if (len < ROW_INLINE_SIZE) {
+        row->coldOffset = ROW_INLINE;
+        content = row->inlineContent;
+    } else {
+        row->coldOffset = 0;
+        row->rawContent = content = malloc(len + 1);
+    }
+
+    //fill the content
+    memcpy(content, s, len);
+    content[len] = '\0';
+}
+
+/**
+ * Expands the tabs of a row, from a byte on. The bytes
+ * before it must not have tabs anymore.
+ * @param row the row
+ * @param from where the tabs can start
+ */
+void rowClearTabsFrom(struct Row *row, int64_t from) {
+    int64_t tabs = 0;
+    int64_t j;
+    char *chars = rowChars(row);
+
+    for (j = from; j < row->rawSize; ++j) {
+        if (chars[j] == '\t') {
+            ++tabs;
+        }
+    }
+
+    if (tabs > 0) {
+        char *newContent = malloc((size_t) ((row->rawSize + 1) + (tabs * 7) + 1));
+
+        memcpy(newContent, chars, (size_t) from);
+        int64_t idx = from;
+
+        for (j = from; j < row->rawSize; ++j) {
+
+            if (chars[j] == '\t') {
+                newContent[idx++] = ' ';// add one because the tab takes at least one space
+                while (idx % 8 != 0) { // go to a tab stop (each 8 char is a tab col)
+                    newContent[idx++] = ' ';
+                }
+            } else {
+                newContent[idx++] = chars[j];
+            }
+        }
+
+        chars = rowResize(row, idx);
+        memcpy(chars, newContent, (size_t) idx);
+        chars[idx] = '\0';
         row->rawSize = idx;
+        free(newContent);
     }
 }
 
-void editorRowInsertTab(struct Row *row, int at) {
+void rowClearTabs(struct Row *row) {
+    rowClearTabsFrom(row, 0);
+}
+
+void editorRowInsertTab(struct Row *row, int64_t at) {
+
+    struct Document *doc = getCurrentDoc();
+    currentRowCountChange(doc);
 
     if (!row) {
         fatal("Missing row (editorInsertChar)");
@@ -350,20 +1196,27 @@ void editorRowInsertTab(struct Row *row, int at) {
         at = row->rawSize;
     }
 
-    row->rawContent = realloc(row->rawContent, (size_t) row->rawSize + 5);
+    struct MemAccount *account = currentRowAccount();
+    memRemoveRow(account, row);
 
-    memmove(&row->rawContent[at + 4], &row->rawContent[at], (size_t) (row->rawSize - at + 1));
+    rowMakeHot(row);
+    char *chars = rowResize(row, row->rawSize + 4);
+
+    memmove(&chars[at + 4], &chars[at], (size_t) (row->rawSize - at + 1));
     row->rawSize += 4;
 
     for (int i = 0; i < 4; ++i) {
-        row->rawContent[at + i] = ' ';
+        chars[at + i] = ' ';
     }
+
+    memAddRow(account, row);
+    currentRowSpliced(at, 0, 4);
 }
 
-void editorRowInsertChar(struct Row *row, int at, int c) {
+void editorRowInsertChar(struct Row *row, int64_t at, int c) {
 
-    struct Tab *currentTab = getCurrentTab();
-    ++currentTab->changesCount;
+    struct Document *doc = getCurrentDoc();
+    currentRowCountChange(doc);
 
     if (!row) {
         fatal("Missing row (editorInsertChar)");
@@ -374,60 +1227,259 @@ void editorRowInsertChar(struct Row *row, int at, int c) {
         at = row->rawSize;
     }
 
-    row->rawContent = realloc(row->rawContent, (size_t) row->rawSize + 2);
+    struct MemAccount *account = currentRowAccount();
+    memRemoveRow(account, row);
 
-    memmove(&row->rawContent[at + 1], &row->rawContent[at], (size_t) (row->rawSize - at + 1));
+    rowMakeHot(row);
+    char *chars = rowResize(row, row->rawSize + 1);
+
+    memmove(&chars[at + 1], &chars[at], (size_t) (row->rawSize - at + 1));
     ++row->rawSize;
-    row->rawContent[at] = (char) c;
+    chars[at] = (char) c;
+
+    memAddRow(account, row);
+    currentRowSpliced(at, 0, 1);
 }
 
-void editorAppendRow(char *s, size_t len) {
+/**
+ * Makes sure the document has room for at least count rows.
+ * The room grows geometrically so appending a lot of rows
+ * (loading or following a file) does not realloc on every row
+ * @param doc the document to grow
+ * @param count the number of rows we need room for
+ */
+void docReserveRows(struct Document *doc, int64_t count) {
+    if (count <= doc->rowCap) {
+        return;
+    }
 
-    struct Tab *currentTab = getCurrentTab();
+    int64_t newCap = doc->rowCap < 16 ? 16 : doc->rowCap;
 
-    if (NULL == currentTab) {
-        fatal("No current tab (append row)");
+    while (newCap < count) {
+        newCap *= 2;
+    }
+
+    struct Row *rows = memRealloc(&doc->arrayMemory, doc->rows, sizeof(struct Row) * (size_t) doc->rowCap,
+                                  sizeof(struct Row) * (size_t) newCap);
+
+    if (NULL == rows) {
+        fatal("Failed to grow the rows (docReserveRows)");
+        return;
+    }
+
+    doc->rows = rows;
+    doc->rowCap = newCap;
+}
+
+void rowInit(struct Row *row, const char *s, size_t len) {
+    rowSetChars(row, s, len);
+    rowClearTabs(row);
+}
+
+/**
+ * Fills a new row of a document from its arenas (or the row
+ * itself for a short one), the tabs expanded like rowClearTabs does.
+ * The documents whose far rows get compressed do not use arenas,
+ * the arenas could not be freed.
+ */
+void docRowInit(struct Document *doc, struct Row *row, const char *s, size_t len) {
+    if (doc->coldStorage) {
+        rowInit(row, s, len);
+        return;
+    }
+
+    // most lines have no tab, they are copied as they are
+    int hasTabs = memchr(s, '\t', len) != NULL;
+    size_t expanded = hasTabs ? 0 : len;
+
+    for (size_t j = 0; hasTabs && j < len; ++j) {
+        expanded = s[j] == '\t' ? (expanded / 8 + 1) * 8 : expanded + 1;
+    }
+
+    struct Arena *arena = NULL;
+    char *content;
+
+    if (expanded < ROW_INLINE_SIZE) {
+        content = row->inlineContent;
+    } else if (NULL == (content = docArenaAlloc(doc, expanded + 1, &arena))) {
+        rowInit(row, s, len);
+        return;
+    }
+
+    size_t idx = hasTabs ? 0 : len;
+
+    if (!hasTabs) {
+        memcpy(content, s, len);
+    }
+
+    for (size_t j = 0; hasTabs && j < len; ++j) {
+        if (s[j] == '\t') {
+            content[idx++] = ' ';
+            while (idx % 8 != 0) {
+                content[idx++] = ' ';
+            }
+        } else {
+            content[idx++] = s[j];
+        }
+    }
+
+    content[idx] = '\0';
+    row->rawSize = (int64_t) idx;
+
+    if (NULL == arena) {
+        row->coldOffset = ROW_INLINE;
         return;
     }
 
-    ++currentTab->changesCount;
+    row->rawContent = content;
+    row->cold = NULL;
+    row->coldOffset = 0;
+    row->arena = arena;
+}
+
+void docAppendRow(struct Document *doc, const char *s, size_t len) {
+
+    ++doc->changesCount;
 
     //add more room for the rows
-    size_t rowSize = sizeof(struct Row);
+    docReserveRows(doc, doc->numRows + 1);
 
-    if (currentTab->numRows == 0) {
-        currentTab->rows = malloc(rowSize);
-    } else {
-        currentTab->rows = realloc(currentTab->rows, rowSize * (currentTab->numRows + 1));
+    docRowInit(doc, &doc->rows[doc->numRows], s, len);
+    memAddRow(&doc->rowMemory, &doc->rows[doc->numRows]);
+
+    doc->numRows = doc->numRows + 1;
+}
+
+/**
+ * Appends a row that takes over a malloc'd buffer, so
+ * a long line is not copied
+ * @param content the bytes, at least len + 1 of them
+ */
+void docAdoptRow(struct Document *doc, char *content, size_t len) {
+
+    ++doc->changesCount;
+
+    docReserveRows(doc, doc->numRows + 1);
+
+    struct Row *row = &doc->rows[doc->numRows];
+    row->rawSize = (int64_t) len;
+    row->coldOffset = 0;
+    row->rawContent = realloc(content, len + 1);
+    row->cold = NULL;
+    row->arena = NULL;
+
+    if (NULL == row->rawContent) {
+        fatal("Failed to shrink a long row (docAdoptRow)");
+        return;
     }
 
-    int at = currentTab->numRows;
+    row->rawContent[len] = '\0';
+    rowClearTabs(row);
+    memAddRow(&doc->rowMemory, row);
 
-    currentTab->rows[at].rawSize = (int) len;
-    currentTab->rows[at].rawContent = malloc(len + 1);
-    //fill the content
-    memcpy(currentTab->rows[at].rawContent, s, len);
-    currentTab->rows[at].rawContent[len] = '\0';
+    doc->numRows = doc->numRows + 1;
+}
+
+void editorAppendRow(char *s, size_t len) {
+
+    struct Document *doc = getCurrentDoc();
+
+    if (NULL == doc) {
+        fatal("No current tab (append row)");
+        return;
+    }
+
+    docAppendRow(doc, s, len);
+}
+
+/**
+ * Appends raw bytes (as read from a file) at the end of the document.
+ * The bytes are split on new lines, and if the last row of the document
+ * was not terminated, the first line continues it.
+ * @param doc the document to append to
+ * @param buf the bytes
+ * @param len how many bytes
+ */
+void docAppendBytes(struct Document *doc, const char *buf, size_t len) {
+
+    while (len > 0) {
+        const char *newLine = memchr(buf, '\n', len);
+        size_t lineLen = newLine ? (size_t) (newLine - buf) : len;
+
+        if (doc->lastRowOpen && doc->numRows > 0) {
+            struct Row *row = &doc->rows[doc->numRows - 1];
+
+            memRemoveRow(&doc->rowMemory, row);
+
+            rowMakeHot(row);
+            int64_t previousSize = row->rawSize;
+            char *chars = rowResize(row, row->rawSize + (int64_t) lineLen);
+            memcpy(&chars[row->rawSize], buf, lineLen);
+            row->rawSize += (int64_t) lineLen;
+            chars[row->rawSize] = '\0';
+
+            // only the new bytes, a long line comes in many reads
+            rowClearTabsFrom(row, previousSize);
+            memAddRow(&doc->rowMemory, row);
+            docRowChanged(doc, doc->numRows - 1);
+            ++doc->changesCount;
+        } else {
+            docAppendRow(doc, buf, lineLen);
+        }
+
+        doc->lastRowOpen = (newLine == NULL);
 
-    rowClearTabs(&currentTab->rows[at]);
+        if (newLine) {
+            // the row is complete, drop the \r of a \r\n
+            struct Row *row = &doc->rows[doc->numRows - 1];
 
-    currentTab->numRows = currentTab->numRows + 1;
+            if (row->rawSize > 0 && rowChars(row)[row->rawSize - 1] == '\r') {
+                memRemoveRow(&doc->rowMemory, row);
+                rowChars(row)[--row->rawSize] = '\0';
+                memAddRow(&doc->rowMemory, row);
+                docRowChanged(doc, doc->numRows - 1);
+            }
+            ++lineLen;
+        }
+
+        buf += lineLen;
+        len -= lineLen;
+    }
 }
 
 /*** Editor operation ***/
 
+void cursorsInsert(const char *s, int64_t len);
+
+void cursorsNewLine();
+
+void cursorsDelete(int after);
+
+/**
+ * @return 1 when what is typed goes to other cursors too
+ */
+int cursorsEditing() {
+    return currentSession.numCursors > 0 && !currentSession.locked;
+}
+
 void editorInsertChar(int c) {
-    struct Tab *currentTab = getCurrentTab();
+    struct Document *doc = getCurrentDoc();
 
-    if (!currentTab) {
+    if (!doc) {
         fatal("Missing tab (editorInsertChar)");
         return;
     }
 
-    ++currentTab->changesCount;
+    if (cursorsEditing()) {
+        char ch = (char) c;
+        cursorsInsert(&ch, 1);
+        return;
+    }
+
+    currentRowCountChange(doc);
 
     /*
-    if ((currentSession.cursorRow) >= (currentTab->numRows)) {
+    if ((currentSession.cursorRow) >= (doc->numRows)) {
         editorAppendRow("", 0);
     }
     */
@@ -436,23 +1488,28 @@ void editorInsertChar(int c) {
         editorAppendRow("", 0);
     }
 
-    editorRowInsertChar(getCurrentRow(), (currentSession.cursorCol + currentSession.colOffset), c);
+    editorRowInsertChar(getCurrentRow(), currentSession.cursorCol, c);
     ++currentSession.cursorCol;
 }
 
 void onTabKeyPress() {
-    struct Tab *currentTab = getCurrentTab();
+    struct Document *doc = getCurrentDoc();
 
-    if (!currentTab) {
+    if (!doc) {
         fatal("Missing tab (editorInsertChar)");
         return;
     }
 
-    if ((currentSession.cursorRow) >= (currentTab->numRows)) {
+    if (cursorsEditing()) {
+        cursorsInsert("    ", 4);
+        return;
+    }
+
+    if ((currentSession.cursorRow) >= (doc->numRows)) {
         editorAppendRow("", 0);
     }
 
-    editorRowInsertTab(getCurrentRow(), (currentSession.cursorCol + currentSession.colOffset));
+    editorRowInsertTab(getCurrentRow(), currentSession.cursorCol);
     currentSession.cursorCol += 4;
 }
 
@@ -461,56 +1518,57 @@ void editorInsertNewRow() {
     // Insert it in a new row
     // append the new row in the middle of the tab
 
-    struct Tab *currentTab = getCurrentTab();
+    struct Document *doc = getCurrentDoc();
 
-    if (NULL == currentTab) {
+    if (NULL == doc) {
         fatal("No current tab (append row)");
         return;
     }
 
-    ++currentTab->changesCount;
+    if (cursorsEditing()) {
+        cursorsNewLine();
+        return;
+    }
+
+    currentRowCountChange(doc);
 
-    int currentRowIdx = currentSession.cursorRow;
-    int nextRowIdx = currentRowIdx + 1;
+    int64_t currentRowIdx = currentSession.cursorRow;
+    int64_t nextRowIdx = currentRowIdx + 1;
 
     size_t rowSize = sizeof(struct Row);
     //get room for one more
-    currentTab->rows = realloc(currentTab->rows, rowSize * (currentTab->numRows + 1));
+    docReserveRows(doc, doc->numRows + 1);
 
-    int at;
+    int64_t at;
 
-    if (nextRowIdx > (currentTab->numRows)) {
-        at = currentTab->numRows;
+    if (nextRowIdx > (doc->numRows)) {
+        at = doc->numRows;
     } else {
         at = nextRowIdx;
         // if we are not on a new line, move the data
-        memmove(&currentTab->rows[nextRowIdx + 1],
-                &currentTab->rows[nextRowIdx],
-                rowSize * ((size_t) (currentTab->numRows - nextRowIdx)));
+        memmove(&doc->rows[nextRowIdx + 1],
+                &doc->rows[nextRowIdx],
+                rowSize * ((size_t) (doc->numRows - nextRowIdx)));
     }
 
     struct Row *currentRow = getCurrentRow();
 
-    int len;
+    int64_t len;
     char *s;
 
     if (currentRow) {
         if (currentSession.cursorCol <= currentRow->rawSize) {
+            memRemoveRow(&doc->rowMemory, currentRow);
+            rowMakeHot(currentRow);
             len = currentRow->rawSize - currentSession.cursorCol;
             s = malloc((size_t) len);
-            s = memcpy(s, &currentRow->rawContent[currentSession.cursorCol], (size_t) len);
-
-            int newLen = currentSession.cursorCol;
+            s = memcpy(s, &rowChars(currentRow)[currentSession.cursorCol], (size_t) len);
 
-            currentRow->rawContent = realloc(currentRow->rawContent, (size_t) (sizeof(char) * (newLen + 1)));
-
-            if (NULL == currentRow->rawContent) {
-                fatal("Failed to shrink the current row (editorInsertRow)");
-                return;
-            }
+            int64_t newLen = currentSession.cursorCol;
 
-            currentRow->rawContent[newLen] = '\0';
+            rowResize(currentRow, newLen)[newLen] = '\0';
             currentRow->rawSize = newLen;
+            memAddRow(&doc->rowMemory, currentRow);
         } else {
             s = NULL;
             len = 0;
@@ -520,13 +1578,12 @@ void editorInsertNewRow() {
         len = 0;
     }
 
-    currentTab->rows[at].rawSize = len;
-    currentTab->rows[at].rawContent = malloc((size_t) (len + 1));
-    //fill the content
-    memcpy(currentTab->rows[at].rawContent, s, (size_t) len);
-    currentTab->rows[at].rawContent[len] = '\0';
+    rowSetChars(&doc->rows[at], s, (size_t) len);
+    memAddRow(&doc->rowMemory, &doc->rows[at]);
 
-    currentTab->numRows = currentTab->numRows + 1;
+    doc->numRows = doc->numRows + 1;
+    docRowsInserted(doc, at, 1);
+    docRowChanged(doc, currentRowIdx);
 
     free(s);
 
@@ -536,8 +1593,18 @@ void editorInsertNewRow() {
     currentSession.colOffset = 0;
 }
 
+void wrapScroll();
+
 void editorScroll() {
 
+    // the rows wrap, the message row does not move the screen
+    if (currentSession.softWrap) {
+        if (!currentSession.locked) {
+            wrapScroll();
+        }
+        return;
+    }
+
     //TODO : This scroll thing is confusing
 
     if (currentSession.cursorRow < currentSession.rowOffset) {
@@ -564,28 +1631,32 @@ void editorScroll() {
     */
 
 
-    if (currentSession.cursorCol < currentSession.colOffset) {
-        currentSession.colOffset = currentSession.cursorCol;
-    } else if (currentSession.cursorCol >= (currentSession.colOffset + env.screenCols)) {
-        currentSession.colOffset = (currentSession.cursorCol - env.screenCols) + 1;
+    // colOffset is in columns, the cursor in bytes
+    int64_t col = cursorColumn();
+    int64_t colEnd = cursorColumnEnd();
+
+    if (col < currentSession.colOffset) {
+        currentSession.colOffset = col;
+    } else if (colEnd > (currentSession.colOffset + env.usableTextScreenCols)) {
+        currentSession.colOffset = colEnd - env.usableTextScreenCols;
     }
 }
 
 
-void deleteRowAtIdx(int idx) {
+void deleteRowAtIdx(int64_t idx) {
 
-    struct Tab *currentTab = getCurrentTab();
+    struct Document *doc = getCurrentDoc();
 
-    if (NULL == currentTab) {
+    if (NULL == doc) {
         fatal("No current tab (del row at idx)");
         return;
     }
 
-    int len = currentTab->numRows - idx;
+    int64_t len = doc->numRows - idx - 1;
 
-    memmove(&currentTab->rows[idx], &currentTab->rows[idx + 1], sizeof(struct Row) * len);
-    currentTab->rows = realloc(currentTab->rows, sizeof(struct Row) * (currentTab->numRows - 1));
-    --currentTab->numRows;
+    memmove(&doc->rows[idx], &doc->rows[idx + 1], sizeof(struct Row) * (size_t) len);
+    --doc->numRows;
+    docRowsRemoved(doc, idx, 1);
     /*
     if (idx > 0) {
         int curCursorRow = currentSession.cursorRow;
@@ -610,17 +1681,17 @@ void deleteRowAtIdx(int idx) {
 //TODO this method does way more than remove a row, we should fix that
 void editorRemoveRow() {
 
-    struct Tab *currentTab = getCurrentTab();
+    struct Document *doc = getCurrentDoc();
 
-    if (NULL == currentTab) {
+    if (NULL == doc) {
         fatal("Not tab is currently loaded (editorRemoveRow)");
         return;
     }
 
-    ++currentTab->changesCount;
+    currentRowCountChange(doc);
 
     struct Row *currentRow = getCurrentRow();
-    int currentRowIdx = currentSession.cursorRow;
+    int64_t currentRowIdx = currentSession.cursorRow;
 
     if (NULL == currentRow) {
         goto go_back;
@@ -631,26 +1702,28 @@ void editorRemoveRow() {
         struct Row *previousRow = getCurrentRow();
         ++currentSession.cursorRow;
 
-        int previousSize = previousRow->rawSize;
+        int64_t previousSize = previousRow->rawSize;
 
-        previousRow->rawContent = realloc(previousRow->rawContent,
-                                          (size_t) (previousRow->rawSize +
-                                                    currentRow->rawSize + 1));
+        memRemoveRow(&doc->rowMemory, previousRow);
+        rowMakeHot(previousRow);
+        char *chars = rowResize(previousRow, previousRow->rawSize + currentRow->rawSize);
 
-        memcpy(&previousRow->rawContent[previousSize], currentRow->rawContent, (size_t) currentRow->rawSize);
+        memcpy(&chars[previousSize], rowChars(currentRow), (size_t) currentRow->rawSize);
 
         previousRow->rawSize += currentRow->rawSize;
-        previousRow->rawContent[previousRow->rawSize] = '\0';
-
-        //that line is about to be deleted, so let's clear it up
-        free(currentRow->rawContent);
+        chars[previousRow->rawSize] = '\0';
+        memAddRow(&doc->rowMemory, previousRow);
+        docRowChanged(doc, currentRowIdx - 1);
     }
 
-    int len = currentTab->numRows - currentRowIdx;
+    //that line is about to be deleted, so let's clear it up
+    docFreeRow(doc, currentRow);
 
-    memmove(&currentTab->rows[currentRowIdx], &currentTab->rows[currentRowIdx + 1], sizeof(struct Row) * len);
-    currentTab->rows = realloc(currentTab->rows, sizeof(struct Row) * (currentTab->numRows - 1));
-    --currentTab->numRows;
+    int64_t len = doc->numRows - currentRowIdx - 1;
+
+    memmove(&doc->rows[currentRowIdx], &doc->rows[currentRowIdx + 1], sizeof(struct Row) * (size_t) len);
+    --doc->numRows;
+    docRowsRemoved(doc, currentRowIdx, 1);
 
     go_back:
     if (currentRowIdx > 0) {
@@ -661,7 +1734,7 @@ void editorRemoveRow() {
         if (previousRow) {
             currentSession.cursorCol = previousRow->rawSize;
 
-            if (previousRow->rawSize < env.screenCols) {
+            if (previousRow->rawSize < env.usableTextScreenCols) {
                 currentSession.colOffset = 0;
             } else {
                 editorScroll();
@@ -672,6 +1745,11 @@ void editorRemoveRow() {
 
 
 void editorDelKey() {
+    if (cursorsEditing()) {
+        cursorsDelete(1);
+        return;
+    }
+
     struct Row *row = getCurrentRow();
 
     if (!row) {
@@ -681,10 +1759,10 @@ void editorDelKey() {
         return;
     }
 
-    struct Tab *tab = getCurrentTab();
-    ++tab->changesCount;
+    struct Document *doc = getCurrentDoc();
+    currentRowCountChange(doc);
 
-    int pos = currentSession.cursorCol;
+    int64_t pos = currentSession.cursorCol;
 
 
     if (currentSession.cursorCol < row->rawSize) {
@@ -692,11 +1770,18 @@ void editorDelKey() {
             return;
         }
 
-        //We delete the char after
-        memmove(&row->rawContent[pos], &row->rawContent[pos + 1], (size_t) (row->rawSize - (pos - 1) - 1));
-        row->rawContent = realloc(row->rawContent, (size_t) (row->rawSize));
+        //We delete the char after, all of its bytes
+        struct MemAccount *account = currentRowAccount();
+        memRemoveRow(account, row);
+        rowMakeHot(row);
+        char *chars = rowChars(row);
+        int64_t charLen = nextCharEnd(chars, row->rawSize, pos) - pos;
+        memmove(&chars[pos], &chars[pos + charLen], (size_t) (row->rawSize - pos - charLen + 1));
+        rowResize(row, row->rawSize - charLen);
 
-        --(row->rawSize);
+        row->rawSize -= charLen;
+        memAddRow(account, row);
+        currentRowSpliced(pos, charLen, 0);
 
     } else if (!currentSession.locked) {
 
@@ -704,25 +1789,37 @@ void editorDelKey() {
         struct Row *nextRow = getCurrentRow();
         --currentSession.cursorRow;
 
-        int currentSize = row->rawSize;
+        // nothing to join at the end of the file
+        if (NULL == nextRow) {
+            return;
+        }
 
-        row->rawContent = realloc(row->rawContent,
-                                  (size_t) (nextRow->rawSize +
-                                            row->rawSize + 1));
+        int64_t currentSize = row->rawSize;
 
-        memcpy(&row->rawContent[currentSize], nextRow->rawContent, (size_t) nextRow->rawSize);
+        memRemoveRow(&doc->rowMemory, row);
+        rowMakeHot(row);
+        char *chars = rowResize(row, row->rawSize + nextRow->rawSize);
+
+        memcpy(&chars[currentSize], rowChars(nextRow), (size_t) nextRow->rawSize);
 
         row->rawSize += nextRow->rawSize;
-        row->rawContent[row->rawSize] = '\0';
+        chars[row->rawSize] = '\0';
+        memAddRow(&doc->rowMemory, row);
+        docRowChanged(doc, currentSession.cursorRow);
 
         //that line is about to be deleted, so let's clear it up
-        free(nextRow->rawContent);
+        docFreeRow(doc, nextRow);
 
         deleteRowAtIdx(currentSession.cursorRow + 1);
     }
 }
 
 void editorBackspace() {
+    if (cursorsEditing()) {
+        cursorsDelete(0);
+        return;
+    }
+
     struct Row *row = getCurrentRow();
 
     if (!row) {
@@ -732,10 +1829,10 @@ void editorBackspace() {
         return;
     }
 
-    struct Tab *tab = getCurrentTab();
-    ++tab->changesCount;
+    struct Document *doc = getCurrentDoc();
+    currentRowCountChange(doc);
 
-    int pos = currentSession.cursorCol;
+    int64_t pos = currentSession.cursorCol;
 
     if (pos < 1 && (!currentSession.locked)) {
         editorRemoveRow();
@@ -750,210 +1847,8499 @@ void editorBackspace() {
             return;
         }
 
-        //We delete the char before
-        memmove(&row->rawContent[pos - 1], &row->rawContent[pos], (size_t) (row->rawSize - (pos - 1) - 1));
-        row->rawContent = realloc(row->rawContent, (size_t) (row->rawSize));
+        //We delete the char before, all of its bytes
+        struct MemAccount *account = currentRowAccount();
+        memRemoveRow(account, row);
+        rowMakeHot(row);
+        char *chars = rowChars(row);
+        int64_t charLen = pos - prevCharStart(chars, row->rawSize, pos);
+
+        if (currentSession.locked && pos - charLen < currentSession.messageLength) {
+            charLen = pos - currentSession.messageLength;
+        }
+
+        memmove(&chars[pos - charLen], &chars[pos], (size_t) (row->rawSize - pos + 1));
+        rowResize(row, row->rawSize - charLen);
 
-        --(row->rawSize);
+        row->rawSize -= charLen;
+        memAddRow(account, row);
+        currentRowSpliced(pos - charLen, charLen, 0);
 
-        --(currentSession.cursorCol);
+        currentSession.cursorCol -= charLen;
     }
 }
 
-/*** file i/o ***/
+/*** file snapshots ***/
 
 /**
- * Gets all the rows and render the string representation
- * of those rows
- * @param bufLen the size of the buffer (will be filled in)
- * @return the buffer. Please do not forget to free the buffer!
- * Comment
- * SY
- * Its kinda bad that we expect the caller to close the ressources
- * of the callee. Of course hes gonna forget
- * Maybe we should do it all on the side of the caller. Have a get buffer lenght
- * method, and then he creates it, then we fill it with another method. Its a lot
- * more work, but its also way safer.
- * Ill keep this in because it came from the tutorial, but its not good
+ * A quick 64 bits hash, eight bytes at a time
  */
-char *editorRowsToString(int *bufLen) {
+uint64_t hashBytes(const char *s, size_t len) {
+    const uint64_t mul = 0x9E3779B97F4A7C15ULL;
+    uint64_t h = len * mul;
+    uint64_t word;
+
+    while (len >= 8) {
+        memcpy(&word, s, 8);
+        h = (h ^ word) * mul;
+        h ^= h >> 29;
+        s += 8;
+        len -= 8;
+    }
 
-    struct Tab *tab = getCurrentTab();
+    word = 0;
+    memcpy(&word, s, len);
+    h = (h ^ word) * mul;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/**
+ * The hash of a row followed by a new line, without copying them together
+ * @return the same as hashBytes on the row and its new line
+ */
+uint64_t hashLine(const char *s, size_t len) {
+    const uint64_t mul = 0x9E3779B97F4A7C15ULL;
+    uint64_t h = (len + 1) * mul;
+    uint64_t word;
+
+    while (len >= 8) {
+        memcpy(&word, s, 8);
+        h = (h ^ word) * mul;
+        h ^= h >> 29;
+        s += 8;
+        len -= 8;
+    }
+
+    word = 0;
+    memcpy(&word, s, len);
+    ((char *) &word)[len] = '\n';
+
+    // the new line fills the last word, an empty one ends the hash
+    if (len == 7) {
+        h = (h ^ word) * mul;
+        h ^= h >> 29;
+        word = 0;
+    }
+
+    h = (h ^ word) * mul;
+    h ^= h >> 32;
+
+    return h;
+}
+
+void snapshotClear(struct FileSnapshot *snapshot) {
+    free(snapshot->chunks);
+    memset(snapshot, 0, sizeof(struct FileSnapshot));
+}
+
+void snapshotEndChunk(struct FileSnapshot *snapshot) {
+    if (snapshot->pending.numLines == 0) {
+        return;
+    }
+
+    if (snapshot->numChunks == snapshot->chunkCap) {
+        snapshot->chunkCap = snapshot->chunkCap ? snapshot->chunkCap * 2 : 64;
+        snapshot->chunks = realloc(snapshot->chunks, sizeof(struct FileChunk) * snapshot->chunkCap);
+
+        if (NULL == snapshot->chunks) {
+            fatal("Failed to grow the snapshot (snapshotEndChunk)");
+            return;
+        }
+    }
+
+    snapshot->chunks[snapshot->numChunks++] = snapshot->pending;
+    memset(&snapshot->pending, 0, sizeof(struct FileChunk));
+}
+
+/**
+ * Adds a line of the file to the snapshot, by its hash
+ * @param len the length of the line, new line included
+ */
+void snapshotAddHashedLine(struct FileSnapshot *snapshot, uint64_t lineHash, size_t len) {
+    struct FileChunk *chunk = &snapshot->pending;
+
+    chunk->hash = (chunk->hash ^ lineHash) * 0x100000001B3ULL;
+    ++chunk->numLines;
+    chunk->numBytes += len;
+    ++snapshot->numLines;
+
+    if ((lineHash & CHUNK_BOUNDARY_MASK) == 0 || chunk->numLines >= CHUNK_MAX_LINES) {
+        snapshotEndChunk(snapshot);
+    }
+}
+
+/**
+ * Adds a line of the file to the snapshot
+ * @param line the line as it is on disk, new line included
+ * @param len the length of the line
+ */
+void snapshotAddLine(struct FileSnapshot *snapshot, const char *line, size_t len) {
+    snapshotAddHashedLine(snapshot, hashBytes(line, len), len);
+}
+
+/**
+ * Builds the snapshot of a whole buffer
+ */
+void snapshotAddBytes(struct FileSnapshot *snapshot, const char *buf, size_t len) {
+    while (len > 0) {
+        const char *newLine = memchr(buf, '\n', len);
+        size_t lineLen = newLine ? (size_t) (newLine - buf) + 1 : len;
+
+        snapshotAddLine(snapshot, buf, lineLen);
+        buf += lineLen;
+        len -= lineLen;
+    }
+
+    snapshotEndChunk(snapshot);
+}
+
+void snapshotSetStat(struct FileSnapshot *snapshot, struct stat *st) {
+    snapshot->mtime = st->st_mtim;
+    snapshot->size = st->st_size;
+}
+
+int snapshotMatchesStat(struct Document *doc, struct stat *st) {
+    return doc->inode == st->st_ino &&
+           doc->snapshot.size == st->st_size &&
+           doc->snapshot.mtime.tv_sec == st->st_mtim.tv_sec &&
+           doc->snapshot.mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*** compression ***/
+
+// a small LZ77 codec in the spirit of LZ4: sequences of literals followed by a copy
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+
+/**
+ * @return the most bytes lzCompress can write for len bytes
+ */
+size_t lzBound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+uint32_t lzRead32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+char *lzWriteLength(char *out, size_t len) {
+    while (len >= 255) {
+        *out++ = (char) 255;
+        len -= 255;
+    }
+    *out++ = (char) len;
+    return out;
+}
+
+char *lzWriteSequence(char *out, const char *literals, size_t litLen, size_t offset, size_t matchLen) {
+    char *token = out++;
+
+    *token = (char) (((litLen >= 15 ? 15 : litLen) << 4) | (matchLen >= 15 ? 15 : matchLen));
+
+    if (litLen >= 15) {
+        out = lzWriteLength(out, litLen - 15);
+    }
+
+    memcpy(out, literals, litLen);
+    out += litLen;
+
+    if (offset > 0) {
+        *out++ = (char) (offset & 0xff);
+        *out++ = (char) (offset >> 8);
+
+        if (matchLen >= 15) {
+            out = lzWriteLength(out, matchLen - 15);
+        }
+    }
+
+    return out;
+}
+
+/**
+ * Compresses a buffer
+ * @param src the bytes to compress
+ * @param len how many
+ * @param dst where to write, at least lzBound(len) bytes
+ * @return the compressed size
+ */
+size_t lzCompress(const char *src, size_t len, char *dst) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    const char *in = src;
+    const char *anchor = src;
+    const char *end = src + len;
+    char *out = dst;
+    unsigned misses = 0;
+
+    memset(table, 0, sizeof(table));
+
+    // the last bytes are always literals, so a match never reads past the end
+    while (len >= 16 && in + 12 <= end) {
+        uint32_t seq = lzRead32(in);
+        uint32_t h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+        const char *ref = src + table[h];
+
+        table[h] = (uint32_t) (in - src);
+
+        if (ref >= in || in - ref > LZ_MAX_OFFSET || lzRead32(ref) != seq) {
+            // skip faster in data that does not compress
+            in += 1 + (misses++ >> 6);
+            continue;
+        }
+
+        misses = 0;
+
+        const char *matchEnd = in + LZ_MIN_MATCH;
+        ref += LZ_MIN_MATCH;
+
+        while (matchEnd < end - 5 && *matchEnd == *ref) {
+            ++matchEnd;
+            ++ref;
+        }
+
+        out = lzWriteSequence(out, anchor, (size_t) (in - anchor), (size_t) (matchEnd - ref),
+                              (size_t) (matchEnd - in) - LZ_MIN_MATCH);
+        in = matchEnd;
+        anchor = in;
+    }
+
+    out = lzWriteSequence(out, anchor, (size_t) (end - anchor), 0, 0);
+
+    return (size_t) (out - dst);
+}
+
+/**
+ * Decompresses what lzCompress wrote
+ * @param src the compressed bytes
+ * @param len how many
+ * @param dst where to write
+ * @param cap the room in dst
+ * @return the decompressed size, or -1 if the data is corrupted
+ */
+ssize_t lzDecompress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *in = (const unsigned char *) src;
+    const unsigned char *end = in + len;
+    char *out = dst;
+    char *outEnd = dst + cap;
+
+    while (in < end) {
+        unsigned token = *in++;
+        size_t litLen = token >> 4;
+
+        if (litLen == 15) {
+            unsigned char more;
+            do {
+                if (in >= end) return -1;
+                more = *in++;
+                litLen += more;
+            } while (more == 255);
+        }
+
+        if (litLen > (size_t) (end - in) || litLen > (size_t) (outEnd - out)) {
+            return -1;
+        }
+
+        memcpy(out, in, litLen);
+        out += litLen;
+        in += litLen;
+
+        if (in >= end) {
+            break;
+        }
+
+        if (end - in < 2) {
+            return -1;
+        }
+
+        size_t offset = in[0] | ((size_t) in[1] << 8);
+        size_t matchLen = token & 15;
+        in += 2;
+
+        if (matchLen == 15) {
+            unsigned char more;
+            do {
+                if (in >= end) return -1;
+                more = *in++;
+                matchLen += more;
+            } while (more == 255);
+        }
+        matchLen += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t) (out - dst) || matchLen > (size_t) (outEnd - out)) {
+            return -1;
+        }
+
+        // when the copy overlaps itself, what is behind repeats, so copy it in growing pieces
+        const char *ref = out - offset;
+
+        while (matchLen > 0) {
+            size_t piece = (size_t) (out - ref) < matchLen ? (size_t) (out - ref) : matchLen;
+            memcpy(out, ref, piece);
+            out += piece;
+            matchLen -= piece;
+        }
+    }
+
+    return out - dst;
+}
+
+/*** cold storage ***/
+
+/**
+ * Consecutive rows compressed together. The rows
+ * keep their offset in the decompressed bytes
+ */
+struct ColdBlock {
+    char *compressed;
+    size_t compressedLen;
+    size_t rawLen;
+    int numRows; // how many rows it was made of
+    int liveRows; // how many rows still point to it
+    int cacheSlot; // -1 when it is not decompressed
+    struct MemAccount *account; // the document's
+};
+
+struct ColdCacheEntry {
+    struct ColdBlock *block;
+    char *data;
+    size_t dataCap;
+    unsigned long lastUse;
+};
+
+/**
+ * The last decompressed blocks, so scrolling
+ * through cold rows does not decompress every frame
+ */
+struct ColdCache {
+    struct ColdCacheEntry entries[COLD_CACHE_BLOCKS];
+    unsigned long clock;
+};
+
+struct ColdCache coldCache;
+
+/**
+ * Decompresses a block, or finds it in the cache. The least recently
+ * used entry makes room for it.
+ * @param block the block to read
+ * @return the decompressed bytes, valid until another block is decompressed
+ */
+char *coldBlockData(struct ColdBlock *block) {
+    if (block->cacheSlot == -1) {
+        int slot = 0;
+
+        for (int i = 1; i < COLD_CACHE_BLOCKS && coldCache.entries[slot].block; ++i) {
+            if (NULL == coldCache.entries[i].block ||
+                coldCache.entries[i].lastUse < coldCache.entries[slot].lastUse) {
+                slot = i;
+            }
+        }
+
+        struct ColdCacheEntry *entry = &coldCache.entries[slot];
+
+        if (entry->block) {
+            entry->block->cacheSlot = -1;
+        }
+
+        if (entry->dataCap < block->rawLen + 1) {
+            free(entry->data);
+            entry->data = malloc(block->rawLen + 1);
+            entry->dataCap = block->rawLen + 1;
+        }
+
+        if (NULL == entry->data ||
+            lzDecompress(block->compressed, block->compressedLen, entry->data, block->rawLen) !=
+            (ssize_t) block->rawLen) {
+            fatal("Failed to decompress cold rows (coldBlockData)");
+            return NULL;
+        }
+
+        entry->block = block;
+        block->cacheSlot = slot;
+    }
+
+    struct ColdCacheEntry *entry = &coldCache.entries[block->cacheSlot];
+    entry->lastUse = ++coldCache.clock;
+
+    return entry->data;
+}
+
+/**
+ * A row stopped pointing to its block, the block goes
+ * away with its last row
+ */
+void coldBlockRelease(struct ColdBlock *block) {
+    if (--block->liveRows > 0) {
+        return;
+    }
+
+    if (block->cacheSlot != -1) {
+        coldCache.entries[block->cacheSlot].block = NULL;
+        coldCache.entries[block->cacheSlot].lastUse = 0;
+    }
+
+    memFree(block->account, block->compressed, block->compressedLen);
+    memFree(block->account, block, sizeof(struct ColdBlock));
+}
+
+/**
+ * @param row the row to read
+ * @return the bytes of the row, hot or cold. For a cold row they are
+ * only valid until another block is decompressed, and must not be modified
+ */
+char *rowChars(struct Row *row) {
+    if (rowIsInline(row)) {
+        return row->inlineContent;
+    }
+
+    if (NULL == row->cold) {
+        return row->rawContent;
+    }
+
+    return coldBlockData(row->cold) + row->coldOffset;
+}
+
+/**
+ * Reads cold rows without the cache, which the threads can not
+ * share: each one keeps the last block it decompressed
+ */
+struct ColdReader {
+    struct ColdBlock *block;
+    char *data;
+    size_t dataCap;
+    char *line;
+    size_t lineCap;
+};
+
+/**
+ * @return the bytes of the row, hot or cold. For a cold row they do not end
+ * with a 0, and are only valid until another block is read through the reader
+ */
+const char *coldReaderBytes(struct ColdReader *reader, struct Row *row) {
+    if (rowIsInline(row) || NULL == row->cold) {
+        return rowChars(row);
+    }
+
+    struct ColdBlock *block = row->cold;
+
+    if (reader->block != block) {
+        if (reader->dataCap < block->rawLen + 1) {
+            free(reader->data);
+            reader->data = malloc(block->rawLen + 1);
+            reader->dataCap = block->rawLen + 1;
+        }
+
+        if (NULL == reader->data ||
+            lzDecompress(block->compressed, block->compressedLen, reader->data, block->rawLen) !=
+            (ssize_t) block->rawLen) {
+            fatal("Failed to decompress cold rows (coldReaderChars)");
+            return NULL;
+        }
+
+        reader->block = block;
+    }
+
+    return reader->data + row->coldOffset;
+}
+
+/**
+ * @return the bytes of the row, hot or cold, ending with a 0. For a cold
+ * row they are only valid until the next row read through the reader
+ */
+const char *coldReaderChars(struct ColdReader *reader, struct Row *row) {
+    const char *bytes = coldReaderBytes(reader, row);
+
+    if (rowIsInline(row) || NULL == row->cold) {
+        return bytes;
+    }
+
+    if (reader->lineCap < (size_t) row->rawSize + 1) {
+        free(reader->line);
+        reader->line = malloc((size_t) row->rawSize + 1);
+        reader->lineCap = (size_t) row->rawSize + 1;
+
+        if (NULL == reader->line) {
+            fatal("Failed to read cold rows (coldReaderChars)");
+            return NULL;
+        }
+    }
+
+    memcpy(reader->line, bytes, (size_t) row->rawSize);
+    reader->line[row->rawSize] = '\0';
+
+    return reader->line;
+}
+
+void coldReaderFree(struct ColdReader *reader) {
+    free(reader->data);
+    free(reader->line);
+    memset(reader, 0, sizeof(struct ColdReader));
+}
+
+/**
+ * Gives back its own bytes to a cold row or a row in
+ * an arena, before modifying it
+ * @param row the row that is about to change
+ */
+void rowMakeHot(struct Row *row) {
+    if (rowIsInline(row)) {
+        return;
+    }
+
+    if (row->arena) {
+        char *chars = row->rawContent;
+
+        row->rawContent = malloc((size_t) row->rawSize + 1);
+        memcpy(row->rawContent, chars, (size_t) row->rawSize + 1);
+        rowLeaveArena(row);
+        return;
+    }
+
+    if (NULL == row->cold) {
+        return;
+    }
+
+    char *chars = rowChars(row);
+
+    row->rawContent = malloc((size_t) row->rawSize + 1);
+    memcpy(row->rawContent, chars, (size_t) row->rawSize);
+    row->rawContent[row->rawSize] = '\0';
+
+    coldBlockRelease(row->cold);
+    row->cold = NULL;
+    row->coldOffset = 0;
+}
+
+void rowFree(struct Row *row) {
+    if (rowIsInline(row)) {
+        row->coldOffset = 0;
+        row->cold = NULL;
+        row->arena = NULL;
+    } else if (row->cold) {
+        coldBlockRelease(row->cold);
+        row->cold = NULL;
+    } else if (row->arena) {
+        rowLeaveArena(row);
+    } else {
+        free(row->rawContent);
+    }
+
+    row->rawContent = NULL;
+}
+
+/**
+ * Frees a row of a document, and takes it out of its account
+ */
+void docFreeRow(struct Document *doc, struct Row *row) {
+    memRemoveRow(&doc->rowMemory, row);
+    rowFree(row);
+}
+
+/**
+ * Compresses the hot rows of a range, at most COLD_BLOCK_ROWS in each block.
+ * The rows already cold are left alone, and so are the huge ones.
+ * @param doc the document
+ * @param from the first row
+ * @param to the row after the last one
+ */
+void docCoolRows(struct Document *doc, int64_t from, int64_t to) {
+    int64_t i = from;
+
+    while (i < to) {
+        if (!rowHasOwnBlock(&doc->rows[i]) || doc->rows[i].rawSize > COLD_BLOCK_MAX_BYTES) {
+            ++i;
+            continue;
+        }
+
+        int64_t end = i;
+        size_t rawLen = 0;
+
+        while (end < to && end - i < COLD_BLOCK_ROWS && rowHasOwnBlock(&doc->rows[end]) &&
+               rawLen + (size_t) doc->rows[end].rawSize <= COLD_BLOCK_MAX_BYTES) {
+            rawLen += (size_t) doc->rows[end].rawSize;
+            ++end;
+        }
+
+        char *raw = malloc(rawLen + 1);
+        char *compressed = malloc(lzBound(rawLen));
+        struct ColdBlock *block = memAlloc(&doc->coldMemory, sizeof(struct ColdBlock));
+
+        if (NULL == raw || NULL == compressed || NULL == block) {
+            fatal("Failed to allocate cold rows (docCoolRows)");
+            return;
+        }
+
+        size_t offset = 0;
+
+        for (int64_t j = i; j < end; ++j) {
+            memcpy(raw + offset, doc->rows[j].rawContent, (size_t) doc->rows[j].rawSize);
+            offset += (size_t) doc->rows[j].rawSize;
+        }
+
+        block->compressedLen = lzCompress(raw, rawLen, compressed);
+        block->compressed = realloc(compressed, block->compressedLen ? block->compressedLen : 1);
+        block->account = &doc->coldMemory;
+        memCount(block->account, block->compressed, block->compressedLen, 1);
+        block->rawLen = rawLen;
+        block->numRows = (int) (end - i);
+        block->liveRows = (int) (end - i);
+        block->cacheSlot = -1;
+
+        offset = 0;
+
+        for (int64_t j = i; j < end; ++j) {
+            memRemoveRow(&doc->rowMemory, &doc->rows[j]);
+            free(doc->rows[j].rawContent);
+            doc->rows[j].rawContent = NULL;
+            doc->rows[j].cold = block;
+            doc->rows[j].coldOffset = (int) offset;
+            offset += (size_t) doc->rows[j].rawSize;
+        }
+
+        free(raw);
+        i = end;
+    }
+}
+
+/**
+ * A big file is compressed as it is loaded, far enough
+ * from the cursor at the top
+ */
+void docCoolLoadedRows(struct Document *doc) {
+    if (doc->coldStorage && doc->numRows % COLD_BLOCK_ROWS == 0 &&
+        doc->numRows - COLD_BLOCK_ROWS >= COLD_WINDOW_ROWS) {
+        docCoolRows(doc, doc->numRows - COLD_BLOCK_ROWS, doc->numRows);
+    }
+}
+
+/**
+ * Compresses the rows far from the cursors, a slice of each big document
+ * per call so an idle tick stays short. Rows that stopped being cold
+ * because they got edited are compressed again once the cursor is far.
+ */
+void editorCoolDocuments() {
+    struct Document *current = getCurrentDoc();
+
+    for (int d = 0; d < currentSession.numDocs; ++d) {
+        struct Document *doc = currentSession.docs[d];
+
+        if (!doc->coldStorage || doc->hibernation != AWAKE) {
+            continue;
+        }
+
+        int64_t hotRow = doc == current ? currentSession.cursorRow : doc->hotRow;
+        int64_t hotFrom = hotRow - COLD_WINDOW_ROWS;
+        int64_t hotTo = hotRow + COLD_WINDOW_ROWS;
+
+        // whole blocks only, the rows at the end may still be growing
+        int64_t lastBlock = doc->numRows - doc->numRows % COLD_BLOCK_ROWS;
+
+        if (doc->coolScan >= lastBlock) {
+            doc->coolScan = 0;
+        }
+
+        int64_t from = doc->coolScan - doc->coolScan % COLD_BLOCK_ROWS;
+        int64_t to = from + COLD_SCAN_ROWS < lastBlock ? from + COLD_SCAN_ROWS : lastBlock;
+
+        for (int64_t b = from; b < to; b += COLD_BLOCK_ROWS) {
+            if (b + COLD_BLOCK_ROWS <= hotFrom || b >= hotTo) {
+                docCoolRows(doc, b, b + COLD_BLOCK_ROWS);
+            }
+        }
+
+        doc->coolScan = to;
+    }
+}
+
+/*** file i/o ***/
+
+/**
+ * Gets all the rows and render the string representation
+ * of those rows
+ * @param bufLen the size of the buffer (will be filled in)
+ * @return the buffer. Please do not forget to free the buffer!
+ * Comment
+ * SY
+ * Its kinda bad that we expect the caller to close the ressources
+ * of the callee. Of course hes gonna forget
+ * Maybe we should do it all on the side of the caller. Have a get buffer lenght
+ * method, and then he creates it, then we fill it with another method. Its a lot
+ * more work, but its also way safer.
+ * Ill keep this in because it came from the tutorial, but its not good
+ */
+char *docRowsToString(struct Document *doc, size_t *bufLen) {
+
+    size_t totalLen = 0;
+    int64_t j;
+    for (j = 0; j < (doc->numRows); ++j) {
+        totalLen += (size_t) doc->rows[j].rawSize + 1;
+    }
+
+    *bufLen = totalLen;
+
+    char *buf = malloc(totalLen);
+    char *p = buf;
+
+    for (j = 0; j < (doc->numRows); ++j) {
+        memcpy(p, rowChars(&doc->rows[j]), (size_t) doc->rows[j].rawSize);
+        p += doc->rows[j].rawSize;
+        *p = '\n';
+        ++p;
+    }
+
+    return buf;
+}
+
+char *editorRowsToString(size_t *bufLen) {
+
+    struct Document *doc = getCurrentDoc();
+
+    if (!doc) {
+        fatal("Missing tab (editorRowsToString)");
+        return NULL;
+    }
+
+    return docRowsToString(doc, bufLen);
+}
+
+/**
+ * Writes a whole buffer, a single write stops short of 2GB
+ * @return -1 on failure, 0 on success
+ */
+int writeAll(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        buf += written;
+        len -= (size_t) written;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes the rows of a document through a small buffer, so a big document
+ * is never copied whole and its cold rows are decompressed a block at a
+ * time. A row longer than the buffer is written from where it is.
+ * @param snapshot built from what is written
+ * @return -1 on failure, 0 on success
+ */
+int docWriteRows(struct Document *doc, int fd, struct FileSnapshot *snapshot) {
+    char *buf = malloc(SAVE_BUFFER_SIZE);
+    size_t used = 0;
+
+    if (NULL == buf) {
+        fatal("Failed to allocate the save buffer (docWriteRows)");
+        return -1;
+    }
+
+    for (int64_t j = 0; j < doc->numRows; ++j) {
+        struct Row *row = &doc->rows[j];
+        size_t rowLen = (size_t) row->rawSize;
+        const char *chars = rowChars(row);
+
+        snapshotAddHashedLine(snapshot, hashLine(chars, rowLen), rowLen + 1);
+
+        if (used + rowLen + 1 > SAVE_BUFFER_SIZE) {
+            if (writeAll(fd, buf, used) == -1) {
+                free(buf);
+                return -1;
+            }
+
+            used = 0;
+        }
+
+        if (rowLen + 1 > SAVE_BUFFER_SIZE) {
+            if (writeAll(fd, chars, rowLen) == -1) {
+                free(buf);
+                return -1;
+            }
+        } else {
+            memcpy(buf + used, chars, rowLen);
+            used += rowLen;
+        }
+
+        buf[used++] = '\n';
+    }
+
+    snapshotEndChunk(snapshot);
+
+    int result = writeAll(fd, buf, used);
+    free(buf);
+    return result;
+}
+
+void editorPrompt(char *msg, int msgLen);
+
+void watchDocFile(struct Document *doc);
+
+void editorSave() {
+
+    struct Document *doc = getCurrentDoc();
+
+    if (NULL == doc) {
+        fatal("No current tab (editorSave)");
+        return;
+    }
+
+    if (NULL == doc->fileName) {
+        const int msgLen = 46;
+        editorPrompt("Please enter a file name (or none to cancel): ", msgLen);
+
+        int64_t responseLength = currentSession.messageRow.rawSize - msgLen + 1;
+
+        if (responseLength > 0) {
+            doc->fileName = malloc((size_t) sizeof(char) * (size_t) responseLength);
+
+            if (NULL == doc->fileName) {
+                fatal("Failed to malloc the length of the message filename required");
+                return;
+            }
+
+            doc->fileName = memcpy(
+                    doc->fileName,
+                    &rowChars(&currentSession.messageRow)[msgLen],
+                    (size_t) sizeof(char) * (size_t) responseLength);
+
+            if (NULL == doc->fileName) {
+                fatal("Failed to copy the content of the filename into the tab struct");
+                return;
+            }
+
+        } else {
+            return;
+        }
+    }
+
+
+    off_t len = 0;
+
+    for (int64_t j = 0; j < doc->numRows; ++j) {
+        len += (off_t) doc->rows[j].rawSize + 1;
+    }
+
+    int fd = open(doc->fileName, O_RDWR | O_CREAT, 0644);
+    struct FileSnapshot written;
+
+    memset(&written, 0, sizeof(struct FileSnapshot));
+
+    if (fd != -1) {
+        if (-1 != ftruncate(fd, len) && docWriteRows(doc, fd, &written) == 0) {
+            // what we wrote is what is on disk now, so our own write is not an external change
+            struct stat st;
+            fstat(fd, &st);
+
+            snapshotClear(&doc->snapshot);
+            doc->snapshot = written;
+            memset(&written, 0, sizeof(struct FileSnapshot));
+            snapshotSetStat(&doc->snapshot, &st);
+            doc->inode = st.st_ino;
+            doc->savedChanges = doc->changesCount;
+            doc->changedOnDisk = 0;
+
+            if (doc->watchDescriptor == -1) {
+                watchDocFile(doc);
+            }
+        }
+        close(fd);
+    }
+
+    snapshotClear(&written);
+}
+
+/*** line index ***/
+
+/**
+ * Where the lines of a big file are, so opening it again does not read it
+ * line by line. The index is kept next to the other caches, it is valid
+ * as long as the size, the mtime and a few sampled pieces of the file
+ * did not change. After the header come an entry per line, then the
+ * chunks of the snapshot.
+ */
+struct IndexHeader {
+    char magic[8];
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t sampleHash;
+    int64_t numLines;
+    int64_t numChunks;
+    int64_t lastRowOpen;
+    int64_t lastChunkOpen; // the last chunk only ended because the file did
+};
+
+#define INDEX_MAGIC "MTHIDX1"
+// a line as it is on disk, and how many \r and \n end it
+#define INDEX_ENTRY(diskLen, stripped) (((uint64_t) (diskLen) << 8) | (uint64_t) (stripped))
+
+/**
+ * The index of the file being loaded, the one on disk (if it
+ * is any good) and the one being written
+ */
+struct LineIndex {
+    char *path;
+    FILE *writer; // NULL when the index on disk is up to date
+    int failed; // a line the index cannot describe, it is not written
+};
+
+/**
+ * @return the directory of the line indexes, NULL when there is none
+ */
+char *indexDirectory() {
+    char *dir = getenv("MITHRIL_CACHE_DIR");
+    char path[4096];
+
+    if (dir) {
+        return dir[0] ? strdup(dir) : NULL;
+    }
+
+    if (getenv("XDG_CACHE_HOME")) {
+        snprintf(path, sizeof(path), "%s/mithril", getenv("XDG_CACHE_HOME"));
+    } else if (getenv("HOME")) {
+        snprintf(path, sizeof(path), "%s/.cache/mithril", getenv("HOME"));
+    } else {
+        return NULL;
+    }
+
+    return strdup(path);
+}
+
+/**
+ * Creates a directory and the ones above it
+ * @return -1 on failure, 0 on success
+ */
+int makeDirectories(const char *path) {
+    char buf[4096];
+    size_t len = strlen(path);
+
+    if (len >= sizeof(buf)) {
+        return -1;
+    }
+
+    memcpy(buf, path, len + 1);
+
+    for (char *p = buf + 1; *p; ++p) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(buf, 0700);
+            *p = '/';
+        }
+    }
+
+    return mkdir(buf, 0700) == -1 && errno != EEXIST ? -1 : 0;
+}
+
+/**
+ * @return where the index of a file goes, named after its absolute
+ * path. Please free it. NULL if the file has none
+ */
+char *indexPath(const char *fileName) {
+    char *absolute = realpath(fileName, NULL);
+
+    if (NULL == absolute || NULL == env.indexDir) {
+        free(absolute);
+        return NULL;
+    }
+
+    size_t size = strlen(env.indexDir) + 32;
+    char *path = malloc(size);
+    snprintf(path, size, "%s/%016llx.idx", env.indexDir,
+             (unsigned long long) hashBytes(absolute, strlen(absolute)));
+    free(absolute);
+
+    return path;
+}
+
+/**
+ * Hashes a few pieces spread over the first size bytes of a file.
+ * A file only appended to keeps the hash of its old size.
+ */
+uint64_t fileSampleHash(int fd, uint64_t size) {
+    char buf[INDEX_SAMPLE_BYTES];
+    uint64_t hash = size;
+
+    for (int i = 0; i < INDEX_SAMPLES; ++i) {
+        uint64_t len = size < INDEX_SAMPLE_BYTES ? size : INDEX_SAMPLE_BYTES;
+        uint64_t offset = (size - len) / (INDEX_SAMPLES - 1) * (uint64_t) i;
+        ssize_t got = pread(fd, buf, (size_t) len, (off_t) offset);
+
+        if (got < 0) {
+            return 0;
+        }
+
+        hash = (hash ^ hashBytes(buf, (size_t) got)) * 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * Starts writing a new index, the entries of the lines already
+ * known are copied first
+ */
+void indexStartWriting(struct LineIndex *index, const uint64_t *entries, int64_t numLines) {
+    size_t len = strlen(index->path) + 8;
+    char *tmpPath = malloc(len);
+    snprintf(tmpPath, len, "%s.tmp", index->path);
+
+    if (makeDirectories(env.indexDir) == 0) {
+        index->writer = fopen(tmpPath, "w");
+    }
+
+    free(tmpPath);
+
+    if (NULL == index->writer) {
+        return;
+    }
+
+    // the header is only written once the index is complete
+    struct IndexHeader empty;
+    memset(&empty, 0, sizeof(struct IndexHeader));
+
+    if (fwrite(&empty, sizeof(struct IndexHeader), 1, index->writer) != 1 ||
+        (numLines > 0 && fwrite(entries, sizeof(uint64_t), (size_t) numLines, index->writer) != (size_t) numLines)) {
+        index->failed = 1;
+    }
+}
+
+/**
+ * The index on disk is taken as it is, so a corrupt or foreign one must
+ * not send the rows out of the file: the lines and the chunks have to
+ * fill the index, and add up to the bytes it covers
+ * @param indexSize the size of the index file
+ * @return 1 when the index can be used
+ */
+int indexIsSound(const struct IndexHeader *header, size_t indexSize) {
+    size_t room = (indexSize - sizeof(struct IndexHeader)) / sizeof(uint64_t);
+
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+        header->numLines < 0 || (uint64_t) header->numLines > room ||
+        header->numChunks < 0 || header->numChunks > INT_MAX ||
+        sizeof(struct IndexHeader) + (size_t) header->numLines * sizeof(uint64_t) +
+        (size_t) header->numChunks * sizeof(struct FileChunk) != indexSize) {
+        return 0;
+    }
+
+    const uint64_t *entries = (const uint64_t *) (header + 1);
+    const struct FileChunk *chunks = (const struct FileChunk *) (entries + header->numLines);
+    uint64_t bytes = 0;
+
+    for (int64_t i = 0; i < header->numLines; ++i) {
+        uint64_t diskLen = entries[i] >> 8;
+
+        if ((entries[i] & 0xff) > diskLen || diskLen > header->size - bytes) {
+            return 0;
+        }
+
+        bytes += diskLen;
+    }
+
+    int64_t chunkLines = 0;
+    uint64_t chunkBytes = 0;
+
+    for (int64_t c = 0; c < header->numChunks; ++c) {
+        if (chunks[c].numLines < 0 || chunks[c].numLines > header->numLines - chunkLines ||
+            chunks[c].numBytes > header->size - chunkBytes) {
+            return 0;
+        }
+
+        chunkLines += chunks[c].numLines;
+        chunkBytes += chunks[c].numBytes;
+    }
+
+    return bytes == header->size && chunkLines == header->numLines && chunkBytes == header->size;
+}
+
+/**
+ * Loads the rows of a document from the index of its file, when
+ * there is a good one, and gets the index ready to be written
+ * if it has to be
+ * @param doc the document, still empty
+ * @param fd the file
+ * @param st what the file is now
+ * @param index filled in
+ * @return how many bytes of the file the rows come from, the loading goes on from there
+ */
+off_t docLoadIndex(struct Document *doc, int fd, struct stat *st, struct LineIndex *index) {
+    memset(index, 0, sizeof(struct LineIndex));
+
+    if (st->st_size < env.indexMinSize || NULL == (index->path = indexPath(doc->fileName))) {
+        return 0;
+    }
+
+    int indexFd = open(index->path, O_RDONLY);
+    struct stat indexSt;
+    struct IndexHeader *header = NULL;
+
+    if (indexFd != -1 && fstat(indexFd, &indexSt) != -1 && (size_t) indexSt.st_size >= sizeof(struct IndexHeader)) {
+        header = mmap(NULL, (size_t) indexSt.st_size, PROT_READ, MAP_PRIVATE, indexFd, 0);
+        header = header == MAP_FAILED ? NULL : header;
+    }
+
+    if (indexFd != -1) {
+        close(indexFd);
+    }
+
+    int complete = 0;
+    int appended = 0;
+
+    if (header && indexIsSound(header, (size_t) indexSt.st_size)) {
+
+        complete = header->size == (uint64_t) st->st_size &&
+                   header->mtimeSec == st->st_mtim.tv_sec && header->mtimeNsec == st->st_mtim.tv_nsec &&
+                   header->sampleHash == fileSampleHash(fd, header->size);
+
+        // the lines we know are still there, the new ones are read as usual
+        appended = !complete && !header->lastRowOpen && header->size < (uint64_t) st->st_size &&
+                   header->sampleHash == fileSampleHash(fd, header->size);
+    }
+
+    off_t covered = 0;
+
+    if (complete || appended) {
+        const uint64_t *entries = (const uint64_t *) (header + 1);
+        char *map = header->size ? mmap(NULL, header->size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+
+        if (map == MAP_FAILED) {
+            munmap(header, (size_t) indexSt.st_size);
+            return 0;
+        }
+
+        madvise(map, header->size, MADV_SEQUENTIAL);
+        docReserveRows(doc, header->numLines);
+
+        const char *line = map;
+
+        for (int64_t i = 0; i < header->numLines; ++i) {
+            uint64_t diskLen = entries[i] >> 8;
+
+            docAppendRow(doc, line, diskLen - (entries[i] & 0xff));
+            docCoolLoadedRows(doc);
+            line += diskLen;
+        }
+
+        if (map) {
+            munmap(map, header->size);
+        }
+
+        struct FileSnapshot *snapshot = &doc->snapshot;
+        snapshot->numChunks = (int) header->numChunks;
+        snapshot->chunkCap = (int) header->numChunks;
+        snapshot->chunks = malloc(sizeof(struct FileChunk) * (size_t) (header->numChunks + 1));
+        memcpy(snapshot->chunks, entries + header->numLines, sizeof(struct FileChunk) * (size_t) header->numChunks);
+        snapshot->numLines = header->numLines;
+        doc->lastRowOpen = (int) header->lastRowOpen;
+
+        // the lines appended since go on with the last chunk, like when reading it all
+        if (appended && header->lastChunkOpen && snapshot->numChunks > 0) {
+            snapshot->pending = snapshot->chunks[--snapshot->numChunks];
+        }
+
+        covered = (off_t) header->size;
+    }
+
+    if (!complete) {
+        indexStartWriting(index, appended ? (const uint64_t *) (header + 1) : NULL, appended ? header->numLines : 0);
+    }
+
+    if (header) {
+        munmap(header, (size_t) indexSt.st_size);
+    }
+
+    return covered;
+}
+
+/**
+ * Adds a line read from the file to the index being written
+ * @param diskLen the line as it is on disk
+ * @param rowLen without the \r and \n that end it
+ */
+void indexAddLine(struct LineIndex *index, size_t diskLen, size_t rowLen) {
+    if (NULL == index->writer || index->failed) {
+        return;
+    }
+
+    uint64_t entry = INDEX_ENTRY(diskLen, diskLen - rowLen);
+
+    if (diskLen - rowLen > 0xff || fwrite(&entry, sizeof(uint64_t), 1, index->writer) != 1) {
+        index->failed = 1;
+    }
+}
+
+/**
+ * Writes what is left of the index (the chunks and the header),
+ * and puts it in place of the old one
+ */
+void docFinishIndex(struct Document *doc, int fd, struct stat *st, struct LineIndex *index, int lastChunkOpen) {
+    if (index->writer) {
+        size_t len = strlen(index->path) + 8;
+        char *tmpPath = malloc(len);
+        snprintf(tmpPath, len, "%s.tmp", index->path);
+
+        struct FileSnapshot *snapshot = &doc->snapshot;
+        struct IndexHeader header;
+        memset(&header, 0, sizeof(struct IndexHeader));
+        memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        header.size = (uint64_t) st->st_size;
+        header.mtimeSec = st->st_mtim.tv_sec;
+        header.mtimeNsec = st->st_mtim.tv_nsec;
+        header.sampleHash = fileSampleHash(fd, header.size);
+        header.numLines = snapshot->numLines;
+        header.numChunks = snapshot->numChunks;
+        header.lastRowOpen = doc->lastRowOpen;
+        header.lastChunkOpen = lastChunkOpen;
+
+        if (snapshot->numChunks > 0 &&
+            fwrite(snapshot->chunks, sizeof(struct FileChunk), (size_t) snapshot->numChunks, index->writer) !=
+            (size_t) snapshot->numChunks) {
+            index->failed = 1;
+        }
+
+        if (fseek(index->writer, 0, SEEK_SET) == -1 ||
+            fwrite(&header, sizeof(struct IndexHeader), 1, index->writer) != 1) {
+            index->failed = 1;
+        }
+
+        if (fclose(index->writer) != 0 || index->failed || rename(tmpPath, index->path) == -1) {
+            unlink(tmpPath);
+        }
+
+        free(tmpPath);
+    }
+
+    free(index->path);
+}
+
+/*** documents and tabs ***/
+
+/**
+ * A document of no session yet, nothing but its
+ * loader looks at it until docRegister
+ */
+struct Document *docNew() {
+    struct Document *doc = calloc(1, sizeof(struct Document));
+
+    if (NULL == doc) {
+        fatal("Failed to allocate a document (docNew)");
+        return NULL;
+    }
+
+    doc->refCount = 1;
+    doc->watchDescriptor = -1;
+    doc->followFd = -1;
+    doc->heldFd = -1;
+    doc->hibernation = AWAKE;
+    doc->lastActive = time(NULL);
+
+    return doc;
+}
+
+void docRegister(struct Document *doc) {
+    currentSession.docs = realloc(currentSession.docs, sizeof(struct Document *) * (currentSession.numDocs + 1));
+    currentSession.docs[currentSession.numDocs++] = doc;
+}
+
+struct Document *docCreate() {
+    struct Document *doc = docNew();
+    docRegister(doc);
+
+    return doc;
+}
+
+void stopFollowing(struct Document *doc);
+
+void unwatchDocFile(struct Document *doc);
+
+void docFreeRows(struct Document *doc);
+
+void docWakeUp(struct Document *doc);
+
+void docCancelPrefetch(struct Document *doc);
+
+void docHighlightFree(struct Document *doc);
+
+void docColumnsFree(struct Document *doc);
+
+void docWrapFree(struct Document *doc);
+
+void docHandOver(struct Document *doc);
+
+void docForgetUndo(struct Document *doc);
+
+void docLetGoOfFile(struct Document *doc);
+
+/**
+ * Lets go of a document, freeing it when no tab shows it anymore
+ * @param doc the document
+ */
+void docRelease(struct Document *doc) {
+    if (--doc->refCount > 0) {
+        return;
+    }
+
+    docCancelPrefetch(doc);
+    docHighlightFree(doc);
+    docColumnsFree(doc);
+    docWrapFree(doc);
+    stopFollowing(doc);
+    unwatchDocFile(doc);
+    snapshotClear(&doc->snapshot);
+    docForgetUndo(doc);
+    docFreeRows(doc);
+    docLetGoOfFile(doc);
+
+    // what was copied from it stays
+    if (doc->lent) {
+        docHandOver(doc);
+    }
+
+    free(doc->packed);
+    free(doc->fileName);
+
+    for (int i = 0; i < currentSession.numDocs; ++i) {
+        if (currentSession.docs[i] == doc) {
+            memmove(&currentSession.docs[i], &currentSession.docs[i + 1],
+                    sizeof(struct Document *) * (currentSession.numDocs - i - 1));
+            --currentSession.numDocs;
+            break;
+        }
+    }
+
+    free(doc);
+}
+
+/**
+ * Finds the document of a file that is already open. The file
+ * is matched by device and inode, so any path to it works
+ * @param fileName the path of the file
+ * @return the document or NULL if the file is not open
+ */
+struct Document *findDocument(const char *fileName) {
+    struct stat st;
+
+    if (stat(fileName, &st) == -1) {
+        return NULL;
+    }
+
+    for (int i = 0; i < currentSession.numDocs; ++i) {
+        struct Document *doc = currentSession.docs[i];
+
+        struct stat docSt;
+
+        // a file deleted since can leave its inode to the one we are looking for
+        if (NULL != doc->fileName && doc->device == st.st_dev && doc->inode == st.st_ino &&
+            stat(doc->fileName, &docSt) != -1 && docSt.st_dev == st.st_dev && docSt.st_ino == st.st_ino) {
+            return doc;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Keeps the cursor of the session in the tab we are leaving
+ */
+void tabSaveView(struct Tab *tab) {
+    tab->colOffset = currentSession.colOffset;
+    tab->rowOffset = currentSession.rowOffset;
+    tab->subRowOffset = currentSession.subRowOffset;
+    tab->cursorRow = currentSession.cursorRow;
+    tab->cursorCol = currentSession.cursorCol;
+    tab->doc->lastActive = time(NULL);
+    tab->doc->hotRow = currentSession.cursorRow;
+}
+
+/**
+ * Gives back its cursor to the tab we arrive on. Another tab on the same
+ * document may have removed rows meanwhile, so the cursor is kept in the text
+ */
+void cursorsClear();
+
+void tabRestoreView(struct Tab *tab) {
+    // the other cursors and the selection were put in the tab being left
+    cursorsClear();
+    currentSession.selecting = NO_SELECTION;
+
+    currentSession.colOffset = tab->colOffset;
+    currentSession.rowOffset = tab->rowOffset;
+    currentSession.subRowOffset = tab->subRowOffset;
+    currentSession.cursorRow = tab->cursorRow;
+    currentSession.cursorCol = tab->cursorCol;
+
+    if (currentSession.cursorRow > tab->doc->numRows) {
+        currentSession.cursorRow = tab->doc->numRows;
+    }
+
+    struct Row *row = getCurrentRow();
+
+    if (NULL == row) {
+        currentSession.cursorCol = 0;
+        currentSession.colOffset = 0;
+    } else if (currentSession.cursorCol > row->rawSize) {
+        currentSession.cursorCol = row->rawSize;
+    }
+}
+
+static size_t tabSize = sizeof(struct Tab);
+
+void createTab() {
+    const int currentTabCount = currentSession.numTabs;
+
+    currentSession.tabs = realloc(currentSession.tabs, tabSize * (currentTabCount + 1));
+    if (currentTabCount > 0) {
+        const int currentTabIdx = currentSession.currentTabIdx;
+        tabSaveView(&currentSession.tabs[currentTabIdx]);
+        memmove(&currentSession.tabs[currentTabIdx + 2],
+                &currentSession.tabs[currentTabIdx + 1],
+                tabSize * (currentTabCount - currentTabIdx - 1));
+    }
+
+    ++currentSession.numTabs;
+    ++currentSession.currentTabIdx;
+
+    struct Tab *currTab = getCurrentTab();
+    currTab->doc = docCreate();
+    currTab->colOffset = 0;
+    currTab->rowOffset = 0;
+    currTab->subRowOffset = 0;
+    currTab->cursorRow = 0;
+    currTab->cursorCol = 0;
+
+    tabRestoreView(currTab);
+}
+
+void closeTab() {
+
+    const int currentTabCount = currentSession.numTabs;
+    const int currentTabIdx = currentSession.currentTabIdx;
+
+    docRelease(getCurrentDoc());
+
+    if (currentTabIdx < (currentTabCount - 1)) {
+        memmove(&currentSession.tabs[currentTabIdx], &currentSession.tabs[currentTabIdx + 1],
+                tabSize * (currentTabCount - currentTabIdx - 1));
+    }
+
+    currentSession.tabs = realloc(currentSession.tabs, tabSize * (currentTabCount - 1));
+
+    if (currentTabIdx > 0) {
+        --currentSession.currentTabIdx;
+    }
+
+    if (currentSession.numTabs > 0) {
+        --currentSession.numTabs;
+    }
+
+    if (currentSession.numTabs == 0) {
+        currentSession.currentTabIdx = -1;
+        createTab();
+    } else {
+        docWakeUp(getCurrentDoc());
+        tabRestoreView(getCurrentTab());
+    }
+}
+
+/**
+ * Reads an opened file at the end of the rows of a document, and closes it
+ * @param fp the file of the document, or what it was
+ */
+void docReadStream(struct Document *doc, FILE *fp) {
+    char *line = NULL;
+    ssize_t lineLen;
+    size_t lineCap = 0;
+
+    struct stat st;
+    doc->coldStorage = fstat(fileno(fp), &st) != -1 && st.st_size >= env.coldMinSize;
+
+    snapshotClear(&doc->snapshot);
+
+    // a big file opened before gives its lines right away, only what was appended since is read
+    struct LineIndex index;
+    off_t indexed = docLoadIndex(doc, fileno(fp), &st, &index);
+
+    if (indexed > 0) {
+        fseeko(fp, indexed, SEEK_SET);
+    }
+
+    while ((lineLen = getline(&line, &lineCap, fp)) != -1) {
+
+        if (lineLen > -1) {
+            snapshotAddLine(&doc->snapshot, line, (size_t) lineLen);
+            doc->lastRowOpen = (lineLen == 0 || line[lineLen - 1] != '\n');
+
+            size_t diskLen = (size_t) lineLen;
+
+            while (lineLen > 0 && (line[lineLen - 1] == '\n' ||
+                                   line[lineLen - 1] == '\r')) {
+                lineLen--;
+            }
+
+            indexAddLine(&index, diskLen, (size_t) lineLen);
+
+            if ((size_t) lineLen > ARENA_SIZE / 8) {
+                // a long line keeps the buffer getline read it in
+                docAdoptRow(doc, line, (size_t) lineLen);
+                line = NULL;
+                lineCap = 0;
+            } else {
+                docAppendRow(doc, line, (size_t) lineLen);
+            }
+
+            docCoolLoadedRows(doc);
+        }
+    }
+
+    int lastChunkOpen = doc->snapshot.pending.numLines > 0;
+    snapshotEndChunk(&doc->snapshot);
+
+    // remember where we stopped, follow mode continues from there
+    if (fstat(fileno(fp), &st) != -1) {
+        doc->device = st.st_dev;
+        doc->inode = st.st_ino;
+        snapshotSetStat(&doc->snapshot, &st);
+    }
+    doc->readOffset = ftello(fp);
+    doc->savedChanges = doc->changesCount;
+
+    docFinishIndex(doc, fileno(fp), &st, &index, lastChunkOpen);
+
+    free(line);
+    fclose(fp);
+}
+
+/**
+ * Reads the file of the document at the end of its rows. Only looks at the
+ * document and the environment, so a worker can read in a document of its own
+ * @param doc the document, with its file name set
+ * @return -1 if the file could not be opened, 0 on success
+ */
+int docReadFile(struct Document *doc) {
+
+    FILE *fp = fopen(doc->fileName, "r");
+
+    if (!fp) {
+        return -1;
+    }
+
+    docReadStream(doc, fp);
+
+    return 0;
+}
+
+/**
+ * Reads the file of the document at the end of its rows, and watches it
+ * @return -1 if the file could not be opened, 0 on success
+ */
+int docLoadFile(struct Document *doc) {
+    if (docReadFile(doc) == -1) {
+        return -1;
+    }
+
+    unwatchDocFile(doc);
+    watchDocFile(doc);
+
+    return 0;
+}
+
+void editorOpen(char *filename, int openInNewTab) {
+
+    struct Document *existing = findDocument(filename);
+    struct Document *current = getCurrentDoc();
+    int currentIsBlank = current && NULL == current->fileName && current->numRows == 0;
+
+    // a file already open gets a new view, we do not load it in another document
+    if (openInNewTab || (existing && !currentIsBlank)) {
+        createTab();
+    }
+
+    struct Document *doc = getCurrentDoc();
+
+    if (NULL == doc) {
+        fatal("No current tab (editor open)");
+        return;
+    }
+
+    if (existing) {
+        docRelease(doc);
+        getCurrentTab()->doc = existing;
+        ++existing->refCount;
+        docWakeUp(existing);
+        return;
+    }
+
+    // the name may come from the message row, which gets reused
+    char *previousName = doc->fileName;
+    doc->fileName = strdup(filename);
+
+    if (docLoadFile(doc) == -1) {
+        fatal("fopen");
+        return;
+    }
+
+    free(previousName);
+}
+
+/*** loading in the background ***/
+
+enum LoadState {
+    LOAD_QUEUED = 0,
+    LOAD_RUNNING,
+    LOAD_DONE
+};
+
+/**
+ * A file read by a worker for a document hibernated on disk
+ */
+struct LoadJob {
+    struct Document *target; // the document waiting for the rows, NULL once it is closed
+    struct Document *loaded; // where the worker reads the file, nothing else looks at it
+    enum LoadState state;
+    int error; // the errno of a read that failed
+};
+
+/**
+ * The workers and what they have to read. Only the editor
+ * adds or removes jobs, the workers take them in order
+ */
+struct Loader {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+    struct LoadJob **jobs;
+    int numJobs;
+    int numWorkers;
+    pthread_t workers[LOAD_MAX_WORKERS];
+};
+
+struct Loader loader = {.lock = PTHREAD_MUTEX_INITIALIZER, .queued = PTHREAD_COND_INITIALIZER,
+                        .done = PTHREAD_COND_INITIALIZER};
+
+int docReadFile(struct Document *doc);
+
+void *loadWorker(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&loader.lock);
+
+    while (1) {
+        struct LoadJob *job = NULL;
+
+        for (int i = 0; i < loader.numJobs && NULL == job; ++i) {
+            if (loader.jobs[i]->state == LOAD_QUEUED) {
+                job = loader.jobs[i];
+            }
+        }
+
+        if (NULL == job) {
+            pthread_cond_wait(&loader.queued, &loader.lock);
+            continue;
+        }
+
+        job->state = LOAD_RUNNING;
+        pthread_mutex_unlock(&loader.lock);
+
+        int error = docReadFile(job->loaded) == -1 ? errno : 0;
+
+        pthread_mutex_lock(&loader.lock);
+        job->error = error;
+        job->state = LOAD_DONE;
+        pthread_cond_broadcast(&loader.done);
+    }
+}
+
+/**
+ * @return the index of the job of the document, -1 if it has none.
+ * The lock must be held
+ */
+int loaderFind(struct Document *doc) {
+    for (int i = 0; i < loader.numJobs; ++i) {
+        if (loader.jobs[i]->target == doc) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Takes a job out of the list, the lock must be held
+ */
+struct LoadJob *loaderRemove(int idx) {
+    struct LoadJob *job = loader.jobs[idx];
+
+    memmove(&loader.jobs[idx], &loader.jobs[idx + 1], sizeof(struct LoadJob *) * (loader.numJobs - idx - 1));
+    --loader.numJobs;
+
+    return job;
+}
+
+void loadJobFree(struct LoadJob *job) {
+    docRelease(job->loaded);
+    free(job);
+}
+
+/**
+ * Starts reading the file of a document hibernated on disk in the
+ * background, docWakeUp takes the rows when they are there
+ * @param doc the document, nothing happens if it is not on disk
+ */
+void docPrefetch(struct Document *doc) {
+    if (doc->hibernation != HIBERNATED_ON_DISK || NULL == doc->fileName) {
+        return;
+    }
+
+    pthread_mutex_lock(&loader.lock);
+
+    if (loaderFind(doc) != -1) {
+        pthread_mutex_unlock(&loader.lock);
+        return;
+    }
+
+    struct LoadJob *job = calloc(1, sizeof(struct LoadJob));
+    loader.jobs = realloc(loader.jobs, sizeof(struct LoadJob *) * (loader.numJobs + 1));
+
+    if (NULL == job || NULL == loader.jobs) {
+        fatal("Failed to allocate a load (docPrefetch)");
+        return;
+    }
+
+    job->target = doc;
+    job->loaded = docNew();
+    job->loaded->fileName = strdup(doc->fileName);
+    loader.jobs[loader.numJobs++] = job;
+
+    // a worker per job waiting, up to one per processor
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxWorkers = cpus > 0 && cpus < LOAD_MAX_WORKERS ? (int) cpus : LOAD_MAX_WORKERS;
+
+    if (loader.numWorkers < maxWorkers &&
+        pthread_create(&loader.workers[loader.numWorkers], NULL, loadWorker, NULL) == 0) {
+        ++loader.numWorkers;
+    }
+
+    pthread_cond_signal(&loader.queued);
+    pthread_mutex_unlock(&loader.lock);
+
+    // without threads, docWakeUp reads the file as before
+    if (loader.numWorkers == 0) {
+        docCancelPrefetch(doc);
+    }
+}
+
+/**
+ * Forgets the load of a document, a worker reading it drops what it read
+ */
+void docCancelPrefetch(struct Document *doc) {
+    pthread_mutex_lock(&loader.lock);
+
+    int idx = loaderFind(doc);
+    struct LoadJob *job = NULL;
+
+    if (idx != -1 && loader.jobs[idx]->state == LOAD_RUNNING) {
+        loader.jobs[idx]->target = NULL;
+    } else if (idx != -1) {
+        job = loaderRemove(idx);
+    }
+
+    pthread_mutex_unlock(&loader.lock);
+
+    if (job) {
+        loadJobFree(job);
+    }
+}
+
+/**
+ * Gives the rows read in a scratch document to a document without rows
+ */
+void docTakeRows(struct Document *doc, struct Document *from) {
+    doc->rows = from->rows;
+    doc->rowCap = from->rowCap;
+    doc->numRows = from->numRows;
+    from->rows = NULL;
+    from->rowCap = 0;
+    from->numRows = 0;
+
+    // the cold blocks count in the account of their document
+    for (int64_t i = 0; i < doc->numRows; ++i) {
+        if (!rowIsInline(&doc->rows[i]) && doc->rows[i].cold) {
+            doc->rows[i].cold->account = &doc->coldMemory;
+        }
+    }
+
+    memMerge(&doc->rowMemory, &from->rowMemory);
+    memMerge(&doc->arrayMemory, &from->arrayMemory);
+    memMerge(&doc->coldMemory, &from->coldMemory);
+    docTakeArenas(doc, from);
+
+    snapshotClear(&doc->snapshot);
+    doc->snapshot = from->snapshot;
+    memset(&from->snapshot, 0, sizeof(struct FileSnapshot));
+
+    doc->device = from->device;
+    doc->inode = from->inode;
+    doc->readOffset = from->readOffset;
+    doc->lastRowOpen = from->lastRowOpen;
+    doc->coldStorage = from->coldStorage;
+    doc->lastActive = time(NULL);
+}
+
+/**
+ * Takes the rows a worker read for a document, waiting for them
+ * if the worker is not done. A load that did not start is dropped.
+ * @return 1 if the document got its rows
+ */
+int docTakePrefetched(struct Document *doc) {
+    pthread_mutex_lock(&loader.lock);
+
+    int idx = loaderFind(doc);
+
+    if (idx == -1) {
+        pthread_mutex_unlock(&loader.lock);
+        return 0;
+    }
+
+    while (loader.jobs[idx]->state == LOAD_RUNNING) {
+        pthread_cond_wait(&loader.done, &loader.lock);
+    }
+
+    struct LoadJob *job = loaderRemove(idx);
+    pthread_mutex_unlock(&loader.lock);
+
+    int taken = job->state == LOAD_DONE && job->error == 0;
+
+    if (taken) {
+        docTakeRows(doc, job->loaded);
+    }
+
+    loadJobFree(job);
+
+    return taken;
+}
+
+/**
+ * Wakes up the documents whose rows the workers are done reading
+ */
+void editorCollectPrefetched() {
+    while (1) {
+        pthread_mutex_lock(&loader.lock);
+
+        int idx = 0;
+
+        while (idx < loader.numJobs && loader.jobs[idx]->state != LOAD_DONE) {
+            ++idx;
+        }
+
+        struct LoadJob *job = idx < loader.numJobs ? loader.jobs[idx] : NULL;
+
+        // the job of a closed document has no one to wake up
+        if (job && NULL == job->target) {
+            loaderRemove(idx);
+        }
+
+        pthread_mutex_unlock(&loader.lock);
+
+        if (NULL == job) {
+            return;
+        } else if (NULL == job->target) {
+            loadJobFree(job);
+        } else {
+            docWakeUp(job->target);
+        }
+    }
+}
+
+/**
+ * Starts reading the files of the tabs around the current one,
+ * so they are there when we move to them
+ */
+void editorPrefetchTabs() {
+    int current = currentSession.currentTabIdx;
+
+    for (int distance = 1; distance <= env.prefetchTabs && current >= 0; ++distance) {
+        if (current + distance < currentSession.numTabs) {
+            docPrefetch(currentSession.tabs[current + distance].doc);
+        }
+        if (current - distance >= 0) {
+            docPrefetch(currentSession.tabs[current - distance].doc);
+        }
+    }
+}
+
+/**
+ * Puts a tab on a document at idx, the current tab stays the current one
+ * (if there is one)
+ */
+void insertTab(int idx, struct Document *doc) {
+    currentSession.tabs = realloc(currentSession.tabs, tabSize * (currentSession.numTabs + 1));
+    memmove(&currentSession.tabs[idx + 1], &currentSession.tabs[idx],
+            tabSize * (currentSession.numTabs - idx));
+    ++currentSession.numTabs;
+
+    struct Tab *tab = &currentSession.tabs[idx];
+    memset(tab, 0, tabSize);
+    tab->doc = doc;
+
+    if (currentSession.currentTabIdx < 0) {
+        // the first tab of the session
+        currentSession.currentTabIdx = idx;
+        tabRestoreView(tab);
+    } else if (idx <= currentSession.currentTabIdx) {
+        ++currentSession.currentTabIdx;
+    }
+}
+
+void editorOpenFiles(char **fileNames, int count) {
+    int first = currentSession.currentTabIdx + 1;
+
+    for (int i = 0; i < count; ++i) {
+        struct stat st;
+
+        // a file we cannot read stops everything before the editor shows up
+        if (access(fileNames[i], R_OK) == -1 || stat(fileNames[i], &st) == -1) {
+            fatal("fopen");
+            return;
+        }
+
+        struct Document *doc = findDocument(fileNames[i]);
+
+        if (doc) {
+            ++doc->refCount;
+        } else {
+            // nothing is read until the tab, or one next to it, is looked at
+            doc = docNew();
+            doc->fileName = strdup(fileNames[i]);
+            doc->device = st.st_dev;
+            doc->inode = st.st_ino;
+            doc->hibernation = HIBERNATED_ON_DISK;
+            docRegister(doc);
+        }
+
+        insertTab(first + i, doc);
+    }
+
+    // the neighbours are read while the current one is
+    editorPrefetchTabs();
+    docWakeUp(getCurrentDoc());
+}
+
+/*** watching files ***/
+
+/**
+ * Watches the file of the document with inotify. If inotify is not
+ * available the document stays with a watch descriptor of -1, which
+ * means we poll the file instead
+ * @param doc the document to watch
+ */
+void watchDocFile(struct Document *doc) {
+    doc->watchDescriptor = -1;
+
+    if (env.inotifyFd != -1 && NULL != doc->fileName) {
+        doc->watchDescriptor = inotify_add_watch(env.inotifyFd, doc->fileName,
+                                                 IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                                 IN_MOVE_SELF | IN_DELETE_SELF);
+    }
+}
+
+void unwatchDocFile(struct Document *doc) {
+    if (doc->watchDescriptor != -1) {
+        inotify_rm_watch(env.inotifyFd, doc->watchDescriptor);
+        doc->watchDescriptor = -1;
+    }
+}
+
+/*** follow mode ***/
+
+void stopFollowing(struct Document *doc) {
+    if (NULL == doc || !doc->following) {
+        return;
+    }
+
+    if (doc->followFd != -1) {
+        close(doc->followFd);
+        doc->followFd = -1;
+    }
+
+    doc->following = 0;
+    doc->followBehind = 0;
+
+    // the rows grew without the snapshot, the next change on disk reloads everything
+    snapshotClear(&doc->snapshot);
+    doc->snapshot.numLines = -1;
+}
+
+/**
+ * Drops all the rows of the document, used when the followed file
+ * got truncated or replaced
+ * @param doc the document to empty
+ */
+void docClearRows(struct Document *doc) {
+    for (int64_t i = 0; i < doc->numRows; ++i) {
+        docFreeRow(doc, &doc->rows[i]);
+    }
+
+    docSweepArenas(doc);
+
+    doc->numRows = 0;
+    doc->lastRowOpen = 0;
+    doc->readOffset = 0;
+    docRowsReset(doc);
+    ++doc->changesCount;
+}
+
+/**
+ * Reads what was appended to the followed file since the last time, at
+ * most FOLLOW_TICK_BYTES so the keys and the screen are not kept waiting.
+ * The document is then behind, the next ticks read the rest.
+ * @param doc the followed document
+ * @return the number of bytes read
+ */
+ssize_t followReadNewBytes(struct Document *doc) {
+    static char *buf = NULL;
+
+    if (NULL == buf) {
+        buf = malloc(FOLLOW_READ_SIZE);
+    }
+
+    ssize_t total = 0;
+    ssize_t lenRead = 0;
+
+    while (total < FOLLOW_TICK_BYTES &&
+           (lenRead = pread(doc->followFd, buf, FOLLOW_READ_SIZE, doc->readOffset)) > 0) {
+        docAppendBytes(doc, buf, (size_t) lenRead);
+        doc->readOffset += lenRead;
+        total += lenRead;
+    }
+
+    doc->followBehind = total >= FOLLOW_TICK_BYTES;
+
+    return total;
+}
+
+/**
+ * Checks a followed document for new content. Handles the file being
+ * truncated (we start over) and the file being rotated (we finish reading
+ * the old file, then start over with the new one)
+ * @param doc the followed document
+ * @return 1 if the rows of the document changed, 0 otherwise
+ */
+int followPoll(struct Document *doc) {
+    struct stat st;
+    int changed = 0;
+    int clean = doc->changesCount == doc->savedChanges;
+
+    if (fstat(doc->followFd, &st) != -1 && st.st_size < doc->readOffset) {
+        docClearRows(doc);
+        changed = 1;
+    }
+
+    changed |= followReadNewBytes(doc) > 0;
+
+    if (stat(doc->fileName, &st) == -1) {
+        // rotated away and not created again yet, we will poll for it
+        unwatchDocFile(doc);
+    } else if (!doc->followBehind && st.st_ino != doc->inode) {
+        // rotated, the new file once the rest of the old one is read
+        int fd = open(doc->fileName, O_RDONLY);
+
+        if (fd != -1) {
+            close(doc->followFd);
+            doc->followFd = fd;
+            doc->inode = st.st_ino;
+
+            docClearRows(doc);
+            followReadNewBytes(doc);
+            changed = 1;
+
+            unwatchDocFile(doc);
+            watchDocFile(doc);
+        }
+    } else if (doc->watchDescriptor == -1) {
+        watchDocFile(doc);
+    }
+
+    // what we appended comes from the file, it is not an edit
+    if (clean) {
+        doc->savedChanges = doc->changesCount;
+    }
+
+    return changed;
+}
+
+void toggleFollow() {
+    struct Document *doc = getCurrentDoc();
+
+    if (NULL == doc || NULL == doc->fileName) {
+        return;
+    }
+
+    if (doc->following) {
+        stopFollowing(doc);
+        return;
+    }
+
+    doc->followFd = open(doc->fileName, O_RDONLY);
+
+    if (doc->followFd == -1) {
+        return;
+    }
+
+    doc->following = 1;
+    doc->changedOnDisk = 0;
+
+    if (doc->watchDescriptor == -1) {
+        watchDocFile(doc);
+    }
+    followPoll(doc);
+
+    // like tail -f, we start at the bottom
+    currentSession.cursorRow = doc->numRows > 0 ? doc->numRows - 1 : 0;
+    currentSession.cursorCol = 0;
+    currentSession.colOffset = 0;
+}
+
+/*** disk changes ***/
+
+int chunksEqual(struct FileChunk *a, struct FileChunk *b) {
+    return a->hash == b->hash && a->numLines == b->numLines && a->numBytes == b->numBytes;
+}
+
+/**
+ * Pairs the chunks of the new file with the chunks of the old one, in order.
+ * Each new chunk takes the first equal old chunk after the last one taken.
+ * @return for each new chunk, the index of its old chunk or -1. Please free it
+ */
+int *chunksMatch(struct FileSnapshot *old, struct FileSnapshot *fresh) {
+    int *matches = malloc(sizeof(int) * (fresh->numChunks + 1));
+    size_t numBuckets = 16;
+
+    while (numBuckets < (size_t) old->numChunks * 2) {
+        numBuckets *= 2;
+    }
+
+    int *heads = malloc(sizeof(int) * numBuckets);
+    int *next = malloc(sizeof(int) * (old->numChunks + 1));
+
+    for (size_t b = 0; b < numBuckets; ++b) {
+        heads[b] = -1;
+    }
+
+    // the chains are in increasing order of chunk index
+    for (int k = old->numChunks - 1; k >= 0; --k) {
+        size_t b = old->chunks[k].hash & (numBuckets - 1);
+        next[k] = heads[b];
+        heads[b] = k;
+    }
+
+    int from = 0;
+
+    for (int j = 0; j < fresh->numChunks; ++j) {
+        int k = heads[fresh->chunks[j].hash & (numBuckets - 1)];
+
+        while (k != -1 && (k < from || !chunksEqual(&old->chunks[k], &fresh->chunks[j]))) {
+            k = next[k];
+        }
+
+        matches[j] = k;
+
+        if (k != -1) {
+            from = k + 1;
+        }
+    }
+
+    free(heads);
+    free(next);
+
+    return matches;
+}
+
+/**
+ * Reloads the document from its file. Only the chunks of lines that changed
+ * are read again, the rows of the chunks that are still in the file are
+ * kept as they are. A document with edits is only flagged, the user decides
+ * (Ctrl-R): reading the chunks again would lose the edits in them.
+ * @param doc the document to reload
+ * @param force reload even if it throws away the edits
+ * @return 1 if the document changed and should be redrawn
+ */
+int docReloadFromDisk(struct Document *doc, int force) {
+    int fd = open(doc->fileName, O_RDONLY);
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return 0;
+    }
+
+    int dirty = doc->changesCount != doc->savedChanges;
+    // the rows only line up with the old snapshot if no row was added or removed
+    int linedUp = doc->numRows == doc->snapshot.numLines;
+
+    if (dirty && !force) {
+        close(fd);
+        int wasFlagged = doc->changedOnDisk;
+        doc->changedOnDisk = 1;
+        return !wasFlagged;
+    }
+
+    char *map = NULL;
+
+    if (st.st_size > 0) {
+        map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+    }
+    close(fd);
+
+    struct FileSnapshot fresh;
+    memset(&fresh, 0, sizeof(struct FileSnapshot));
+    snapshotAddBytes(&fresh, map, (size_t) st.st_size);
+    snapshotSetStat(&fresh, &st);
+
+    struct FileSnapshot *old = &doc->snapshot;
+    int keepRows = linedUp && !dirty;
+    int *matches = chunksMatch(old, &fresh);
+
+    // where each old chunk starts in the rows, and where it goes
+    int64_t *oldStarts = malloc(sizeof(int64_t) * (size_t) (old->numChunks + 1));
+    int64_t *newStarts = malloc(sizeof(int64_t) * (size_t) (old->numChunks + 1));
+
+    oldStarts[0] = 0;
+    for (int k = 0; k < old->numChunks; ++k) {
+        oldStarts[k + 1] = oldStarts[k] + old->chunks[k].numLines;
+        newStarts[k] = -1;
+    }
+
+    struct Document rebuilt;
+    memset(&rebuilt, 0, sizeof(struct Document));
+    rebuilt.coldStorage = doc->coldStorage;
+    docReserveRows(&rebuilt, fresh.numLines);
+
+    size_t offset = 0;
+    int lastChunkKept = 0;
+
+    for (int j = 0; j < fresh.numChunks; ++j) {
+        int k = keepRows ? matches[j] : -1;
+
+        if (k != -1) {
+            memcpy(&rebuilt.rows[rebuilt.numRows], &doc->rows[oldStarts[k]],
+                   sizeof(struct Row) * old->chunks[k].numLines);
+            newStarts[k] = rebuilt.numRows;
+            rebuilt.numRows += old->chunks[k].numLines;
+        } else {
+            docAppendBytes(&rebuilt, map + offset, fresh.chunks[j].numBytes);
+        }
+
+        lastChunkKept = (k != -1);
+        offset += fresh.chunks[j].numBytes;
+    }
+
+    if (map) {
+        munmap(map, (size_t) st.st_size);
+    }
+
+    if (doc == getCurrentDoc()) {
+        // keep the cursor on the same line of text, or after the last kept line before it
+        int64_t row = currentSession.cursorRow;
+        int64_t newRow = 0;
+
+        for (int k = 0; k < old->numChunks && oldStarts[k] <= row; ++k) {
+            if (newStarts[k] != -1) {
+                newRow = newStarts[k] + (row - oldStarts[k]);
+            }
+        }
+
+        currentSession.cursorRow = newRow < rebuilt.numRows ? newRow : rebuilt.numRows;
+    }
+
+    // free the rows that did not make it
+    for (int k = 0; k < old->numChunks; ++k) {
+        if (newStarts[k] == -1 || !keepRows) {
+            for (int64_t i = oldStarts[k]; i < oldStarts[k + 1] && i < doc->numRows; ++i) {
+                docFreeRow(doc, &doc->rows[i]);
+            }
+        }
+    }
+
+    if (!keepRows) {
+        for (int64_t i = oldStarts[old->numChunks]; i < doc->numRows; ++i) {
+            docFreeRow(doc, &doc->rows[i]);
+        }
+    }
+
+    free(matches);
+    free(oldStarts);
+    free(newStarts);
+    memFree(&doc->arrayMemory, doc->rows, sizeof(struct Row) * (size_t) doc->rowCap);
+
+    // the new rows and their array were counted in the scratch document
+    memMerge(&doc->rowMemory, &rebuilt.rowMemory);
+    memMerge(&doc->arrayMemory, &rebuilt.arrayMemory);
+    docTakeArenas(doc, &rebuilt);
+    docSweepArenas(doc);
+
+    doc->rows = rebuilt.rows;
+    doc->rowCap = rebuilt.rowCap;
+    doc->numRows = rebuilt.numRows;
+    docRowsReset(doc);
+
+    if (!lastChunkKept) {
+        doc->lastRowOpen = rebuilt.lastRowOpen;
+    }
+
+    if (doc == getCurrentDoc()) {
+        struct Row *row = getCurrentRow();
+
+        if (NULL == row) {
+            currentSession.cursorCol = 0;
+        } else if (currentSession.cursorCol > row->rawSize) {
+            currentSession.cursorCol = row->rawSize;
+        }
+    }
+
+    ++doc->changesCount;
+    doc->savedChanges = doc->changesCount;
+
+    snapshotClear(old);
+    *old = fresh;
+    doc->readOffset = st.st_size;
+    doc->changedOnDisk = 0;
+
+    if (doc->inode != st.st_ino) {
+        doc->inode = st.st_ino;
+        unwatchDocFile(doc);
+        watchDocFile(doc);
+    }
+
+    return 1;
+}
+
+/**
+ * Checks if the file of the document changed on disk, and reloads it
+ * @return 1 if the document changed and should be redrawn
+ */
+int docCheckDisk(struct Document *doc) {
+    struct stat st;
+
+    if (stat(doc->fileName, &st) == -1) {
+        // deleted or being replaced, we poll until it comes back
+        unwatchDocFile(doc);
+        return 0;
+    }
+
+    if (snapshotMatchesStat(doc, &st)) {
+        if (doc->watchDescriptor == -1) {
+            watchDocFile(doc);
+        }
+        return 0;
+    }
+
+    return docReloadFromDisk(doc, 0);
+}
+
+void reloadCurrentDoc() {
+    struct Document *doc = getCurrentDoc();
+
+    if (NULL == doc || NULL == doc->fileName || doc->following) {
+        return;
+    }
+
+    docReloadFromDisk(doc, 1);
+}
+
+/**
+ * Looks at every opened file for changes. With inotify we only
+ * look at the files we got an event for, the others are polled.
+ * @return 1 if the current tab changed and should be redrawn
+ */
+int editorPollWatchers() {
+    char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int redraw = 0;
+    int anyFile = 0;
+
+    for (int i = 0; i < currentSession.numDocs; ++i) {
+        anyFile |= (NULL != currentSession.docs[i]->fileName);
+    }
+
+    if (!anyFile) {
+        return 0;
+    }
+
+    int *notified = calloc((size_t) currentSession.numDocs + 1, sizeof(int));
+
+    if (env.inotifyFd != -1) {
+        ssize_t len;
+
+        while ((len = read(env.inotifyFd, events, sizeof(events))) > 0) {
+            for (char *p = events; p < events + len;) {
+                struct inotify_event *event = (struct inotify_event *) p;
+
+                for (int i = 0; i < currentSession.numDocs; ++i) {
+                    if (currentSession.docs[i]->watchDescriptor == event->wd) {
+                        notified[i] = 1;
+                    }
+                }
+
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    }
+
+    for (int i = 0; i < currentSession.numDocs; ++i) {
+        struct Document *doc = currentSession.docs[i];
+
+        // a followed document behind its file reads on without being told
+        if (NULL == doc->fileName || doc->hibernation != AWAKE ||
+            (doc->watchDescriptor != -1 && !notified[i] && !doc->followBehind)) {
+            continue;
+        }
+
+        int isCurrent = (doc == getCurrentDoc());
+
+        if (!doc->following) {
+            redraw |= docCheckDisk(doc) && isCurrent;
+            continue;
+        }
+
+        // the cursor is pinned when it sits on the last row
+        int pinned = isCurrent && currentSession.cursorRow >= doc->numRows - 1;
+
+        if (followPoll(doc) && isCurrent) {
+            redraw = 1;
+
+            if (pinned) {
+                currentSession.cursorRow = doc->numRows > 0 ? doc->numRows - 1 : 0;
+                currentSession.cursorCol = 0;
+                currentSession.colOffset = 0;
+            } else if (currentSession.cursorRow > doc->numRows) {
+                currentSession.cursorRow = doc->numRows;
+            }
+        }
+    }
+
+    free(notified);
+
+    return redraw;
+}
+
+/*** hibernation ***/
+
+/**
+ * Estimates the memory used by the rows of a document,
+ * counting what malloc adds to each allocation
+ */
+size_t docEstimateResidentBytes(struct Document *doc) {
+    size_t bytes = sizeof(struct Row) * (size_t) doc->rowCap;
+
+    for (int64_t i = 0; i < doc->numRows; ++i) {
+        if (rowIsInline(&doc->rows[i])) {
+            continue;
+        }
+
+        struct ColdBlock *block = doc->rows[i].cold;
+
+        if (block) {
+            bytes += block->compressedLen / (size_t) block->numRows;
+        } else {
+            bytes += (size_t) doc->rows[i].rawSize + 1 + 2 * sizeof(size_t);
+        }
+    }
+
+    return bytes;
+}
+
+void docDiffFree(struct Document *doc);
+
+void docFreeRows(struct Document *doc) {
+    for (int64_t i = 0; i < doc->numRows; ++i) {
+        docFreeRow(doc, &doc->rows[i]);
+    }
+
+    memFree(&doc->arrayMemory, doc->rows, sizeof(struct Row) * (size_t) doc->rowCap);
+    docSweepArenas(doc);
+    doc->rows = NULL;
+    doc->numRows = 0;
+    doc->rowCap = 0;
+    docRowsReset(doc);
+    docDiffFree(doc);
+}
+
+/**
+ * Opens the file of a document and keeps it open, when it is still the one the
+ * rows were read from: deleted or replaced, it can then be read back all the same
+ * @return 1 when the file is held
+ */
+int docHoldFile(struct Document *doc) {
+    int fd = open(doc->fileName, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_dev != doc->device || !snapshotMatchesStat(doc, &st)) {
+        close(fd);
+        return 0;
+    }
+
+    doc->heldFd = fd;
+    return 1;
+}
+
+void docLetGoOfFile(struct Document *doc) {
+    if (doc->heldFd != -1) {
+        close(doc->heldFd);
+        doc->heldFd = -1;
+    }
+}
+
+/**
+ * @return 1 when the name of the file still leads to the file we hold
+ */
+int docHeldFileIsThere(struct Document *doc) {
+    struct stat held;
+    struct stat named;
+
+    return fstat(doc->heldFd, &held) != -1 && stat(doc->fileName, &named) != -1 &&
+           held.st_dev == named.st_dev && held.st_ino == named.st_ino;
+}
+
+/**
+ * Gets the rows of a document out of memory. A clean document is the same as its
+ * file so we just drop the rows, keeping the file open; the others, and the ones
+ * whose file is not what they were read from anymore, are packed and compressed.
+ * @param doc a document in the background
+ */
+void docHibernate(struct Document *doc) {
+    if (doc->hibernation != AWAKE || doc->following || doc->numRows == 0) {
+        return;
+    }
+
+    int clean = doc->changesCount == doc->savedChanges;
+
+    if (clean && NULL != doc->fileName && doc->numRows == doc->snapshot.numLines && docHoldFile(doc)) {
+        docFreeRows(doc);
+        doc->hibernation = HIBERNATED_ON_DISK;
+        return;
+    }
+
+    size_t len;
+    char *buf = docRowsToString(doc, &len);
+
+    doc->packed = malloc(lzBound(len));
+
+    if (NULL == doc->packed) {
+        free(buf);
+        return;
+    }
+
+    doc->packedLen = lzCompress(buf, len, doc->packed);
+    doc->packed = realloc(doc->packed, doc->packedLen);
+    doc->unpackedLen = len;
+    free(buf);
+
+    docFreeRows(doc);
+    doc->hibernation = HIBERNATED_PACKED;
+}
+
+/**
+ * Brings the rows of a hibernated document back in memory
+ * @param doc the document to wake up
+ */
+void docWakeUp(struct Document *doc) {
+    if (doc->hibernation == HIBERNATED_ON_DISK) {
+        int64_t changes = doc->changesCount;
+        int lastRowOpen = doc->lastRowOpen;
+
+        if (doc->heldFd != -1 && !docHeldFileIsThere(doc)) {
+            // deleted or replaced, what the rows were is in the file we held
+            FILE *fp = fdopen(doc->heldFd, "r");
+
+            docCancelPrefetch(doc);
+
+            if (fp) {
+                docReadStream(doc, fp);
+                doc->heldFd = -1;
+            }
+
+            unwatchDocFile(doc);
+            watchDocFile(doc);
+        } else if (docTakePrefetched(doc)) {
+            // a worker read it already, docCheckDisk below watches it
+        } else if (docLoadFile(doc) == -1) {
+            // the file is gone and was never read, there is nothing to keep
+            doc->lastRowOpen = lastRowOpen;
+        }
+
+        docLetGoOfFile(doc);
+
+        // reading it back is not a change
+        doc->changesCount = changes;
+        doc->savedChanges = changes;
+    } else if (doc->hibernation == HIBERNATED_PACKED) {
+        char *buf = malloc(doc->unpackedLen + 1);
+
+        if (NULL == buf) {
+            fatal("Failed to unpack a hibernated document (docWakeUp)");
+            return;
+        }
+
+        if (lzDecompress(doc->packed, doc->packedLen, buf, doc->unpackedLen) != (ssize_t) doc->unpackedLen) {
+            fatal("A hibernated document got corrupted (docWakeUp)");
+            return;
+        }
+
+        int64_t changes = doc->changesCount;
+        char *line = buf;
+        char *end = buf + doc->unpackedLen;
+
+        // every row was written with a new line after it
+        while (line < end) {
+            char *newLine = memchr(line, '\n', (size_t) (end - line));
+            docAppendRow(doc, line, (size_t) (newLine - line));
+            line = newLine + 1;
+        }
+
+        doc->changesCount = changes;
+
+        free(buf);
+        free(doc->packed);
+        doc->packed = NULL;
+        doc->packedLen = 0;
+        doc->unpackedLen = 0;
+    }
+
+    doc->hibernation = AWAKE;
+    doc->estimatedChanges = doc->changesCount - 1;
+
+    // it may have changed on disk while it was sleeping
+    if (NULL != doc->fileName) {
+        docCheckDisk(doc);
+    }
+}
+
+/**
+ * Moves to another tab, waking its document up if needed
+ * @param idx the index of the tab
+ */
+void editorSwitchTab(int idx) {
+    if (idx < 0 || idx >= currentSession.numTabs) {
+        return;
+    }
+
+    struct Tab *previous = getCurrentTab();
+
+    if (previous) {
+        tabSaveView(previous);
+    }
+
+    currentSession.currentTabIdx = idx;
+    editorPrefetchTabs();
+    docWakeUp(getCurrentDoc());
+    tabRestoreView(getCurrentTab());
+}
+
+/**
+ * Hibernates the documents in the background that were not looked at for a while,
+ * then the least recently looked at ones while the documents in the background
+ * use more than the memory budget. Does the work at most once a second.
+ */
+void editorHibernateTabs() {
+    static time_t lastCheck = 0;
+    time_t now = time(NULL);
+
+    if (now == lastCheck || currentSession.numDocs < 2) {
+        return;
+    }
+    lastCheck = now;
+
+    size_t resident = 0;
+    int hibernated = 0;
+
+    for (int i = 0; i < currentSession.numDocs; ++i) {
+        struct Document *doc = currentSession.docs[i];
+
+        if (doc == getCurrentDoc() || doc->hibernation != AWAKE) {
+            continue;
+        }
+
+        if (now - doc->lastActive >= env.hibernateAfter) {
+            docHibernate(doc);
+            hibernated |= doc->hibernation != AWAKE;
+        }
+
+        if (doc->hibernation == AWAKE) {
+            if (doc->estimatedChanges != doc->changesCount) {
+                doc->residentBytes = docEstimateResidentBytes(doc);
+                doc->estimatedChanges = doc->changesCount;
+            }
+            resident += doc->residentBytes;
+        }
+    }
+
+    while (resident > env.memoryBudget) {
+        struct Document *oldest = NULL;
+
+        for (int i = 0; i < currentSession.numDocs; ++i) {
+            struct Document *doc = currentSession.docs[i];
+
+            if (doc != getCurrentDoc() && doc->hibernation == AWAKE && !doc->following &&
+                doc->numRows > 0 && (NULL == oldest || doc->lastActive < oldest->lastActive)) {
+                oldest = doc;
+            }
+        }
+
+        if (NULL == oldest) {
+            break;
+        }
+
+        docHibernate(oldest);
+        resident -= oldest->residentBytes;
+        hibernated = 1;
+    }
+
+    // free() keeps the small blocks of the rows around, give them back to the system
+    if (hibernated) {
+        malloc_trim(0);
+    }
+}
+
+/*** memory report ***/
+
+/**
+ * Writes a size with a unit that keeps it short
+ */
+int formatBytes(char *buf, size_t size, size_t bytes) {
+    if (bytes < 1024) {
+        return snprintf(buf, size, "%zuB", bytes);
+    } else if (bytes < 1024 * 1024) {
+        return snprintf(buf, size, "%.1fKB", bytes / 1024.0);
+    } else if (bytes < 1024 * 1024 * 1024) {
+        return snprintf(buf, size, "%.1fMB", bytes / (1024.0 * 1024));
+    }
+
+    return snprintf(buf, size, "%.1fGB", bytes / (1024.0 * 1024 * 1024));
+}
+
+/**
+ * The array of rows, where the room kept for more rows is not payload
+ */
+struct MemAccount docArrayMemory(struct Document *doc) {
+    struct MemAccount array = doc->arrayMemory;
+    size_t used = sizeof(struct Row) * (size_t) doc->numRows;
+
+    if (array.payload > used) {
+        array.payload = used;
+    }
+
+    return array;
+}
+
+/**
+ * The arenas, where the bytes of the rows that left them are not payload
+ */
+struct MemAccount docArenaMemory(struct Document *doc) {
+    struct MemAccount arenas = doc->arenaMemory;
+
+    arenas.payload = 0;
+
+    for (struct Arena *arena = doc->arenas; arena; arena = arena->next) {
+        arenas.payload += arena->live;
+    }
+
+    return arenas;
+}
+
+/**
+ * @param total filled with all that a document uses: its rows,
+ * their array, their arenas and the compressed blocks
+ */
+void docMemory(struct Document *doc, struct MemAccount *total) {
+    struct MemAccount array = docArrayMemory(doc);
+    struct MemAccount arenas = docArenaMemory(doc);
+
+    memset(total, 0, sizeof(struct MemAccount));
+    memSum(total, &doc->rowMemory);
+    memSum(total, &array);
+    memSum(total, &arenas);
+    memSum(total, &doc->coldMemory);
+}
+
+/**
+ * How much of what malloc gave is not used: what it rounded up,
+ * and the room kept for more rows
+ */
+int memFragmentation(struct MemAccount *account) {
+    size_t allocated = memAllocated(account);
+
+    if (allocated == 0) {
+        return 0;
+    }
+
+    return (int) ((account->usable - account->payload) * 100 / allocated);
+}
+
+/**
+ * A short summary of the memory of the current tab, for the status bar
+ */
+int docMemorySummary(char *buf, size_t size, struct Document *doc) {
+    struct MemAccount total;
+    docMemory(doc, &total);
+
+    char payload[16];
+    char overhead[16];
+
+    formatBytes(payload, sizeof(payload), total.payload);
+    formatBytes(overhead, sizeof(overhead), memAllocated(&total) - total.payload);
+
+    return snprintf(buf, size, "[%s +%s overhead, %lld rows, %d%% frag] ", payload, overhead, (long long) doc->numRows,
+                    memFragmentation(&total));
+}
+
+void writeAccount(FILE *fp, const char *name, struct MemAccount *account) {
+    fprintf(fp, "  %-12s payload %12zu  allocated %12zu  overhead %12zu  blocks %10ld  fragmentation %3d%%\n",
+            name, account->payload, memAllocated(account), memAllocated(account) - account->payload,
+            account->blocks, memFragmentation(account));
+}
+
+/**
+ * Writes what each tab uses to a file, and tells where in the status bar
+ */
+void dumpMemory() {
+    char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char path[512];
+    int pathLen = snprintf(path, sizeof(path), "%s/mithril-memory-%d.txt", dir, (int) getpid());
+
+    if (pathLen < 0 || pathLen >= (int) sizeof(path)) {
+        snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage),
+                 " (TMPDIR is too long, the memory was not written)");
+        return;
+    }
+
+    // the status bar is shorter than a path, the name without its directory tells enough
+    const char *name = strrchr(path, '/') + 1;
+    FILE *fp = fopen(path, "w");
+
+    if (!fp) {
+        if (snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage),
+                     " (could not write %s)", path) >= (int) sizeof(currentSession.statusMessage)) {
+            snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage),
+                     " (could not write %s in TMPDIR)", name);
+        }
+        return;
+    }
+
+    tabSaveView(getCurrentTab());
+
+    for (int i = 0; i < currentSession.numTabs; ++i) {
+        struct Document *doc = currentSession.tabs[i].doc;
+        struct MemAccount total;
+        struct MemAccount array = docArrayMemory(doc);
+        struct MemAccount arenas = docArenaMemory(doc);
+        docMemory(doc, &total);
+
+        fprintf(fp, "tab %d: %s%s\n", i + 1, doc->fileName ? doc->fileName : "(new file)",
+                doc->refCount > 1 ? " (shared with other tabs)" : "");
+        fprintf(fp, "  %lld rows, %ld allocated on their own, %s\n", (long long) doc->numRows, doc->rowMemory.blocks,
+                doc->hibernation == AWAKE ? "awake" : "hibernated");
+        writeAccount(fp, "rows", &doc->rowMemory);
+        writeAccount(fp, "row array", &array);
+        writeAccount(fp, "arenas", &arenas);
+        writeAccount(fp, "cold blocks", &doc->coldMemory);
+        writeAccount(fp, "total", &total);
+
+        if (doc->packed) {
+            fprintf(fp, "  packed       %12zu\n", doc->packedLen);
+        }
+    }
+
+    fprintf(fp, "editor\n");
+    writeAccount(fp, "frame", &editorMemory.frame);
+    fprintf(fp, "  %-12s peak %zu\n", "", editorMemory.frame.peak);
+    writeAccount(fp, "message", &editorMemory.message);
+    writeAccount(fp, "cursors", &editorMemory.cursors);
+    writeAccount(fp, "yank", &editorMemory.yank);
+    writeAccount(fp, "shared", &editorMemory.shared);
+    writeAccount(fp, "undo", &editorMemory.undo);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    fprintf(fp, "heap\n  from the system %zu  in use %zu  free %zu\n",
+            info.arena + info.hblkhd, info.uordblks + info.hblkhd, info.fordblks);
+#endif
+
+    fclose(fp);
+
+    if (snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (memory written to %s)",
+                 path) >= (int) sizeof(currentSession.statusMessage)) {
+        snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage),
+                 " (memory written to %s in TMPDIR)", name);
+    }
+}
+
+/*** syntax highlighting ***/
+
+enum HighlightType {
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_KEYWORD,
+    HL_TYPE,
+    HL_STRING,
+    HL_NUMBER
+};
+
+/**
+ * What the lexer is in at the end of a row, kept in hlState
+ */
+enum LexerState {
+    LEX_NORMAL = 0,
+    LEX_BLOCK_COMMENT,
+    LEX_DOUBLE_QUOTE, // only open at the end of a row that ends with a '\'
+    LEX_SINGLE_QUOTE,
+    LEX_TRIPLE_DOUBLE,
+    LEX_TRIPLE_SINGLE
+};
+
+/**
+ * How a language is highlighted
+ */
+struct Syntax {
+    char *name;
+    char **extensions; // with their dot, or whole file names
+    char **keywords;
+    char **types;
+    char *lineComment;
+    char *blockStart; // NULL when the language has no block comments
+    char *blockEnd;
+    int tripleQuotes; // strings in three quotes span rows
+};
+
+char *cExtensions[] = {".c", ".h", ".cc", ".cpp", ".cxx", ".hpp", ".hh", NULL};
+
+char *cKeywords[] = {
+        "auto", "break", "case", "const", "continue", "default", "do", "else", "enum", "extern", "for", "goto",
+        "if", "inline", "register", "restrict", "return", "sizeof", "static", "struct", "switch", "typedef",
+        "union", "volatile", "while", "class", "namespace", "public", "private", "protected", "template",
+        "typename", "new", "delete", "this", "virtual", "override", "nullptr", "true", "false", "using",
+        "try", "catch", "throw", "NULL", NULL
+};
+
+char *cTypes[] = {
+        "int", "long", "short", "char", "float", "double", "void", "unsigned", "signed", "bool", "size_t",
+        "ssize_t", "off_t", "int8_t", "int16_t", "int32_t", "int64_t", "uint8_t", "uint16_t", "uint32_t",
+        "uint64_t", NULL
+};
+
+char *pythonExtensions[] = {".py", NULL};
+
+char *pythonKeywords[] = {
+        "and", "as", "assert", "async", "await", "break", "class", "continue", "def", "del", "elif", "else",
+        "except", "finally", "for", "from", "global", "if", "import", "in", "is", "lambda", "nonlocal", "not",
+        "or", "pass", "raise", "return", "try", "while", "with", "yield", "True", "False", "None", NULL
+};
+
+char *pythonTypes[] = {"int", "str", "float", "list", "dict", "set", "tuple", "bytes", "bool", "self", NULL};
+
+struct Syntax syntaxes[] = {
+        {"c", cExtensions, cKeywords, cTypes, "//", "/*", "*/", 0},
+        {"python", pythonExtensions, pythonKeywords, pythonTypes, "#", NULL, NULL, 1},
+};
+
+/**
+ * The colours of a row, as runs of the same type
+ */
+struct HighlightSpan {
+    int64_t end; // the run goes from the end of the one before to here
+    unsigned char type;
+};
+
+/**
+ * A row on screen, lexed from startState
+ */
+struct HighlightRow {
+    int64_t row; // -1 when the entry is free
+    unsigned char startState;
+    unsigned char endState;
+    int plain; // too long to be highlighted
+    int numSpans;
+    int spanCap;
+    struct HighlightSpan *spans;
+};
+
+/**
+ * The rows lexed for the screen, a row goes to the entry of its index
+ * modulo HL_CACHE_ROWS so scrolling only lexes the rows coming in
+ */
+struct HighlightCache {
+    struct HighlightRow rows[HL_CACHE_ROWS];
+};
+
+/**
+ * @return the syntax of the file, NULL for plain text
+ */
+const struct Syntax *syntaxForFile(const char *fileName) {
+    if (NULL == fileName) {
+        return NULL;
+    }
+
+    const char *base = strrchr(fileName, '/');
+    const char *ext = strrchr(fileName, '.');
+    base = base ? base + 1 : fileName;
+
+    for (size_t i = 0; i < sizeof(syntaxes) / sizeof(syntaxes[0]); ++i) {
+        for (char **match = syntaxes[i].extensions; *match; ++match) {
+            if (strcmp(base, *match) == 0 || (ext && strcmp(ext, *match) == 0)) {
+                return &syntaxes[i];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int isSeparator(char c) {
+    return isspace((unsigned char) c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}:&|^!?", c) != NULL;
+}
+
+int isWordChar(char c) {
+    return isalnum((unsigned char) c) || c == '_';
+}
+
+/**
+ * Colours bytes of a row being lexed, the bytes skipped since the last call are normal
+ */
+void spanMark(struct HighlightRow *hl, int64_t from, int64_t to, unsigned char type) {
+    int64_t last = hl->numSpans > 0 ? hl->spans[hl->numSpans - 1].end : 0;
+
+    if (from > last) {
+        spanMark(hl, last, from, HL_NORMAL);
+    }
+
+    if (to <= from) {
+        return;
+    }
+
+    if (hl->numSpans > 0 && hl->spans[hl->numSpans - 1].type == type) {
+        hl->spans[hl->numSpans - 1].end = to;
+        return;
+    }
+
+    if (hl->numSpans == hl->spanCap) {
+        hl->spanCap = hl->spanCap < 16 ? 16 : hl->spanCap * 2;
+        hl->spans = realloc(hl->spans, sizeof(struct HighlightSpan) * (size_t) hl->spanCap);
+
+        if (NULL == hl->spans) {
+            fatal("Failed to allocate the colours of a row (spanMark)");
+            return;
+        }
+    }
+
+    hl->spans[hl->numSpans].end = to;
+    hl->spans[hl->numSpans].type = type;
+    ++hl->numSpans;
+}
+
+int wordIn(const char *s, int64_t len, char **words) {
+    for (char **word = words; *word; ++word) {
+        if ((int64_t) strlen(*word) == len && memcmp(s, *word, (size_t) len) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @return where the needle is in the len bytes of s, NULL if it is not
+ */
+const char *findBytes(const char *s, int64_t len, const char *needle) {
+    size_t needleLen = strlen(needle);
+    const char *end = s + len;
+
+    while ((size_t) (end - s) >= needleLen && NULL != (s = memchr(s, needle[0], (size_t) (end - s)))) {
+        if ((size_t) (end - s) >= needleLen && memcmp(s, needle, needleLen) == 0) {
+            return s;
+        }
+        ++s;
+    }
+
+    return NULL;
+}
+
+int startsWith(const char *s, int64_t len, const char *prefix) {
+    size_t prefixLen = strlen(prefix);
+
+    return (size_t) len >= prefixLen && memcmp(s, prefix, prefixLen) == 0;
+}
+
+/**
+ * Lexes a row, from the state the row before ended in
+ * @param hl where the colours go, NULL when only the state at the end matters
+ * @return the state at the end of the row
+ */
+unsigned char lexRow(const struct Syntax *syntax, const char *s, int64_t len, unsigned char state,
+                     struct HighlightRow *hl) {
+    int64_t i = 0;
+
+    while (i < len) {
+        if (state == LEX_BLOCK_COMMENT) {
+            const char *end = findBytes(s + i, len - i, syntax->blockEnd);
+            int64_t stop = end ? (end - s) + (int64_t) strlen(syntax->blockEnd) : len;
+
+            if (hl) {
+                spanMark(hl, i, stop, HL_COMMENT);
+            }
+
+            state = end ? LEX_NORMAL : LEX_BLOCK_COMMENT;
+            i = stop;
+            continue;
+        }
+
+        if (state != LEX_NORMAL) {
+            char quote = (state == LEX_DOUBLE_QUOTE || state == LEX_TRIPLE_DOUBLE) ? '"' : '\'';
+            int triple = state == LEX_TRIPLE_DOUBLE || state == LEX_TRIPLE_SINGLE;
+            int64_t j = i;
+
+            while (j < len) {
+                if (s[j] == '\\') {
+                    j += 2;
+                } else if (s[j] == quote && (!triple || (j + 2 < len && s[j + 1] == quote && s[j + 2] == quote))) {
+                    j += triple ? 3 : 1;
+                    state = LEX_NORMAL;
+                    break;
+                } else {
+                    ++j;
+                }
+            }
+
+            j = j < len ? j : len;
+
+            if (hl) {
+                spanMark(hl, i, j, HL_STRING);
+            }
+
+            i = j;
+            continue;
+        }
+
+        char c = s[i];
+
+        if (syntax->lineComment && startsWith(s + i, len - i, syntax->lineComment)) {
+            if (hl) {
+                spanMark(hl, i, len, HL_COMMENT);
+            }
+            break;
+        }
+
+        if (syntax->blockStart && startsWith(s + i, len - i, syntax->blockStart)) {
+            if (hl) {
+                spanMark(hl, i, i + (int64_t) strlen(syntax->blockStart), HL_COMMENT);
+            }
+            state = LEX_BLOCK_COMMENT;
+            i += (int64_t) strlen(syntax->blockStart);
+            continue;
+        }
+
+        if (c == '"' || c == '\'') {
+            int triple = syntax->tripleQuotes && i + 2 < len && s[i + 1] == c && s[i + 2] == c;
+
+            if (hl) {
+                spanMark(hl, i, i + (triple ? 3 : 1), HL_STRING);
+            }
+            state = c == '"' ? (triple ? LEX_TRIPLE_DOUBLE : LEX_DOUBLE_QUOTE) :
+                    (triple ? LEX_TRIPLE_SINGLE : LEX_SINGLE_QUOTE);
+            i += triple ? 3 : 1;
+            continue;
+        }
+
+        // what follows only gives colours, the state does not depend on it
+        if (NULL == hl || (i > 0 && !isSeparator(s[i - 1]))) {
+            ++i;
+            continue;
+        }
+
+        if (isdigit((unsigned char) c) || isWordChar(c)) {
+            int64_t j = i;
+
+            while (j < len && (isWordChar(s[j]) || (isdigit((unsigned char) c) && s[j] == '.'))) {
+                ++j;
+            }
+
+            if (isdigit((unsigned char) c)) {
+                spanMark(hl, i, j, HL_NUMBER);
+            } else if (wordIn(s + i, j - i, syntax->keywords)) {
+                spanMark(hl, i, j, HL_KEYWORD);
+            } else if (wordIn(s + i, j - i, syntax->types)) {
+                spanMark(hl, i, j, HL_TYPE);
+            }
+
+            i = j;
+            continue;
+        }
+
+        ++i;
+    }
+
+    // a string in one quote only goes on after a '\'
+    if ((state == LEX_DOUBLE_QUOTE || state == LEX_SINGLE_QUOTE) && (len == 0 || s[len - 1] != '\\')) {
+        state = LEX_NORMAL;
+    }
+
+    if (hl) {
+        spanMark(hl, len, len, HL_NORMAL);
+    }
+
+    return state;
+}
+
+/**
+ * The end state of a row, rows too long to be highlighted leave the state as it was
+ */
+unsigned char rowLex(const struct Syntax *syntax, struct Row *row, unsigned char state, struct HighlightRow *hl) {
+    if (row->rawSize > HL_MAX_ROW_BYTES) {
+        return state;
+    }
+
+    return lexRow(syntax, rowChars(row), row->rawSize, state, hl);
+}
+
+/**
+ * Forgets the colours of every row, keeping the memory for the next ones
+ */
+void docHighlightClearCache(struct Document *doc) {
+    if (NULL == doc->hlCache) {
+        return;
+    }
+
+    for (int i = 0; i < HL_CACHE_ROWS; ++i) {
+        doc->hlCache->rows[i].row = -1;
+    }
+}
+
+void docHighlightReset(struct Document *doc) {
+    doc->hlValidRows = 0;
+    doc->hlKnownRows = 0;
+    doc->hlDirtyEnd = 0;
+    docHighlightClearCache(doc);
+}
+
+void docHighlightFree(struct Document *doc) {
+    if (NULL == doc->hlCache) {
+        return;
+    }
+
+    for (int i = 0; i < HL_CACHE_ROWS; ++i) {
+        free(doc->hlCache->rows[i].spans);
+    }
+
+    free(doc->hlCache);
+    doc->hlCache = NULL;
+}
+
+/**
+ * The bytes of a row changed, its state and the ones after it have to be checked again
+ */
+void docHighlightChanged(struct Document *doc, int64_t row) {
+    if (row < doc->hlValidRows) {
+        doc->hlValidRows = row;
+    }
+
+    if (row + 1 > doc->hlDirtyEnd) {
+        doc->hlDirtyEnd = row + 1;
+    }
+
+    if (doc->hlCache && doc->hlCache->rows[row % HL_CACHE_ROWS].row == row) {
+        doc->hlCache->rows[row % HL_CACHE_ROWS].row = -1;
+    }
+}
+
+/**
+ * Rows were put at a position, the states of the rows after them moved with them.
+ * The colours of the rows on screen are left to the caller.
+ */
+void highlightShiftInserted(struct Document *doc, int64_t at, int64_t count) {
+    if (at < doc->hlValidRows) {
+        doc->hlValidRows = at;
+    }
+
+    if (at < doc->hlKnownRows) {
+        doc->hlKnownRows += count;
+    }
+
+    if (at < doc->hlDirtyEnd) {
+        doc->hlDirtyEnd += count;
+    }
+
+    if (at + count > doc->hlDirtyEnd) {
+        doc->hlDirtyEnd = at + count;
+    }
+}
+
+void docHighlightInserted(struct Document *doc, int64_t at, int64_t count) {
+    highlightShiftInserted(doc, at, count);
+    docHighlightClearCache(doc);
+}
+
+void highlightShiftRemoved(struct Document *doc, int64_t at, int64_t count) {
+    if (at < doc->hlValidRows) {
+        doc->hlValidRows = at;
+    }
+
+    if (doc->hlKnownRows >= at + count) {
+        doc->hlKnownRows -= count;
+    } else if (doc->hlKnownRows > at) {
+        doc->hlKnownRows = at;
+    }
+
+    if (doc->hlDirtyEnd >= at + count) {
+        doc->hlDirtyEnd -= count;
+    } else if (doc->hlDirtyEnd > at) {
+        doc->hlDirtyEnd = at;
+    }
+}
+
+void docHighlightRemoved(struct Document *doc, int64_t at, int64_t count) {
+    highlightShiftRemoved(doc, at, count);
+    docHighlightClearCache(doc);
+}
+
+/**
+ * Lexes the rows whose state is not known, up to a row. Past the edited rows,
+ * a row that ends in the state it ended in before the edits means the rows
+ * after it are right too, so an edit only lexes until the states agree again.
+ * @param upTo the rows before it get their state
+ * @param maxRows the most rows lexed
+ * @return 1 once the rows before upTo have their state
+ */
+int docLexStates(struct Document *doc, int64_t upTo, int64_t maxRows) {
+    if (upTo > doc->numRows) {
+        upTo = doc->numRows;
+    }
+
+    int64_t i = doc->hlValidRows;
+
+    while (i < upTo && maxRows-- > 0) {
+        unsigned char state = i > 0 ? doc->rows[i - 1].hlState : LEX_NORMAL;
+        unsigned char end = rowLex(doc->syntax, &doc->rows[i], state, NULL);
+
+        if (i >= doc->hlDirtyEnd && i < doc->hlKnownRows && end == doc->rows[i].hlState) {
+            i = doc->hlKnownRows;
+            continue;
+        }
+
+        doc->rows[i].hlState = end;
+        ++i;
+    }
+
+    doc->hlValidRows = i;
+
+    if (i > doc->hlKnownRows) {
+        doc->hlKnownRows = i;
+    }
+
+    return i >= upTo;
+}
+
+/**
+ * Picks the syntax of the document from its file name, a new one starts over
+ */
+void docUpdateSyntax(struct Document *doc) {
+    const struct Syntax *syntax = syntaxForFile(doc->fileName);
+
+    if (syntax != doc->syntax) {
+        doc->syntax = syntax;
+        docHighlightReset(doc);
+    }
+}
+
+/**
+ * The colours of a row on screen, lexed again only when the
+ * row or the state it starts in changed
+ * @param startState the state the row before ended in
+ */
+struct HighlightRow *docHighlightRow(struct Document *doc, int64_t idx, unsigned char startState) {
+    if (NULL == doc->hlCache) {
+        doc->hlCache = calloc(1, sizeof(struct HighlightCache));
+
+        if (NULL == doc->hlCache) {
+            fatal("Failed to allocate the highlighting (docHighlightRow)");
+            return NULL;
+        }
+
+        docHighlightClearCache(doc);
+    }
+
+    struct HighlightRow *hl = &doc->hlCache->rows[idx % HL_CACHE_ROWS];
+
+    if (hl->row == idx && hl->startState == startState) {
+        return hl;
+    }
+
+    struct Row *row = &doc->rows[idx];
+
+    hl->row = idx;
+    hl->startState = startState;
+    hl->numSpans = 0;
+    hl->plain = row->rawSize > HL_MAX_ROW_BYTES;
+    hl->endState = rowLex(doc->syntax, row, startState, hl->plain ? NULL : hl);
+
+    return hl;
+}
+
+/**
+ * Makes sure the rows above the screen have their state, when there are
+ * not too many to lex. editorHighlightIdle gets to the others.
+ */
+void docHighlightPrepare(struct Document *doc, int64_t rowOffset) {
+    docUpdateSyntax(doc);
+
+    if (doc->syntax && rowOffset - doc->hlValidRows <= HL_DRAW_ROWS) {
+        docLexStates(doc, rowOffset, HL_DRAW_ROWS);
+    }
+}
+
+/**
+ * Lexes a slice of the rows above the screen, after a jump far down a file
+ * @return 1 when the screen has to be drawn again with the right states
+ */
+int editorHighlightIdle() {
+    struct Document *doc = getCurrentDoc();
+
+    if (NULL == doc || NULL == doc->syntax || doc->hibernation != AWAKE ||
+        doc->hlValidRows >= currentSession.rowOffset) {
+        return 0;
+    }
+
+    return docLexStates(doc, currentSession.rowOffset, HL_SCAN_ROWS);
+}
+
+/*** display columns ***/
+
+/**
+ * Code points that do not take one column
+ */
+struct WidthRange {
+    uint32_t first;
+    uint32_t last;
+    int width;
+};
+
+// sorted, the combining marks take no column and the east asian wide characters two
+const struct WidthRange widthRanges[] = {
+        {0x0300, 0x036F, 0}, {0x0483, 0x0489, 0}, {0x0591, 0x05BD, 0}, {0x05BF, 0x05BF, 0},
+        {0x05C1, 0x05C2, 0}, {0x05C4, 0x05C5, 0}, {0x05C7, 0x05C7, 0}, {0x0610, 0x061A, 0},
+        {0x064B, 0x065F, 0}, {0x0670, 0x0670, 0}, {0x06D6, 0x06DC, 0}, {0x06DF, 0x06E4, 0},
+        {0x06E7, 0x06E8, 0}, {0x06EA, 0x06ED, 0}, {0x0711, 0x0711, 0}, {0x0730, 0x074A, 0},
+        {0x07A6, 0x07B0, 0}, {0x0900, 0x0902, 0}, {0x093C, 0x093C, 0}, {0x0941, 0x0948, 0},
+        {0x094D, 0x094D, 0}, {0x0951, 0x0957, 0}, {0x0962, 0x0963, 0}, {0x0E31, 0x0E31, 0},
+        {0x0E34, 0x0E3A, 0}, {0x0E47, 0x0E4E, 0}, {0x1100, 0x115F, 2}, {0x1160, 0x11FF, 0},
+        {0x1AB0, 0x1AFF, 0}, {0x1DC0, 0x1DFF, 0}, {0x200B, 0x200F, 0}, {0x202A, 0x202E, 0},
+        {0x2060, 0x2064, 0}, {0x20D0, 0x20FF, 0}, {0x231A, 0x231B, 2}, {0x2329, 0x232A, 2},
+        {0x23E9, 0x23EC, 2}, {0x23F0, 0x23F0, 2}, {0x23F3, 0x23F3, 2}, {0x25FD, 0x25FE, 2},
+        {0x2614, 0x2615, 2}, {0x2648, 0x2653, 2}, {0x267F, 0x267F, 2}, {0x2693, 0x2693, 2},
+        {0x26A1, 0x26A1, 2}, {0x26AA, 0x26AB, 2}, {0x26BD, 0x26BE, 2}, {0x26C4, 0x26C5, 2},
+        {0x26CE, 0x26CE, 2}, {0x26D4, 0x26D4, 2}, {0x26EA, 0x26EA, 2}, {0x26F2, 0x26F3, 2},
+        {0x26F5, 0x26F5, 2}, {0x26FA, 0x26FA, 2}, {0x26FD, 0x26FD, 2}, {0x2705, 0x2705, 2},
+        {0x270A, 0x270B, 2}, {0x2728, 0x2728, 2}, {0x274C, 0x274C, 2}, {0x274E, 0x274E, 2},
+        {0x2753, 0x2755, 2}, {0x2757, 0x2757, 2}, {0x2795, 0x2797, 2}, {0x27B0, 0x27B0, 2},
+        {0x27BF, 0x27BF, 2}, {0x2B1B, 0x2B1C, 2}, {0x2B50, 0x2B50, 2}, {0x2B55, 0x2B55, 2},
+        {0x2E80, 0x3029, 2}, {0x302A, 0x302D, 0}, {0x302E, 0x303E, 2}, {0x3041, 0x3098, 2},
+        {0x3099, 0x309A, 0}, {0x309B, 0x33FF, 2}, {0x3400, 0x4DBF, 2}, {0x4E00, 0x9FFF, 2},
+        {0xA000, 0xA4CF, 2}, {0xA960, 0xA97F, 2}, {0xAC00, 0xD7A3, 2}, {0xF900, 0xFAFF, 2},
+        {0xFE00, 0xFE0F, 0}, {0xFE10, 0xFE19, 2}, {0xFE20, 0xFE2F, 0}, {0xFE30, 0xFE6F, 2},
+        {0xFEFF, 0xFEFF, 0}, {0xFF00, 0xFF60, 2}, {0xFFE0, 0xFFE6, 2}, {0x16FE0, 0x16FE4, 2},
+        {0x17000, 0x18AFF, 2}, {0x1B000, 0x1B2FF, 2}, {0x1F004, 0x1F004, 2}, {0x1F0CF, 0x1F0CF, 2},
+        {0x1F18E, 0x1F18E, 2}, {0x1F191, 0x1F19A, 2}, {0x1F200, 0x1F251, 2}, {0x1F300, 0x1F64F, 2},
+        {0x1F680, 0x1F6FF, 2}, {0x1F900, 0x1F9FF, 2}, {0x1FA70, 0x1FAFF, 2}, {0x20000, 0x2FFFD, 2},
+        {0x30000, 0x3FFFD, 2}, {0xE0020, 0xE007F, 0}, {0xE0100, 0xE01EF, 0},
+};
+
+// the widths of the first plane, where almost all the text is, looked up in the ranges once
+unsigned char planeWidths[0x10000];
+int planeWidthsReady = 0;
+
+int rangeWidth(uint32_t cp);
+
+/**
+ * @return how many columns a code point takes on screen, like wcwidth
+ * but without asking the locale
+ */
+int codepointWidth(uint32_t cp) {
+    if (cp < widthRanges[0].first) {
+        return 1;
+    } else if (cp > 0xFFFF) {
+        return rangeWidth(cp);
+    }
+
+    if (!planeWidthsReady) {
+        for (uint32_t c = 0; c < 0x10000; ++c) {
+            planeWidths[c] = (unsigned char) rangeWidth(c);
+        }
+        planeWidthsReady = 1;
+    }
+
+    return planeWidths[cp];
+}
+
+int rangeWidth(uint32_t cp) {
+    int lo = 0;
+    int hi = (int) (sizeof(widthRanges) / sizeof(widthRanges[0]));
+
+    if (cp < widthRanges[0].first) {
+        return 1;
+    }
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (widthRanges[mid].last < cp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return (lo < (int) (sizeof(widthRanges) / sizeof(widthRanges[0])) && widthRanges[lo].first <= cp) ?
+           widthRanges[lo].width : 1;
+}
+
+/**
+ * Decodes the UTF-8 character at the start of s. A byte that does not start a valid
+ * character (cut, overlong, a surrogate) is a character of its own, U+FFFD.
+ * @param len the bytes there are, at least one
+ * @return how many bytes the character takes
+ */
+int utf8Decode(const char *s, int64_t len, uint32_t *cp) {
+    const unsigned char *u = (const unsigned char *) s;
+    int n;
+    uint32_t min;
+
+    if (u[0] < 0x80) {
+        *cp = u[0];
+        return 1;
+    } else if (u[0] >= 0xC2 && u[0] <= 0xDF) {
+        n = 2;
+        *cp = u[0] & 0x1F;
+        min = 0x80;
+    } else if (u[0] >= 0xE0 && u[0] <= 0xEF) {
+        n = 3;
+        *cp = u[0] & 0x0F;
+        min = 0x800;
+    } else if (u[0] >= 0xF0 && u[0] <= 0xF4) {
+        n = 4;
+        *cp = u[0] & 0x07;
+        min = 0x10000;
+    } else {
+        *cp = 0xFFFD;
+        return 1;
+    }
+
+    if (len < n) {
+        *cp = 0xFFFD;
+        return 1;
+    }
+
+    for (int i = 1; i < n; ++i) {
+        if ((u[i] & 0xC0) != 0x80) {
+            *cp = 0xFFFD;
+            return 1;
+        }
+
+        *cp = (*cp << 6) | (u[i] & 0x3F);
+    }
+
+    if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF)) {
+        *cp = 0xFFFD;
+        return 1;
+    }
+
+    return n;
+}
+
+/**
+ * @return 1 when none of the bytes is past ASCII, looked at thirty two at a time
+ */
+int isAsciiBytes(const char *s, int64_t len) {
+    const uint64_t high = 0x8080808080808080ULL;
+    uint64_t a, b, c, d;
+
+    // four words per step and a single test, the compiler turns it into vector loads
+    while (len >= 32) {
+        memcpy(&a, s, 8);
+        memcpy(&b, s + 8, 8);
+        memcpy(&c, s + 16, 8);
+        memcpy(&d, s + 24, 8);
+
+        if ((a | b | c | d) & high) {
+            return 0;
+        }
+
+        s += 32;
+        len -= 32;
+    }
+
+    while (len >= 8) {
+        memcpy(&a, s, 8);
+
+        if (a & high) {
+            return 0;
+        }
+
+        s += 8;
+        len -= 8;
+    }
+
+    while (len-- > 0) {
+        if (*s++ & 0x80) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * A character that is not one byte shown in one column
+ */
+struct WidthMark {
+    int64_t byte;
+    int64_t col;
+    int len;
+    int width;
+};
+
+/**
+ * Where a chunk of a long row starts, it goes on to the next one
+ */
+struct ColumnChunk {
+    int64_t byte;
+    int64_t col;
+    int ascii; // a byte is a column in the chunk
+};
+
+/**
+ * Where the characters of a row are on screen. The bytes between
+ * two marks are ASCII, one column each. A long row has a chunk every
+ * COL_CHUNK bytes instead, so finding a column only decodes a chunk
+ * and an edit only counts the columns of its own chunk again.
+ */
+struct ColumnMap {
+    int64_t row; // -1 when the entry is free
+    int64_t rawSize;
+    int ascii; // no marks, a byte is a column
+    int64_t numCols;
+    int64_t numMarks;
+    int64_t markCap;
+    struct WidthMark *marks;
+    int chunked; // a long row, the chunks are used and not the marks
+    int64_t numChunks;
+    int64_t chunkCap;
+    struct ColumnChunk *chunks;
+};
+
+/**
+ * The maps of the rows on screen, a row goes to the entry
+ * of its index modulo COL_CACHE_ROWS
+ */
+struct ColumnCache {
+    struct ColumnMap rows[COL_CACHE_ROWS];
+};
+
+/**
+ * Counts the columns of a chunk of a row, from a character
+ * @param limit the chunk ends on the first character that ends at or past it
+ * @param end where the chunk ends
+ * @return the columns of the chunk
+ */
+int64_t chunkColumns(const char *s, int64_t len, int64_t from, int64_t limit, int64_t *end, int *ascii) {
+    if (isAsciiBytes(s + from, limit - from)) {
+        *end = limit;
+        *ascii = 1;
+        return limit - from;
+    }
+
+    int64_t cols = 0;
+    int64_t i = from;
+
+    while (i < limit) {
+        uint32_t cp;
+        uint64_t word;
+
+        if (!(s[i] & 0x80)) {
+            // the ASCII between the other characters, a word at a time
+            while (i + 8 <= limit && (memcpy(&word, s + i, 8), !(word & 0x8080808080808080ULL))) {
+                i += 8;
+                cols += 8;
+            }
+
+            if (i < limit && !(s[i] & 0x80)) {
+                ++i;
+                ++cols;
+            }
+            continue;
+        }
+
+        i += utf8Decode(s + i, len - i, &cp);
+        cols += codepointWidth(cp);
+    }
+
+    *end = i;
+    *ascii = 0;
+    return cols;
+}
+
+/**
+ * Cuts bytes of a row in chunks of about COL_CHUNK bytes
+ * @param chunks where they go, as many as COL_CHUNK fits in the bytes and one more
+ * @param col the column of the first byte, then the one after the last
+ * @return how many chunks, -1 when the last character goes past the bytes
+ */
+int64_t chunkBytes(const char *s, int64_t len, int64_t from, int64_t to, int64_t *col, struct ColumnChunk *chunks) {
+    int64_t count = 0;
+
+    while (from < to) {
+        int64_t limit = to - from > COL_CHUNK ? from + COL_CHUNK : to;
+        int64_t end;
+        int ascii;
+        int64_t cols = chunkColumns(s, len, from, limit, &end, &ascii);
+
+        if (end > to) {
+            return -1;
+        }
+
+        chunks[count++] = (struct ColumnChunk) {.byte = from, .col = *col, .ascii = ascii};
+        from = end;
+        *col += cols;
+    }
+
+    return count;
+}
+
+void columnMapReserveChunks(struct ColumnMap *map, int64_t count) {
+    if (count <= map->chunkCap) {
+        return;
+    }
+
+    map->chunkCap = count < 2 * map->chunkCap ? 2 * map->chunkCap : count;
+    map->chunks = realloc(map->chunks, sizeof(struct ColumnChunk) * (size_t) map->chunkCap);
+
+    if (NULL == map->chunks) {
+        fatal("Failed to allocate the columns of a row (columnMapReserveChunks)");
+    }
+}
+
+void columnMapBuild(struct ColumnMap *map, const char *s, int64_t len) {
+    map->rawSize = len;
+    map->numMarks = 0;
+    map->numChunks = 0;
+    map->chunked = len >= COL_LONG_ROW;
+
+    if (map->chunked) {
+        columnMapReserveChunks(map, len / COL_CHUNK + 1);
+        map->numCols = 0;
+        map->numChunks = chunkBytes(s, len, 0, len, &map->numCols, map->chunks);
+        map->ascii = 1;
+
+        for (int64_t k = 0; k < map->numChunks; ++k) {
+            map->ascii &= map->chunks[k].ascii;
+        }
+
+        return;
+    }
+
+    map->ascii = isAsciiBytes(s, len);
+    map->numCols = len;
+
+    if (map->ascii) {
+        return;
+    }
+
+    int64_t col = 0;
+    int64_t i = 0;
+
+    while (i < len) {
+        if (!(s[i] & 0x80)) {
+            ++i;
+            ++col;
+            continue;
+        }
+
+        uint32_t cp;
+        int n = utf8Decode(s + i, len - i, &cp);
+        int width = codepointWidth(cp);
+
+        if (map->numMarks == map->markCap) {
+            map->markCap = map->markCap < 16 ? 16 : map->markCap * 2;
+            map->marks = realloc(map->marks, sizeof(struct WidthMark) * (size_t) map->markCap);
+
+            if (NULL == map->marks) {
+                fatal("Failed to allocate the columns of a row (columnMapBuild)");
+                return;
+            }
+        }
+
+        map->marks[map->numMarks++] = (struct WidthMark) {.byte = i, .col = col, .len = n, .width = width};
+        i += n;
+        col += width;
+    }
+
+    map->numCols = col;
+}
+
+/**
+ * @return the last chunk starting at or before a byte
+ */
+int64_t chunkOfByte(const struct ColumnMap *map, int64_t byte) {
+    int64_t lo = 0;
+    int64_t hi = map->numChunks;
+
+    while (lo < hi) {
+        int64_t mid = (lo + hi) / 2;
+
+        if (map->chunks[mid].byte <= byte) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo > 0 ? lo - 1 : 0;
+}
+
+/**
+ * @return the last chunk starting at or before a column
+ */
+int64_t chunkOfColumn(const struct ColumnMap *map, int64_t col) {
+    int64_t lo = 0;
+    int64_t hi = map->numChunks;
+
+    while (lo < hi) {
+        int64_t mid = (lo + hi) / 2;
+
+        if (map->chunks[mid].col <= col) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo > 0 ? lo - 1 : 0;
+}
+
+int64_t chunkEnd(const struct ColumnMap *map, int64_t k) {
+    return k + 1 < map->numChunks ? map->chunks[k + 1].byte : map->rawSize;
+}
+
+/**
+ * Bytes of a long row were replaced: the chunks around them are cut
+ * again, the ones after them only move
+ * @param s the bytes of the row, once replaced
+ * @param len the size of the row, once replaced
+ * @return 0 when the map has to be built again
+ */
+int columnMapSplice(struct ColumnMap *map, const char *s, int64_t len, int64_t at, int64_t removed,
+                    int64_t inserted) {
+    if (!map->chunked || map->numChunks == 0 || map->rawSize + inserted - removed != len) {
+        return 0;
+    }
+
+    // bytes put at the start of a chunk could end the character before it
+    int64_t first = at > 0 ? chunkOfByte(map, at - 1) : 0;
+    int64_t last = chunkOfByte(map, at + removed);
+    int64_t delta = inserted - removed;
+    int64_t from = map->chunks[first].byte;
+    int64_t to = chunkEnd(map, last) + delta;
+    int64_t oldEndCol = last + 1 < map->numChunks ? map->chunks[last + 1].col : map->numCols;
+    int64_t room = (to - from) / COL_CHUNK + 1;
+
+    // the new chunks are cut past where the ones after them go
+    columnMapReserveChunks(map, map->numChunks + 2 * room);
+
+    struct ColumnChunk *fresh = map->chunks + map->numChunks + room;
+    int64_t col = map->chunks[first].col;
+    int64_t count = chunkBytes(s, len, from, to, &col, fresh);
+
+    if (count < 0) {
+        return 0;
+    }
+
+    int64_t tail = map->numChunks - (last + 1);
+
+    for (int64_t k = last + 1; k < map->numChunks; ++k) {
+        map->chunks[k].byte += delta;
+        map->chunks[k].col += col - oldEndCol;
+    }
+
+    memmove(map->chunks + first + count, map->chunks + last + 1, sizeof(struct ColumnChunk) * (size_t) tail);
+    memcpy(map->chunks + first, fresh, sizeof(struct ColumnChunk) * (size_t) count);
+
+    for (int64_t k = 0; k < count; ++k) {
+        map->ascii &= fresh[k].ascii;
+    }
+
+    map->numChunks = first + count + tail;
+    map->numCols += col - oldEndCol;
+    map->rawSize = len;
+
+    return 1;
+}
+
+/**
+ * @return the last mark at or before a byte, NULL when there is none
+ */
+struct WidthMark *markBeforeByte(const struct ColumnMap *map, int64_t byte) {
+    int64_t lo = 0;
+    int64_t hi = map->numMarks;
+
+    while (lo < hi) {
+        int64_t mid = (lo + hi) / 2;
+
+        if (map->marks[mid].byte <= byte) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo > 0 ? &map->marks[lo - 1] : NULL;
+}
+
+/**
+ * @param s the bytes of the row, a long row decodes the chunk of the byte
+ * @return the column of the character a byte is in
+ */
+int64_t columnOfByte(const struct ColumnMap *map, const char *s, int64_t byte) {
+    if (map->ascii) {
+        return byte;
+    }
+
+    if (map->chunked) {
+        struct ColumnChunk *chunk = &map->chunks[chunkOfByte(map, byte)];
+        int64_t col = chunk->col;
+        int64_t i = chunk->byte;
+
+        if (chunk->ascii) {
+            return col + (byte - i);
+        }
+
+        while (i < byte) {
+            uint32_t cp;
+            int n = utf8Decode(s + i, map->rawSize - i, &cp);
+
+            if (i + n > byte) {
+                break;
+            }
+
+            i += n;
+            col += codepointWidth(cp);
+        }
+
+        return col;
+    }
+
+    struct WidthMark *mark = markBeforeByte(map, byte);
+
+    if (NULL == mark) {
+        return byte;
+    } else if (byte < mark->byte + mark->len) {
+        return mark->col;
+    }
+
+    return mark->col + mark->width + (byte - mark->byte - mark->len);
+}
+
+/**
+ * @param s the bytes of the row, a long row decodes the chunk of the column
+ * @param charCol where the column of the character is put, it is before
+ * col when a wide character covers col
+ * @return the first byte of the character at a column, the size of the row past its end
+ */
+int64_t byteOfColumn(const struct ColumnMap *map, const char *s, int64_t col, int64_t *charCol) {
+    if (col >= map->numCols) {
+        *charCol = map->numCols;
+        return map->rawSize;
+    }
+
+    if (map->ascii) {
+        *charCol = col;
+        return col;
+    }
+
+    if (map->chunked) {
+        int64_t k = chunkOfColumn(map, col);
+        int64_t end = chunkEnd(map, k);
+        int64_t c = map->chunks[k].col;
+        int64_t i = map->chunks[k].byte;
+
+        if (map->chunks[k].ascii) {
+            *charCol = col;
+            return i + (col - c);
+        }
+
+        while (i < end) {
+            uint32_t cp;
+            int n = utf8Decode(s + i, map->rawSize - i, &cp);
+            int width = codepointWidth(cp);
+
+            // the combining marks go with the character before them
+            if (col < c + width) {
+                break;
+            }
+
+            i += n;
+            c += width;
+        }
+
+        *charCol = c;
+        return i;
+    }
+
+    // the last mark starting at or before the column
+    int64_t lo = 0;
+    int64_t hi = map->numMarks;
+
+    while (lo < hi) {
+        int64_t mid = (lo + hi) / 2;
+
+        if (map->marks[mid].col <= col) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0) {
+        *charCol = col;
+        return col;
+    }
+
+    struct WidthMark *mark = &map->marks[lo - 1];
+
+    if (col < mark->col + mark->width) {
+        *charCol = mark->col;
+        return mark->byte;
+    }
+
+    *charCol = col;
+    return mark->byte + mark->len + (col - mark->col - mark->width);
+}
+
+void docColumnsClear(struct Document *doc) {
+    if (NULL == doc->colCache) {
+        return;
+    }
+
+    for (int i = 0; i < COL_CACHE_ROWS; ++i) {
+        doc->colCache->rows[i].row = -1;
+    }
+}
+
+void docColumnsFree(struct Document *doc) {
+    if (NULL == doc->colCache) {
+        return;
+    }
+
+    for (int i = 0; i < COL_CACHE_ROWS; ++i) {
+        free(doc->colCache->rows[i].marks);
+        free(doc->colCache->rows[i].chunks);
+    }
+
+    free(doc->colCache);
+    doc->colCache = NULL;
+}
+
+/**
+ * The columns of a row of a document, only looked for again when the row changed
+ */
+struct ColumnMap *docColumnMap(struct Document *doc, int64_t idx) {
+    if (NULL == doc->colCache) {
+        doc->colCache = calloc(1, sizeof(struct ColumnCache));
+
+        if (NULL == doc->colCache) {
+            fatal("Failed to allocate the display columns (docColumnMap)");
+            return NULL;
+        }
+
+        docColumnsClear(doc);
+    }
+
+    struct ColumnMap *map = &doc->colCache->rows[idx % COL_CACHE_ROWS];
+    struct Row *row = &doc->rows[idx];
+
+    if (map->row != idx || map->rawSize != row->rawSize) {
+        map->row = idx;
+        columnMapBuild(map, rowChars(row), row->rawSize);
+    }
+
+    return map;
+}
+
+// the message row is short and not part of a document, its map is made when needed
+struct ColumnMap messageColumns;
+
+/**
+ * @return the columns of the row the cursor is on, NULL past the last row
+ */
+struct ColumnMap *currentColumnMap() {
+    struct Row *row = getCurrentRow();
+
+    if (NULL == row) {
+        return NULL;
+    } else if (currentSession.locked) {
+        columnMapBuild(&messageColumns, rowChars(row), row->rawSize);
+        return &messageColumns;
+    }
+
+    return docColumnMap(getCurrentDoc(), currentSession.cursorRow);
+}
+
+/**
+ * @return the column the cursor is in on its row
+ */
+int64_t cursorColumn() {
+    struct ColumnMap *map = currentColumnMap();
+
+    return map ? columnOfByte(map, rowChars(getCurrentRow()), currentSession.cursorCol) : currentSession.cursorCol;
+}
+
+/**
+ * Puts the cursor on the character at a column of its row, the
+ * start of a wide one when the column is its second half
+ */
+void cursorToColumn(int64_t col) {
+    struct ColumnMap *map = currentColumnMap();
+    int64_t charCol;
+
+    currentSession.cursorCol = map ? byteOfColumn(map, rowChars(getCurrentRow()), col, &charCol) : 0;
+}
+
+/**
+ * @return the column after the character the cursor is on
+ */
+int64_t cursorColumnEnd() {
+    struct ColumnMap *map = currentColumnMap();
+
+    if (NULL == map) {
+        return currentSession.cursorCol + 1;
+    } else if (currentSession.cursorCol >= map->rawSize) {
+        return map->numCols + 1;
+    }
+
+    struct Row *row = getCurrentRow();
+
+    return columnOfByte(map, rowChars(row), nextCharEnd(rowChars(row), row->rawSize, currentSession.cursorCol));
+}
+
+/**
+ * @return where the character after pos ends, with the marks that go on it
+ */
+int64_t nextCharEnd(const char *s, int64_t len, int64_t pos) {
+    uint32_t cp;
+
+    if (pos >= len) {
+        return len;
+    }
+
+    pos += utf8Decode(s + pos, len - pos, &cp);
+
+    while (pos < len && (s[pos] & 0x80)) {
+        int n = utf8Decode(s + pos, len - pos, &cp);
+
+        if (codepointWidth(cp) != 0) {
+            break;
+        }
+
+        pos += n;
+    }
+
+    return pos;
+}
+
+/**
+ * @return where the character before pos starts, with the marks that go on it
+ */
+int64_t prevCharStart(const char *s, int64_t len, int64_t pos) {
+    while (pos > 0) {
+        // back over the continuation bytes, to a byte that decodes up to pos
+        int64_t start = pos - 1;
+
+        while (start > 0 && pos - start < 4 && (s[start] & 0xC0) == 0x80) {
+            --start;
+        }
+
+        uint32_t cp;
+
+        if (utf8Decode(s + start, len - start, &cp) != pos - start) {
+            start = pos - 1;
+            cp = 0xFFFD;
+        }
+
+        pos = start;
+
+        if (codepointWidth(cp) != 0) {
+            break;
+        }
+    }
+
+    return pos;
+}
+
+/*** soft wrap ***/
+
+/**
+ * How many screen lines each row of a document takes when the rows wrap,
+ * with a Fenwick tree over blocks of WRAP_BLOCK_ROWS rows: the first screen
+ * line of a row, or the row of a screen line, is a walk down the tree and a
+ * block, not a sum over the rows before it. Inserting a row moves the rows
+ * after it to other blocks, so their sums are made again, but only the sums.
+ * The rows are counted from their size first, a character has at least as
+ * many bytes as columns so that is never less than they take. The rows on
+ * screen, and the ones the idle ticks get to, are counted for real; only
+ * the rows that changed are counted again.
+ */
+struct WrapLayout {
+    int width; // the screen columns the rows were counted for, 0 to count them all again
+    int64_t numRows;
+    int64_t cap;
+    int32_t *lines; // of each row, negative when it is a guess from the size of the row
+    int64_t *tree; // tree[i] sums the lines of the blocks i - (i & -i) up to i - 1
+    int64_t treeValid; // the blocks before it have the right sums, the ones after are made again
+    int64_t guessed; // how many rows are still a guess
+    int64_t scan; // the row the next idle tick counts from
+};
+
+/**
+ * @return the screen lines of a row of that many columns
+ */
+int64_t wrapLinesOf(int64_t cols, int width) {
+    return cols <= 0 ? 1 : (cols + width - 1) / width;
+}
+
+/**
+ * @return the screen lines of a row from its size, negative when the row
+ * could take less (a short row takes a single one, that is not a guess)
+ */
+int32_t wrapGuess(struct Row *row, int width) {
+    if (row->rawSize <= width) {
+        return 1;
+    }
+
+    int64_t lines = wrapLinesOf(row->rawSize, width);
+
+    return (int32_t) -(lines < INT32_MAX ? lines : INT32_MAX);
+}
+
+void wrapReserve(struct WrapLayout *wrap, int64_t numRows) {
+    if (numRows <= wrap->cap) {
+        return;
+    }
+
+    int64_t cap = wrap->cap < 1024 ? 1024 : wrap->cap;
+
+    while (cap < numRows) {
+        cap *= 2;
+    }
+
+    wrap->lines = realloc(wrap->lines, sizeof(int32_t) * (size_t) cap);
+    wrap->tree = realloc(wrap->tree, sizeof(int64_t) * (size_t) (cap / WRAP_BLOCK_ROWS + 2));
+
+    if (NULL == wrap->lines || NULL == wrap->tree) {
+        fatal("Failed to allocate the wrapped rows (wrapReserve)");
+        return;
+    }
+
+    wrap->cap = cap;
+}
+
+int64_t wrapNumBlocks(struct WrapLayout *wrap) {
+    return (wrap->numRows + WRAP_BLOCK_ROWS - 1) / WRAP_BLOCK_ROWS;
+}
+
+/**
+ * @return the screen lines of the rows from a row to another
+ */
+int64_t wrapSumLines(struct WrapLayout *wrap, int64_t from, int64_t to) {
+    int64_t sum = 0;
+
+    for (int64_t i = from; i < to; ++i) {
+        sum += wrap->lines[i] < 0 ? -wrap->lines[i] : wrap->lines[i];
+    }
+
+    return sum;
+}
+
+/**
+ * Makes the sums of the blocks from treeValid on again
+ */
+void wrapBuildTree(struct WrapLayout *wrap) {
+    int64_t *tree = wrap->tree;
+    int64_t valid = wrap->treeValid;
+    int64_t numBlocks = wrapNumBlocks(wrap);
+
+    for (int64_t i = valid + 1; i <= numBlocks; ++i) {
+        int64_t end = i * WRAP_BLOCK_ROWS;
+
+        tree[i] = wrapSumLines(wrap, end - WRAP_BLOCK_ROWS, end < wrap->numRows ? end : wrap->numRows);
+    }
+
+    // the right sums that go in one after treeValid, the ones the prefix of treeValid adds up
+    for (int64_t i = valid; i > 0; i -= i & -i) {
+        int64_t parent = i + (i & -i);
+
+        if (parent <= numBlocks) {
+            tree[parent] += tree[i];
+        }
+    }
+
+    for (int64_t i = valid + 1; i <= numBlocks; ++i) {
+        int64_t parent = i + (i & -i);
+
+        if (parent <= numBlocks) {
+            tree[parent] += tree[i];
+        }
+    }
+
+    wrap->treeValid = numBlocks;
+}
+
+/**
+ * The rows from idx on moved, the sums of their blocks are not right anymore
+ */
+void wrapInvalidate(struct WrapLayout *wrap, int64_t idx) {
+    if (idx / WRAP_BLOCK_ROWS < wrap->treeValid) {
+        wrap->treeValid = idx / WRAP_BLOCK_ROWS;
+    }
+}
+
+/**
+ * Gives a row of the layout its screen lines
+ * @param lines negative for a guess
+ */
+void wrapSetLines(struct WrapLayout *wrap, int64_t idx, int32_t lines) {
+    int32_t old = wrap->lines[idx];
+
+    wrap->guessed += (lines < 0) - (old < 0);
+    wrap->lines[idx] = lines;
+
+    int64_t delta = llabs(lines) - llabs(old);
+
+    if (delta == 0) {
+        return;
+    }
+
+    // the sums after treeValid are made from the lines anyway
+    for (int64_t i = idx / WRAP_BLOCK_ROWS + 1; i <= wrap->treeValid; i += i & -i) {
+        wrap->tree[i] += delta;
+    }
+}
+
+/**
+ * @return the screen lines of the rows before a row
+ */
+int64_t wrapLinesBefore(struct WrapLayout *wrap, int64_t idx) {
+    if (wrap->treeValid < wrapNumBlocks(wrap)) {
+        wrapBuildTree(wrap);
+    }
+
+    idx = idx < wrap->numRows ? idx : wrap->numRows;
+
+    int64_t block = idx / WRAP_BLOCK_ROWS;
+    int64_t sum = wrapSumLines(wrap, block * WRAP_BLOCK_ROWS, idx);
+
+    for (int64_t i = block; i > 0; i -= i & -i) {
+        sum += wrap->tree[i];
+    }
+
+    return sum;
+}
+
+/**
+ * @param line a screen line, from the first one of the document
+ * @param sub where the screen line of the row goes, from its first one
+ * @return the row the screen line is in, numRows past the last one
+ */
+int64_t wrapRowAt(struct WrapLayout *wrap, int64_t line, int64_t *sub) {
+    int64_t numBlocks = wrapNumBlocks(wrap);
+
+    if (wrap->treeValid < numBlocks) {
+        wrapBuildTree(wrap);
+    }
+
+    int64_t step = 1;
+
+    while (step * 2 <= numBlocks) {
+        step *= 2;
+    }
+
+    // down the tree, the most blocks whose lines all come before the line
+    int64_t pos = 0;
+
+    for (; step > 0; step /= 2) {
+        if (pos + step <= numBlocks && wrap->tree[pos + step] <= line) {
+            pos += step;
+            line -= wrap->tree[pos];
+        }
+    }
+
+    // then the rows of the next block, there is none past the last line
+    int64_t row = pos * WRAP_BLOCK_ROWS < wrap->numRows ? pos * WRAP_BLOCK_ROWS : wrap->numRows;
+
+    while (row < wrap->numRows && llabs(wrap->lines[row]) <= line) {
+        line -= llabs(wrap->lines[row]);
+        ++row;
+    }
+
+    *sub = line;
+    return row;
+}
+
+/**
+ * The layout of a document for the screen as it is now, with
+ * the rows that came at its end since it was last looked at
+ */
+struct WrapLayout *docWrap(struct Document *doc) {
+    if (NULL == doc->wrap) {
+        doc->wrap = calloc(1, sizeof(struct WrapLayout));
+
+        if (NULL == doc->wrap) {
+            fatal("Failed to allocate the wrapped rows (docWrap)");
+            return NULL;
+        }
+    }
+
+    struct WrapLayout *wrap = doc->wrap;
+
+    // the screen changed size, everything is a guess again and the screen is counted first
+    if (wrap->width != env.usableTextScreenCols) {
+        wrap->width = env.usableTextScreenCols;
+        wrap->numRows = 0;
+        wrap->treeValid = 0;
+        wrap->guessed = 0;
+        wrap->scan = currentSession.rowOffset;
+    }
+
+    // loading and following add rows at the end without telling anyone
+    if (wrap->numRows != doc->numRows) {
+        int64_t from = wrap->numRows < doc->numRows ? wrap->numRows : doc->numRows;
+
+        wrapReserve(wrap, doc->numRows);
+
+        for (int64_t i = from; i < wrap->numRows; ++i) {
+            wrap->guessed -= wrap->lines[i] < 0;
+        }
+
+        for (int64_t i = from; i < doc->numRows; ++i) {
+            wrap->lines[i] = wrapGuess(&doc->rows[i], wrap->width);
+            wrap->guessed += wrap->lines[i] < 0;
+        }
+
+        wrap->numRows = doc->numRows;
+        wrapInvalidate(wrap, from);
+    }
+
+    return wrap;
+}
+
+void docWrapFree(struct Document *doc) {
+    if (NULL == doc->wrap) {
+        return;
+    }
+
+    free(doc->wrap->lines);
+    free(doc->wrap->tree);
+    free(doc->wrap);
+    doc->wrap = NULL;
+}
+
+/**
+ * Finds a screen line of a row that wraps. A wide character across the right edge
+ * goes to the next line, but in the long rows, cut every width columns: finding
+ * where their lines start would mean decoding them all
+ * @param line stop at that screen line, -1 for no limit
+ * @param col or at the screen line the column is in
+ * @param start the column the screen line starts at
+ * @param end the one the next screen line starts at
+ * @return the screen line, from the first one of the row
+ */
+int64_t wrapWalk(const struct ColumnMap *map, int width, int64_t line, int64_t col, int64_t *start, int64_t *end) {
+    int64_t last = map->numCols > 0 ? (map->numCols - 1) / width : 0;
+
+    if (map->ascii || map->chunked) {
+        int64_t k = col / width;
+
+        if (line >= 0 && k > line) {
+            k = line;
+        }
+
+        k = k < last ? k : last;
+        *start = k * width;
+        *end = *start + width;
+        return k;
+    }
+
+    int64_t k = 0;
+    int64_t s = 0;
+    int64_t j = 0;
+
+    for (;;) {
+        int64_t e = s + width;
+
+        // the marks before the edge, then the wide one across it
+        while (j < map->numMarks && map->marks[j].col < e - 1) {
+            ++j;
+        }
+
+        for (int64_t m = j; e < map->numCols && e - 1 > s && m < map->numMarks && map->marks[m].col == e - 1; ++m) {
+            if (map->marks[m].width > 1) {
+                --e;
+                break;
+            }
+        }
+
+        if (k == line || e >= map->numCols || col < e) {
+            *start = s;
+            *end = e;
+            return k;
+        }
+
+        s = e;
+        ++k;
+    }
+}
+
+/**
+ * @return the screen lines of a row of that width
+ */
+int64_t wrapMapLines(const struct ColumnMap *map, int width) {
+    int64_t start;
+    int64_t end;
+    int64_t lines = wrapWalk(map, width, -1, INT64_MAX, &start, &end) + 1;
+
+    return lines < INT32_MAX ? lines : INT32_MAX;
+}
+
+/**
+ * @return the screen lines a row takes, counted for real
+ */
+int64_t docWrapLines(struct Document *doc, int64_t idx) {
+    struct WrapLayout *wrap = doc->wrap;
+
+    if (wrap->lines[idx] < 0) {
+        wrapSetLines(wrap, idx, (int32_t) wrapMapLines(docColumnMap(doc, idx), wrap->width));
+    }
+
+    return wrap->lines[idx];
+}
+
+/**
+ * The screen lines of a row are not known anymore
+ */
+void docWrapChanged(struct Document *doc, int64_t row) {
+    struct WrapLayout *wrap = doc->wrap;
+
+    if (wrap && wrap->width && row < wrap->numRows) {
+        wrapSetLines(wrap, row, wrapGuess(&doc->rows[row], wrap->width));
+    }
+}
+
+void docWrapInserted(struct Document *doc, int64_t at, int64_t count) {
+    struct WrapLayout *wrap = doc->wrap;
+
+    // the rows past the layout are guessed when it is looked at
+    if (NULL == wrap || 0 == wrap->width || at > wrap->numRows) {
+        return;
+    }
+
+    wrapReserve(wrap, wrap->numRows + count);
+    memmove(&wrap->lines[at + count], &wrap->lines[at], sizeof(int32_t) * (size_t) (wrap->numRows - at));
+
+    for (int64_t i = at; i < at + count; ++i) {
+        wrap->lines[i] = wrapGuess(&doc->rows[i], wrap->width);
+        wrap->guessed += wrap->lines[i] < 0;
+    }
+
+    wrap->numRows += count;
+    wrapInvalidate(wrap, at);
+}
+
+void docWrapRemoved(struct Document *doc, int64_t at, int64_t count) {
+    struct WrapLayout *wrap = doc->wrap;
+
+    if (NULL == wrap || 0 == wrap->width || at >= wrap->numRows) {
+        return;
+    }
+
+    if (count > wrap->numRows - at) {
+        count = wrap->numRows - at;
+    }
+
+    for (int64_t i = at; i < at + count; ++i) {
+        wrap->guessed -= wrap->lines[i] < 0;
+    }
+
+    memmove(&wrap->lines[at], &wrap->lines[at + count], sizeof(int32_t) * (size_t) (wrap->numRows - at - count));
+    wrap->numRows -= count;
+    wrapInvalidate(wrap, at);
+}
+
+/**
+ * Rows were put at many positions at once, the layout moves in a single pass
+ * @param at where each new row is, in order
+ */
+void docWrapInsertedAt(struct Document *doc, const int64_t *at, int64_t count) {
+    struct WrapLayout *wrap = doc->wrap;
+
+    if (NULL == wrap || 0 == wrap->width || count == 0) {
+        return;
+    }
+
+    // the rows put past the layout are guessed when it is looked at
+    int64_t inside = 0;
+
+    while (inside < count && at[inside] - inside <= wrap->numRows) {
+        ++inside;
+    }
+
+    if (inside == 0) {
+        return;
+    }
+
+    int64_t numRows = wrap->numRows + inside;
+    int64_t from = wrap->numRows;
+
+    wrapReserve(wrap, numRows);
+
+    // from the back, the lines of a row move once
+    for (int64_t i = inside - 1, to = numRows - 1; i >= 0; --to) {
+        if (to == at[i]) {
+            wrap->lines[to] = wrapGuess(&doc->rows[to], wrap->width);
+            wrap->guessed += wrap->lines[to] < 0;
+            --i;
+        } else {
+            wrap->lines[to] = wrap->lines[--from];
+        }
+    }
+
+    wrap->numRows = numRows;
+    wrapInvalidate(wrap, at[0]);
+}
+
+/**
+ * Rows were taken from many positions at once
+ * @param at where each one was, in order
+ */
+void docWrapRemovedAt(struct Document *doc, const int64_t *at, int64_t count) {
+    struct WrapLayout *wrap = doc->wrap;
+
+    if (NULL == wrap || 0 == wrap->width || count == 0 || at[0] >= wrap->numRows) {
+        return;
+    }
+
+    int64_t to = at[0];
+    int64_t i = 0;
+
+    for (int64_t from = at[0]; from < wrap->numRows; ++from) {
+        if (i < count && from == at[i]) {
+            wrap->guessed -= wrap->lines[from] < 0;
+            ++i;
+        } else {
+            wrap->lines[to++] = wrap->lines[from];
+        }
+    }
+
+    wrap->numRows = to;
+    wrapInvalidate(wrap, at[0]);
+}
+
+void docWrapReset(struct Document *doc) {
+    if (doc->wrap) {
+        doc->wrap->width = 0;
+    }
+}
+
+/**
+ * @param x where the cursor is on its screen line
+ * @return the screen line of the cursor in its row
+ */
+int64_t wrapCursorSub(struct Document *doc, int64_t *x) {
+    int64_t col = cursorColumn();
+    int64_t start = 0;
+    int64_t end;
+    int64_t sub = 0;
+
+    if (currentSession.cursorRow < doc->numRows) {
+        docWrapLines(doc, currentSession.cursorRow);
+        sub = wrapWalk(currentColumnMap(), doc->wrap->width, -1, col, &start, &end);
+    }
+
+    if (x) {
+        *x = col - start;
+    }
+
+    return sub;
+}
+
+/**
+ * Keeps the cursor on screen when the rows wrap, the top of the
+ * screen is a row and the screen line of it shown first
+ */
+void wrapScroll() {
+    struct Document *doc = getCurrentDoc();
+    struct WrapLayout *wrap = docWrap(doc);
+    int64_t cursorRow = currentSession.cursorRow;
+    int64_t cursorSub = wrapCursorSub(doc, NULL);
+
+    currentSession.colOffset = 0;
+
+    if (currentSession.rowOffset > doc->numRows) {
+        currentSession.rowOffset = doc->numRows;
+        currentSession.subRowOffset = 0;
+    }
+
+    if (currentSession.rowOffset < doc->numRows &&
+        currentSession.subRowOffset >= docWrapLines(doc, currentSession.rowOffset)) {
+        currentSession.subRowOffset = docWrapLines(doc, currentSession.rowOffset) - 1;
+    }
+
+    int64_t below = wrapLinesBefore(wrap, cursorRow) + cursorSub
+                    - wrapLinesBefore(wrap, currentSession.rowOffset) - currentSession.subRowOffset;
+
+    if (below < 0) {
+        currentSession.rowOffset = cursorRow;
+        currentSession.subRowOffset = cursorSub;
+    } else if (below >= env.usableTextScreenRows) {
+        // up from the cursor, a screen of lines counted for real
+        int64_t above = env.usableTextScreenRows - 1;
+        int64_t row = cursorRow;
+        int64_t sub = cursorSub;
+
+        while (above > sub && row > 0) {
+            above -= sub + 1;
+            --row;
+            sub = docWrapLines(doc, row) - 1;
+        }
+
+        currentSession.rowOffset = row;
+        currentSession.subRowOffset = sub > above ? sub - above : 0;
+    }
+}
+
+/**
+ * @param x where the cursor is on its screen line, the last column at most
+ * @return the screen line of the cursor, from the top
+ */
+int64_t wrapCursorY(struct Document *doc, int64_t *x) {
+    struct WrapLayout *wrap = docWrap(doc);
+    int64_t sub = wrapCursorSub(doc, x);
+
+    if (*x >= wrap->width) {
+        *x = wrap->width - 1;
+    }
+
+    return wrapLinesBefore(wrap, currentSession.cursorRow) + sub
+           - wrapLinesBefore(wrap, currentSession.rowOffset) - currentSession.subRowOffset;
+}
+
+/**
+ * Moves the cursor by screen lines, in the same column of the screen
+ * @param by how many, negative to go up
+ */
+void wrapMoveLines(int64_t by) {
+    struct Document *doc = getCurrentDoc();
+    struct WrapLayout *wrap = docWrap(doc);
+    int64_t x;
+    int64_t cursorSub = wrapCursorSub(doc, &x);
+
+    // the rows the cursor goes over are counted for real, up to a screen of them
+    int64_t step = by < 0 ? -1 : 1;
+    int64_t left = (by < 0 ? -by : by) + 1;
+
+    for (int64_t row = currentSession.cursorRow; left > 0 && row >= 0 && row < doc->numRows; row += step) {
+        left -= docWrapLines(doc, row);
+    }
+
+    int64_t line = wrapLinesBefore(wrap, currentSession.cursorRow) + cursorSub + by;
+    int64_t total = wrapLinesBefore(wrap, doc->numRows);
+
+    if (line < 0) {
+        line = 0;
+    } else if (line > total) {
+        line = total;
+    }
+
+    int64_t sub;
+
+    currentSession.cursorRow = wrapRowAt(wrap, line, &sub);
+
+    if (currentSession.cursorRow >= doc->numRows) {
+        currentSession.cursorCol = 0;
+        return;
+    }
+
+    int64_t start;
+    int64_t end;
+
+    docWrapLines(doc, currentSession.cursorRow);
+    wrapWalk(currentColumnMap(), wrap->width, sub, INT64_MAX, &start, &end);
+    cursorToColumn(start + x);
+
+    // the column is past the end of its screen line, the cursor stays on it
+    if (wrapCursorSub(doc, NULL) > sub) {
+        cursorToColumn(end - 1);
+    }
+}
+
+// the rows counted by the idle ticks are not kept in the cache of the screen
+struct ColumnMap wrapColumns;
+
+/**
+ * Counts the screen lines of some rows that are still a guess,
+ * from the screen down, so going far away is right more often
+ * @return 1 when the screen needs to be refreshed
+ */
+int editorWrapIdle() {
+    struct Document *doc = getCurrentDoc();
+
+    if (!currentSession.softWrap || NULL == doc || doc->hibernation != AWAKE) {
+        return 0;
+    }
+
+    struct WrapLayout *wrap = docWrap(doc);
+
+    for (int64_t n = 0; n < WRAP_SCAN_ROWS && wrap->guessed > 0; ++n) {
+        if (wrap->scan >= wrap->numRows) {
+            wrap->scan = 0;
+        }
+
+        int64_t idx = wrap->scan++;
+
+        if (wrap->lines[idx] < 0) {
+            struct Row *row = &doc->rows[idx];
+
+            columnMapBuild(&wrapColumns, rowChars(row), row->rawSize);
+            wrapSetLines(wrap, idx, (int32_t) wrapMapLines(&wrapColumns, wrap->width));
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Turns soft wrap on and off
+ */
+void toggleSoftWrap() {
+    currentSession.softWrap = !currentSession.softWrap;
+    currentSession.colOffset = 0;
+    currentSession.subRowOffset = 0;
+
+    snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage),
+             currentSession.softWrap ? " (soft wrap)" : " (no wrap)");
+}
+
+/*** diff with the file ***/
+
+/**
+ * Rows of the document, from row from up to row to, that are not the lines of
+ * the file they stand for. delta is how many more rows there are than lines,
+ * so a span of no rows is lines that were removed. A dirty span was edited since
+ * it was diffed: its rows are only known to be somewhere in it, and diffing it
+ * again is all an edit costs, whatever the size of the file.
+ */
+struct DiffSpan {
+    int64_t from;
+    int64_t to;
+    int64_t delta;
+    int dirty;
+};
+
+struct DiffSpans {
+    int64_t count;
+    int64_t cap;
+    struct DiffSpan *spans; // in order, a span ends before the next one starts
+};
+
+/**
+ * How the rows of a document differ from its file: the hash of each line of the
+ * file, so lines are compared as integers, and the spans of rows that differ.
+ * The rows between two spans are the lines of the file between them.
+ */
+struct DiffView {
+    uint64_t *disk; // the hash of each line of the file
+    int64_t diskRows;
+    int64_t diskCap;
+    int valid; // disk is what the file was, otherwise it has to be read
+    struct timespec mtime; // of the file, when disk was made
+    off_t size; // -1 when there was no file
+    ino_t inode;
+    int64_t numRows; // of the document, as the spans know it
+    int64_t changesCount; // the document as it was diffed
+    int64_t savedChanges;
+    int changedOnDisk;
+    struct DiffSpans spans;
+    struct DiffSpans scratch; // where the spans are made again
+    uint64_t *hashes; // of the rows of the span being diffed
+    int64_t hashCap;
+};
+
+void diffReserve(void **array, int64_t *cap, int64_t count, size_t size) {
+    if (count <= *cap) {
+        return;
+    }
+
+    int64_t newCap = *cap ? *cap : 64;
+
+    while (newCap < count) {
+        newCap *= 2;
+    }
+
+    void *grown = realloc(*array, size * (size_t) newCap);
+
+    if (NULL == grown) {
+        fatal("Failed to grow the diff (diffReserve)");
+        return;
+    }
+
+    *array = grown;
+    *cap = newCap;
+}
+
+/**
+ * Adds a span after the others, merged with the last one when they touch
+ */
+void diffSpansAdd(struct DiffSpans *list, int64_t from, int64_t to, int64_t delta, int dirty) {
+    if (list->count > 0 && list->spans[list->count - 1].to >= from) {
+        struct DiffSpan *last = &list->spans[list->count - 1];
+
+        last->to = to > last->to ? to : last->to;
+        last->delta += delta;
+        last->dirty |= dirty;
+        return;
+    }
+
+    diffReserve((void **) &list->spans, &list->cap, list->count + 1, sizeof(struct DiffSpan));
+    list->spans[list->count++] = (struct DiffSpan) {from, to, delta, dirty};
+}
+
+void diffSwapSpans(struct DiffView *view) {
+    struct DiffSpans spans = view->spans;
+
+    view->spans = view->scratch;
+    view->scratch = spans;
+    view->scratch.count = 0;
+}
+
+/**
+ * Rows were replaced at many places, in order. The spans they touch, and the
+ * ones touching those, become a single dirty span; the others only move.
+ * @param at where each edit is, in the rows before the edits
+ * or, with newCoords, in the rows after them (an insertion only)
+ * @param removed how many rows each edit took
+ * @param inserted and how many it put instead
+ */
+void diffEditRows(struct DiffView *view, const int64_t *at, int64_t count, int64_t removed, int64_t inserted,
+                  int newCoords) {
+    struct DiffSpans *old = &view->spans;
+    struct DiffSpans *out = &view->scratch;
+    int64_t moved = inserted - removed;
+    int64_t shift = 0; // how far the edits so far moved the rows after them
+    int64_t next = 0;
+
+    out->count = 0;
+
+    for (int64_t i = 0; i < count; ++i) {
+        int64_t pos = newCoords ? at[i] - i * moved : at[i];
+
+        while (next < old->count && old->spans[next].to < pos) {
+            struct DiffSpan *span = &old->spans[next++];
+            diffSpansAdd(out, span->from + shift, span->to + shift, span->delta, span->dirty);
+        }
+
+        struct DiffSpan edit = {pos + shift, pos + removed + shift, 0, 1};
+
+        // the edit before may already cover it
+        if (out->count > 0 && out->spans[out->count - 1].to >= edit.from) {
+            struct DiffSpan *last = &out->spans[--out->count];
+
+            edit.from = last->from;
+            edit.to = last->to > edit.to ? last->to : edit.to;
+            edit.delta = last->delta;
+        }
+
+        while (next < old->count && old->spans[next].from <= pos + removed) {
+            struct DiffSpan *span = &old->spans[next++];
+
+            edit.from = span->from + shift < edit.from ? span->from + shift : edit.from;
+            edit.to = span->to + shift > edit.to ? span->to + shift : edit.to;
+            edit.delta += span->delta;
+        }
+
+        diffSpansAdd(out, edit.from, edit.to + moved, edit.delta + moved, 1);
+        shift += moved;
+    }
+
+    while (next < old->count) {
+        struct DiffSpan *span = &old->spans[next++];
+        diffSpansAdd(out, span->from + shift, span->to + shift, span->delta, span->dirty);
+    }
+
+    view->numRows += moved * count;
+    diffSwapSpans(view);
+}
+
+/**
+ * Any row can be any line again, the whole document is diffed
+ */
+void diffResetSpans(struct DiffView *view, int64_t numRows) {
+    view->spans.count = 0;
+    view->numRows = numRows;
+
+    if (numRows > 0 || view->diskRows > 0) {
+        diffSpansAdd(&view->spans, 0, numRows, numRows - view->diskRows, 1);
+    }
+}
+
+/**
+ * The rows came at the end of the document without anyone saying,
+ * like when loading or following the file
+ */
+void diffCatchUp(struct DiffView *view, int64_t numRows) {
+    if (view->numRows < numRows) {
+        int64_t at = view->numRows;
+        diffEditRows(view, &at, 1, 0, numRows - view->numRows, 0);
+    } else if (view->numRows > numRows) {
+        diffResetSpans(view, numRows);
+    }
+}
+
+/**
+ * A line of the file hashes like the row it is read into: without its
+ * new line and carriage returns, the tabs turned into spaces
+ * @param buf room to expand the tabs in
+ */
+uint64_t diffHashLine(const char *line, size_t len, char **buf, size_t *bufCap) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        --len;
+    }
+
+    if (NULL == memchr(line, '\t', len)) {
+        return hashBytes(line, len);
+    }
+
+    size_t expanded = 0;
+
+    for (size_t j = 0; j < len; ++j) {
+        expanded = line[j] == '\t' ? (expanded / 8 + 1) * 8 : expanded + 1;
+    }
+
+    if (expanded > *bufCap) {
+        *buf = realloc(*buf, expanded);
+        *bufCap = expanded;
+
+        if (NULL == *buf) {
+            fatal("Failed to expand a line (diffHashLine)");
+            return 0;
+        }
+    }
+
+    size_t idx = 0;
+
+    for (size_t j = 0; j < len; ++j) {
+        if (line[j] == '\t') {
+            do {
+                (*buf)[idx++] = ' ';
+            } while (idx % 8 != 0);
+        } else {
+            (*buf)[idx++] = line[j];
+        }
+    }
+
+    return hashBytes(*buf, expanded);
+}
+
+void diffSetStat(struct DiffView *view, struct stat *st) {
+    view->size = st ? st->st_size : -1;
+    view->inode = st ? st->st_ino : 0;
+    view->mtime = st ? st->st_mtim : (struct timespec) {0, 0};
+}
+
+/**
+ * @return 1 when the file is not what disk was made from anymore
+ */
+int diffStatChanged(struct DiffView *view, const char *fileName) {
+    struct stat st;
+
+    if (stat(fileName, &st) == -1) {
+        return view->size != -1;
+    }
+
+    return view->size != st.st_size || view->inode != st.st_ino ||
+           view->mtime.tv_sec != st.st_mtim.tv_sec || view->mtime.tv_nsec != st.st_mtim.tv_nsec;
+}
+
+/**
+ * Hashes the lines of the file, a missing file has none
+ */
+void diffReadFile(struct DiffView *view, const char *fileName) {
+    view->diskRows = 0;
+    view->valid = 1;
+    diffSetStat(view, NULL);
+
+    FILE *fp = fopen(fileName, "r");
+
+    if (!fp) {
+        return;
+    }
+
+    struct stat st;
+
+    if (fstat(fileno(fp), &st) != -1) {
+        diffSetStat(view, &st);
+    }
+
+    char *line = NULL;
+    size_t lineCap = 0;
+    char *buf = NULL;
+    size_t bufCap = 0;
+    ssize_t lineLen;
+
+    while ((lineLen = getline(&line, &lineCap, fp)) != -1) {
+        diffReserve((void **) &view->disk, &view->diskCap, view->diskRows + 1, sizeof(uint64_t));
+        view->disk[view->diskRows++] = diffHashLine(line, (size_t) lineLen, &buf, &bufCap);
+    }
+
+    free(line);
+    free(buf);
+    fclose(fp);
+}
+
+/**
+ * @return the hashes of some rows, valid until the next call
+ */
+uint64_t *diffHashRows(struct DiffView *view, struct Document *doc, int64_t from, int64_t to) {
+    diffReserve((void **) &view->hashes, &view->hashCap, to - from, sizeof(uint64_t));
+
+    for (int64_t i = from; i < to; ++i) {
+        struct Row *row = &doc->rows[i];
+        view->hashes[i - from] = hashBytes(rowChars(row), (size_t) row->rawSize);
+    }
+
+    return view->hashes;
+}
+
+/**
+ * The document is its file again (it was saved or read again), its rows become
+ * the lines of the file. Only the rows in the spans are hashed, the lines
+ * between them are the ones we had.
+ */
+void diffAdoptRows(struct DiffView *view, struct Document *doc) {
+    struct stat st;
+    diffSetStat(view, stat(doc->fileName, &st) == -1 ? NULL : &st);
+
+    if (view->spans.count == 0 && view->diskRows == doc->numRows) {
+        return;
+    }
+
+    uint64_t *disk = NULL;
+    int64_t diskCap = 0;
+    int64_t row = 0;
+    int64_t shift = 0; // how many more rows than lines there are before row
+
+    diffReserve((void **) &disk, &diskCap, doc->numRows, sizeof(uint64_t));
+
+    for (int64_t i = 0; i <= view->spans.count; ++i) {
+        struct DiffSpan *span = i < view->spans.count ? &view->spans.spans[i] : NULL;
+        int64_t from = span ? span->from : doc->numRows;
+
+        if (from > row) {
+            memcpy(&disk[row], &view->disk[row - shift], sizeof(uint64_t) * (size_t) (from - row));
+        }
+
+        if (span) {
+            memcpy(&disk[span->from], diffHashRows(view, doc, span->from, span->to),
+                   sizeof(uint64_t) * (size_t) (span->to - span->from));
+            shift += span->delta;
+            row = span->to;
+        }
+    }
+
+    free(view->disk);
+    view->disk = disk;
+    view->diskCap = diskCap;
+    view->diskRows = doc->numRows;
+    view->spans.count = 0;
+}
+
+/**
+ * Myers' diff of two runs of lines that differ at both ends, giving up
+ * after DIFF_MAX_EDITS edits: the whole runs are then one change
+ * @param a the lines of the file
+ * @param b the rows
+ * @param bBase the row b starts at, the spans are in rows
+ */
+void diffMyers(const uint64_t *a, int64_t n, const uint64_t *b, int64_t m, int64_t bBase, struct DiffSpans *out) {
+    int64_t maxEdits = n + m < DIFF_MAX_EDITS ? n + m : DIFF_MAX_EDITS;
+    int64_t *trace = NULL; // the furthest x on diagonal k after d edits is at d * d + k + d
+    int64_t traceCap = 0;
+    int64_t found = -1;
+
+    for (int64_t d = 0; d <= maxEdits && found == -1; ++d) {
+        diffReserve((void **) &trace, &traceCap, (d + 1) * (d + 1), sizeof(int64_t));
+
+        int64_t *prev = d > 0 ? &trace[(d - 1) * (d - 1) + d - 1] : NULL; // indexed by k
+        int64_t *cur = &trace[d * d + d];
+
+        for (int64_t k = -d; k <= d; k += 2) {
+            int64_t x;
+
+            if (d == 0) {
+                x = 0;
+            } else if (k == -d || (k != d && prev[k - 1] < prev[k + 1])) {
+                x = prev[k + 1];
+            } else {
+                x = prev[k - 1] + 1;
+            }
+
+            int64_t y = x - k;
+
+            while (x < n && y < m && a[x] == b[y]) {
+                ++x;
+                ++y;
+            }
+
+            cur[k] = x;
+
+            if (x >= n && y >= m) {
+                found = d;
+                break;
+            }
+        }
+    }
+
+    if (found == -1) {
+        free(trace);
+        diffSpansAdd(out, bBase, bBase + m, m - n, 0);
+        return;
+    }
+
+    // back from the end, each edit is a line of the file removed or a row added
+    int64_t *edits = malloc(sizeof(int64_t) * 2 * (size_t) (found + 1));
+
+    if (NULL == edits) {
+        fatal("Failed to allocate the edits (diffMyers)");
+        return;
+    }
+
+    int64_t x = n;
+    int64_t y = m;
+
+    for (int64_t d = found; d > 0; --d) {
+        int64_t *prev = &trace[(d - 1) * (d - 1) + d - 1];
+        int64_t k = x - y;
+        int down = k == -d || (k != d && prev[k - 1] < prev[k + 1]);
+        int64_t prevK = down ? k + 1 : k - 1;
+
+        x = prev[prevK];
+        y = x - prevK;
+
+        // x in the file and y in the rows where the edit is, a row added is a negative y
+        edits[2 * (d - 1)] = x;
+        edits[2 * (d - 1) + 1] = down ? -(y + 1) : y;
+    }
+
+    // the edits that follow each other are one span
+    int64_t aStart = 0, bStart = 0, aEnd = -1, bEnd = -1;
+
+    for (int64_t i = 0; i < found; ++i) {
+        int64_t ex = edits[2 * i];
+        int64_t ey = edits[2 * i + 1] < 0 ? -edits[2 * i + 1] - 1 : edits[2 * i + 1];
+        int added = edits[2 * i + 1] < 0;
+
+        if (ex != aEnd || ey != bEnd) {
+            if (aEnd >= 0) {
+                diffSpansAdd(out, bBase + bStart, bBase + bEnd, (bEnd - bStart) - (aEnd - aStart), 0);
+            }
+
+            aStart = ex;
+            bStart = ey;
+        }
+
+        aEnd = added ? ex : ex + 1;
+        bEnd = added ? ey + 1 : ey;
+    }
+
+    if (aEnd >= 0) {
+        diffSpansAdd(out, bBase + bStart, bBase + bEnd, (bEnd - bStart) - (aEnd - aStart), 0);
+    }
+
+    free(edits);
+    free(trace);
+}
+
+void diffLines(const uint64_t *a, int64_t n, const uint64_t *b, int64_t m, int64_t bBase,
+               struct DiffSpans *out, int chunked);
+
+/**
+ * A chunk of lines, it ends after a line whose hash has its low bits at 0,
+ * as in the file snapshots, so an edit only changes the chunks around it
+ */
+struct DiffChunk {
+    uint64_t hash;
+    int64_t start;
+    int64_t len;
+    int64_t other; // the chunk it is the only match of on the other side, -1 for none
+};
+
+struct DiffChunk *diffChunksOf(const uint64_t *lines, int64_t count, int64_t *numChunks) {
+    struct DiffChunk *chunks = NULL;
+    int64_t cap = 0;
+    int64_t num = 0;
+    int64_t start = 0;
+    uint64_t hash = 0;
+
+    for (int64_t i = 0; i < count; ++i) {
+        hash = (hash ^ lines[i]) * 0x100000001B3ULL;
+
+        if ((lines[i] & CHUNK_BOUNDARY_MASK) == 0 || i - start + 1 >= CHUNK_MAX_LINES || i == count - 1) {
+            diffReserve((void **) &chunks, &cap, num + 1, sizeof(struct DiffChunk));
+            chunks[num++] = (struct DiffChunk) {hash ^ (uint64_t) (i - start + 1), start, i - start + 1, -1};
+            start = i + 1;
+            hash = 0;
+        }
+    }
+
+    *numChunks = num;
+    return chunks;
+}
+
+/**
+ * A chunk of either side, sorted by hash to find the ones that are on each side once
+ */
+struct DiffChunkRef {
+    uint64_t hash;
+    int64_t idx; // in the chunks of the file, or -1 - the index in the chunks of the rows
+};
+
+int compareChunkRefs(const void *a, const void *b) {
+    const struct DiffChunkRef *x = a;
+    const struct DiffChunkRef *y = b;
+
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+
+    return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+/**
+ * The patience diff of chunks: the chunks found once in the file and once in
+ * the rows are matched, the longest run of them in the same order on both
+ * sides is kept, and only the lines between two of those are diffed. A long
+ * span with a few edits in it costs a hash per line, not a diff of it all.
+ */
+void diffChunks(const uint64_t *a, int64_t n, const uint64_t *b, int64_t m, int64_t bBase, struct DiffSpans *out) {
+    int64_t numA;
+    int64_t numB;
+    struct DiffChunk *chunksA = diffChunksOf(a, n, &numA);
+    struct DiffChunk *chunksB = diffChunksOf(b, m, &numB);
+    struct DiffChunkRef *refs = malloc(sizeof(struct DiffChunkRef) * (size_t) (numA + numB));
+    int64_t *tails = malloc(sizeof(int64_t) * (size_t) (numA + 1)); // the last chunk of the best run of each length
+    int64_t *before = malloc(sizeof(int64_t) * (size_t) (numA + 1)); // the chunk before it in its run
+
+    if (NULL == refs || NULL == tails || NULL == before) {
+        fatal("Failed to allocate the chunks (diffChunks)");
+        return;
+    }
+
+    for (int64_t i = 0; i < numA; ++i) {
+        refs[i] = (struct DiffChunkRef) {chunksA[i].hash, i};
+    }
+
+    for (int64_t j = 0; j < numB; ++j) {
+        refs[numA + j] = (struct DiffChunkRef) {chunksB[j].hash, -1 - j};
+    }
+
+    qsort(refs, (size_t) (numA + numB), sizeof(struct DiffChunkRef), compareChunkRefs);
+
+    // the rows sort first (negative), a hash seen exactly twice, once on each side, is a match
+    for (int64_t i = 0; i < numA + numB;) {
+        int64_t j = i;
+
+        while (j < numA + numB && refs[j].hash == refs[i].hash) {
+            ++j;
+        }
+
+        if (j - i == 2 && refs[i].idx < 0 && refs[i + 1].idx >= 0) {
+            chunksA[refs[i + 1].idx].other = -1 - refs[i].idx;
+        }
+
+        i = j;
+    }
+
+    // the longest increasing run of the matching chunks of the rows, in the order of the file
+    int64_t runLen = 0;
+
+    for (int64_t i = 0; i < numA; ++i) {
+        if (chunksA[i].other < 0) {
+            continue;
+        }
+
+        int64_t lo = 0;
+        int64_t hi = runLen;
+
+        while (lo < hi) {
+            int64_t mid = (lo + hi) / 2;
+
+            if (chunksA[tails[mid]].other < chunksA[i].other) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        before[i] = lo > 0 ? tails[lo - 1] : -1;
+        tails[lo] = i;
+        runLen = lo == runLen ? runLen + 1 : runLen;
+    }
+
+    // back from the last one, the run is in before, from the end
+    int64_t count = runLen;
+
+    for (int64_t i = runLen > 0 ? tails[runLen - 1] : -1; i >= 0; i = before[i]) {
+        tails[--count] = i;
+    }
+
+    int64_t aPos = 0;
+    int64_t bPos = 0;
+
+    for (int64_t r = 0; r <= runLen; ++r) {
+        struct DiffChunk *chunkA = r < runLen ? &chunksA[tails[r]] : NULL;
+        struct DiffChunk *chunkB = chunkA ? &chunksB[chunkA->other] : NULL;
+
+        // two chunks with the same hash but other lines are not a match
+        if (chunkA && (chunkA->len != chunkB->len ||
+                       memcmp(&a[chunkA->start], &b[chunkB->start], sizeof(uint64_t) * (size_t) chunkA->len) != 0)) {
+            continue;
+        }
+
+        int64_t aTo = chunkA ? chunkA->start : n;
+        int64_t bTo = chunkB ? chunkB->start : m;
+
+        diffLines(&a[aPos], aTo - aPos, &b[bPos], bTo - bPos, bBase + bPos, out, 0);
+
+        if (chunkA) {
+            aPos = chunkA->start + chunkA->len;
+            bPos = chunkB->start + chunkB->len;
+        }
+    }
+
+    free(before);
+    free(tails);
+    free(refs);
+    free(chunksB);
+    free(chunksA);
+}
+
+/**
+ * Diffs the lines of the file with the rows that stand for them. The lines
+ * both start and end with are left out first, so an edit in a long span
+ * is only diffed around it
+ * @param a the hashes of the lines of the file
+ * @param b the hashes of the rows
+ * @param bBase the row b starts at, the spans are in rows
+ * @param chunked long runs are matched by chunks first
+ */
+void diffLines(const uint64_t *a, int64_t n, const uint64_t *b, int64_t m, int64_t bBase,
+               struct DiffSpans *out, int chunked) {
+    int64_t prefix = 0;
+
+    while (prefix < n && prefix < m && a[prefix] == b[prefix]) {
+        ++prefix;
+    }
+
+    int64_t suffix = 0;
+
+    while (suffix < n - prefix && suffix < m - prefix && a[n - 1 - suffix] == b[m - 1 - suffix]) {
+        ++suffix;
+    }
+
+    a += prefix;
+    b += prefix;
+    n -= prefix + suffix;
+    m -= prefix + suffix;
+    bBase += prefix;
+
+    if (n == 0 && m == 0) {
+        return;
+    }
+
+    if (n == 0 || m == 0) {
+        diffSpansAdd(out, bBase, bBase + m, m - n, 0);
+    } else if (chunked && n + m >= DIFF_CHUNK_MIN_ROWS) {
+        diffChunks(a, n, b, m, bBase, out);
+    } else {
+        diffMyers(a, n, b, m, bBase, out);
+    }
+}
+
+/**
+ * @return 1 when the rows are the file: nothing was edited, and
+ * the file did not change since it was read or written
+ */
+int docRowsAreFile(struct Document *doc) {
+    if (doc->changesCount != doc->savedChanges || doc->changedOnDisk) {
+        return 0;
+    }
+
+    struct stat st;
+
+    // a followed file grows, the rows are what was read of it
+    return doc->following || (stat(doc->fileName, &st) != -1 && snapshotMatchesStat(doc, &st));
+}
+
+/**
+ * How the rows of a document differ from its file, as of now. The first time,
+ * the file is hashed (or the rows, when they are the file); then only the spans
+ * of rows edited since are diffed again.
+ * @return NULL when the document has no file
+ */
+struct DiffView *docDiff(struct Document *doc) {
+    if (NULL == doc->fileName) {
+        return NULL;
+    }
+
+    if (NULL == doc->diff) {
+        doc->diff = calloc(1, sizeof(struct DiffView));
+
+        if (NULL == doc->diff) {
+            fatal("Failed to allocate the diff (docDiff)");
+            return NULL;
+        }
+    }
+
+    struct DiffView *view = doc->diff;
+
+    // a file that changed under the edits can change again, that is only seen by looking at it
+    if (view->valid && view->numRows == doc->numRows && view->changesCount == doc->changesCount &&
+        view->savedChanges == doc->savedChanges && view->changedOnDisk == doc->changedOnDisk &&
+        !(doc->changedOnDisk && diffStatChanged(view, doc->fileName))) {
+        return view;
+    }
+
+    int clean = docRowsAreFile(doc);
+
+    if (!view->valid && clean) {
+        view->diskRows = 0;
+        view->valid = 1;
+        diffResetSpans(view, doc->numRows);
+    } else if (!view->valid || (!clean && diffStatChanged(view, doc->fileName))) {
+        diffReadFile(view, doc->fileName);
+        diffResetSpans(view, doc->numRows);
+    } else {
+        diffCatchUp(view, doc->numRows);
+    }
+
+    if (clean) {
+        diffAdoptRows(view, doc);
+    }
+
+    int64_t shift = 0; // how many more rows than lines there are before the span
+
+    view->scratch.count = 0;
+
+    for (int64_t i = 0; i < view->spans.count; ++i) {
+        struct DiffSpan span = view->spans.spans[i];
+
+        if (!span.dirty) {
+            diffSpansAdd(&view->scratch, span.from, span.to, span.delta, 0);
+        } else {
+            uint64_t *rows = diffHashRows(view, doc, span.from, span.to);
+            int64_t lines = span.to - span.from - span.delta;
+
+            diffLines(&view->disk[span.from - shift], lines, rows, span.to - span.from, span.from, &view->scratch, 1);
+        }
+
+        shift += span.delta;
+    }
+
+    diffSwapSpans(view);
+
+    view->changesCount = doc->changesCount;
+    view->savedChanges = doc->savedChanges;
+    view->changedOnDisk = doc->changedOnDisk;
+
+    return view;
+}
+
+void docDiffFree(struct Document *doc) {
+    struct DiffView *view = doc->diff;
+
+    if (NULL == view) {
+        return;
+    }
+
+    free(view->disk);
+    free(view->spans.spans);
+    free(view->scratch.spans);
+    free(view->hashes);
+    free(view);
+    doc->diff = NULL;
+}
+
+/**
+ * Rows of a document were edited, the spans around them are diffed again on the next frame
+ */
+void docDiffEdited(struct Document *doc, const int64_t *at, int64_t count, int64_t removed, int64_t inserted,
+                   int newCoords) {
+    struct DiffView *view = doc->diff;
+
+    if (NULL == view || !view->valid) {
+        return;
+    }
+
+    diffCatchUp(view, doc->numRows - (inserted - removed) * count);
+    diffEditRows(view, at, count, removed, inserted, newCoords);
+}
+
+void docDiffReset(struct Document *doc) {
+    if (doc->diff && doc->diff->valid) {
+        diffResetSpans(doc->diff, doc->numRows);
+    }
+}
+
+/**
+ * @return how a row differs from the file
+ */
+enum DiffMark diffMark(struct DiffView *view, int64_t row) {
+    struct DiffSpans *list = &view->spans;
+    int64_t lo = 0;
+    int64_t hi = list->count;
+
+    // the first span that does not end before the row
+    while (lo < hi) {
+        int64_t mid = (lo + hi) / 2;
+
+        if (list->spans[mid].to < row) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < list->count && list->spans[lo].from <= row) {
+        struct DiffSpan *span = &list->spans[lo];
+
+        if (span->from == span->to) {
+            return DIFF_REMOVED;
+        }
+
+        if (row < span->to) {
+            return row - span->from < span->to - span->from - span->delta ? DIFF_CHANGED : DIFF_ADDED;
+        }
+    }
+
+    // the last lines of the file were removed
+    if (row == view->numRows - 1 && list->count > 0 && list->spans[list->count - 1].from == view->numRows) {
+        return DIFF_REMOVED_BELOW;
+    }
+
+    return DIFF_SAME;
+}
+
+int diffGutterCols() {
+    return currentSession.showDiff ? DIFF_GUTTER_COLS : 0;
+}
+
+/**
+ * Turns the gutter of the diff with the file on and off
+ */
+void toggleDiff() {
+    currentSession.showDiff = !currentSession.showDiff;
+    env.usableTextScreenCols = env.screenCols - diffGutterCols();
+
+    // the hashes of the files are not kept when nothing shows them
+    if (!currentSession.showDiff) {
+        for (int i = 0; i < currentSession.numDocs; ++i) {
+            docDiffFree(currentSession.docs[i]);
+        }
+    }
+
+    snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage),
+             currentSession.showDiff ? " (diff with the file)" : " (no diff)");
+}
+
+/*** row changes ***/
+
+/**
+ * The bytes of a row changed, what is kept about it has to be looked at again
+ */
+void docRowChanged(struct Document *doc, int64_t row) {
+    docHighlightChanged(doc, row);
+
+    docWrapChanged(doc, row);
+    docDiffEdited(doc, &row, 1, 1, 1, 0);
+
+    if (doc->colCache && doc->colCache->rows[row % COL_CACHE_ROWS].row == row) {
+        doc->colCache->rows[row % COL_CACHE_ROWS].row = -1;
+    }
+}
+
+/**
+ * Bytes of a row were replaced, a long row only has the columns around them counted again
+ * @param at where the bytes were
+ * @param removed how many there were
+ * @param inserted how many there are now
+ */
+void docRowSpliced(struct Document *doc, int64_t row, int64_t at, int64_t removed, int64_t inserted) {
+    docHighlightChanged(doc, row);
+    docWrapChanged(doc, row);
+    docDiffEdited(doc, &row, 1, 1, 1, 0);
+
+    if (NULL == doc->colCache || doc->colCache->rows[row % COL_CACHE_ROWS].row != row) {
+        return;
+    }
+
+    struct ColumnMap *map = &doc->colCache->rows[row % COL_CACHE_ROWS];
+    struct Row *r = &doc->rows[row];
+
+    if (!columnMapSplice(map, rowChars(r), r->rawSize, at, removed, inserted)) {
+        map->row = -1;
+    }
+}
+
+/**
+ * Rows were put at a position, moving the ones after them
+ */
+void docRowsInserted(struct Document *doc, int64_t at, int64_t count) {
+    docHighlightInserted(doc, at, count);
+    docColumnsClear(doc);
+    docWrapInserted(doc, at, count);
+    docDiffEdited(doc, &at, 1, 0, count, 0);
+}
+
+void docRowsRemoved(struct Document *doc, int64_t at, int64_t count) {
+    docHighlightRemoved(doc, at, count);
+    docColumnsClear(doc);
+    docWrapRemoved(doc, at, count);
+    docDiffEdited(doc, &at, 1, count, 0, 0);
+}
+
+/**
+ * Rows were put at many positions at once, by an edit at many cursors
+ * @param at where each new row is, in order
+ */
+void docRowsInsertedAt(struct Document *doc, const int64_t *at, int64_t count) {
+    for (int64_t i = 0; i < count; ++i) {
+        highlightShiftInserted(doc, at[i], 1);
+    }
+
+    docHighlightClearCache(doc);
+    docColumnsClear(doc);
+    docWrapInsertedAt(doc, at, count);
+    docDiffEdited(doc, at, count, 0, 1, 1);
+}
+
+/**
+ * Rows were taken from many positions at once
+ * @param at where each one was, in order
+ */
+void docRowsRemovedAt(struct Document *doc, const int64_t *at, int64_t count) {
+    for (int64_t i = 0; i < count; ++i) {
+        highlightShiftRemoved(doc, at[i] - i, 1);
+    }
+
+    docHighlightClearCache(doc);
+    docColumnsClear(doc);
+    docWrapRemovedAt(doc, at, count);
+    docDiffEdited(doc, at, count, 1, 0, 0);
+}
+
+/**
+ * All the rows changed, like when the file is read again
+ */
+void docRowsReset(struct Document *doc) {
+    docHighlightReset(doc);
+    docColumnsClear(doc);
+    docWrapReset(doc);
+    docDiffReset(doc);
+}
+
+/**
+ * Bytes of the current row were replaced, unless it is the message row
+ */
+void currentRowSpliced(int64_t at, int64_t removed, int64_t inserted) {
+    if (!currentSession.locked) {
+        docRowSpliced(getCurrentDoc(), currentSession.cursorRow, at, removed, inserted);
+    }
+}
+
+/*** multiple cursors ***/
+
+int compareCursors(const void *a, const void *b) {
+    const struct Cursor *x = a;
+    const struct Cursor *y = b;
+
+    if (x->row != y->row) {
+        return x->row < y->row ? -1 : 1;
+    }
+
+    return x->col < y->col ? -1 : x->col > y->col;
+}
+
+void cursorsReserve(int64_t count) {
+    if (count <= currentSession.cursorCap) {
+        return;
+    }
+
+    int64_t cap = currentSession.cursorCap < 16 ? 16 : currentSession.cursorCap;
+
+    while (cap < count) {
+        cap *= 2;
+    }
+
+    struct Cursor *cursors = memRealloc(&editorMemory.cursors, currentSession.cursors,
+                                        sizeof(struct Cursor) * (size_t) currentSession.cursorCap,
+                                        sizeof(struct Cursor) * (size_t) cap);
+
+    if (NULL == cursors) {
+        fatal("Failed to grow the cursors (cursorsReserve)");
+        return;
+    }
+
+    currentSession.cursors = cursors;
+    currentSession.cursorCap = cap;
+}
+
+/**
+ * Forgets the other cursors, only the one of the session is left
+ */
+void cursorsClear() {
+    memFree(&editorMemory.cursors, currentSession.cursors, sizeof(struct Cursor) * (size_t) currentSession.cursorCap);
+    currentSession.cursors = NULL;
+    currentSession.numCursors = 0;
+    currentSession.cursorCap = 0;
+}
+
+void addCursor(int64_t row, int64_t col) {
+    cursorsReserve(currentSession.numCursors + 1);
+    currentSession.cursors[currentSession.numCursors].row = row;
+    currentSession.cursors[currentSession.numCursors].col = col;
+    ++currentSession.numCursors;
+}
+
+/**
+ * Two cursors on the same byte are one, and none stays on the cursor
+ * of the session. The cursors have to be in order.
+ */
+void cursorsDedupe() {
+    struct Cursor *cursors = currentSession.cursors;
+    int64_t n = 0;
+
+    for (int64_t i = 0; i < currentSession.numCursors; ++i) {
+        int onSession = cursors[i].row == currentSession.cursorRow && cursors[i].col == currentSession.cursorCol;
+
+        if (!onSession && (n == 0 || compareCursors(&cursors[n - 1], &cursors[i]) != 0)) {
+            cursors[n++] = cursors[i];
+        }
+    }
+
+    currentSession.numCursors = n;
+
+    if (n == 0) {
+        cursorsClear();
+    }
+}
+
+/**
+ * Puts the cursors back in order, after they were added or moved
+ */
+void cursorsNormalize() {
+    if (currentSession.numCursors == 0) {
+        return;
+    }
+
+    qsort(currentSession.cursors, (size_t) currentSession.numCursors, sizeof(struct Cursor), compareCursors);
+    cursorsDedupe();
+}
+
+/**
+ * @return the first cursor at or after a position, numCursors when there is none
+ */
+int64_t cursorsSearch(int64_t row, int64_t col) {
+    struct Cursor key = {row, col};
+    int64_t lo = 0;
+    int64_t hi = currentSession.numCursors;
+
+    while (lo < hi) {
+        int64_t mid = (lo + hi) / 2;
+
+        if (compareCursors(&currentSession.cursors[mid], &key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/**
+ * Puts the cursor of the session with the others, in order, for an edit
+ * at all of them. The cursors past the rows are brought back on them.
+ * @return where the cursor of the session is among them
+ */
+int64_t cursorsGather(struct Document *doc) {
+    int clamped = 0;
+
+    for (int64_t i = 0; i < currentSession.numCursors; ++i) {
+        struct Cursor *cursor = &currentSession.cursors[i];
+
+        if (cursor->row > doc->numRows) {
+            cursor->row = doc->numRows;
+            clamped = 1;
+        }
+
+        int64_t size = cursor->row < doc->numRows ? doc->rows[cursor->row].rawSize : 0;
+
+        if (cursor->col > size) {
+            cursor->col = size;
+            clamped = 1;
+        }
+    }
+
+    // after a reload, say
+    if (clamped) {
+        cursorsNormalize();
+    }
+
+    int64_t at = cursorsSearch(currentSession.cursorRow, currentSession.cursorCol);
+
+    cursorsReserve(currentSession.numCursors + 1);
+    memmove(&currentSession.cursors[at + 1], &currentSession.cursors[at],
+            sizeof(struct Cursor) * (size_t) (currentSession.numCursors - at));
+    currentSession.cursors[at].row = currentSession.cursorRow;
+    currentSession.cursors[at].col = currentSession.cursorCol;
+    ++currentSession.numCursors;
+
+    return at;
+}
+
+/**
+ * Takes the cursor of the session back from the others, after an edit
+ * @param at where it is among them
+ */
+void cursorsScatter(int64_t at) {
+    currentSession.cursorRow = currentSession.cursors[at].row;
+    currentSession.cursorCol = currentSession.cursors[at].col;
+
+    memmove(&currentSession.cursors[at], &currentSession.cursors[at + 1],
+            sizeof(struct Cursor) * (size_t) (currentSession.numCursors - at - 1));
+    --currentSession.numCursors;
+
+    // the edits keep the cursors in order, some of them may meet
+    cursorsDedupe();
+}
+
+/**
+ * @return the last of the cursors on the row of a cursor
+ */
+int64_t cursorsRowEnd(struct Cursor *cursors, int64_t count, int64_t first) {
+    int64_t last = first;
+
+    while (last + 1 < count && cursors[last + 1].row == cursors[first].row) {
+        ++last;
+    }
+
+    return last;
+}
+
+/**
+ * Puts the same bytes before all the cursors of a row, every byte
+ * of the row moves once whatever the number of cursors
+ * @param cursors the ones on that row, in order
+ */
+void rowInsertAtCursors(struct Document *doc, int64_t idx, struct Cursor *cursors, int64_t count,
+                        const char *s, int64_t len) {
+    struct Row *row = &doc->rows[idx];
+    int64_t size = row->rawSize;
+    int64_t newSize = size + count * len;
+
+    memRemoveRow(&doc->rowMemory, row);
+    rowMakeHot(row);
+    char *chars = rowResize(row, newSize);
+
+    // from the back, the bytes after a cursor go past the bytes put before the cursors before it
+    for (int64_t i = count - 1, end = size; i >= 0; --i) {
+        int64_t at = cursors[i].col;
+
+        memmove(&chars[at + (i + 1) * len], &chars[at], (size_t) (end - at));
+        memcpy(&chars[at + i * len], s, (size_t) len);
+        cursors[i].col = at + (i + 1) * len;
+        end = at;
+    }
+
+    row->rawSize = newSize;
+    chars[newSize] = '\0';
+    memAddRow(&doc->rowMemory, row);
+
+    if (count == 1) {
+        docRowSpliced(doc, idx, cursors[0].col - len, 0, len);
+    } else {
+        docRowChanged(doc, idx);
+    }
+}
+
+/**
+ * Types bytes at every cursor, each row is made again once
+ */
+void cursorsInsert(const char *s, int64_t len) {
+    struct Document *doc = getCurrentDoc();
+    ++doc->changesCount;
+
+    int64_t session = cursorsGather(doc);
+    struct Cursor *cursors = currentSession.cursors;
+    int64_t count = currentSession.numCursors;
+
+    // the cursors past the last row type on a new one
+    if (cursors[count - 1].row >= doc->numRows) {
+        editorAppendRow("", 0);
+    }
+
+    for (int64_t first = 0; first < count;) {
+        int64_t last = cursorsRowEnd(cursors, count, first);
+
+        rowInsertAtCursors(doc, cursors[first].row, &cursors[first], last - first + 1, s, len);
+        first = last + 1;
+    }
+
+    cursorsScatter(session);
+}
+
+/**
+ * Deletes the character before (or after) each cursor of a row, in a single pass
+ * @param cursors the ones on that row, in order
+ * @param edges room for the other end of each deletion
+ */
+void rowDeleteAtCursors(struct Document *doc, int64_t idx, struct Cursor *cursors, int64_t count, int after,
+                        int64_t *edges) {
+    struct Row *row = &doc->rows[idx];
+    int64_t size = row->rawSize;
+    int64_t removed = 0;
+
+    memRemoveRow(&doc->rowMemory, row);
+    rowMakeHot(row);
+    char *chars = rowChars(row);
+
+    // where the deletions end, before any byte moves
+    for (int64_t i = 0; i < count; ++i) {
+        int64_t col = cursors[i].col;
+
+        if (after) {
+            edges[i] = col < size ? nextCharEnd(chars, size, col) : col;
+        } else {
+            edges[i] = col > 0 ? prevCharStart(chars, size, col) : col;
+        }
+    }
+
+    int64_t kept = 0; // where the next bytes kept go
+    int64_t next = 0; // the first byte not looked at
+
+    for (int64_t i = 0; i < count; ++i) {
+        int64_t from = after ? cursors[i].col : edges[i];
+        int64_t to = after ? edges[i] : cursors[i].col;
+
+        from = from > next ? from : next;
+        to = to > from ? to : from;
+
+        memmove(&chars[kept], &chars[next], (size_t) (from - next));
+        kept += from - next;
+        removed += to - from;
+        cursors[i].col = kept;
+        next = to;
+    }
+
+    memmove(&chars[kept], &chars[next], (size_t) (size - next + 1));
+    rowResize(row, size - removed);
+    row->rawSize = size - removed;
+    memAddRow(&doc->rowMemory, row);
+
+    if (removed > 0) {
+        docRowChanged(doc, idx);
+    }
+}
+
+/**
+ * Joins rows with the rows before them, the rows left move up once
+ * for all the joins, and the cursors with them
+ * @param joins the rows that go at the end of the row before them, in order
+ * @param cursors all of them, in order
+ */
+void docJoinRows(struct Document *doc, const int64_t *joins, int64_t count, struct Cursor *cursors,
+                 int64_t numCursors) {
+    int64_t c = cursorsSearch(joins[0], 0);
+
+    for (int64_t j = 0; j < count; ++j) {
+        int64_t from = joins[j];
+        int64_t end = j + 1 < count ? joins[j + 1] : doc->numRows;
+        struct Row *into = &doc->rows[from - j - 1];
+        struct Row *row = &doc->rows[from];
+        int64_t size = into->rawSize;
+
+        memRemoveRow(&doc->rowMemory, into);
+        rowMakeHot(into);
+        char *chars = rowResize(into, size + row->rawSize);
+
+        memcpy(&chars[size], rowChars(row), (size_t) row->rawSize);
+        into->rawSize += row->rawSize;
+        chars[into->rawSize] = '\0';
+        memAddRow(&doc->rowMemory, into);
+        docFreeRow(doc, row);
+
+        for (; c < numCursors && cursors[c].row == from; ++c) {
+            cursors[c].row = from - j - 1;
+            cursors[c].col += size;
+        }
+
+        // the rows up to the next join move up with their cursors
+        memmove(&doc->rows[from - j], &doc->rows[from + 1], sizeof(struct Row) * (size_t) (end - from - 1));
+
+        for (; c < numCursors && (cursors[c].row < end || j + 1 == count); ++c) {
+            cursors[c].row -= j + 1;
+        }
+    }
+
+    doc->numRows -= count;
+    docRowsRemovedAt(doc, joins, count);
+
+    for (int64_t j = 0; j < count; ++j) {
+        docRowChanged(doc, joins[j] - j - 1);
+    }
+}
+
+/**
+ * Deletes the character next to every cursor, a cursor at the
+ * edge of its row joins it with the row next to it instead
+ * @param after 1 for the characters after the cursors
+ */
+void cursorsDelete(int after) {
+    struct Document *doc = getCurrentDoc();
+    ++doc->changesCount;
+
+    int64_t session = cursorsGather(doc);
+    struct Cursor *cursors = currentSession.cursors;
+    int64_t count = currentSession.numCursors;
+    int64_t *edges = malloc(sizeof(int64_t) * 2 * (size_t) count);
+    int64_t *joins = edges + count;
+    int64_t numJoins = 0;
+
+    if (NULL == edges) {
+        fatal("Failed to delete at the cursors (cursorsDelete)");
+        return;
+    }
+
+    // the cursors past the last row have nothing to delete
+    for (int64_t first = 0; first < count && cursors[first].row < doc->numRows;) {
+        int64_t last = cursorsRowEnd(cursors, count, first);
+        int64_t idx = cursors[first].row;
+
+        // the edges of the row are looked at before the deletions move them
+        if (!after && cursors[first].col == 0 && idx > 0) {
+            joins[numJoins++] = idx;
+        } else if (after && cursors[last].col >= doc->rows[idx].rawSize && idx + 1 < doc->numRows) {
+            joins[numJoins++] = idx + 1;
+        }
+
+        rowDeleteAtCursors(doc, idx, &cursors[first], last - first + 1, after, &edges[first]);
+        first = last + 1;
+    }
+
+    if (numJoins > 0) {
+        docJoinRows(doc, joins, numJoins, cursors, count);
+    }
+
+    free(edges);
+    cursorsScatter(session);
+}
+
+/**
+ * Cuts a row at all its cursors, the pieces go in the rows after
+ * it, which are free, and the cursors at their start
+ * @param shift how many rows were put before it
+ * @param at where the new rows are
+ */
+void rowSplitAtCursors(struct Document *doc, int64_t idx, int64_t shift, struct Cursor *cursors, int64_t count,
+                       int64_t *at) {
+    struct Row *row = &doc->rows[idx];
+    const char *chars = rowChars(row);
+    int64_t cut = cursors[0].col;
+
+    for (int64_t i = 0; i < count; ++i) {
+        int64_t from = cursors[i].col;
+        int64_t to = i + 1 < count ? cursors[i + 1].col : row->rawSize;
+        struct Row *piece = &doc->rows[idx + shift + i + 1];
+
+        rowSetChars(piece, chars + from, (size_t) (to - from));
+        memAddRow(&doc->rowMemory, piece);
+
+        at[i] = idx + shift + i + 1;
+        cursors[i].row = at[i];
+        cursors[i].col = 0;
+    }
+
+    memRemoveRow(&doc->rowMemory, row);
+    rowMakeHot(row);
+    rowResize(row, cut)[cut] = '\0';
+    row->rawSize = cut;
+    memAddRow(&doc->rowMemory, row);
+
+    if (shift > 0) {
+        doc->rows[idx + shift] = *row;
+    }
+}
+
+/**
+ * Cuts the rows at every cursor. The rows array grows once, and from
+ * the back each row moves once to where it ends.
+ */
+void cursorsNewLine() {
+    struct Document *doc = getCurrentDoc();
+    ++doc->changesCount;
+
+    int64_t session = cursorsGather(doc);
+    struct Cursor *cursors = currentSession.cursors;
+    int64_t count = currentSession.numCursors;
+    int64_t *at = malloc(sizeof(int64_t) * (size_t) count);
+
+    if (NULL == at) {
+        fatal("Failed to cut the rows (cursorsNewLine)");
+        return;
+    }
+
+    if (cursors[count - 1].row >= doc->numRows) {
+        editorAppendRow("", 0);
+    }
+
+    docReserveRows(doc, doc->numRows + count);
+
+    for (int64_t last = count - 1, end = doc->numRows; last >= 0;) {
+        int64_t idx = cursors[last].row;
+        int64_t first = last;
+
+        while (first > 0 && cursors[first - 1].row == idx) {
+            --first;
+        }
+
+        // the rows after it go past all the new rows before them
+        memmove(&doc->rows[idx + last + 2], &doc->rows[idx + 1], sizeof(struct Row) * (size_t) (end - idx - 1));
+        rowSplitAtCursors(doc, idx, first, &cursors[first], last - first + 1, &at[first]);
+
+        end = idx;
+        last = first - 1;
+    }
+
+    doc->numRows += count;
+    docRowsInsertedAt(doc, at, count);
+
+    // the rows that were cut, each one just before its first new row
+    for (int64_t i = 0; i < count; ++i) {
+        if (i == 0 || at[i] - 1 != at[i - 1]) {
+            docRowChanged(doc, at[i] - 1);
+        }
+    }
+
+    free(at);
+    cursorsScatter(session);
+}
+
+/**
+ * Moves the other cursors the way the arrows, home and end move the cursor of the session
+ */
+void cursorsMove(int code) {
+    struct Document *doc = getCurrentDoc();
+
+    if (currentSession.locked || currentSession.numCursors == 0) {
+        return;
+    }
+
+    for (int64_t i = 0; i < currentSession.numCursors; ++i) {
+        struct Cursor *cursor = &currentSession.cursors[i];
+
+        if (cursor->row >= doc->numRows) {
+            cursor->row = doc->numRows;
+            cursor->col = 0;
+        }
+
+        struct Row *row = cursor->row < doc->numRows ? &doc->rows[cursor->row] : NULL;
+
+        if (row && cursor->col > row->rawSize) {
+            cursor->col = row->rawSize;
+        }
+
+        switch (code) {
+            case ARROW_UP:
+            case ARROW_DOWN: {
+                int64_t to = cursor->row + (code == ARROW_UP ? -1 : 1);
+
+                if (to < 0 || to > doc->numRows) {
+                    break;
+                }
+
+                int64_t col = row ? columnOfByte(docColumnMap(doc, cursor->row), rowChars(row), cursor->col) : 0;
+                int64_t charCol;
+
+                cursor->row = to;
+                cursor->col = to < doc->numRows ? byteOfColumn(docColumnMap(doc, to), rowChars(&doc->rows[to]), col,
+                                                               &charCol) : 0;
+            }
+                break;
+            case ARROW_LEFT:
+                if (cursor->col > 0) {
+                    cursor->col = prevCharStart(rowChars(row), row->rawSize, cursor->col);
+                } else if (cursor->row > 0) {
+                    --cursor->row;
+                    cursor->col = doc->rows[cursor->row].rawSize;
+                }
+                break;
+            case ARROW_RIGHT:
+                if (row && cursor->col < row->rawSize) {
+                    cursor->col = nextCharEnd(rowChars(row), row->rawSize, cursor->col);
+                } else if (cursor->row < doc->numRows - 1) {
+                    ++cursor->row;
+                    cursor->col = 0;
+                }
+                break;
+            case HOME_KEY:
+                cursor->col = 0;
+                break;
+            case END_KEY:
+                cursor->col = row ? row->rawSize : 0;
+                break;
+            default:
+                break;
+        }
+    }
+
+    cursorsNormalize();
+}
+
+void cursorsStatus() {
+    snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (%lld cursors)",
+             (long long) currentSession.numCursors + 1);
+}
+
+/**
+ * Leaves a cursor where the cursor is, and moves it to the same column of the next row
+ */
+void cursorAddBelow() {
+    struct Document *doc = getCurrentDoc();
+
+    if (currentSession.locked || currentSession.cursorRow + 1 >= doc->numRows) {
+        return;
+    }
+
+    int64_t col = cursorColumn();
+
+    addCursor(currentSession.cursorRow, currentSession.cursorCol);
+    ++currentSession.cursorRow;
+    cursorToColumn(col);
+    cursorsNormalize();
+    cursorsStatus();
+}
+
+/**
+ * @return 1 when the bytes from a position of a row are a whole word
+ */
+int isWordAt(const char *chars, int64_t size, int64_t at, int64_t len) {
+    return (at == 0 || !isWordChar(chars[at - 1])) && (at + len == size || !isWordChar(chars[at + len]));
+}
+
+/**
+ * Leaves a cursor where the cursor is, and moves it to the same place in the next
+ * time the word it is on shows up, after the end of the file comes its start.
+ * Again and again, that puts a cursor on every one of them.
+ */
+void cursorAddNextMatch() {
+    struct Document *doc = getCurrentDoc();
+    struct Row *row = getCurrentRow();
+
+    if (currentSession.locked || NULL == row) {
+        return;
+    }
+
+    const char *chars = rowChars(row);
+    int64_t start = currentSession.cursorCol;
+    int64_t end = currentSession.cursorCol;
+
+    while (start > 0 && isWordChar(chars[start - 1])) {
+        --start;
+    }
+
+    while (end < row->rawSize && isWordChar(chars[end])) {
+        ++end;
+    }
+
+    if (start == end) {
+        snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (no word at the cursor)");
+        return;
+    }
+
+    int64_t len = end - start;
+    int64_t offset = currentSession.cursorCol - start;
+    char *word = strndup(chars + start, (size_t) len);
+
+    if (NULL == word) {
+        fatal("Failed to copy the word (cursorAddNextMatch)");
+        return;
+    }
+
+    // the rows from the one of the cursor, and that one again up to the word
+    for (int64_t k = 0; k <= doc->numRows; ++k) {
+        int64_t idx = (currentSession.cursorRow + k) % doc->numRows;
+        struct Row *r = &doc->rows[idx];
+        const char *s = rowChars(r);
+        int64_t at = k == 0 ? end : 0;
+        const char *found;
+
+        while (NULL != (found = findBytes(s + at, r->rawSize - at, word))) {
+            at = found - s;
+
+            if (k == doc->numRows && at >= start) {
+                break;
+            }
+
+            int64_t col = at + offset;
+            int64_t existing = cursorsSearch(idx, col);
+            int taken = existing < currentSession.numCursors && currentSession.cursors[existing].row == idx &&
+                        currentSession.cursors[existing].col == col;
+
+            if (isWordAt(s, r->rawSize, at, len) && !taken) {
+                addCursor(currentSession.cursorRow, currentSession.cursorCol);
+                currentSession.cursorRow = idx;
+                currentSession.cursorCol = col;
+                cursorsNormalize();
+                cursorsStatus();
+                free(word);
+                return;
+            }
+
+            at += len;
+        }
+    }
+
+    free(word);
+    snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (no more matches)");
+}
+
+/**
+ * Puts a cursor at every place some text is, instead of the other cursors.
+ * The cursor of the session goes to the first one after it.
+ */
+void cursorsAtMatches(const char *needle) {
+    struct Document *doc = getCurrentDoc();
+    int64_t len = (int64_t) strlen(needle);
+
+    if (len == 0) {
+        return;
+    }
+
+    cursorsClear();
+
+    for (int64_t idx = 0; idx < doc->numRows; ++idx) {
+        struct Row *row = &doc->rows[idx];
+        const char *s = rowChars(row);
+        const char *found;
+
+        for (int64_t at = 0; NULL != (found = findBytes(s + at, row->rawSize - at, needle)); at += len) {
+            at = found - s;
+            addCursor(idx, at);
+        }
+    }
+
+    if (currentSession.numCursors == 0) {
+        snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (not found)");
+        return;
+    }
+
+    int64_t first = cursorsSearch(currentSession.cursorRow, currentSession.cursorCol);
+
+    first = first < currentSession.numCursors ? first : 0;
+    currentSession.cursorRow = currentSession.cursors[first].row;
+    currentSession.cursorCol = currentSession.cursors[first].col;
+    cursorsDedupe();
+    cursorsStatus();
+}
+
+/*** selection and yank ***/
+
+/**
+ * What was copied or cut. Its rows are Row descriptors like the ones
+ * of the documents: a whole row copied shares the bytes of its arena or
+ * of its cold block, only the rows at the edges of what was copied get
+ * bytes of their own.
+ */
+struct Yank {
+    int64_t numRows;
+    int64_t cap;
+    struct Row *rows;
+    int block; // the rows go on top of each other at the cursor when pasted
+};
+
+struct Yank yank;
+
+void yankReserve(int64_t count) {
+    if (count <= yank.cap) {
+        return;
+    }
+
+    int64_t cap = yank.cap < 16 ? 16 : yank.cap;
+
+    while (cap < count) {
+        cap *= 2;
+    }
+
+    struct Row *rows = memRealloc(&editorMemory.yank, yank.rows, sizeof(struct Row) * (size_t) yank.cap,
+                                  sizeof(struct Row) * (size_t) cap);
+
+    if (NULL == rows) {
+        fatal("Failed to grow the yank buffer (yankReserve)");
+        return;
+    }
+
+    yank.rows = rows;
+    yank.cap = cap;
+}
+
+void yankClear() {
+    for (int64_t i = 0; i < yank.numRows; ++i) {
+        memRemoveRow(&editorMemory.yank, &yank.rows[i]);
+        rowFree(&yank.rows[i]);
+    }
+
+    memFree(&editorMemory.yank, yank.rows, sizeof(struct Row) * (size_t) yank.cap);
+    yank.rows = NULL;
+    yank.numRows = 0;
+    yank.cap = 0;
+}
+
+/**
+ * Makes a row that reads the same bytes as another one. The bytes of an
+ * arena or of a cold block are shared, they stay there as long as a
+ * row uses them. A row with its own malloc is copied, it could change.
+ */
+void rowShare(struct Row *row, struct Row *from) {
+    *row = *from;
+
+    if (rowIsInline(from)) {
+        // the bytes are in the row
+    } else if (from->cold) {
+        ++row->cold->liveRows;
+    } else if (from->arena) {
+        row->arena->live += (size_t) row->rawSize + 1;
+    } else {
+        rowSetChars(row, from->rawContent, (size_t) from->rawSize);
+    }
+
+    row->hlState = 0;
+}
+
+/**
+ * Puts some bytes of a row at the end of the yank buffer, the whole
+ * row is shared instead of copied
+ * @param start the first byte
+ * @param end the byte after the last one
+ */
+void yankPush(struct Row *from, int64_t start, int64_t end) {
+    yankReserve(yank.numRows + 1);
+
+    struct Row *row = &yank.rows[yank.numRows++];
+
+    if (start == 0 && end == from->rawSize) {
+        rowShare(row, from);
+    } else {
+        rowSetChars(row, rowChars(from) + start, (size_t) (end - start));
+    }
+
+    memAddRow(&editorMemory.yank, row);
+}
+
+/**
+ * Keeps a position in the text, past the last row is the end of it
+ */
+void docClampPosition(struct Document *doc, int64_t *row, int64_t *col) {
+    if (*row >= doc->numRows) {
+        *row = doc->numRows - 1;
+        *col = INT64_MAX;
+    }
+
+    if (*col > doc->rows[*row].rawSize) {
+        *col = doc->rows[*row].rawSize;
+    }
+}
+
+int64_t docColumnOfByte(struct Document *doc, int64_t row, int64_t byte) {
+    struct ColumnMap *map = docColumnMap(doc, row);
+
+    return columnOfByte(map, rowChars(&doc->rows[row]), byte);
+}
+
+/**
+ * Where the selection starts and ends, the end is not in it. A block
+ * gives the rows it is on, and its display columns instead of bytes.
+ * @return 0 when nothing is selected
+ */
+int selectionBounds(struct Document *doc, int64_t *fromRow, int64_t *fromCol, int64_t *toRow, int64_t *toCol) {
+    if (currentSession.selecting == NO_SELECTION || currentSession.locked || doc->numRows == 0) {
+        return 0;
+    }
+
+    int64_t anchorRow = currentSession.anchorRow;
+    int64_t anchorCol = currentSession.anchorCol;
+    int64_t cursorRow = currentSession.cursorRow;
+    int64_t cursorCol = currentSession.cursorCol;
+
+    docClampPosition(doc, &anchorRow, &anchorCol);
+    docClampPosition(doc, &cursorRow, &cursorCol);
+
+    if (currentSession.selecting == BLOCK_SELECTION) {
+        int64_t anchorX = docColumnOfByte(doc, anchorRow, anchorCol);
+        int64_t cursorX = docColumnOfByte(doc, cursorRow, cursorCol);
+
+        *fromRow = anchorRow < cursorRow ? anchorRow : cursorRow;
+        *toRow = anchorRow < cursorRow ? cursorRow : anchorRow;
+        *fromCol = anchorX < cursorX ? anchorX : cursorX;
+        *toCol = anchorX < cursorX ? cursorX : anchorX;
+
+        return *fromCol < *toCol;
+    }
+
+    int anchorFirst = anchorRow < cursorRow || (anchorRow == cursorRow && anchorCol < cursorCol);
+
+    *fromRow = anchorFirst ? anchorRow : cursorRow;
+    *fromCol = anchorFirst ? anchorCol : cursorCol;
+    *toRow = anchorFirst ? cursorRow : anchorRow;
+    *toCol = anchorFirst ? cursorCol : anchorCol;
+
+    return *fromRow != *toRow || *fromCol != *toCol;
+}
+
+/**
+ * Drops the mark: nothing, then some text, then a block, then nothing again
+ */
+void toggleSelection() {
+    if (currentSession.locked) {
+        return;
+    }
+
+    currentSession.selecting = (currentSession.selecting + 1) % (BLOCK_SELECTION + 1);
+    currentSession.anchorRow = currentSession.cursorRow;
+    currentSession.anchorCol = currentSession.cursorCol;
+}
+
+/**
+ * Takes bytes out of a row of a document
+ */
+void docRowCut(struct Document *doc, int64_t idx, int64_t at, int64_t len) {
+    struct Row *row = &doc->rows[idx];
+
+    memRemoveRow(&doc->rowMemory, row);
+    rowMakeHot(row);
+
+    char *chars = rowChars(row);
+
+    memmove(&chars[at], &chars[at + len], (size_t) (row->rawSize - at - len + 1));
+    rowResize(row, row->rawSize - len);
+    row->rawSize -= len;
+    memAddRow(&doc->rowMemory, row);
+    docRowSpliced(doc, idx, at, len, 0);
+}
+
+/**
+ * Takes text out of a document, from a position to another one. The
+ * rows between the first and the last one were moved to the yank buffer,
+ * the last row goes at the end of the first one.
+ */
+void docCutRange(struct Document *doc, int64_t fromRow, int64_t fromCol, int64_t toRow, int64_t toCol) {
+    if (fromRow == toRow) {
+        docRowCut(doc, fromRow, fromCol, toCol - fromCol);
+        return;
+    }
+
+    struct Row *first = &doc->rows[fromRow];
+    struct Row *last = &doc->rows[toRow];
+    int64_t tail = last->rawSize - toCol;
+
+    memRemoveRow(&doc->rowMemory, first);
+    rowMakeHot(first);
+
+    char *chars = rowResize(first, fromCol + tail);
+
+    memcpy(&chars[fromCol], rowChars(last) + toCol, (size_t) tail);
+    first->rawSize = fromCol + tail;
+    chars[first->rawSize] = '\0';
+    memAddRow(&doc->rowMemory, first);
+    docFreeRow(doc, last);
+
+    memmove(&doc->rows[fromRow + 1], &doc->rows[toRow + 1], sizeof(struct Row) * (size_t) (doc->numRows - toRow - 1));
+    doc->numRows -= toRow - fromRow;
+    docRowsRemoved(doc, fromRow + 1, toRow - fromRow);
+    docRowChanged(doc, fromRow);
+}
+
+/**
+ * Puts the text from a position to another one in the yank buffer.
+ * When it is cut, the rows in the middle move there as they are.
+ */
+void yankLinear(struct Document *doc, int64_t fromRow, int64_t fromCol, int64_t toRow, int64_t toCol, int cut) {
+    yankReserve(toRow - fromRow + 1);
+
+    if (!cut) {
+        docRowsToArenas(doc, fromRow + 1, toRow);
+    }
+
+    for (int64_t r = fromRow; r <= toRow; ++r) {
+        struct Row *row = &doc->rows[r];
+
+        if (cut && r != fromRow && r != toRow) {
+            memRemoveRow(&doc->rowMemory, row);
+            yank.rows[yank.numRows++] = *row;
+            memAddRow(&editorMemory.yank, row);
+        } else {
+            yankPush(row, r == fromRow ? fromCol : 0, r == toRow ? toCol : row->rawSize);
+        }
+    }
+
+    if (cut) {
+        docCutRange(doc, fromRow, fromCol, toRow, toCol);
+        currentSession.cursorRow = fromRow;
+        currentSession.cursorCol = fromCol;
+    }
+}
+
+/**
+ * Puts the same columns of some rows in the yank buffer, a row too
+ * short for them gives an empty one
+ */
+void yankBlock(struct Document *doc, int64_t fromRow, int64_t fromCol, int64_t toRow, int64_t toCol, int cut) {
+    yankReserve(toRow - fromRow + 1);
+
+    for (int64_t r = fromRow; r <= toRow; ++r) {
+        struct ColumnMap *map = docColumnMap(doc, r);
+        const char *chars = rowChars(&doc->rows[r]);
+        int64_t charCol;
+        int64_t start = byteOfColumn(map, chars, fromCol, &charCol);
+        int64_t end = byteOfColumn(map, chars, toCol, &charCol);
+
+        yankPush(&doc->rows[r], start, end);
+
+        if (cut && end > start) {
+            docRowCut(doc, r, start, end - start);
+        }
+    }
+
+    if (cut) {
+        currentSession.cursorRow = fromRow;
+        cursorToColumn(fromCol);
+    }
+}
+
+/**
+ * Copies what is selected to the yank buffer, and takes it out of
+ * the document when it is cut. The selection is over after that.
+ * @param cut 1 to take it out
+ */
+void copySelection(int cut) {
+    struct Document *doc = getCurrentDoc();
+    int64_t fromRow;
+    int64_t fromCol;
+    int64_t toRow;
+    int64_t toCol;
+
+    if (currentSession.locked) {
+        return;
+    } else if (!selectionBounds(doc, &fromRow, &fromCol, &toRow, &toCol)) {
+        snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (nothing selected)");
+        return;
+    }
+
+    yankClear();
+    yank.block = currentSession.selecting == BLOCK_SELECTION;
+    doc->lent = 1;
+
+    if (cut) {
+        // the rows move under them
+        cursorsClear();
+        ++doc->changesCount;
+    }
+
+    if (yank.block) {
+        yankBlock(doc, fromRow, fromCol, toRow, toCol, cut);
+    } else {
+        yankLinear(doc, fromRow, fromCol, toRow, toCol, cut);
+    }
+
+    currentSession.selecting = NO_SELECTION;
+    snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (%lld lines %s)",
+             (long long) yank.numRows, cut ? "cut" : "copied");
+}
+
+/**
+ * Puts bytes in a row of a document, after some spaces
+ * @param src the bytes, they must not be in a cold block
+ */
+void docRowPut(struct Document *doc, int64_t idx, int64_t at, int64_t spaces, struct Row *src) {
+    struct Row *row = &doc->rows[idx];
+    int64_t len = src->rawSize;
+
+    memRemoveRow(&doc->rowMemory, row);
+    rowMakeHot(row);
+
+    char *chars = rowResize(row, row->rawSize + spaces + len);
+
+    memmove(&chars[at + spaces + len], &chars[at], (size_t) (row->rawSize - at + 1));
+    memset(&chars[at], ' ', (size_t) spaces);
+    // the row is hot now, the bytes of a cold source stay there
+    memcpy(&chars[at + spaces], rowChars(src), (size_t) len);
+    row->rawSize += spaces + len;
+    memAddRow(&doc->rowMemory, row);
+    docRowSpliced(doc, idx, at, 0, spaces + len);
+}
+
+/**
+ * Pastes text at the cursor. The rows in the middle of it share their
+ * bytes with the yank buffer, they all go in with a single move of the
+ * rows after the cursor. The cursor ends after what was pasted.
+ */
+void pasteLinear(struct Document *doc) {
+    int64_t r = currentSession.cursorRow;
+    int64_t c = currentSession.cursorCol;
+    int64_t n = yank.numRows;
+    struct Row *last = &yank.rows[n - 1];
+
+    if (n == 1) {
+        docRowPut(doc, r, c, 0, last);
+        currentSession.cursorCol += last->rawSize;
+        return;
+    }
+
+    docReserveRows(doc, doc->numRows + n - 1);
+
+    struct Row *row = &doc->rows[r];
+    struct Row old = *row;
+
+    memmove(&doc->rows[r + n], &doc->rows[r + 1], sizeof(struct Row) * (size_t) (doc->numRows - r - 1));
+    doc->numRows += n - 1;
+
+    // the end of the cursor's row goes after the last row pasted
+    struct Row *end = &doc->rows[r + n - 1];
+
+    if (c == 0 && last->rawSize == 0) {
+        *end = old;
+    } else {
+        memRemoveRow(&doc->rowMemory, &old);
+        rowMakeHot(&old);
+
+        int64_t tail = old.rawSize - c;
+
+        rowShare(end, last);
+        rowMakeHot(end);
+
+        char *chars = rowResize(end, last->rawSize + tail);
+
+        memcpy(&chars[last->rawSize], rowChars(&old) + c, (size_t) tail);
+        end->rawSize = last->rawSize + tail;
+        chars[end->rawSize] = '\0';
+        memAddRow(&doc->rowMemory, end);
+
+        if (c == 0) {
+            rowFree(&old);
+        } else {
+            // and the start of it before the first one
+            chars = rowResize(&old, c + yank.rows[0].rawSize);
+            memcpy(&chars[c], rowChars(&yank.rows[0]), (size_t) yank.rows[0].rawSize);
+            old.rawSize = c + yank.rows[0].rawSize;
+            chars[old.rawSize] = '\0';
+            memAddRow(&doc->rowMemory, &old);
+            *row = old;
+        }
+    }
+
+    for (int64_t i = c == 0 ? 0 : 1; i < n - 1; ++i) {
+        rowShare(&doc->rows[r + i], &yank.rows[i]);
+        memAddRow(&doc->rowMemory, &doc->rows[r + i]);
+    }
+
+    if (c == 0) {
+        docRowsInserted(doc, r, n - 1);
+    } else {
+        docRowsInserted(doc, r + 1, n - 1);
+        docRowChanged(doc, r);
+    }
+
+    docRowChanged(doc, r + n - 1);
+    currentSession.cursorRow = r + n - 1;
+    currentSession.cursorCol = last->rawSize;
+}
+
+/**
+ * Pastes a block: its rows go on the rows from the cursor's one down, at the
+ * column of the cursor. The rows too short get spaces, and rows are added
+ * past the end of the document.
+ */
+void pasteBlock(struct Document *doc) {
+    int64_t col = cursorColumn();
+    int64_t r = currentSession.cursorRow;
+
+    docReserveRows(doc, r + yank.numRows);
+
+    while (doc->numRows < r + yank.numRows) {
+        docAppendRow(doc, "", 0);
+    }
+
+    for (int64_t i = 0; i < yank.numRows; ++i) {
+        struct ColumnMap *map = docColumnMap(doc, r + i);
+        int64_t charCol;
+        int64_t at = byteOfColumn(map, rowChars(&doc->rows[r + i]), col, &charCol);
+        int64_t spaces = col > map->numCols ? col - map->numCols : 0;
+
+        docRowPut(doc, r + i, at, spaces, &yank.rows[i]);
+    }
+
+    cursorToColumn(col);
+}
+
+void editorPaste() {
+    struct Document *doc = getCurrentDoc();
+
+    if (currentSession.locked) {
+        return;
+    } else if (yank.numRows == 0) {
+        snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (nothing to paste)");
+        return;
+    }
+
+    cursorsClear();
+    currentSession.selecting = NO_SELECTION;
+    ++doc->changesCount;
+
+    if (currentSession.cursorRow >= doc->numRows) {
+        docAppendRow(doc, "", 0);
+        currentSession.cursorRow = doc->numRows - 1;
+        currentSession.cursorCol = 0;
+    }
+
+    if (yank.block) {
+        pasteBlock(doc);
+    } else {
+        pasteLinear(doc);
+    }
+}
+
+/**
+ * A document is going away but some of its rows were copied. The arenas
+ * they still use go to the shared ones, and the cold blocks are counted
+ * there instead of in the document.
+ */
+void docHandOver(struct Document *doc) {
+    if (doc->arenas) {
+        struct Arena *last = doc->arenas;
+
+        while (last->next) {
+            last = last->next;
+        }
+
+        last->next = sharedArenas;
+        sharedArenas = doc->arenas;
+        doc->arenas = NULL;
+        memMerge(&editorMemory.shared, &doc->arenaMemory);
+    }
+
+    if (doc->coldMemory.blocks == 0) {
+        return;
+    }
+
+    for (int d = -1; d < currentSession.numDocs; ++d) {
+        struct Row *rows = d < 0 ? yank.rows : currentSession.docs[d]->rows;
+        int64_t numRows = d < 0 ? yank.numRows : currentSession.docs[d]->numRows;
+
+        for (int64_t i = 0; i < numRows; ++i) {
+            struct ColdBlock *block = rowIsInline(&rows[i]) ? NULL : rows[i].cold;
+
+            if (block && block->account == &doc->coldMemory) {
+                memCount(&editorMemory.shared, block->compressed, block->compressedLen, 1);
+                memCount(&editorMemory.shared, block, sizeof(struct ColdBlock), 1);
+                block->account = &editorMemory.shared;
+            }
+        }
+    }
+}
+
+/*** line transforms ***/
+
+enum SortKind {
+    SORT_TEXT = 0,
+    SORT_NUMBER, // by the number the key starts with
+    SORT_HASH // equal rows next to each other, in no useful order
+};
+
+/**
+ * How the rows of a range compare, the workers only read it
+ */
+struct LineSort {
+    struct Row *rows; // the first row of the range
+    enum SortKind kind;
+    int reverse;
+    int field; // the key starts at that field (from 1, the fields are separated by blanks), 0 for the whole row
+    const uint64_t *chunk; // by row of the range, the bytes of its key compared in this round of the ties
+    const int64_t *len; // by row, the length of its key
+};
+
+struct LineSort lineSort;
+
+/**
+ * A row of the range being sorted. The rows are sorted through
+ * their keys, they only move once, to their place.
+ */
+struct SortKey {
+    uint64_t prefix; // compares like the key, as far as it goes
+    int64_t idx;
+};
+
+/**
+ * What a worker does, on a part of the range
+ */
+struct TransformJob {
+    pthread_t thread;
+    int running;
+    int64_t from;
+    int64_t mid; // where the second half starts, for a merge
+    int64_t to;
+    struct SortKey *keys;
+    struct SortKey *out;
+    regex_t pattern; // each its own, regexec takes a lock on the one it runs
+    int drop;
+    char *keep;
+};
+
+/**
+ * The last transform, so it can be undone while its document did not change
+ */
+struct LinesUndo {
+    struct Document *doc;
+    int64_t changesCount;
+    int64_t from;
+    int64_t numBefore;
+    int64_t numAfter;
+    int64_t *order; // the row of the range each row was, before, -1 for the rows a command wrote
+    int64_t numDropped;
+    struct Row *dropped; // the rows taken out, until they come back or the undo is forgotten
+    int64_t *droppedAt;
+};
+
+struct LinesUndo linesUndo;
+
+/**
+ * @return where the key of a row starts in its bytes
+ */
+const char *rowKey(struct ColdReader *reader, struct Row *row, int64_t *len) {
+    const char *s = coldReaderBytes(reader, row);
+    const char *end = s + row->rawSize;
+
+    for (int f = 1; f < lineSort.field && s < end; ++f) {
+        while (s < end && (*s == ' ' || *s == '\t')) {
+            ++s;
+        }
+
+        while (s < end && *s != ' ' && *s != '\t') {
+            ++s;
+        }
+    }
+
+    *len = end - s;
+    return s;
+}
+
+/**
+ * The number a key starts with (after blanks), 0 when there is none
+ */
+double keyNumber(const char *s, int64_t len) {
+    int64_t i = 0;
+    double value = 0;
+    double scale = 1;
+    int negative = 0;
+
+    while (i < len && (s[i] == ' ' || s[i] == '\t')) {
+        ++i;
+    }
+
+    if (i < len && s[i] == '-') {
+        negative = 1;
+        ++i;
+    }
+
+    for (; i < len && isdigit((unsigned char) s[i]); ++i) {
+        value = value * 10 + (s[i] - '0');
+    }
+
+    if (i < len && s[i] == '.') {
+        for (++i; i < len && isdigit((unsigned char) s[i]); ++i) {
+            scale /= 10;
+            value += (s[i] - '0') * scale;
+        }
+    }
+
+    // no -0, it would not be equal to 0
+    return negative && value != 0 ? -value : value;
+}
+
+/**
+ * @return the 8 bytes of a key from an offset, the ones past its end are 0
+ */
+uint64_t keyChunk(const char *s, int64_t len, int64_t offset) {
+    uint64_t chunk = 0;
+
+    for (int64_t i = offset; i < offset + 8; ++i) {
+        chunk = chunk << 8 | (i < len ? (unsigned char) s[i] : 0);
+    }
+
+    return chunk;
+}
+
+uint64_t rowSortPrefix(struct ColdReader *reader, struct Row *row) {
+    int64_t len;
+    const char *s = rowKey(reader, row, &len);
+
+    if (lineSort.kind == SORT_HASH) {
+        return hashBytes(s, (size_t) len);
+    }
+
+    if (lineSort.kind == SORT_NUMBER) {
+        double value = keyNumber(s, len);
+        uint64_t bits;
+
+        // the doubles compare like their bits once the negative ones are flipped
+        memcpy(&bits, &value, sizeof(bits));
+        return bits >> 63 ? ~bits : bits | (1ULL << 63);
+    }
+
+    return keyChunk(s, len, 0);
+}
+
+/**
+ * Two rows are never equal, the first one in the range comes first. The
+ * rows with the same prefix are ordered by their index until sortRowTies.
+ */
+int compareSortKeys(const void *a, const void *b) {
+    const struct SortKey *x = a;
+    const struct SortKey *y = b;
+    int result = x->prefix < y->prefix ? -1 : x->prefix > y->prefix;
+
+    if (lineSort.reverse) {
+        result = -result;
+    }
+
+    return result != 0 ? result : (x->idx < y->idx ? -1 : x->idx > y->idx);
+}
+
+/**
+ * Two rows whose keys were equal so far, by the next bytes of their keys
+ * then by their length: past its end a key reads as 0s
+ */
+int compareTiedKeys(const void *a, const void *b) {
+    const struct SortKey *x = a;
+    const struct SortKey *y = b;
+    uint64_t chunkX = lineSort.chunk[x->idx];
+    uint64_t chunkY = lineSort.chunk[y->idx];
+    int64_t lenX = lineSort.len[x->idx];
+    int64_t lenY = lineSort.len[y->idx];
+    int result = chunkX < chunkY ? -1 : chunkX > chunkY;
+
+    if (result == 0) {
+        result = lenX < lenY ? -1 : lenX > lenY;
+    }
+
+    if (lineSort.reverse) {
+        result = -result;
+    }
+
+    return result != 0 ? result : (x->idx < y->idx ? -1 : x->idx > y->idx);
+}
+
+/**
+ * @return how many workers share a range of rows, a power of two
+ */
+int transformWorkers(int64_t count) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = 1;
+
+    while (workers * 2 <= TRANSFORM_MAX_WORKERS && workers * 2 <= cpus &&
+           count / (workers * 2) >= TRANSFORM_MIN_ROWS) {
+        workers *= 2;
+    }
+
+    return workers;
+}
+
+/**
+ * Runs the jobs in threads of their own, the first one in this
+ * thread. A job whose thread could not start runs here too.
+ */
+void runJobs(void *(*work)(void *), struct TransformJob *jobs, int count) {
+    for (int w = 1; w < count; ++w) {
+        jobs[w].running = pthread_create(&jobs[w].thread, NULL, work, &jobs[w]) == 0;
+    }
+
+    work(&jobs[0]);
+
+    for (int w = 1; w < count; ++w) {
+        if (jobs[w].running) {
+            pthread_join(jobs[w].thread, NULL);
+        } else {
+            work(&jobs[w]);
+        }
+    }
+}
+
+void *sortWorker(void *arg) {
+    struct TransformJob *job = arg;
+    struct ColdReader reader = {0};
+
+    for (int64_t i = job->from; i < job->to; ++i) {
+        job->keys[i].prefix = rowSortPrefix(&reader, &lineSort.rows[i]);
+        job->keys[i].idx = i;
+    }
+
+    coldReaderFree(&reader);
+    qsort(&job->keys[job->from], (size_t) (job->to - job->from), sizeof(struct SortKey), compareSortKeys);
+    return NULL;
+}
+
+void *mergeWorker(void *arg) {
+    struct TransformJob *job = arg;
+    struct SortKey *in = job->keys;
+    int64_t i = job->from;
+    int64_t j = job->mid;
+    int64_t k = job->from;
+
+    while (i < job->mid && j < job->to) {
+        job->out[k++] = compareSortKeys(&in[j], &in[i]) < 0 ? in[j++] : in[i++];
+    }
+
+    memcpy(&job->out[k], &in[i], sizeof(struct SortKey) * (size_t) (job->mid - i));
+    k += job->mid - i;
+    memcpy(&job->out[k], &in[j], sizeof(struct SortKey) * (size_t) (job->to - j));
+
+    return NULL;
+}
+
+/**
+ * Rows of the keys tied so far, from start to the one before end
+ */
+struct TieRun {
+    int64_t start;
+    int64_t end;
+};
+
+// the keys compared whole, each read through its own reader
+struct ColdReader tieReaders[2];
+
+/**
+ * Two rows by their whole keys, the first one in the range first when they are equal
+ */
+int compareWholeKeys(const void *a, const void *b) {
+    const struct SortKey *x = a;
+    const struct SortKey *y = b;
+    int64_t lenX;
+    int64_t lenY;
+    const char *keyX = rowKey(&tieReaders[0], &lineSort.rows[x->idx], &lenX);
+    const char *keyY = rowKey(&tieReaders[1], &lineSort.rows[y->idx], &lenY);
+    int result = memcmp(keyX, keyY, (size_t) (lenX < lenY ? lenX : lenY));
+
+    result = result != 0 ? (result < 0 ? -1 : 1) : (lenX < lenY ? -1 : lenX > lenY);
+
+    if (lineSort.reverse) {
+        result = -result;
+    }
+
+    return result != 0 ? result : (x->idx < y->idx ? -1 : x->idx > y->idx);
+}
+
+/**
+ * @return 1 when a row of the run is cold
+ */
+int tieRunIsCold(struct SortKey *keys, struct TieRun *run) {
+    for (int64_t k = run->start; k < run->end; ++k) {
+        struct Row *row = &lineSort.rows[keys[k].idx];
+
+        if (!rowIsInline(row) && row->cold) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Sorts a run on the whole keys
+ */
+void tieRunSortWhole(struct SortKey *keys, struct TieRun *run, char *same) {
+    qsort(&keys[run->start], (size_t) (run->end - run->start), sizeof(struct SortKey), compareWholeKeys);
+
+    if (NULL == same) {
+        return;
+    }
+
+    for (int64_t k = run->start + 1; k < run->end; ++k) {
+        struct SortKey previous = keys[k - 1];
+
+        // equal keys are only told apart by their index
+        previous.idx = keys[k].idx;
+        same[k] = compareWholeKeys(&previous, &keys[k]) == 0;
+    }
+}
+
+/**
+ * Keys equal to each other in a run, first is the first of them
+ */
+struct TieGroup {
+    struct SortKey first; // first, it compares like the keys
+    int64_t start;
+    int64_t end;
+};
+
+/**
+ * Sorts a long run of cold rows whose keys are copies of a few, like the
+ * repeated lines of a log. The keys are read once, in the order of the
+ * rows, and grouped by their hash; the copies are then checked byte by
+ * byte against the first of their group and the groups sorted on their
+ * whole keys.
+ * @param keys the run in the order of the rows, as the prefixes left it
+ * @param chunk by row, takes the hashes of the keys
+ * @param len by row, takes the lengths of the keys
+ * @return 0 when the keys are not copies of a few, the run is left to the rounds
+ */
+int tieRunSortCopies(struct SortKey *keys, struct TieRun *run, char *same, struct ColdReader *reader,
+                     uint64_t *chunk, int64_t *len) {
+    int64_t numGroups = 1;
+
+    for (int64_t k = run->start; k < run->end; ++k) {
+        int64_t i = keys[k].idx;
+        const char *s = rowKey(reader, &lineSort.rows[i], &len[i]);
+
+        chunk[i] = hashBytes(s, (size_t) len[i]);
+    }
+
+    qsort(&keys[run->start], (size_t) (run->end - run->start), sizeof(struct SortKey), compareTiedKeys);
+
+    for (int64_t k = run->start + 1; k < run->end; ++k) {
+        int64_t i = keys[k].idx;
+        int64_t j = keys[k - 1].idx;
+
+        numGroups += chunk[i] != chunk[j] || len[i] != len[j];
+    }
+
+    // the groups are sorted on their whole keys, except for uniq which needs no order
+    if (numGroups > TIE_WHOLE_ROWS && lineSort.kind != SORT_HASH) {
+        return 0;
+    }
+
+    struct TieGroup *groups = malloc(sizeof(struct TieGroup) * (size_t) numGroups);
+    struct SortKey *sorted = malloc(sizeof(struct SortKey) * (size_t) (run->end - run->start));
+
+    if (NULL == groups || NULL == sorted) {
+        free(groups);
+        free(sorted);
+        return 0;
+    }
+
+    int64_t g = -1;
+
+    for (int64_t k = run->start; k < run->end; ++k) {
+        int64_t i = keys[k].idx;
+        int64_t lenFirst;
+        int64_t lenCopy;
+
+        if (g == -1 || chunk[i] != chunk[groups[g].first.idx] || len[i] != len[groups[g].first.idx]) {
+            groups[++g].first = keys[k];
+            groups[g].start = k;
+            groups[g].end = k + 1;
+            continue;
+        }
+
+        // the hashes can be equal for different keys
+        const char *first = rowKey(&tieReaders[0], &lineSort.rows[groups[g].first.idx], &lenFirst);
+        const char *copy = rowKey(&tieReaders[1], &lineSort.rows[i], &lenCopy);
+
+        if (lenFirst != lenCopy || memcmp(first, copy, (size_t) lenCopy) != 0) {
+            free(groups);
+            free(sorted);
+            return 0;
+        }
+
+        groups[g].end = k + 1;
+    }
+
+    if (lineSort.kind != SORT_HASH) {
+        qsort(groups, (size_t) numGroups, sizeof(struct TieGroup), compareWholeKeys);
+    }
+
+    int64_t at = 0;
+
+    for (g = 0; g < numGroups; ++g) {
+        for (int64_t k = groups[g].start; k < groups[g].end; ++k) {
+            if (same) {
+                same[run->start + at] = k > groups[g].start;
+            }
+
+            sorted[at++] = keys[k];
+        }
+    }
+
+    memcpy(&keys[run->start], sorted, sizeof(struct SortKey) * (size_t) (run->end - run->start));
+    free(groups);
+    free(sorted);
+    return 1;
+}
+
+int compareRowIndexes(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Orders the rows whose prefixes are equal. The runs of hot rows, and
+ * the short ones, are sorted on their whole keys, and so are the long
+ * runs of cold rows made of copies of a few keys. In the other long runs
+ * of cold rows the keys are read 8 bytes further each round, in the order
+ * of the rows so a block is decompressed once a round and the rows stay
+ * cold. Only the rows still tied are read again.
+ * @param keys sorted by their prefix
+ * @param same filled with 1 where a key is equal to the one before, can be NULL
+ * @return 0 when there was no memory
+ */
+int sortRowTies(struct SortKey *keys, int64_t count, char *same) {
+    size_t n = (size_t) (count > 0 ? count : 1);
+    uint64_t *chunk = malloc(sizeof(uint64_t) * n);
+    int64_t *len = malloc(sizeof(int64_t) * n);
+    int64_t *tiedRows = malloc(sizeof(int64_t) * n);
+    struct TieRun *runs = malloc(sizeof(struct TieRun) * (n / 2 + 1));
+    struct TieRun *nextRuns = malloc(sizeof(struct TieRun) * (n / 2 + 1));
+    struct ColdReader reader = {0};
+    int64_t numRuns = 0;
+
+    if (NULL == chunk || NULL == len || NULL == tiedRows || NULL == runs || NULL == nextRuns) {
+        free(chunk);
+        free(len);
+        free(tiedRows);
+        free(runs);
+        free(nextRuns);
+        return 0;
+    }
+
+    lineSort.chunk = chunk;
+    lineSort.len = len;
+
+    for (int64_t k = 0; k < count; ++k) {
+        if (same) {
+            same[k] = 0;
+        }
+
+        if (k > 0 && keys[k].prefix == keys[k - 1].prefix) {
+            if (numRuns > 0 && runs[numRuns - 1].end == k) {
+                runs[numRuns - 1].end = k + 1;
+            } else {
+                runs[numRuns].start = k - 1;
+                runs[numRuns++].end = k + 1;
+            }
+        }
+    }
+
+    // the prefix of a text key is its first 8 bytes, the others are compared from the start
+    int64_t firstOffset = lineSort.kind == SORT_TEXT ? 8 : 0;
+
+    for (int64_t offset = firstOffset; numRuns > 0; offset += 8) {
+        int64_t numLeft = 0;
+        int64_t numTied = 0;
+
+        for (int64_t r = 0; r < numRuns; ++r) {
+            if (runs[r].end - runs[r].start <= TIE_WHOLE_ROWS || !tieRunIsCold(keys, &runs[r])) {
+                tieRunSortWhole(keys, &runs[r], same);
+                continue;
+            }
+
+            if (offset == firstOffset && tieRunSortCopies(keys, &runs[r], same, &reader, chunk, len)) {
+                continue;
+            }
+
+            runs[numLeft++] = runs[r];
+
+            for (int64_t k = runs[r].start; k < runs[r].end; ++k) {
+                tiedRows[numTied++] = keys[k].idx;
+            }
+        }
+
+        qsort(tiedRows, (size_t) numTied, sizeof(int64_t), compareRowIndexes);
+
+        for (int64_t t = 0; t < numTied; ++t) {
+            int64_t i = tiedRows[t];
+            const char *s = rowKey(&reader, &lineSort.rows[i], &len[i]);
+
+            chunk[i] = keyChunk(s, len[i], offset);
+        }
+
+        int64_t numNext = 0;
+
+        for (int64_t r = 0; r < numLeft; ++r) {
+            qsort(&keys[runs[r].start], (size_t) (runs[r].end - runs[r].start), sizeof(struct SortKey),
+                  compareTiedKeys);
+
+            // a key that ends in this chunk is done, the ones still tied go on reading
+            for (int64_t k = runs[r].start + 1; k < runs[r].end; ++k) {
+                int64_t i = keys[k].idx;
+                int64_t j = keys[k - 1].idx;
+
+                if (chunk[i] != chunk[j] || (len[i] != len[j] && (len[i] <= offset + 8 || len[j] <= offset + 8))) {
+                    continue;
+                }
+
+                if (len[i] <= offset + 8) {
+                    if (same) {
+                        same[k] = 1;
+                    }
+                } else if (numNext > 0 && nextRuns[numNext - 1].end == k) {
+                    nextRuns[numNext - 1].end = k + 1;
+                } else {
+                    nextRuns[numNext].start = k - 1;
+                    nextRuns[numNext++].end = k + 1;
+                }
+            }
+        }
+
+        struct TieRun *done = runs;
+        runs = nextRuns;
+        nextRuns = done;
+        numRuns = numNext;
+    }
+
+    coldReaderFree(&reader);
+    coldReaderFree(&tieReaders[0]);
+    coldReaderFree(&tieReaders[1]);
+    lineSort.chunk = NULL;
+    lineSort.len = NULL;
+    free(chunk);
+    free(len);
+    free(tiedRows);
+    free(runs);
+    free(nextRuns);
+    return 1;
+}
+
+/**
+ * Sorts the rows of lineSort through their keys: each worker sorts
+ * its part by the prefixes, then the parts are merged two by two, the
+ * merges of a round in parallel. The ties are ordered at the end.
+ * @param same see sortRowTies
+ * @return the keys in order, NULL when there was no memory
+ */
+struct SortKey *sortRowKeys(int64_t count, char *same) {
+    int workers = transformWorkers(count);
+    struct SortKey *keys = malloc(sizeof(struct SortKey) * (size_t) count);
+    struct SortKey *out = workers > 1 ? malloc(sizeof(struct SortKey) * (size_t) count) : NULL;
+    struct TransformJob jobs[TRANSFORM_MAX_WORKERS];
+
+    if (NULL == keys || (workers > 1 && NULL == out)) {
+        free(keys);
+        free(out);
+        return NULL;
+    }
+
+    for (int w = 0; w < workers; ++w) {
+        jobs[w].from = count * w / workers;
+        jobs[w].to = count * (w + 1) / workers;
+        jobs[w].keys = keys;
+    }
+
+    runJobs(sortWorker, jobs, workers);
+
+    for (int width = 1; width < workers; width *= 2) {
+        int merges = 0;
+
+        for (int w = 0; w < workers; w += 2 * width) {
+            jobs[merges].from = count * w / workers;
+            jobs[merges].mid = count * (w + width) / workers;
+            jobs[merges].to = count * (w + 2 * width) / workers;
+            jobs[merges].keys = keys;
+            jobs[merges].out = out;
+            ++merges;
+        }
+
+        runJobs(mergeWorker, jobs, merges);
+
+        struct SortKey *merged = out;
+        out = keys;
+        keys = merged;
+    }
+
+    free(out);
+
+    if (!sortRowTies(keys, count, same)) {
+        free(keys);
+        return NULL;
+    }
+
+    return keys;
+}
+
+void *matchWorker(void *arg) {
+    struct TransformJob *job = arg;
+    struct ColdReader reader = {0};
+
+    for (int64_t i = job->from; i < job->to; ++i) {
+        int matches = regexec(&job->pattern, coldReaderChars(&reader, &lineSort.rows[i]), 0, NULL, 0) == 0;
+
+        job->keep[i] = (char) (matches != job->drop);
+    }
+
+    coldReaderFree(&reader);
+    return NULL;
+}
+
+/**
+ * Forgets the last transform, the rows it took out are freed
+ */
+void linesUndoClear() {
+    for (int64_t i = 0; i < linesUndo.numDropped; ++i) {
+        memRemoveRow(&editorMemory.undo, &linesUndo.dropped[i]);
+        rowFree(&linesUndo.dropped[i]);
+    }
+
+    memFree(&editorMemory.undo, linesUndo.order, sizeof(int64_t) * (size_t) (linesUndo.numAfter + 1));
+    memFree(&editorMemory.undo, linesUndo.dropped, sizeof(struct Row) * (size_t) linesUndo.numDropped);
+    memFree(&editorMemory.undo, linesUndo.droppedAt, sizeof(int64_t) * (size_t) linesUndo.numDropped);
+    memset(&linesUndo, 0, sizeof(struct LinesUndo));
+}
+
+/**
+ * A document is going away, the rows taken out of it go first
+ */
+void docForgetUndo(struct Document *doc) {
+    if (linesUndo.doc == doc) {
+        linesUndoClear();
+    }
+}
+
+/**
+ * Starts the undo of a transform on a range of rows
+ * @return the order of the rows, for the transform to fill
+ */
+int64_t *linesUndoStart(struct Document *doc, int64_t from, int64_t count, int64_t numAfter) {
+    linesUndoClear();
+
+    linesUndo.doc = doc;
+    linesUndo.from = from;
+    linesUndo.numBefore = count;
+    linesUndo.numAfter = numAfter;
+    linesUndo.order = memAlloc(&editorMemory.undo, sizeof(int64_t) * (size_t) (numAfter + 1));
+
+    if (NULL == linesUndo.order) {
+        fatal("Failed to remember the order of the rows (linesUndoStart)");
+        return NULL;
+    }
+
+    return linesUndo.order;
+}
+
+/**
+ * The rows changed places, the undo knows where they were
+ */
+void linesUndoDone(struct Document *doc) {
+    ++doc->changesCount;
+    linesUndo.changesCount = doc->changesCount;
+    docRowsReset(doc);
+}
+
+/**
+ * Puts the rows of a range in a new order, each moves once
+ * @param order the row of the range each row takes
+ */
+void rowsPermute(struct Row *rows, const int64_t *order, int64_t count) {
+    char *placed = calloc((size_t) (count > 0 ? count : 1), 1);
+
+    if (NULL == placed) {
+        fatal("Failed to move the rows (rowsPermute)");
+        return;
+    }
+
+    // the rows go around in cycles, the first one of a cycle waits aside
+    for (int64_t start = 0; start < count; ++start) {
+        if (placed[start]) {
+            continue;
+        }
+
+        struct Row first = rows[start];
+        int64_t at = start;
+
+        while (order[at] != start) {
+            rows[at] = rows[order[at]];
+            placed[at] = 1;
+            at = order[at];
+        }
+
+        rows[at] = first;
+        placed[at] = 1;
+    }
+
+    free(placed);
+}
+
+/**
+ * Sorts the rows of a range
+ */
+void docSortRows(struct Document *doc, int64_t from, int64_t to, enum SortKind kind, int reverse, int field) {
+    int64_t count = to - from;
+
+    lineSort.rows = &doc->rows[from];
+    lineSort.kind = kind;
+    lineSort.reverse = reverse;
+    lineSort.field = field;
+
+    struct SortKey *keys = sortRowKeys(count, NULL);
+
+    if (NULL == keys) {
+        fatal("Failed to sort the rows (docSortRows)");
+        return;
+    }
+
+    int64_t *order = linesUndoStart(doc, from, count, count);
+
+    for (int64_t i = 0; i < count; ++i) {
+        order[i] = keys[i].idx;
+    }
+
+    free(keys);
+    rowsPermute(&doc->rows[from], order, count);
+    linesUndoDone(doc);
+}
+
+/**
+ * Keeps some rows of a range, the others go to the undo
+ * @param keep 1 for each row that stays
+ */
+void docKeepRows(struct Document *doc, int64_t from, int64_t to, const char *keep) {
+    int64_t count = to - from;
+    int64_t kept = 0;
+
+    for (int64_t i = 0; i < count; ++i) {
+        kept += keep[i];
+    }
+
+    int64_t *order = linesUndoStart(doc, from, count, kept);
+    int64_t numDropped = count - kept;
+
+    linesUndo.dropped = memAlloc(&editorMemory.undo, sizeof(struct Row) * (size_t) numDropped);
+    linesUndo.droppedAt = memAlloc(&editorMemory.undo, sizeof(int64_t) * (size_t) numDropped);
+
+    if (numDropped > 0 && (NULL == linesUndo.dropped || NULL == linesUndo.droppedAt)) {
+        fatal("Failed to remember the rows taken out (docKeepRows)");
+        return;
+    }
+
+    struct Row *rows = &doc->rows[from];
+    int64_t k = 0;
+
+    for (int64_t i = 0; i < count; ++i) {
+        if (keep[i]) {
+            order[k] = i;
+            rows[k++] = rows[i];
+        } else {
+            memRemoveRow(&doc->rowMemory, &rows[i]);
+            linesUndo.dropped[linesUndo.numDropped] = rows[i];
+            linesUndo.droppedAt[linesUndo.numDropped++] = i;
+            memAddRow(&editorMemory.undo, &rows[i]);
+        }
+    }
+
+    memmove(&doc->rows[from + kept], &doc->rows[to], sizeof(struct Row) * (size_t) (doc->numRows - to));
+    doc->numRows -= numDropped;
+    linesUndoDone(doc);
+}
+
+/**
+ * Keeps the rows of a range that match a pattern, or the ones that do not
+ * @return 0 when the pattern is not a regular expression
+ */
+int docFilterRows(struct Document *doc, int64_t from, int64_t to, const char *pattern, int drop) {
+    int64_t count = to - from;
+    int workers = transformWorkers(count);
+    struct TransformJob jobs[TRANSFORM_MAX_WORKERS];
+
+    for (int w = 0; w < workers; ++w) {
+        if (regcomp(&jobs[w].pattern, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+            while (w-- > 0) {
+                regfree(&jobs[w].pattern);
+            }
+            return 0;
+        }
+    }
+
+    char *keep = malloc((size_t) (count > 0 ? count : 1));
+
+    if (NULL == keep) {
+        fatal("Failed to filter the rows (docFilterRows)");
+        return 0;
+    }
+
+    lineSort.rows = &doc->rows[from];
+
+    for (int w = 0; w < workers; ++w) {
+        jobs[w].from = count * w / workers;
+        jobs[w].to = count * (w + 1) / workers;
+        jobs[w].drop = drop;
+        jobs[w].keep = keep;
+    }
+
+    runJobs(matchWorker, jobs, workers);
+
+    for (int w = 0; w < workers; ++w) {
+        regfree(&jobs[w].pattern);
+    }
+
+    docKeepRows(doc, from, to, keep);
+    free(keep);
+    return 1;
+}
+
+/**
+ * Keeps the first of the equal rows of a range. The rows are sorted
+ * by their hash so the equal ones are next to each other.
+ */
+void docUniqueRows(struct Document *doc, int64_t from, int64_t to) {
+    int64_t count = to - from;
+
+    lineSort.rows = &doc->rows[from];
+    lineSort.kind = SORT_HASH;
+    lineSort.reverse = 0;
+    lineSort.field = 0;
+
+    char *same = malloc((size_t) (count > 0 ? count : 1));
+    char *keep = malloc((size_t) (count > 0 ? count : 1));
+    struct SortKey *keys = NULL == same ? NULL : sortRowKeys(count, same);
+
+    if (NULL == keys || NULL == keep) {
+        fatal("Failed to find the equal rows (docUniqueRows)");
+        return;
+    }
+
+    memset(keep, 1, (size_t) count);
+
+    for (int64_t i = 1; i < count; ++i) {
+        if (same[i]) {
+            keep[keys[i].idx] = 0;
+        }
+    }
+
+    free(keys);
+    free(same);
+    docKeepRows(doc, from, to, keep);
+    free(keep);
+}
+
+void docReverseRows(struct Document *doc, int64_t from, int64_t to) {
+    int64_t count = to - from;
+    int64_t *order = linesUndoStart(doc, from, count, count);
+
+    for (int64_t i = 0; i < count; ++i) {
+        order[i] = count - 1 - i;
+    }
+
+    for (int64_t i = from, j = to - 1; i < j; ++i, --j) {
+        struct Row row = doc->rows[i];
+        doc->rows[i] = doc->rows[j];
+        doc->rows[j] = row;
+    }
+
+    linesUndoDone(doc);
+}
+
+/**
+ * Puts back the rows of the last transform, if its document did not change since
+ */
+void linesUndoApply(struct Document *doc) {
+    if (linesUndo.doc != doc) {
+        snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (nothing to undo)");
+        return;
+    } else if (linesUndo.changesCount != doc->changesCount) {
+        snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage),
+                 " (the rows changed since, nothing to undo)");
+        return;
+    }
 
-    if (!tab) {
-        fatal("Missing tab (editorRowsToString)");
-        return NULL;
+    int64_t from = linesUndo.from;
+    int64_t numAfter = linesUndo.numAfter;
+    struct Row *kept = malloc(sizeof(struct Row) * (size_t) (numAfter > 0 ? numAfter : 1));
+
+    if (NULL == kept) {
+        fatal("Failed to put the rows back (linesUndoApply)");
+        return;
     }
 
+    memcpy(kept, &doc->rows[from], sizeof(struct Row) * (size_t) numAfter);
+    docReserveRows(doc, doc->numRows + linesUndo.numBefore - numAfter);
+    memmove(&doc->rows[from + linesUndo.numBefore], &doc->rows[from + numAfter],
+            sizeof(struct Row) * (size_t) (doc->numRows - from - numAfter));
+    doc->numRows += linesUndo.numBefore - numAfter;
 
-    int totalLen = 0;
-    int j;
-    for (j = 0; j < (tab->numRows); ++j) {
-        totalLen += tab->rows[j].rawSize + 1;
+    for (int64_t i = 0; i < numAfter; ++i) {
+        if (linesUndo.order[i] < 0) {
+            docFreeRow(doc, &kept[i]);
+        } else {
+            doc->rows[from + linesUndo.order[i]] = kept[i];
+        }
     }
 
-    *bufLen = totalLen;
+    for (int64_t i = 0; i < linesUndo.numDropped; ++i) {
+        struct Row *row = &doc->rows[from + linesUndo.droppedAt[i]];
 
-    char *buf = malloc((size_t) totalLen);
-    char *p = buf;
+        *row = linesUndo.dropped[i];
+        memRemoveRow(&editorMemory.undo, row);
+        memAddRow(&doc->rowMemory, row);
+    }
 
-    for (j = 0; j < (tab->numRows); ++j) {
-        memcpy(p, tab->rows[j].rawContent, (size_t) tab->rows[j].rawSize);
-        p += tab->rows[j].rawSize;
-        *p = '\n';
-        ++p;
+    free(kept);
+
+    // the rows are the document's again
+    memFree(&editorMemory.undo, linesUndo.dropped, sizeof(struct Row) * (size_t) linesUndo.numDropped);
+    memFree(&editorMemory.undo, linesUndo.droppedAt, sizeof(int64_t) * (size_t) linesUndo.numDropped);
+    linesUndo.dropped = NULL;
+    linesUndo.droppedAt = NULL;
+    linesUndo.numDropped = 0;
+    linesUndoClear();
+
+    ++doc->changesCount;
+    docRowsReset(doc);
+    snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (undone)");
+}
+
+/**
+ * The rows a transform works on: the ones of the selection, or all of them.
+ * A selection ending at the start of a row does not take that row.
+ */
+void transformRange(struct Document *doc, int64_t *from, int64_t *to) {
+    int64_t fromCol;
+    int64_t toRow;
+    int64_t toCol;
+
+    if (!selectionBounds(doc, from, &fromCol, &toRow, &toCol)) {
+        *from = 0;
+        *to = doc->numRows;
+        return;
     }
 
-    return buf;
+    *to = toRow + 1;
+
+    if (currentSession.selecting == LINEAR_SELECTION && toCol == 0 && toRow > *from) {
+        --*to;
+    }
 }
 
-void editorPrompt(char *msg, int msgLen);
+int docPipeRows(struct Document *doc, int64_t from, int64_t to, const char *command);
 
-void editorSave() {
+/**
+ * Runs a transform on the rows of the selection, or on all the rows:
+ * sort [-n] [-r] [-k field], uniq, keep pattern, drop pattern, reverse,
+ * | command (the rows go through a shell command), or undo for the last one
+ */
+void linesTransform(const char *command) {
+    struct Document *doc = getCurrentDoc();
+    int64_t from;
+    int64_t to;
+    uint64_t start = perfNow();
+    int64_t numRows = doc->numRows;
+
+    while (*command == ' ') {
+        ++command;
+    }
 
-    struct Tab *tab = getCurrentTab();
+    transformRange(doc, &from, &to);
 
-    if (NULL == tab) {
-        fatal("No current tab (editorSave)");
+    if (strncmp(command, "undo", 4) == 0) {
+        linesUndoApply(doc);
+    } else if (command[0] == '|') {
+        // without rows, what the command writes goes in at the cursor
+        if (!docPipeRows(doc, from, to, command + 1)) {
+            return;
+        }
+    } else if (to <= from) {
+        snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (no rows)");
+        return;
+    } else if (strncmp(command, "sort", 4) == 0) {
+        int numeric = strstr(command, "-n") != NULL;
+        int reverse = strstr(command, "-r") != NULL;
+        const char *field = strstr(command, "-k");
+
+        docSortRows(doc, from, to, numeric ? SORT_NUMBER : SORT_TEXT, reverse, field ? atoi(field + 2) : 0);
+    } else if (strncmp(command, "uniq", 4) == 0) {
+        docUniqueRows(doc, from, to);
+    } else if (strncmp(command, "reverse", 7) == 0) {
+        docReverseRows(doc, from, to);
+    } else if (strncmp(command, "keep ", 5) == 0 || strncmp(command, "drop ", 5) == 0) {
+        if (!docFilterRows(doc, from, to, command + 5, command[0] == 'd')) {
+            snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (bad pattern)");
+            return;
+        }
+    } else {
+        snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage),
+                 " (sort [-n] [-r] [-k field], uniq, keep pattern, drop pattern, reverse, | command or undo)");
         return;
     }
 
-    if (NULL == tab->fileName) {
-        const int msgLen = 46;
-        editorPrompt("Please enter a file name (or none to cancel): ", msgLen);
+    cursorsClear();
+    currentSession.selecting = NO_SELECTION;
 
-        int responseLength = currentSession.messageRow.rawSize - msgLen + 1;
+    if (currentSession.cursorRow > doc->numRows) {
+        currentSession.cursorRow = doc->numRows;
+    }
 
-        if (responseLength > 0) {
-            tab->fileName = malloc((size_t) sizeof(char) * responseLength);
+    if (currentSession.cursorRow < doc->numRows &&
+        currentSession.cursorCol > doc->rows[currentSession.cursorRow].rawSize) {
+        currentSession.cursorCol = doc->rows[currentSession.cursorRow].rawSize;
+    }
 
-            if (NULL == tab->fileName) {
-                fatal("Failed to malloc the length of the message filename required");
-                return;
+    if (currentSession.statusMessage[0] == '\0') {
+        snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage),
+                 " (%lld rows, %lld taken out, in %.0f ms)", (long long) (to - from),
+                 (long long) (numRows - doc->numRows), (double) (perfNow() - start) / 1e6);
+    }
+}
+
+/*** pipes ***/
+
+/**
+ * The rows going to a command, a bit at a time. The short rows are
+ * gathered in a buffer, the long ones go to the pipe from the row itself.
+ */
+struct PipeFeed {
+    struct Document *doc;
+    int64_t row; // the row being written
+    int64_t to;
+    int64_t offset; // the bytes of that row already written
+    int splice; // 0 once vmsplice did not work, everything is copied then
+    char *buf;
+    size_t len;
+    size_t done; // the bytes of buf already written
+    int64_t bytes; // all that was written
+};
+
+/**
+ * @return 1 when the pipe can take the bytes of the row as they are: they do not
+ * move until the row changes, and no row changes while a command runs. A cold
+ * row is only decompressed for a while, it is copied.
+ */
+int rowSpliceable(struct Row *row) {
+    return !rowIsInline(row) && NULL == row->cold && row->rawSize >= PIPE_SPLICE_MIN;
+}
+
+/**
+ * Fills the buffer with the next rows, it stops before a row that can be spliced
+ */
+void pipeFeedFill(struct PipeFeed *feed) {
+    feed->len = 0;
+    feed->done = 0;
+
+    while (feed->row < feed->to && feed->len < PIPE_BUFFER_SIZE) {
+        struct Row *row = &feed->doc->rows[feed->row];
+
+        if (feed->splice && feed->offset == 0 && rowSpliceable(row)) {
+            break;
+        }
+
+        size_t left = (size_t) (row->rawSize - feed->offset);
+        size_t room = PIPE_BUFFER_SIZE - feed->len;
+        size_t len = left < room ? left : room;
+
+        memcpy(feed->buf + feed->len, rowChars(row) + feed->offset, len);
+        feed->len += len;
+        feed->offset += (int64_t) len;
+
+        if (feed->offset == row->rawSize && feed->len < PIPE_BUFFER_SIZE) {
+            feed->buf[feed->len++] = '\n';
+            feed->offset = 0;
+            ++feed->row;
+        }
+    }
+}
+
+/**
+ * @return what pipeFeed returns when a write failed
+ */
+int pipeWriteFailed() {
+    if (errno == EAGAIN || errno == EINTR) {
+        return 0;
+    }
+
+    // the command does not read the rest (like head), that is not a failure
+    return errno == EPIPE ? 1 : -1;
+}
+
+/**
+ * Writes as much of the rows as the pipe takes without waiting
+ * @param fd the input of the command, non-blocking
+ * @return 1 when all the rows were written, or the command stopped reading them,
+ * -1 when the pipe failed, 0 when it is full
+ */
+int pipeFeed(struct PipeFeed *feed, int fd) {
+    for (;;) {
+        ssize_t written;
+
+        if (feed->done < feed->len) {
+            if ((written = write(fd, feed->buf + feed->done, feed->len - feed->done)) == -1) {
+                return pipeWriteFailed();
             }
 
-            tab->fileName = memcpy(
-                    tab->fileName,
-                    &currentSession.messageRow.rawContent[msgLen],
-                    (size_t) sizeof(char) * responseLength);
+            feed->done += (size_t) written;
+            feed->bytes += written;
+            continue;
+        }
 
-            if (NULL == tab->fileName) {
-                fatal("Failed to copy the content of the filename into the tab struct");
-                return;
+        if (feed->row == feed->to) {
+            return 1;
+        }
+
+        struct Row *row = &feed->doc->rows[feed->row];
+
+        if (feed->splice && feed->offset < row->rawSize && rowSpliceable(row)) {
+            struct iovec bytes = {rowChars(row) + feed->offset, (size_t) (row->rawSize - feed->offset)};
+
+            if ((written = vmsplice(fd, &bytes, 1, SPLICE_F_NONBLOCK)) >= 0) {
+                feed->offset += written;
+                feed->bytes += written;
+                continue;
+            } else if (errno != EINVAL && errno != ENOSYS) {
+                return pipeWriteFailed();
             }
 
-        } else {
-            return;
+            feed->splice = 0;
         }
+
+        pipeFeedFill(feed);
     }
+}
 
+/**
+ * Reads what the command wrote, the rows are made as the lines come in
+ * @param out the document the rows go to
+ * @param bytes counts what was read
+ * @return 0 at the end of the output, -1 when the pipe failed, 1 otherwise
+ */
+int pipeDrain(struct Document *out, int fd, char *buf, int64_t *bytes) {
+    // a few reads at most, the rows going in are not kept waiting
+    for (int reads = 0; reads < 16; ++reads) {
+        ssize_t lenRead = read(fd, buf, PIPE_BUFFER_SIZE);
+
+        if (lenRead == 0) {
+            return 0;
+        } else if (lenRead == -1) {
+            return errno == EAGAIN || errno == EINTR ? 1 : -1;
+        }
 
-    int len;
-    char *buf = editorRowsToString(&len);
+        docAppendBytes(out, buf, (size_t) lenRead);
+        *bytes += lenRead;
+    }
 
-    int fd = open(tab->fileName, O_RDWR | O_CREAT, 0644);
+    return 1;
+}
 
-    if (fd != -1) {
-        if (-1 != ftruncate(fd, len)) {
-            write(fd, buf, (size_t) len);
-        }
-        close(fd);
+/**
+ * Keeps the start of what the command wrote on its error output, for the status bar
+ * @return 0 at the end of it, 1 otherwise
+ */
+int pipeDrainErrors(int fd, char *message, size_t size) {
+    char buf[4096];
+    ssize_t lenRead;
+    size_t len = strlen(message);
+
+    while ((lenRead = read(fd, buf, sizeof(buf))) > 0) {
+        size_t taken = (size_t) lenRead < size - 1 - len ? (size_t) lenRead : size - 1 - len;
+
+        memcpy(message + len, buf, taken);
+        len += taken;
+        message[len] = '\0';
     }
-    free(buf);
+
+    return lenRead == -1 && (errno == EAGAIN || errno == EINTR);
 }
 
-static size_t tabSize = sizeof(struct Tab);
+/**
+ * Starts a shell command, its input, output and error output are pipes
+ * @param fds where our ends go: its input, its output, its error output
+ * @return its pid, -1 when it could not start
+ */
+pid_t pipeSpawn(const char *command, int fds[3]) {
+    int in[2];
+    int out[2];
+    int err[2];
 
-void createTab() {
-    const int currentTabCount = currentSession.numTabs;
+    if (pipe2(in, O_CLOEXEC) == -1) {
+        return -1;
+    } else if (pipe2(out, O_CLOEXEC) == -1) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    } else if (pipe2(err, O_CLOEXEC) == -1) {
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
 
-    currentSession.tabs = realloc(currentSession.tabs, tabSize * (currentTabCount + 1));
-    if (currentTabCount > 0) {
-        const int currentTabIdx = currentSession.currentTabIdx;
-        memmove(&currentSession.tabs[currentTabIdx + 2],
-                &currentSession.tabs[currentTabIdx + 1],
-                sizeof(struct Tab) * (currentTabCount - currentTabIdx - 1));
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        // a group of its own, stopping it stops what it started
+        setpgid(0, 0);
+        signal(SIGPIPE, SIG_DFL);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+        _exit(127);
     }
 
-    ++currentSession.numTabs;
-    ++currentSession.currentTabIdx;
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
 
-    struct Tab *currTab = getCurrentTab();
-    currTab->numRows = 0;
-    currTab->rows = NULL;
-    currTab->fileName = NULL;
-    currTab->changesCount = 0;
+    fds[0] = in[1];
+    fds[1] = out[0];
+    fds[2] = err[0];
+
+    for (int i = 0; i < 3; ++i) {
+        if (pid == -1) {
+            close(fds[i]);
+        } else {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        }
+    }
+
+    // fewer and bigger reads and writes, it does not matter if the size is refused
+    if (pid != -1) {
+        fcntl(fds[0], F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+        fcntl(fds[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+    }
+
+    return pid;
 }
 
-void closeTab() {
+/**
+ * Runs a shell command with the rows of a range as its input, and puts
+ * what it writes in their place. The rows go to it while what it wrote
+ * comes back, through pipes that only hold a bit of them, so a command
+ * that writes before it read everything does not block, and the rows
+ * are never all in a single buffer. The rows replaced go to the undo.
+ * Esc stops the command, and the rows stay as they were.
+ * @return 1 when the rows were replaced, 0 when the command failed (the status says why)
+ */
+int docPipeRows(struct Document *doc, int64_t from, int64_t to, const char *command) {
+    uint64_t start = perfNow();
 
-    const int currentTabCount = currentSession.numTabs;
-    const int currentTabIdx = currentSession.currentTabIdx;
+    while (*command == ' ') {
+        ++command;
+    }
 
-    size_t tabSize = sizeof(struct Tab);
+    if (*command == '\0') {
+        snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (no command)");
+        return 0;
+    }
 
-    if (currentTabIdx < (currentTabCount - 1)) {
-        memmove(&currentSession.tabs[currentTabIdx], &currentSession.tabs[currentTabIdx + 1],
-                tabSize * (currentTabCount - currentTabIdx - 1));
+    // a command that stops reading must not take us down with it
+    struct sigaction ignore = {0};
+    struct sigaction previous;
+
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &previous);
+
+    int fds[3];
+    pid_t pid = pipeSpawn(command, fds);
+
+    if (pid == -1) {
+        sigaction(SIGPIPE, &previous, NULL);
+        snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (cannot run %s)", command);
+        return 0;
     }
 
-    currentSession.tabs = realloc(currentSession.tabs, tabSize * (currentTabCount - 1));
+    struct PipeFeed feed = {.doc = doc, .row = from, .to = to, .splice = 1};
+    struct Document *out = docNew();
+    char *buf = malloc(PIPE_BUFFER_SIZE);
+    char errors[96] = "";
+    int64_t outBytes = 0;
+    int stopped = 0;
+    int failed = 0;
+    uint64_t shown = start;
 
-    if (currentTabIdx > 0) {
-        --currentSession.currentTabIdx;
+    feed.buf = malloc(PIPE_BUFFER_SIZE);
+    out->coldStorage = doc->coldStorage;
+
+    if (NULL == buf || NULL == feed.buf) {
+        fatal("Failed to allocate the pipe buffers (docPipeRows)");
+        return 0;
     }
 
-    if (currentSession.numTabs > 0) {
-        --currentSession.numTabs;
+    while (fds[1] != -1 || fds[2] != -1) {
+        struct pollfd polled[3];
+
+        for (int i = 0; i < 3; ++i) {
+            polled[i].fd = fds[i];
+            polled[i].events = i == 0 ? POLLOUT : POLLIN;
+            polled[i].revents = 0;
+        }
+
+        if (poll(polled, 3, PIPE_PROGRESS_MS) == -1 && errno != EINTR) {
+            failed = 1;
+            break;
+        }
+
+        int done[3] = {0, 0, 0};
+
+        if (polled[0].revents) {
+            int fed = pipeFeed(&feed, fds[0]);
+
+            failed |= fed == -1;
+            done[0] = fed != 0;
+        }
+
+        if (polled[1].revents) {
+            int drained = pipeDrain(out, fds[1], buf, &outBytes);
+
+            failed |= drained == -1;
+            done[1] = drained != 1;
+        }
+
+        if (polled[2].revents) {
+            done[2] = !pipeDrainErrors(fds[2], errors, sizeof(errors));
+        }
+
+        for (int i = 0; i < 3; ++i) {
+            if (done[i]) {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+
+        if (!stopped && popKeyIf('\x1b')) {
+            // it may not be in its group yet
+            if (kill(-pid, SIGTERM) == -1) {
+                kill(pid, SIGTERM);
+            }
+
+            stopped = 1;
+        }
+
+        if (perfNow() - shown >= PIPE_PROGRESS_MS * 1000000ULL) {
+            snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage),
+                     " (Esc stops it, %lld MB in, %lld MB out)", (long long) (feed.bytes >> 20),
+                     (long long) (outBytes >> 20));
+            editorRefreshScreen();
+            shown = perfNow();
+        }
     }
 
-    if (currentSession.numTabs == 0) {
-        currentSession.currentTabIdx = -1;
-        createTab();
+    for (int i = 0; i < 3; ++i) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
     }
-}
 
-void editorOpen(char *filename, int openInNewTab) {
+    int status = 0;
 
-    if (openInNewTab) {
-        createTab();
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
     }
 
-    struct Tab *currentTab = getCurrentTab();
+    sigaction(SIGPIPE, &previous, NULL);
+    free(buf);
+    free(feed.buf);
+
+    if (stopped || failed || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        docRelease(out);
 
-    if (NULL == currentTab) {
-        fatal("No current tab (editor open)");
-        return;
+        // its first line says enough
+        errors[strcspn(errors, "\n")] = '\0';
+
+        if (stopped) {
+            snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (stopped)");
+        } else if (errors[0]) {
+            snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (%s)", errors);
+        } else {
+            snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage), " (%s failed)", command);
+        }
+
+        return 0;
     }
 
-    FILE *fp = fopen(filename, "r");
+    // the rows of the range go to the undo, the rows the command wrote take their place
+    int64_t count = to - from;
+    int64_t numAfter = out->numRows;
+    int64_t *order = linesUndoStart(doc, from, count, numAfter);
 
-    if (!fp) {
-        fatal("fopen");
-        return;
-    } else {
-        currentTab->fileName = filename;
+    linesUndo.dropped = memAlloc(&editorMemory.undo, sizeof(struct Row) * (size_t) count);
+    linesUndo.droppedAt = memAlloc(&editorMemory.undo, sizeof(int64_t) * (size_t) count);
+
+    if (count > 0 && (NULL == linesUndo.dropped || NULL == linesUndo.droppedAt)) {
+        fatal("Failed to remember the rows replaced (docPipeRows)");
+        return 0;
     }
 
-    char *line = NULL;
-    ssize_t lineLen;
-    size_t lineCap = 0;
+    for (int64_t i = 0; i < count; ++i) {
+        struct Row *row = &doc->rows[from + i];
 
-    while ((lineLen = getline(&line, &lineCap, fp)) != -1) {
+        memRemoveRow(&doc->rowMemory, row);
+        memAddRow(&editorMemory.undo, row);
+        linesUndo.dropped[i] = *row;
+        linesUndo.droppedAt[i] = i;
+    }
 
-        if (lineLen > -1) {
-            while (lineLen > 0 && (line[lineLen - 1] == '\n' ||
-                                   line[lineLen - 1] == '\r')) {
-                lineLen--;
-            }
-            editorAppendRow(line, (size_t) lineLen);
-        }
+    linesUndo.numDropped = count;
+
+    for (int64_t i = 0; i < numAfter; ++i) {
+        order[i] = -1;
     }
 
-    free(line);
-    fclose(fp);
-}
+    docReserveRows(doc, doc->numRows - count + numAfter);
+    memmove(&doc->rows[from + numAfter], &doc->rows[to], sizeof(struct Row) * (size_t) (doc->numRows - to));
+    if (numAfter > 0) {
+        memcpy(&doc->rows[from], out->rows, sizeof(struct Row) * (size_t) numAfter);
+    }
+
+    doc->numRows += numAfter - count;
+
+    memMerge(&doc->rowMemory, &out->rowMemory);
+    docTakeArenas(doc, out);
+    out->numRows = 0;
+    docRelease(out);
+    linesUndoDone(doc);
 
+    snprintf(currentSession.statusMessage, sizeof(currentSession.statusMessage),
+             " (%lld rows in, %lld out, in %.0f ms)", (long long) count, (long long) numAfter,
+             (double) (perfNow() - start) / 1e6);
+    return 1;
+}
 
 /*** small string ***/
 
@@ -966,7 +10352,7 @@ struct SmallStr {
 
 void appendToStr(struct SmallStr *str, const char *s, int len) {
 
-    char *new = realloc(str->b, (size_t) (str->len + len));
+    char *new = memRealloc(&editorMemory.frame, str->b, (size_t) str->len, (size_t) (str->len + len));
 
     if (new == NULL) return;
 
@@ -978,31 +10364,128 @@ void appendToStr(struct SmallStr *str, const char *s, int len) {
 }
 
 void clearStr(struct SmallStr *str) {
-    free(str->b);
+    memFree(&editorMemory.frame, str->b, (size_t) str->len);
+}
+
+/**
+ * Appends bytes of a row as they can be shown: the characters that
+ * do not decode, and the C1 controls, become U+FFFD
+ */
+void appendDisplayBytes(struct SmallStr *str, const char *s, int64_t from, int64_t to) {
+    int64_t run = from;
+    int64_t i = from;
+
+    while (i < to) {
+        if (!(s[i] & 0x80)) {
+            ++i;
+            continue;
+        }
+
+        uint32_t cp;
+        int n = utf8Decode(s + i, to - i, &cp);
+
+        if ((cp == 0xFFFD && n == 1) || (cp >= 0x80 && cp < 0xA0)) {
+            appendToStr(str, s + run, (int) (i - run));
+            appendToStr(str, "\xEF\xBF\xBD", 3);
+            run = i + n;
+        }
+
+        i += n;
+    }
+
+    appendToStr(str, s + run, (int) (to - run));
+}
+
+void editorInit(int rows, int cols) {
+    currentSession.colOffset = 0;
+    currentSession.rowOffset = 0;
+    currentSession.subRowOffset = 0;
+    currentSession.softWrap = 0;
+    currentSession.showDiff = 0;
+
+    currentSession.cursorRow = 0;
+    currentSession.cursorCol = 0;
+
+    currentSession.numCursors = 0;
+    currentSession.cursorCap = 0;
+    currentSession.cursors = NULL;
+
+    currentSession.selecting = NO_SELECTION;
+
+    currentSession.currentTabIdx = -1;
+    currentSession.numTabs = 0;
+    currentSession.numDocs = 0;
+
+    currentSession.locked = 0;
+    currentSession.messageLength = 0;
+
+    env.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    char *budget = getenv("MITHRIL_MEMORY_BUDGET_MB");
+    char *after = getenv("MITHRIL_HIBERNATE_AFTER");
+    env.memoryBudget = (size_t) (budget ? atol(budget) : HIBERNATE_BUDGET_MB) << 20;
+    env.hibernateAfter = after ? atol(after) : HIBERNATE_AFTER_SECONDS;
+
+    char *coldMin = getenv("MITHRIL_COLD_MIN_MB");
+    env.coldMinSize = (off_t) (coldMin ? atol(coldMin) : COLD_MIN_MB) << 20;
+
+    char *indexMin = getenv("MITHRIL_INDEX_MIN_MB");
+    env.indexMinSize = (off_t) (indexMin ? atol(indexMin) : INDEX_MIN_MB) << 20;
+    env.indexDir = indexDirectory();
+
+    char *prefetch = getenv("MITHRIL_PREFETCH_TABS");
+    env.prefetchTabs = prefetch ? atoi(prefetch) : PREFETCH_TABS;
+
+    if (rows > 0 && cols > 0) {
+        env.screenRows = rows;
+        env.screenCols = cols;
+    } else if (getWindowSize(&env.screenRows, &env.screenCols) == -1) {
+        env.screenCols = 10;
+        env.screenRows = 10;
+    }
+
+    env.usableTextScreenRows = env.screenRows - 3;
+    env.usableTextScreenCols = env.screenCols;
+}
+
+void editorResize(int rows, int cols) {
+    if (rows <= 0 || cols <= 0) {
+        return;
+    }
+
+    // the wrapped rows see the new width in docWrap, and are counted from the screen again
+    env.screenRows = rows;
+    env.screenCols = cols;
+    env.usableTextScreenRows = env.screenRows - 3;
+    env.usableTextScreenCols = env.screenCols - diffGutterCols();
 }
 
-void init() {
-    currentSession.colOffset = 0;
-    currentSession.rowOffset = 0;
+// set by SIGWINCH, the idle ticks look at the new size
+volatile sig_atomic_t windowResized = 0;
 
-    currentSession.cursorRow = 0;
-    currentSession.cursorCol = 0;
+void onWindowResize(int sig) {
+    (void) sig;
+    windowResized = 1;
+}
 
-    currentSession.currentTabIdx = -1;
-    currentSession.numTabs = 0;
+/**
+ * @return 1 when the terminal changed size, the screen needs to be refreshed
+ */
+int editorPollResize() {
+    struct winsize ws;
 
-    currentSession.locked = 0;
-    currentSession.messageLength = 0;
+    if (!windowResized) {
+        return 0;
+    }
 
-    int *cols = &env.screenCols;
-    int *rows = &env.screenRows;
+    windowResized = 0;
 
-    if (getWindowSize(rows, cols) == -1) {
-        *cols = 10;
-        *rows = 10;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        return 0;
     }
 
-    env.usableTextScreenRows = *rows - 3;
+    editorResize(ws.ws_row, ws.ws_col);
+    return 1;
 }
 
 void disableRawMode() {
@@ -1029,7 +10512,8 @@ void setRawMode() {
     //disable the echo
     //disable the canonical mode
     //disable the ctrl-c
-    raw.c_lflag &= ~(ECHO | ICANON | ISIG);
+    //disable the ctrl-v, it would wait for the next key
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
     //minimum byte size before read can return
     raw.c_cc[VMIN] = 0;
     //maximum time to can elapse before read returns
@@ -1038,10 +10522,17 @@ void setRawMode() {
     //set the terms settings to the new ones
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         fatal("tcsetattr");
+
+    // the read wakes up at least every tenth of a second, no need to interrupt it
+    struct sigaction resize = {0};
+    resize.sa_handler = onWindowResize;
+    resize.sa_flags = SA_RESTART;
+    sigemptyset(&resize.sa_mask);
+    sigaction(SIGWINCH, &resize, NULL);
 }
 
 void setCursorAtStart() {
-    write(STDOUT_FILENO, "\x1b[H", 3); //resends the cursor at the top of the screen
+    editorWrite("\x1b[H", 3); //resends the cursor at the top of the screen
 }
 
 void clearAllLinesAndGoToStart(struct SmallStr *str) {
@@ -1067,27 +10558,50 @@ void editorDrawStatusBar(struct SmallStr *str) {
 
     char status[env.screenCols];
 
-    int row = currentSession.cursorRow + 1;
-    int col = currentSession.cursorCol + 1;
+    long long row = currentSession.cursorRow + 1;
+    long long col = cursorColumn() + 1;
 
     int currentTab = currentSession.currentTabIdx + 1;
     int totalTab = currentSession.numTabs;
 
-    struct Tab *tab = getCurrentTab();
+    struct Document *doc = getCurrentDoc();
+
+    char *fileName = doc->fileName;
+    char *note = "";
+    char cursorsNote[32];
+
+    if (currentSession.statusMessage[0]) {
+        note = currentSession.statusMessage;
+    } else if (doc->following) {
+        note = " (following)";
+    } else if (doc->changedOnDisk) {
+        note = " (changed on disk, Ctrl-R to reload)";
+    } else if (currentSession.selecting != NO_SELECTION && !currentSession.locked) {
+        note = currentSession.selecting == BLOCK_SELECTION ? " (selecting a block)" : " (selecting)";
+    } else if (currentSession.numCursors > 0) {
+        snprintf(cursorsNote, sizeof(cursorsNote), " (%lld cursors)", (long long) currentSession.numCursors + 1);
+        note = cursorsNote;
+    }
 
-    char *fileName = tab->fileName;
+    // with the performance overlay, what the tab uses comes first
+    char memory[128] = "";
+
+    if (perf.shown) {
+        docMemorySummary(memory, sizeof(memory), doc);
+    }
 
     int statusLen;
 
     if (NULL == fileName) {
         statusLen =
-                snprintf(status, sizeof(status), "Line %d, Column %d, Tab %d of %d, File never saved / new file",
-                         row, col, currentTab, totalTab);
+                snprintf(status, sizeof(status),
+                         "%sLine %lld, Column %lld, Tab %d of %d, File never saved / new file%s",
+                         memory, row, col, currentTab, totalTab, currentSession.statusMessage);
 
     } else {
         statusLen =
-                snprintf(status, sizeof(status), "Line %d, Column %d, Tab %d of %d, File %s",
-                         row, col, currentTab, totalTab, fileName);
+                snprintf(status, sizeof(status), "%sLine %lld, Column %lld, Tab %d of %d, File %s%s",
+                         memory, row, col, currentTab, totalTab, fileName, note);
     }
 
     if (statusLen > env.screenCols) {
@@ -1104,31 +10618,227 @@ void editorDrawStatusBar(struct SmallStr *str) {
     editorNormalColor(str);
 }
 
+/**
+ * Writes a duration with a unit that keeps it short
+ */
+int formatNanos(char *buf, size_t size, uint64_t nanos) {
+    if (nanos < 1000) {
+        return snprintf(buf, size, "%lluns", (unsigned long long) nanos);
+    } else if (nanos < 1000000) {
+        return snprintf(buf, size, "%.1fus", nanos / 1000.0);
+    }
+
+    return snprintf(buf, size, "%.1fms", nanos / 1000000.0);
+}
+
+/**
+ * The performance overlay: what the last frame cost,
+ * and the average of the last edits of each kind
+ */
+void editorDrawPerf(struct SmallStr *str) {
+    static const char *names[NUM_EDIT_OPERATIONS] = {"ins", "nl", "bs", "del"};
+
+    char line[256];
+    char latency[16];
+    char build[16];
+
+    formatNanos(latency, sizeof(latency), __atomic_load_n(&perf.inputToPaint, __ATOMIC_RELAXED));
+    formatNanos(build, sizeof(build), perf.frameBuild);
+
+    int len = snprintf(line, sizeof(line), "paint %s build %s %zuB %lusys %lualloc |",
+                       latency, build, perf.frameBytes, perf.frameSyscalls, perf.frameAllocations);
+
+    for (int op = 0; op < NUM_EDIT_OPERATIONS; ++op) {
+        int count = perf.editCount[op] < PERF_WINDOW ? perf.editCount[op] : PERF_WINDOW;
+
+        if (count == 0) {
+            continue;
+        }
+
+        uint64_t total = 0;
+
+        for (int i = 0; i < count; ++i) {
+            total += perf.editNanos[op][i];
+        }
+
+        char average[16];
+        formatNanos(average, sizeof(average), total / (uint64_t) count);
+        len += snprintf(line + len, sizeof(line) - (size_t) len, " %s %s", names[op], average);
+    }
+
+    if (len > env.screenCols) {
+        len = env.screenCols;
+    }
+
+    appendToStr(str, line, len);
+}
+
 void editorDrawStatusRow(struct SmallStr *str) {
 
-    struct Row row = currentSession.messageRow;
+    struct Row *row = &currentSession.messageRow;
 
     if (currentSession.locked) {
-        appendToStr(str, (row.rawContent + currentSession.colOffset), row.rawSize);
+        appendDisplayBytes(str, rowChars(row), 0, row->rawSize);
+    } else if (perf.shown) {
+        editorDrawPerf(str);
     }
 
     eraseLineFromCursor(str);
     appendToStr(str, "\r\n", 2);
 }
 
+// the escapes of the highlight types, all as long
+const char *highlightColors[] = {"\x1b[39m", "\x1b[36m", "\x1b[33m", "\x1b[32m", "\x1b[35m", "\x1b[31m"};
+
+/**
+ * Draws the visible part of a row in its colours, a colour
+ * escape only goes out where the type changes
+ * @param chars the bytes of the row
+ * @param from the first byte on screen
+ * @param len how many bytes are on screen
+ * @param ascii the bytes are all ASCII, nothing to check
+ */
+void drawHighlightedRow(struct SmallStr *str, const char *chars, int64_t from, int64_t len, struct HighlightRow *hl,
+                        int ascii) {
+    // the first run on screen
+    int lo = 0;
+    int hi = hl->numSpans;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (hl->spans[mid].end <= from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    unsigned char current = HL_NORMAL;
+    int64_t at = from;
+
+    for (int k = lo; k < hl->numSpans && at < from + len; ++k) {
+        int64_t end = hl->spans[k].end < from + len ? hl->spans[k].end : from + len;
+
+        // an escape in the middle of a character would break it
+        while (!ascii && end < from + len && (chars[end] & 0xC0) == 0x80) {
+            ++end;
+        }
+
+        if (end <= at) {
+            continue;
+        }
+
+        if (hl->spans[k].type != current) {
+            current = hl->spans[k].type;
+            appendToStr(str, highlightColors[current], 5);
+        }
+
+        if (ascii) {
+            appendToStr(str, chars + at, (int) (end - at));
+        } else {
+            appendDisplayBytes(str, chars, at, end);
+        }
+
+        at = end;
+    }
+
+    if (current != HL_NORMAL) {
+        appendToStr(str, highlightColors[HL_NORMAL], 5);
+    }
+}
+
+/**
+ * Draws the columns of a row that are on screen, a wide
+ * character cut by an edge of the screen leaves blanks
+ * @param colOffset the first column drawn
+ * @param width how many are drawn
+ * @param hl the colours, NULL for none
+ */
+void drawRow(struct SmallStr *str, const char *chars, struct ColumnMap *map, int64_t colOffset, int64_t width,
+             struct HighlightRow *hl) {
+    int64_t firstCol;
+    int64_t lastCol;
+    int64_t endCol = colOffset + width;
+    int64_t from = byteOfColumn(map, chars, colOffset, &firstCol);
+    int64_t to = byteOfColumn(map, chars, endCol, &lastCol);
+
+    if (firstCol < colOffset) {
+        from = nextCharEnd(chars, map->rawSize, from);
+        firstCol = columnOfByte(map, chars, from);
+    }
+
+    for (int64_t col = colOffset; col < firstCol && col < endCol; ++col) {
+        appendToStr(str, " ", 1);
+    }
+
+    if (from < to) {
+        if (hl) {
+            drawHighlightedRow(str, chars, from, to - from, hl, map->ascii);
+        } else if (map->ascii) {
+            appendToStr(str, chars + from, (int) (to - from));
+        } else {
+            appendDisplayBytes(str, chars, from, to);
+        }
+    }
+
+    for (int64_t col = lastCol; to < map->rawSize && col < endCol; ++col) {
+        appendToStr(str, " ", 1);
+    }
+}
+
+/**
+ * Draws the gutter left of a screen line
+ */
+void drawDiffGutter(struct SmallStr *str, enum DiffMark mark) {
+    static const char *marks[] = {" ", "\x1b[32m+", "\x1b[33m~", "\x1b[31m-", "\x1b[31m_"};
+
+    appendToStr(str, marks[mark], (int) strlen(marks[mark]));
+
+    if (mark != DIFF_SAME) {
+        appendToStr(str, "\x1b[39m", 5);
+    }
+
+    for (int i = 1; i < DIFF_GUTTER_COLS; ++i) {
+        appendToStr(str, " ", 1);
+    }
+}
+
 void editorDrawRows(struct SmallStr *str) {
 
-    struct Tab *tab = getCurrentTab();
+    struct Document *doc = getCurrentDoc();
 
-    if (!tab) {
+    if (!doc) {
         fatal("No tab (editorDrawRow");
         return;
     }
 
+    docHighlightPrepare(doc, currentSession.rowOffset);
+
+    // far down a file not lexed yet, we guess until the idle ticks get there
+    unsigned char state = LEX_NORMAL;
+
+    if (currentSession.rowOffset > 0 && currentSession.rowOffset <= doc->hlValidRows) {
+        state = doc->rows[currentSession.rowOffset - 1].hlState;
+    }
+
+    // when the rows wrap, a row goes on as many screen lines as it needs
+    struct WrapLayout *wrap = currentSession.softWrap ? docWrap(doc) : NULL;
+    int64_t fileRow = currentSession.rowOffset;
+    int64_t sub = wrap ? currentSession.subRowOffset : 0;
+    struct HighlightRow *hl = NULL;
+
+    // the gutter shows how the rows differ from the file
+    struct DiffView *diff = currentSession.showDiff ? docDiff(doc) : NULL;
+
     for (int y = 0; y < env.usableTextScreenRows; ++y) {
-        int fileRow = y + currentSession.rowOffset;
-        if (fileRow >= tab->numRows) {
-            if ((tab->numRows == 0) && (y == (env.usableTextScreenRows / 3) + 1)) {
+        if (currentSession.showDiff) {
+            int firstLine = fileRow < doc->numRows && sub == 0;
+            drawDiffGutter(str, diff && firstLine ? diffMark(diff, fileRow) : DIFF_SAME);
+        }
+
+        if (fileRow >= doc->numRows) {
+            if ((doc->numRows == 0) && (y == (env.usableTextScreenRows / 3) + 1)) {
 
                 char welcome[80];
                 int welcomeLen = snprintf(welcome, sizeof(welcome), "-- Mithril -- version %s", VERSION);
@@ -1153,21 +10863,29 @@ void editorDrawRows(struct SmallStr *str) {
                 appendToStr(str, "~", 1);
             }
         } else {
-            int len = tab->rows[fileRow].rawSize;
-            len = len - currentSession.colOffset;
-            //make sure the len is never more than what we actually can display
-            //if we have a col offset of 5 on a len 10 sentence
-            //we want to start at the 5th char
-            //but we only want to display 5 chars, not the 10
-            if (len < 0) {
-                len = 0;
+            if (y == 0 || sub == 0) {
+                hl = doc->syntax ? docHighlightRow(doc, fileRow, state) : NULL;
             }
 
-            if (len > env.screenCols) {
-                len = env.screenCols;
+            struct ColumnMap *map = docColumnMap(doc, fileRow);
+            int64_t colOffset = currentSession.colOffset;
+            int64_t width = env.usableTextScreenCols;
+            int64_t end;
+
+            if (wrap) {
+                wrapWalk(map, wrap->width, sub, INT64_MAX, &colOffset, &end);
+                width = end - colOffset;
             }
 
-            appendToStr(str, (tab->rows[fileRow].rawContent + currentSession.colOffset), len);
+            drawRow(str, rowChars(&doc->rows[fileRow]), map, colOffset, width, hl && !hl->plain ? hl : NULL);
+
+            if (wrap && ++sub < docWrapLines(doc, fileRow)) {
+                // the same row on the next screen line
+            } else {
+                state = hl ? hl->endState : LEX_NORMAL;
+                ++fileRow;
+                sub = 0;
+            }
         }
 
 
@@ -1179,8 +10897,131 @@ void editorDrawRows(struct SmallStr *str) {
     appendToStr(str, "\r\n", 2);
 }
 
+/**
+ * Draws the other cursors that are on screen over the rows, in inverse video
+ */
+void editorDrawCursors(struct SmallStr *str) {
+    struct Document *doc = getCurrentDoc();
+    struct WrapLayout *wrap = currentSession.softWrap ? docWrap(doc) : NULL;
+    int64_t top = wrap ? wrapLinesBefore(wrap, currentSession.rowOffset) + currentSession.subRowOffset : 0;
+
+    for (int64_t i = cursorsSearch(currentSession.rowOffset, 0); i < currentSession.numCursors; ++i) {
+        struct Cursor *cursor = &currentSession.cursors[i];
+
+        // a row takes at least a screen line
+        if (cursor->row >= doc->numRows || cursor->row >= currentSession.rowOffset + env.usableTextScreenRows) {
+            break;
+        }
+
+        struct Row *row = &doc->rows[cursor->row];
+        int64_t at = cursor->col < row->rawSize ? cursor->col : row->rawSize;
+        int64_t y = cursor->row - currentSession.rowOffset;
+        int64_t x;
+
+        if (wrap) {
+            docWrapLines(doc, cursor->row);
+        }
+
+        struct ColumnMap *map = docColumnMap(doc, cursor->row);
+        const char *chars = rowChars(row);
+        int64_t col = columnOfByte(map, chars, at);
+
+        if (wrap) {
+            int64_t start = 0;
+            int64_t end;
+            int64_t sub = wrapWalk(map, wrap->width, -1, col, &start, &end);
+
+            y = wrapLinesBefore(wrap, cursor->row) + sub - top;
+            x = col - start < wrap->width ? col - start : wrap->width - 1;
+        } else {
+            x = col - currentSession.colOffset;
+        }
+
+        if (y < 0 || y >= env.usableTextScreenRows || x < 0 || x >= env.usableTextScreenCols) {
+            continue;
+        }
+
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int) y + 1, (int) x + diffGutterCols() + 1);
+
+        appendToStr(str, buf, len);
+        editorInvertColor(str);
+
+        if (at < row->rawSize) {
+            appendDisplayBytes(str, chars, at, nextCharEnd(chars, row->rawSize, at));
+        } else {
+            appendToStr(str, " ", 1);
+        }
+
+        editorNormalColor(str);
+    }
+}
+
+int selectionBounds(struct Document *doc, int64_t *fromRow, int64_t *fromCol, int64_t *toRow, int64_t *toCol);
+
+/**
+ * Draws the selected part of the rows on screen again, in inverse video
+ */
+void editorDrawSelection(struct SmallStr *str) {
+    struct Document *doc = getCurrentDoc();
+    int64_t fromRow;
+    int64_t fromCol;
+    int64_t toRow;
+    int64_t toCol;
+
+    if (!selectionBounds(doc, &fromRow, &fromCol, &toRow, &toCol)) {
+        return;
+    }
+
+    struct WrapLayout *wrap = currentSession.softWrap ? docWrap(doc) : NULL;
+    int64_t fileRow = currentSession.rowOffset;
+    int64_t sub = wrap ? currentSession.subRowOffset : 0;
+
+    for (int y = 0; y < env.usableTextScreenRows && fileRow < doc->numRows && fileRow <= toRow; ++y) {
+        struct ColumnMap *map = docColumnMap(doc, fileRow);
+        const char *chars = rowChars(&doc->rows[fileRow]);
+        int64_t start = currentSession.colOffset;
+        int64_t end = start + env.usableTextScreenCols;
+
+        if (wrap) {
+            wrapWalk(map, wrap->width, sub, INT64_MAX, &start, &end);
+        }
+
+        // the columns of the row that are selected
+        int64_t from = fromCol;
+        int64_t to = toCol;
+
+        if (currentSession.selecting == LINEAR_SELECTION) {
+            from = fileRow == fromRow ? columnOfByte(map, chars, fromCol) : 0;
+            to = fileRow == toRow ? columnOfByte(map, chars, toCol) : map->numCols;
+        }
+
+        from = from > start ? from : start;
+        to = to < end ? to : end;
+
+        if (fileRow >= fromRow && from < to) {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, (int) (from - start) + diffGutterCols() + 1);
+
+            appendToStr(str, buf, len);
+            editorInvertColor(str);
+            drawRow(str, chars, map, from, to - from, NULL);
+            editorNormalColor(str);
+        }
+
+        if (wrap && ++sub < docWrapLines(doc, fileRow)) {
+            // the same row on the next screen line
+        } else {
+            ++fileRow;
+            sub = 0;
+        }
+    }
+}
+
 void editorRefreshScreen() {
 
+    uint64_t start = perfNow();
+
     editorScroll();
 
     struct SmallStr str = SMALLSTR_INIT;
@@ -1191,18 +11032,25 @@ void editorRefreshScreen() {
     editorDrawRows(&str);
     editorDrawStatusRow(&str);
     editorDrawStatusBar(&str);
+    editorDrawSelection(&str);
+    editorDrawCursors(&str);
 
 
     char buf[32];
 
     if (currentSession.locked) {
         snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
-                 (currentSession.cursorRow) + 1,// - currentSession.rowOffset
-                 (currentSession.cursorCol) + 1);// - currentSession.colOffset
+                 (int) (currentSession.cursorRow) + 1,// - currentSession.rowOffset
+                 (int) cursorColumn() + 1);// - currentSession.colOffset
+    } else if (currentSession.softWrap) {
+        int64_t x;
+        int64_t y = wrapCursorY(getCurrentDoc(), &x);
+
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int) y + 1, (int) x + diffGutterCols() + 1);
     } else {
         snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
-                 (currentSession.cursorRow - currentSession.rowOffset) + 1,
-                 (currentSession.cursorCol - currentSession.colOffset) + 1);
+                 (int) (currentSession.cursorRow - currentSession.rowOffset) + 1,
+                 (int) (cursorColumn() - currentSession.colOffset) + diffGutterCols() + 1);
     }
 
 
@@ -1212,8 +11060,28 @@ void editorRefreshScreen() {
     // appendToStr(&str, "\x1b[H", 3);
     appendToStr(&str, "\x1b[?25h", 6);
 
-    write(STDOUT_FILENO, str.b, (size_t) str.len);
-    clearStr(&str);
+    perf.frameBuild = perfNow() - start;
+    perf.frameBytes = (size_t) str.len;
+
+    // the render thread frees it, it is not the frame being built anymore
+    memCount(&editorMemory.frame, str.b, (size_t) str.len, -1);
+
+    if (publishFrame(str.b, (size_t) str.len, perf.keyNanos)) {
+        // the render thread measures it once the frame is written
+        perf.keyNanos = 0;
+    } else {
+        editorWrite(str.b, (size_t) str.len);
+        free(str.b);
+    }
+
+    // what the frame cost, the overlay shows it on the next one
+    if (perf.keyNanos) {
+        perf.inputToPaint = perfNow() - perf.keyNanos;
+        perf.keyNanos = 0;
+    }
+
+    perf.frameSyscalls = __atomic_exchange_n(&perf.syscalls, 0, __ATOMIC_RELAXED);
+    perf.frameAllocations = __atomic_exchange_n(&perf.allocations, 0, __ATOMIC_RELAXED);
 }
 
 
@@ -1234,11 +11102,12 @@ void moveToEndOfLine() {
 
 void snapAtEndIfPast() {
     struct Row *row = getCurrentRow();
+    struct ColumnMap *map = currentColumnMap();
 
-    if (row && ((currentSession.cursorCol > row->rawSize) || (currentSession.colOffset > row->rawSize))) {
+    if (row && ((currentSession.cursorCol > row->rawSize) || (currentSession.colOffset > map->numCols))) {
         currentSession.cursorCol = row->rawSize;
 
-        if (row->rawSize < env.screenCols) {
+        if (map->numCols < env.usableTextScreenCols) {
             currentSession.colOffset = 0;
         } else {
             editorScroll();
@@ -1252,30 +11121,40 @@ void snapAtEndIfPast() {
 
 void editorCursorMove(int code) {
 
-    struct Tab *currentTab = getCurrentTab();
+    struct Document *doc = getCurrentDoc();
 
-    if (!currentTab) return;
+    if (!doc) return;
 
     struct Row *row = getCurrentRow();
 
     if (currentSession.locked) return;
 
+    // up and down go by screen lines when the rows wrap
+    if (currentSession.softWrap && (code == ARROW_UP || code == ARROW_DOWN)) {
+        wrapMoveLines(code == ARROW_UP ? -1 : 1);
+        return;
+    }
+
     switch (code) {
         case ARROW_UP:
             if (currentSession.cursorRow > 0) {
+                int64_t col = cursorColumn();
                 currentSession.cursorRow--;
+                cursorToColumn(col);
                 snapAtEndIfPast();
             }
             break;
         case ARROW_DOWN:
-            if (currentSession.cursorRow < (currentTab->numRows)) {
+            if (currentSession.cursorRow < (doc->numRows)) {
+                int64_t col = cursorColumn();
                 currentSession.cursorRow++;
+                cursorToColumn(col);
                 snapAtEndIfPast();
             }
             break;
         case ARROW_LEFT:
             if (currentSession.cursorCol > 0) {
-                currentSession.cursorCol--;
+                currentSession.cursorCol = prevCharStart(rowChars(row), row->rawSize, currentSession.cursorCol);
             } else if (currentSession.cursorRow > 0) {
                 --currentSession.cursorRow;
                 moveToEndOfLine();
@@ -1283,8 +11162,8 @@ void editorCursorMove(int code) {
             break;
         case ARROW_RIGHT:
             if (row && currentSession.cursorCol < row->rawSize) {
-                currentSession.cursorCol++;
-            } else if (currentSession.cursorRow + currentSession.rowOffset < (currentTab->numRows - 1)) {
+                currentSession.cursorCol = nextCharEnd(rowChars(row), row->rawSize, currentSession.cursorCol);
+            } else if (currentSession.cursorRow + currentSession.rowOffset < (doc->numRows - 1)) {
                 ++currentSession.cursorRow;
                 moveToBeginningOfLine();
             }
@@ -1296,8 +11175,44 @@ void editorCursorMove(int code) {
 
 void openFile();
 
-void processKeyPress() {
-    int c = readKey();
+void goToLine();
+
+void addCursorsAtMatches();
+
+void transformLines();
+
+/**
+ * @return which kind of edit a key does, for the performance overlay
+ */
+enum EditOperation editOperationOf(int c) {
+    if (currentSession.locked) {
+        return EDIT_NONE;
+    }
+
+    switch (c) {
+        case '\n':
+            return EDIT_NEWLINE;
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+            return EDIT_BACKSPACE;
+        case DEL_KEY:
+            return EDIT_DELETE;
+        default:
+            return (c == '\t' || (c >= ' ' && c < BACKSPACE)) ? EDIT_INSERT : EDIT_NONE;
+    }
+}
+
+void editorProcessKey(int c) {
+
+    enum EditOperation op = editOperationOf(c);
+    uint64_t start = perfNow();
+
+    currentSession.statusMessage[0] = '\0';
+
+    // typing ends the selection
+    if (op != EDIT_NONE) {
+        currentSession.selecting = NO_SELECTION;
+    }
 
     switch (c) {
         case '\r':
@@ -1311,9 +11226,11 @@ void processKeyPress() {
             }
             break;
         case CTRL_KEY('q'): {
+            editorPaintWait();
+
             struct SmallStr str = SMALLSTR_INIT;
             clearAllLinesAndGoToStart(&str);
-            write(STDOUT_FILENO, str.b, (size_t) str.len);
+            editorWrite(str.b, (size_t) str.len);
             clearStr(&str);
             exit(0);
         }
@@ -1326,9 +11243,15 @@ void processKeyPress() {
         case ARROW_LEFT:
         case ARROW_RIGHT:
             editorCursorMove(c);
+            cursorsMove(c);
             break;
         case PG_UP:
         case PG_DOWN: {
+            if (currentSession.softWrap && !currentSession.locked) {
+                wrapMoveLines(c == PG_UP ? -env.usableTextScreenRows : env.usableTextScreenRows);
+                break;
+            }
+
             int times = env.usableTextScreenRows;
             while ((times--) > 0) {
                 editorCursorMove((c == PG_UP) ? ARROW_UP : ARROW_DOWN);
@@ -1337,10 +11260,12 @@ void processKeyPress() {
             break;
         case HOME_KEY: {
             moveToBeginningOfLine();
+            cursorsMove(c);
         }
             break;
         case END_KEY: {
             moveToEndOfLine();
+            cursorsMove(c);
         }
             break;
         case BACKSPACE:
@@ -1352,7 +11277,11 @@ void processKeyPress() {
         }
             break;
         case CTRL_KEY('l'):
+            break;
+
         case '\x1b':
+            cursorsClear();
+            currentSession.selecting = NO_SELECTION;
             break;
 
         case CTRL_KEY('s'): {
@@ -1375,34 +11304,102 @@ void processKeyPress() {
         }
             break;
 
+        case CTRL_KEY('f') : {
+            toggleFollow();
+        }
+            break;
+
+        case CTRL_KEY('r') : {
+            reloadCurrentDoc();
+        }
+            break;
+
         case MOVE_TAB_LEFT:
-            if (currentSession.currentTabIdx > 0) {
-                --currentSession.currentTabIdx;
-            }
+            editorSwitchTab(currentSession.currentTabIdx - 1);
             break;
         case MOVE_TAB_RIGHT:
-            if (currentSession.currentTabIdx + 1 < currentSession.numTabs) {
-                ++currentSession.currentTabIdx;
-            }
+            editorSwitchTab(currentSession.currentTabIdx + 1);
+            break;
+
+        case CTRL_KEY('p'):
+            perf.shown = !perf.shown;
+            break;
+
+        case CTRL_KEY('u'):
+            dumpMemory();
+            break;
+
+        case CTRL_KEY('e'):
+            toggleSoftWrap();
+            break;
+
+        case CTRL_KEY('y'):
+            toggleDiff();
+            break;
+
+        case CTRL_KEY('g'):
+            goToLine();
+            break;
+
+        case CTRL_KEY('n'):
+            cursorAddBelow();
+            break;
+
+        case CTRL_KEY('d'):
+            cursorAddNextMatch();
+            break;
+
+        case CTRL_KEY('a'):
+            addCursorsAtMatches();
+            break;
+
+        case CTRL_KEY('b'):
+            toggleSelection();
+            break;
+
+        case CTRL_KEY('c'):
+            copySelection(0);
+            break;
+
+        case CTRL_KEY('x'):
+            copySelection(1);
+            break;
+
+        case CTRL_KEY('v'):
+            editorPaste();
+            break;
+
+        case CTRL_KEY('k'):
+            transformLines();
             break;
 
         default:
             editorInsertChar(c);
             break;
     }
+
+    if (op != EDIT_NONE) {
+        perf.editNanos[op][perf.editCount[op]++ % PERF_WINDOW] = perfNow() - start;
+    }
+}
+
+void processKeyPress() {
+    editorProcessKey(readKey());
 }
 
 void editorPrompt(char *msg, int msgLen) {
 
     struct Row *messageRow = &currentSession.messageRow;
 
-    int previousRow = currentSession.cursorRow;
-    int previousCol = currentSession.cursorCol;
+    int64_t previousRow = currentSession.cursorRow;
+    int64_t previousCol = currentSession.cursorCol;
 
-    messageRow->rawContent = realloc(messageRow->rawContent, (size_t) msgLen + 1);
+    memRemoveRow(&editorMemory.message, messageRow);
+    char *chars = rowResize(messageRow, msgLen);
     messageRow->rawSize = msgLen;
-    memcpy(messageRow->rawContent, msg, (size_t) msgLen);
-    messageRow->rawContent[msgLen] = '\0';
+    memcpy(chars, msg, (size_t) msgLen);
+    chars[msgLen] = '\0';
+    memAddRow(&editorMemory.message, messageRow);
 
     currentSession.cursorRow = env.screenRows - 2;
     currentSession.cursorCol = msgLen;
@@ -1428,7 +11425,7 @@ void openFile() {
     /*
     editorPrompt("Open in current file (y/n/c): ", 30);
     if ((currentSession.messageRow.rawSize - 30) > 0) {
-        char c = currentSession.messageRow.rawContent[30];
+        char c = rowChars(&currentSession.messageRow)[30];
 
         int openInOtherTab;
 
@@ -1442,31 +11439,57 @@ void openFile() {
 
     editorPrompt("Please enter a file name (None to exit): ", 41);
     if ((currentSession.messageRow.rawSize - 41) > 0) {
-        editorOpen(&currentSession.messageRow.rawContent[41], 0);
+        editorOpen(&rowChars(&currentSession.messageRow)[41], 0);
     }
     //}
 
 }
 
-int main(int argc, char *argv[]) {
+/**
+ * Asks for a line number and puts the cursor at its start
+ */
+void goToLine() {
+    editorPrompt("Go to line: ", 12);
+
+    if (currentSession.messageRow.rawSize <= 12) {
+        return;
+    }
 
-    setRawMode();
-    init();
+    struct Document *doc = getCurrentDoc();
+    int64_t line = atoll(&rowChars(&currentSession.messageRow)[12]);
 
-    for (int argPos = 1; argPos < argc; ++argPos) {
-        editorOpen(argv[argPos], 1);
+    if (line < 1) {
+        line = 1;
+    } else if (line > doc->numRows) {
+        line = doc->numRows > 0 ? doc->numRows : 1;
     }
 
-    if (currentSession.numTabs < 1) {
-        createTab();
+    currentSession.cursorRow = line - 1;
+    currentSession.cursorCol = 0;
+}
+
+/**
+ * Asks for some text and puts a cursor at every place it is
+ */
+void addCursorsAtMatches() {
+    editorPrompt("Cursors at: ", 12);
+
+    if (currentSession.messageRow.rawSize <= 12) {
+        return;
     }
-    currentSession.currentTabIdx = 0;
 
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wmissing-noreturn"
-    while (1) {
-        editorRefreshScreen();
-        processKeyPress();
+    cursorsAtMatches(&rowChars(&currentSession.messageRow)[12]);
+}
+
+/**
+ * Asks for a transform of the rows of the selection, or of all of them
+ */
+void transformLines() {
+    editorPrompt("Lines: ", 7);
+
+    if (currentSession.messageRow.rawSize <= 7) {
+        return;
     }
-#pragma clang diagnostic pop
+
+    linesTransform(&rowChars(&currentSession.messageRow)[7]);
 }
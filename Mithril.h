@@ -0,0 +1,392 @@
+//
+// The editing core of Mithril. It runs in a terminal (see main.c),
+// or headless with the input and output hooks of the environment
+//
+#ifndef MITHRIL_H
+#define MITHRIL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define VERSION "1.0.0"
+
+// allows to get the keycode of a ctrl+something key, that macro thing
+// is definetly new to me
+#define CTRL_KEY(k) ((k) & 0x1f)
+
+// the rows shorter than this (with their '\0') fit in the row itself
+#define ROW_INLINE_SIZE (3 * sizeof(char *))
+#define ROW_INLINE (-1)
+
+enum EditorKey {
+    BACKSPACE = 127,
+    ARROW_LEFT = 1000,
+    ARROW_RIGHT,
+    ARROW_UP,
+    ARROW_DOWN,
+    DEL_KEY,
+    HOME_KEY,
+    END_KEY,
+    PG_UP,
+    PG_DOWN,
+    MOVE_TAB_LEFT,
+    MOVE_TAB_RIGHT
+};
+
+struct ColdBlock;
+
+struct Arena;
+
+struct Syntax;
+
+struct HighlightCache;
+
+struct ColumnCache;
+
+struct WrapLayout;
+
+struct DiffView;
+
+/**
+ * What some allocations use: the bytes we asked for,
+ * and what malloc really gave
+ */
+struct MemAccount {
+    size_t payload;
+    size_t usable; // the payload plus what malloc rounded up
+    long blocks;
+    size_t peak; // the most usable bytes at once
+};
+
+/**
+ * A text row
+ * We use rawSize and rawContent
+ * to be able to render some
+ * characters differently (like tabs)
+ * A cold row has no rawContent, its bytes are
+ * compressed in a block shared with its neighbours.
+ * A loaded row borrows its bytes from an arena of its
+ * document until it is edited.
+ * A short row keeps its bytes in the row itself, in place
+ * of the pointers (coldOffset is then ROW_INLINE).
+ */
+struct Row {
+    int64_t rawSize;
+    int coldOffset; // in the decompressed block, a block holds less than 2GB
+    unsigned char hlState; // what the highlighting is in at the end of the row (a comment, a string)
+    union {
+        struct {
+            char *rawContent;
+            struct ColdBlock *cold;
+            struct Arena *arena; // NULL when rawContent is the row's own
+        };
+        char inlineContent[ROW_INLINE_SIZE];
+    };
+};
+
+enum Hibernation {
+    AWAKE = 0,
+    HIBERNATED_ON_DISK, // the rows are the file, we read them again when needed
+    HIBERNATED_PACKED // the rows are compressed in a single blob
+};
+
+/**
+ * A chunk of lines of a file on disk. Where a chunk
+ * ends depends on the content of the lines, so an insertion
+ * in the file only changes the chunks around it
+ */
+struct FileChunk {
+    uint64_t hash;
+    int numLines;
+    size_t numBytes;
+};
+
+/**
+ * What the file looked like the last
+ * time we read or wrote it
+ */
+struct FileSnapshot {
+    struct timespec mtime;
+    off_t size;
+    int64_t numLines;
+    int numChunks;
+    int chunkCap;
+    struct FileChunk *chunks;
+    struct FileChunk pending; // the chunk being built
+};
+
+/**
+ * The content of a file, shared by
+ * all the tabs showing that file
+ */
+struct Document {
+    int refCount;
+    char *fileName;
+    dev_t device;
+    int64_t numRows;
+    int64_t rowCap;
+    int64_t changesCount;
+    struct Row *rows;
+    /*** what is on disk ***/
+    int64_t savedChanges; // the changesCount when the rows last matched the file
+    int changedOnDisk; // the file changed but reloading would lose edits
+    int watchDescriptor; // -1 when we have to poll the file
+    ino_t inode;
+    struct FileSnapshot snapshot;
+    /*** follow mode (tail -f) ***/
+    int following;
+    int followFd;
+    off_t readOffset; // how much of the file is already in the rows
+    int followBehind; // the file has more than was read in the last tick
+    int lastRowOpen; // the last row did not end with a new line (yet)
+    /*** hibernation ***/
+    enum Hibernation hibernation;
+    int heldFd; // the file the dropped rows are read back from, -1 when none is held
+    time_t lastActive;
+    size_t residentBytes; // what the rows use, as of estimatedChanges
+    int64_t estimatedChanges;
+    char *packed;
+    size_t packedLen;
+    size_t unpackedLen;
+    /*** cold rows ***/
+    int coldStorage; // the rows far from the cursor get compressed
+    int64_t hotRow; // the row the rows stay hot around, when it is not the current document
+    int64_t coolScan; // where the next idle cooling pass starts
+    /*** memory accounting ***/
+    struct MemAccount rowMemory; // the hot rows
+    struct MemAccount coldMemory; // the compressed blocks
+    struct MemAccount arrayMemory; // the array of rows
+    struct MemAccount arenaMemory; // the arenas of the loaded rows
+    struct Arena *arenas; // the one rows are carved from first
+    /*** syntax highlighting ***/
+    const struct Syntax *syntax; // NULL for plain text
+    int64_t hlValidRows; // the rows before it have the right hlState
+    int64_t hlKnownRows; // the rows before it had the right hlState, before the last edits
+    int64_t hlDirtyEnd; // the rows edited since are before it
+    struct HighlightCache *hlCache; // the colours of the rows on screen
+    /*** display columns ***/
+    struct ColumnCache *colCache; // where the characters of the rows on screen are, when not all ASCII
+    struct WrapLayout *wrap; // how many screen lines the rows take, once soft wrap was turned on
+    /*** copying ***/
+    int lent; // rows of it were copied, the yank buffer and other documents may share its arenas and cold blocks
+    /*** diff with the file ***/
+    struct DiffView *diff; // how the rows differ from the file on disk, while the gutter shows it
+};
+
+/**
+ * A view on a document, with its
+ * own cursor and scrolling
+ */
+struct Tab {
+    struct Document *doc;
+    int64_t colOffset;
+    int64_t rowOffset;
+    int64_t subRowOffset;
+    int64_t cursorRow;
+    int64_t cursorCol;
+};
+
+/**
+ * A cursor besides the one of the session,
+ * before a byte of a row
+ */
+struct Cursor {
+    int64_t row;
+    int64_t col;
+};
+
+enum Selection {
+    NO_SELECTION = 0,
+    LINEAR_SELECTION, // the text from the anchor to the cursor
+    BLOCK_SELECTION // the columns between the anchor and the cursor, on the rows between them
+};
+
+/**
+ * How a row differs from the file on disk, as the gutter shows it
+ */
+enum DiffMark {
+    DIFF_SAME = 0,
+    DIFF_ADDED,
+    DIFF_CHANGED,
+    DIFF_REMOVED, // lines of the file were before that row
+    DIFF_REMOVED_BELOW // the last lines of the file, after the last row
+};
+
+/**
+ * A struct that
+ * contains the environnement
+ * settings like the available rows
+ */
+struct Environment {
+    int screenRows;
+    int screenCols;
+    int usableTextScreenRows;
+    int usableTextScreenCols; // the screen less the gutter
+    /*** The user's terminal settings ***/
+    struct termios orig_termios;
+    /*** used to be notified when the opened files change, -1 if unavailable ***/
+    int inotifyFd;
+    /*** when to hibernate the tabs in the background ***/
+    time_t hibernateAfter;
+    size_t memoryBudget;
+    /*** files at least that big keep their far rows compressed ***/
+    off_t coldMinSize;
+    /*** where the line indexes of the files at least that big go, NULL for nowhere ***/
+    char *indexDir;
+    off_t indexMinSize;
+    /*** how many tabs on each side of the current one are read in the background ***/
+    int prefetchTabs;
+    /*** where the keys come from and where the frames go, the terminal when NULL ***/
+    ssize_t (*readInput)(char *c);
+    ssize_t (*writeOutput)(const char *buf, size_t len);
+};
+
+/**
+ * A struct to store
+ * the current session
+ * of editing
+ */
+struct Session {
+    /*** Cursor positioning ***/
+    int64_t colOffset;
+    int64_t rowOffset;
+    int64_t subRowOffset; // the first screen line of rowOffset shown, when the rows wrap
+    int64_t cursorRow;
+    int64_t cursorCol;
+    /*** the other cursors, what is typed goes to all of them ***/
+    int64_t numCursors;
+    int64_t cursorCap;
+    struct Cursor *cursors; // in order, none on the cursor of the session
+    /*** what is selected, from the anchor to the cursor ***/
+    enum Selection selecting;
+    int64_t anchorRow;
+    int64_t anchorCol;
+    /*** the long rows go on the next screen lines instead of scrolling ***/
+    int softWrap;
+    /*** a gutter marks the rows that differ from the file on disk ***/
+    int showDiff;
+    /*** tabs that the user can open ***/
+    int currentTabIdx;
+    int numTabs;
+    struct Tab *tabs;
+    /*** what the tabs show, a file is only loaded once ***/
+    int numDocs;
+    struct Document **docs;
+    /*** message editor row ***/
+    int messageLength;
+    struct Row messageRow;
+    /*** mvmt locked ***/
+    int locked;
+    /*** shown in the status bar until the next key ***/
+    char statusMessage[128];
+};
+
+extern struct Environment env;
+
+extern struct Session currentSession;
+
+/*** setting up ***/
+
+/**
+ * Sets up the session and the environment
+ * @param rows the size of the screen, 0 to ask the terminal
+ * @param cols the size of the screen, 0 to ask the terminal
+ */
+void editorInit(int rows, int cols);
+
+void setRawMode();
+
+/**
+ * The terminal changed size, the wrapped rows are counted
+ * again from the ones on screen
+ * @param rows the size of the screen
+ * @param cols the size of the screen
+ */
+void editorResize(int rows, int cols);
+
+/*** documents and tabs ***/
+
+struct Tab *getCurrentTab();
+
+struct Document *getCurrentDoc();
+
+struct Row *getCurrentRow();
+
+void createTab();
+
+void closeTab();
+
+void editorSwitchTab(int idx);
+
+void editorOpen(char *filename, int openInNewTab);
+
+/**
+ * Opens files in tabs of their own, in that order, after the current tab.
+ * Only the current tab is read right away, the others when they are looked
+ * at, or in the background when they are next to the current one
+ * @param fileNames the files
+ * @param count how many there are
+ */
+void editorOpenFiles(char **fileNames, int count);
+
+void editorSave();
+
+/*** editing ***/
+
+void rowClearTabs(struct Row *row);
+
+void rowFree(struct Row *row);
+
+void editorAppendRow(char *s, size_t len);
+
+void editorInsertChar(int c);
+
+void editorInsertNewRow();
+
+void editorRemoveRow();
+
+void editorDelKey();
+
+void editorBackspace();
+
+char *editorRowsToString(size_t *bufLen);
+
+/*** input and output ***/
+
+int readKey();
+
+/**
+ * Does what a key does, as if it was typed
+ * @param c the key, as returned by readKey
+ */
+void editorProcessKey(int c);
+
+void processKeyPress();
+
+void editorRefreshScreen();
+
+/**
+ * Reads the keys in a thread and paints the frames in another one, so
+ * the core never waits for the terminal. readKey then takes the keys
+ * that thread decoded, and editorRefreshScreen only builds the frames.
+ * Without threads, the core keeps doing it all.
+ */
+void editorStartThreads();
+
+/**
+ * @return 1 when the input thread has keys waiting, they
+ * can all be handled before the next frame is built
+ */
+int editorKeysPending();
+
+/**
+ * What the idle ticks do: looking at the opened files
+ * and keeping the memory in check
+ * @return 1 when the screen needs to be refreshed
+ */
+int editorIdle();
+
+#endif //MITHRIL_H
@@ -0,0 +1,187 @@
+//
+// What the benchmarks of Mithril share
+//
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "bench.h"
+
+uint64_t nowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void samplesAdd(struct Samples *samples, uint64_t value) {
+    if (samples->count == samples->cap) {
+        samples->cap = samples->cap < 64 ? 64 : samples->cap * 2;
+        samples->values = realloc(samples->values, sizeof(uint64_t) * samples->cap);
+
+        if (NULL == samples->values) {
+            perror("samplesAdd");
+            exit(1);
+        }
+    }
+
+    samples->values[samples->count++] = value;
+}
+
+int compareSamples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+uint64_t samplesPercentile(struct Samples *samples, double percent) {
+    if (samples->count == 0) {
+        return 0;
+    }
+
+    qsort(samples->values, (size_t) samples->count, sizeof(uint64_t), compareSamples);
+
+    int idx = (int) (percent / 100.0 * (samples->count - 1) + 0.5);
+
+    return samples->values[idx];
+}
+
+void samplesClear(struct Samples *samples) {
+    free(samples->values);
+    samples->values = NULL;
+    samples->count = 0;
+    samples->cap = 0;
+}
+
+size_t parseSize(const char *s) {
+    char *end;
+    double value = strtod(s, &end);
+
+    switch (*end) {
+        case 'k':
+        case 'K':
+            value *= 1 << 10;
+            break;
+        case 'm':
+        case 'M':
+            value *= 1 << 20;
+            break;
+        case 'g':
+        case 'G':
+            value *= 1 << 30;
+            break;
+        case '\0':
+            break;
+        default:
+            return 0;
+    }
+
+    return value > 0 ? (size_t) value : 0;
+}
+
+uint64_t nextRandom(uint64_t *state) {
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+const char *lineLengthNames[NUM_LINE_LENGTHS] = {"fixed", "uniform", "long-tail"};
+
+int randomLine(char *line, int cap, int lineLength, enum LineLengths lengths, uint64_t *state) {
+    static const char words[] = "lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor ";
+
+    int len = lineLength;
+
+    if (lineLength <= 0) {
+        len = 0;
+    } else if (lengths == LINES_UNIFORM) {
+        len = (int) (nextRandom(state) % (uint64_t) (2 * lineLength + 1));
+    } else if (lengths == LINES_LONG_TAIL) {
+        // one line in 64 is 32 times the average, the others are short
+        if (nextRandom(state) % 64 == 0) {
+            len = lineLength * 32;
+        } else {
+            len = (int) (nextRandom(state) % (uint64_t) (lineLength / 2 + 1));
+        }
+    }
+
+    if (len > cap) {
+        len = cap;
+    }
+
+    int start = (int) (nextRandom(state) % (sizeof(words) - 1));
+
+    for (int i = 0; i < len; ++i) {
+        line[i] = words[(start + i) % (sizeof(words) - 1)];
+    }
+
+    // some indentation now and then
+    if (len > 0 && nextRandom(state) % 8 == 0) {
+        line[0] = '\t';
+    }
+
+    return len;
+}
+
+int generateFile(const char *path, size_t size, int lineLength, uint64_t seed) {
+    FILE *fp = fopen(path, "w");
+
+    if (!fp) {
+        return -1;
+    }
+
+    uint64_t state = seed ? seed : 1;
+    size_t written = 0;
+    char line[4096];
+
+    while (written < size) {
+        int len = randomLine(line, sizeof(line) - 1, lineLength, LINES_UNIFORM, &state);
+
+        if ((size_t) len + 1 > size - written) {
+            len = (int) (size - written - 1);
+        }
+
+        line[len] = '\n';
+
+        if (fwrite(line, 1, (size_t) len + 1, fp) != (size_t) len + 1) {
+            fclose(fp);
+            return -1;
+        }
+
+        written += (size_t) len + 1;
+    }
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+int generateSparseFile(const char *path, size_t size) {
+    FILE *fp = fopen(path, "w");
+
+    if (!fp) {
+        return -1;
+    }
+
+    const char head[] = "a sparse file\n\tthe next line is a hole\n";
+    const char tail[] = "end of the hole\n";
+
+    if (size < sizeof(head) + sizeof(tail)) {
+        fclose(fp);
+        errno = EINVAL;
+        return -1;
+    }
+
+    int failed = fwrite(head, 1, sizeof(head) - 1, fp) != sizeof(head) - 1 ||
+                 fseeko(fp, (off_t) (size - (sizeof(tail) - 1)), SEEK_SET) == -1 ||
+                 fwrite(tail, 1, sizeof(tail) - 1, fp) != sizeof(tail) - 1;
+
+    return fclose(fp) == 0 && !failed ? 0 : -1;
+}
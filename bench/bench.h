@@ -0,0 +1,81 @@
+//
+// What the benchmarks of Mithril share: timing,
+// generated files and latency percentiles
+//
+#ifndef MITHRIL_BENCH_H
+#define MITHRIL_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Time measurements, in nanoseconds
+ */
+struct Samples {
+    int count;
+    int cap;
+    uint64_t *values;
+};
+
+uint64_t nowNanos();
+
+void samplesAdd(struct Samples *samples, uint64_t value);
+
+/**
+ * @param samples the measurements, sorted by the call
+ * @param percent between 0 and 100
+ * @return the value under which are percent of the measurements
+ */
+uint64_t samplesPercentile(struct Samples *samples, double percent);
+
+void samplesClear(struct Samples *samples);
+
+/**
+ * Parses a size like 1K, 64M or 2G
+ * @return the size in bytes, 0 when it does not parse
+ */
+size_t parseSize(const char *s);
+
+/**
+ * A small random number generator, so the runs are the same everywhere
+ */
+uint64_t nextRandom(uint64_t *state);
+
+/**
+ * How the lengths of the generated lines are spread
+ */
+enum LineLengths {
+    LINES_FIXED = 0, // all the same length
+    LINES_UNIFORM, // between 0 and twice the average
+    LINES_LONG_TAIL, // mostly short, now and then a very long one
+    NUM_LINE_LENGTHS
+};
+
+extern const char *lineLengthNames[NUM_LINE_LENGTHS];
+
+/**
+ * Makes up a line of text, with some tabs in it
+ * @param line where it goes, without a new line
+ * @param cap the room in line
+ * @param lineLength the average length
+ * @return the length of the line
+ */
+int randomLine(char *line, int cap, int lineLength, enum LineLengths lengths, uint64_t *state);
+
+/**
+ * Writes a file of about size bytes, made of lines of random
+ * lengths (lineLength on average)
+ * @param seed the same seed gives the same file
+ * @return 0 when it worked, -1 otherwise
+ */
+int generateFile(const char *path, size_t size, int lineLength, uint64_t seed);
+
+/**
+ * Writes a file of size bytes that takes almost no room on disk:
+ * a few lines, then a hole read as a single line of zeros that
+ * ends the file. Sizes and lines past 2GB cost nothing to make.
+ * @return 0 when it worked, -1 otherwise
+ */
+int generateSparseFile(const char *path, size_t size);
+
+#endif //MITHRIL_BENCH_H
@@ -0,0 +1,398 @@
+//
+// Times the routines of the editing core one by one, on documents
+// of several sizes and line lengths, and prints CSV or JSON
+//
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Mithril.h"
+#include "bench.h"
+
+#define SCREEN_ROWS 24
+#define SCREEN_COLS 80
+
+// how many times the routines that touch one row are called per run
+#define OPS_PER_RUN 1000
+
+/**
+ * The lines of a document, made up before
+ * any timing starts
+ */
+struct Corpus {
+    char *bytes;
+    int numLines;
+    int *starts; // numLines + 1 offsets in bytes
+};
+
+struct Result {
+    const char *benchmark;
+    const char *position;
+    size_t size;
+    int numLines;
+    enum LineLengths lengths;
+    long ops;
+    struct Samples nsPerOp;
+};
+
+struct Results {
+    int count;
+    int cap;
+    struct Result *results;
+};
+
+struct Results results;
+
+ssize_t discardWrite(const char *buf, size_t len) {
+    (void) buf;
+    return (ssize_t) len;
+}
+
+void corpusMake(struct Corpus *corpus, size_t size, int lineLength, enum LineLengths lengths) {
+    uint64_t state = 42;
+    int lineCap = 64 * (lineLength + 1);
+    size_t used = 0;
+    int linesCap = 1024;
+
+    corpus->bytes = malloc(size + (size_t) lineCap);
+    corpus->starts = malloc(sizeof(int) * linesCap);
+    corpus->numLines = 0;
+
+    if (NULL == corpus->bytes || NULL == corpus->starts) {
+        perror("corpusMake");
+        exit(1);
+    }
+
+    while (used < size) {
+        if (corpus->numLines + 2 > linesCap) {
+            linesCap *= 2;
+            corpus->starts = realloc(corpus->starts, sizeof(int) * linesCap);
+        }
+
+        corpus->starts[corpus->numLines++] = (int) used;
+        used += (size_t) randomLine(corpus->bytes + used, lineCap, lineLength, lengths, &state);
+    }
+
+    corpus->starts[corpus->numLines] = (int) used;
+}
+
+void corpusFree(struct Corpus *corpus) {
+    free(corpus->bytes);
+    free(corpus->starts);
+}
+
+/**
+ * Opens a blank tab and fills it with the corpus
+ */
+void loadCorpus(struct Corpus *corpus) {
+    createTab();
+
+    for (int i = 0; i < corpus->numLines; ++i) {
+        editorAppendRow(corpus->bytes + corpus->starts[i],
+                        (size_t) (corpus->starts[i + 1] - corpus->starts[i]));
+    }
+}
+
+struct Result *resultFor(const char *benchmark, const char *position, size_t size,
+                         struct Corpus *corpus, enum LineLengths lengths, long ops) {
+    if (results.count == results.cap) {
+        results.cap = results.cap < 64 ? 64 : results.cap * 2;
+        results.results = realloc(results.results, sizeof(struct Result) * results.cap);
+
+        if (NULL == results.results) {
+            perror("resultFor");
+            exit(1);
+        }
+    }
+
+    struct Result *result = &results.results[results.count++];
+    memset(result, 0, sizeof(struct Result));
+
+    result->benchmark = benchmark;
+    result->position = position;
+    result->size = size;
+    result->numLines = corpus->numLines;
+    result->lengths = lengths;
+    result->ops = ops;
+
+    return result;
+}
+
+void record(struct Result *result, uint64_t elapsed) {
+    samplesAdd(&result->nsPerOp, elapsed / (uint64_t) result->ops);
+}
+
+/**
+ * Where in the document the edits happen
+ */
+int rowAt(const char *position) {
+    int numRows = getCurrentDoc()->numRows;
+
+    if (strcmp(position, "start") == 0) {
+        return 1;
+    } else if (strcmp(position, "middle") == 0) {
+        return numRows / 2;
+    }
+
+    return numRows - 1;
+}
+
+void benchClearTabs(struct Corpus *corpus, size_t size, enum LineLengths lengths, int runs) {
+    struct Result *result = resultFor("rowClearTabs", "", size, corpus, lengths, corpus->numLines);
+    struct Row *rows = malloc(sizeof(struct Row) * corpus->numLines);
+
+    for (int run = 0; run < runs; ++run) {
+        for (int i = 0; i < corpus->numLines; ++i) {
+            int len = corpus->starts[i + 1] - corpus->starts[i];
+
+            rows[i].rawSize = len;
+            rows[i].rawContent = malloc((size_t) len + 1);
+            rows[i].coldOffset = 0;
+            rows[i].cold = NULL;
+            rows[i].arena = NULL;
+            memcpy(rows[i].rawContent, corpus->bytes + corpus->starts[i], (size_t) len);
+            rows[i].rawContent[len] = '\0';
+        }
+
+        uint64_t start = nowNanos();
+
+        for (int i = 0; i < corpus->numLines; ++i) {
+            rowClearTabs(&rows[i]);
+        }
+
+        record(result, nowNanos() - start);
+
+        for (int i = 0; i < corpus->numLines; ++i) {
+            rowFree(&rows[i]);
+        }
+    }
+
+    free(rows);
+}
+
+void benchLoad(struct Corpus *corpus, size_t size, enum LineLengths lengths, int runs) {
+    struct Result *result = resultFor("editorAppendRow", "", size, corpus, lengths, corpus->numLines);
+
+    for (int run = 0; run < runs; ++run) {
+        uint64_t start = nowNanos();
+        loadCorpus(corpus);
+        record(result, nowNanos() - start);
+
+        closeTab();
+    }
+}
+
+void benchInsertNewRow(struct Corpus *corpus, size_t size, enum LineLengths lengths, int runs,
+                       const char *position) {
+    struct Result *result = resultFor("editorInsertNewRow", position, size, corpus, lengths, OPS_PER_RUN);
+
+    for (int run = 0; run < runs; ++run) {
+        loadCorpus(corpus);
+
+        uint64_t start = nowNanos();
+
+        for (int i = 0; i < OPS_PER_RUN; ++i) {
+            currentSession.cursorRow = rowAt(position);
+            currentSession.cursorCol = getCurrentRow()->rawSize / 2;
+            editorInsertNewRow();
+        }
+
+        record(result, nowNanos() - start);
+        closeTab();
+    }
+}
+
+void benchRemoveRow(struct Corpus *corpus, size_t size, enum LineLengths lengths, int runs,
+                    const char *position) {
+    struct Result *result = resultFor("editorRemoveRow", position, size, corpus, lengths, OPS_PER_RUN);
+
+    for (int run = 0; run < runs; ++run) {
+        loadCorpus(corpus);
+
+        uint64_t start = nowNanos();
+
+        for (int i = 0; i < OPS_PER_RUN && getCurrentDoc()->numRows > 2; ++i) {
+            currentSession.cursorRow = rowAt(position);
+            currentSession.cursorCol = 0;
+            editorRemoveRow();
+        }
+
+        record(result, nowNanos() - start);
+        closeTab();
+    }
+}
+
+void benchRowsToString(struct Corpus *corpus, size_t size, enum LineLengths lengths, int runs) {
+    struct Result *result = resultFor("editorRowsToString", "", size, corpus, lengths, 1);
+
+    loadCorpus(corpus);
+
+    for (int run = 0; run < runs; ++run) {
+        size_t len;
+
+        uint64_t start = nowNanos();
+        char *buf = editorRowsToString(&len);
+        record(result, nowNanos() - start);
+
+        free(buf);
+    }
+
+    closeTab();
+}
+
+void benchFrame(struct Corpus *corpus, size_t size, enum LineLengths lengths, int runs) {
+    struct Result *result = resultFor("editorRefreshScreen", "", size, corpus, lengths, OPS_PER_RUN);
+
+    loadCorpus(corpus);
+
+    for (int run = 0; run < runs; ++run) {
+        uint64_t start = nowNanos();
+
+        // a frame at a new place each time, so they all scroll
+        for (int i = 0; i < OPS_PER_RUN; ++i) {
+            currentSession.cursorRow = (int) ((long) i * SCREEN_ROWS % getCurrentDoc()->numRows);
+            currentSession.cursorCol = 0;
+            editorRefreshScreen();
+        }
+
+        record(result, nowNanos() - start);
+    }
+
+    closeTab();
+}
+
+void printCsv(FILE *out) {
+    fprintf(out, "benchmark,position,size,lines,line_lengths,ops,runs,median_ns_per_op,min_ns_per_op,max_ns_per_op\n");
+
+    for (int i = 0; i < results.count; ++i) {
+        struct Result *r = &results.results[i];
+
+        fprintf(out, "%s,%s,%zu,%d,%s,%ld,%d,%llu,%llu,%llu\n", r->benchmark, r->position, r->size, r->numLines,
+                lineLengthNames[r->lengths], r->ops, r->nsPerOp.count,
+                (unsigned long long) samplesPercentile(&r->nsPerOp, 50),
+                (unsigned long long) samplesPercentile(&r->nsPerOp, 0),
+                (unsigned long long) samplesPercentile(&r->nsPerOp, 100));
+    }
+}
+
+void printJson(FILE *out) {
+    fprintf(out, "{\n  \"version\": \"%s\",\n  \"results\": [\n", VERSION);
+
+    for (int i = 0; i < results.count; ++i) {
+        struct Result *r = &results.results[i];
+
+        fprintf(out, "    {\"benchmark\": \"%s\", \"position\": \"%s\", \"size\": %zu, \"lines\": %d, "
+                     "\"line_lengths\": \"%s\", \"ops\": %ld, \"runs\": %d, \"median_ns_per_op\": %llu, "
+                     "\"min_ns_per_op\": %llu, \"max_ns_per_op\": %llu}%s\n",
+                r->benchmark, r->position, r->size, r->numLines, lineLengthNames[r->lengths], r->ops,
+                r->nsPerOp.count,
+                (unsigned long long) samplesPercentile(&r->nsPerOp, 50),
+                (unsigned long long) samplesPercentile(&r->nsPerOp, 0),
+                (unsigned long long) samplesPercentile(&r->nsPerOp, 100),
+                i + 1 < results.count ? "," : "");
+    }
+
+    fprintf(out, "  ]\n}\n");
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-s sizes] [-l line length] [-r runs] [-f csv|json] [-o output]\n"
+                    "  -s  comma separated document sizes, like 64K,1M,16M (default 64K,1M,16M)\n"
+                    "  -l  average line length (default 60)\n"
+                    "  -r  how many times each benchmark runs (default 5)\n"
+                    "  -f  the output format (default csv)\n"
+                    "  -o  where the results go (default the standard output)\n", name);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    char *sizes = "64K,1M,16M";
+    char *format = "csv";
+    char *outPath = NULL;
+    int lineLength = 60;
+    int runs = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:l:r:f:o:")) != -1) {
+        switch (opt) {
+            case 's':
+                sizes = optarg;
+                break;
+            case 'l':
+                lineLength = atoi(optarg);
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 'f':
+                format = optarg;
+                break;
+            case 'o':
+                outPath = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (strcmp(format, "csv") != 0 && strcmp(format, "json") != 0) {
+        usage(argv[0]);
+    }
+
+    env.writeOutput = discardWrite;
+    editorInit(SCREEN_ROWS, SCREEN_COLS);
+    createTab();
+    editorSwitchTab(0);
+
+    char *sizeList = strdup(sizes);
+
+    for (char *sizeName = strtok(sizeList, ","); sizeName; sizeName = strtok(NULL, ",")) {
+        size_t size = parseSize(sizeName);
+
+        if (size == 0) {
+            usage(argv[0]);
+        }
+
+        for (int lengths = 0; lengths < NUM_LINE_LENGTHS; ++lengths) {
+            struct Corpus corpus;
+            corpusMake(&corpus, size, lineLength, (enum LineLengths) lengths);
+
+            fprintf(stderr, "%s, %s lines\n", sizeName, lineLengthNames[lengths]);
+
+            benchClearTabs(&corpus, size, lengths, runs);
+            benchLoad(&corpus, size, lengths, runs);
+            benchInsertNewRow(&corpus, size, lengths, runs, "start");
+            benchInsertNewRow(&corpus, size, lengths, runs, "middle");
+            benchInsertNewRow(&corpus, size, lengths, runs, "end");
+            benchRemoveRow(&corpus, size, lengths, runs, "start");
+            benchRemoveRow(&corpus, size, lengths, runs, "middle");
+            benchRemoveRow(&corpus, size, lengths, runs, "end");
+            benchRowsToString(&corpus, size, lengths, runs);
+            benchFrame(&corpus, size, lengths, runs);
+
+            corpusFree(&corpus);
+        }
+    }
+
+    free(sizeList);
+
+    FILE *out = outPath ? fopen(outPath, "w") : stdout;
+
+    if (!out) {
+        perror(outPath);
+        return 1;
+    }
+
+    if (strcmp(format, "json") == 0) {
+        printJson(out);
+    } else {
+        printCsv(out);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return 0;
+}
@@ -0,0 +1,305 @@
+//
+// Replays key scripts on generated files, without a terminal,
+// and gives the latency of each kind of key
+//
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "Mithril.h"
+#include "bench.h"
+
+#define SCREEN_ROWS 24
+#define SCREEN_COLS 80
+
+enum Operation {
+    OP_OPEN = 0,
+    OP_INSERT,
+    OP_NEWLINE,
+    OP_BACKSPACE,
+    OP_DELETE,
+    OP_PAGE,
+    OP_MOVE,
+    OP_SAVE,
+    OP_OTHER,
+    NUM_OPERATIONS
+};
+
+const char *operationNames[NUM_OPERATIONS] = {
+        "open", "insert", "newline", "backspace", "delete", "page", "move", "save", "other"
+};
+
+/**
+ * The keys being replayed, as the terminal would send them
+ */
+struct Script {
+    char *keys;
+    size_t len;
+    size_t pos;
+};
+
+struct Script script;
+
+size_t bytesPainted;
+
+ssize_t scriptRead(char *c) {
+    if (script.pos >= script.len) {
+        // a prompt is waiting for more keys than the script has
+        errno = EIO;
+        return -1;
+    }
+
+    *c = script.keys[script.pos++];
+    return 1;
+}
+
+ssize_t countingWrite(const char *buf, size_t len) {
+    (void) buf;
+    bytesPainted += len;
+    return (ssize_t) len;
+}
+
+void scriptAppend(struct Script *s, const char *keys, size_t len) {
+    s->keys = realloc(s->keys, s->len + len);
+
+    if (NULL == s->keys) {
+        perror("scriptAppend");
+        exit(1);
+    }
+
+    memcpy(s->keys + s->len, keys, len);
+    s->len += len;
+}
+
+/**
+ * Some typing all over the file, when no script is given
+ */
+void defaultScript(struct Script *s) {
+    for (int i = 0; i < 50; ++i) {
+        scriptAppend(s, "\x1b[6~\x1b[6~", 8);
+        scriptAppend(s, "hello world ", 12);
+        scriptAppend(s, "\n", 1);
+        scriptAppend(s, "\x7f\x7f\x7f", 3);
+        scriptAppend(s, "\x1b[3~\x1b[3~\x1b[3~", 12);
+        scriptAppend(s, "\x1b[B\x1b[C", 6);
+        scriptAppend(s, "\x1b[5~", 4);
+    }
+
+    scriptAppend(s, "\x13", 1);
+}
+
+int loadScript(struct Script *s, const char *path) {
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        return -1;
+    }
+
+    char buf[4096];
+    size_t len;
+
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        scriptAppend(s, buf, len);
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+enum Operation classifyKey(int c) {
+    switch (c) {
+        case '\n':
+            return OP_NEWLINE;
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+            return OP_BACKSPACE;
+        case DEL_KEY:
+            return OP_DELETE;
+        case PG_UP:
+        case PG_DOWN:
+            return OP_PAGE;
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+            return OP_MOVE;
+        case CTRL_KEY('s'):
+            return OP_SAVE;
+        default:
+            return (c == '\t' || (c >= ' ' && c < BACKSPACE)) ? OP_INSERT : OP_OTHER;
+    }
+}
+
+/**
+ * Opens the file in the current (blank) tab, replays the
+ * script on it, and closes it
+ */
+void replayOnce(char *path, struct Samples *samples) {
+    uint64_t start = nowNanos();
+    editorOpen(path, 0);
+    editorRefreshScreen();
+    samplesAdd(&samples[OP_OPEN], nowNanos() - start);
+
+    script.pos = 0;
+
+    while (script.pos < script.len) {
+        start = nowNanos();
+
+        int c = readKey();
+
+        // the terminal turns the enter key into a new line
+        if (c == '\r') {
+            c = '\n';
+        }
+
+        // quitting is up to us
+        if (c == CTRL_KEY('q')) {
+            break;
+        }
+
+        editorProcessKey(c);
+        editorRefreshScreen();
+
+        samplesAdd(&samples[classifyKey(c)], nowNanos() - start);
+    }
+
+    closeTab();
+}
+
+void printResults(const char *sizeName, struct Samples *samples) {
+    for (int op = 0; op < NUM_OPERATIONS; ++op) {
+        if (samples[op].count == 0) {
+            continue;
+        }
+
+        printf("%-8s %-10s %8d %12.1f %12.1f %12.1f\n", sizeName, operationNames[op], samples[op].count,
+               samplesPercentile(&samples[op], 50) / 1000.0,
+               samplesPercentile(&samples[op], 99) / 1000.0,
+               samplesPercentile(&samples[op], 100) / 1000.0);
+    }
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-s sizes] [-l line length] [-r runs] [-k key script] [-d directory] [-S] [-I] [-K]\n"
+                    "  -s  comma separated file sizes, like 1K,1M,1G (default 1K,1M,64M)\n"
+                    "  -l  average line length (default 60)\n"
+                    "  -r  how many times each file is opened and the script replayed (default 3)\n"
+                    "  -k  the keys to replay, as typed in the terminal (default: some typing all over the file)\n"
+                    "  -d  where the files are generated (default $TMPDIR or /tmp)\n"
+                    "  -S  sparse files: a few lines, then the rest of the size as a single line (like 3G)\n"
+                    "  -I  let the opens after the first use the line index of the file\n"
+                    "  -K  keep the generated files\n", name);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    char *sizes = "1K,1M,64M";
+    char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char *scriptPath = NULL;
+    int lineLength = 60;
+    int runs = 3;
+    int keepFiles = 0;
+    int sparse = 0;
+    int useIndex = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:l:r:k:d:SIK")) != -1) {
+        switch (opt) {
+            case 's':
+                sizes = optarg;
+                break;
+            case 'l':
+                lineLength = atoi(optarg);
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 'k':
+                scriptPath = optarg;
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'S':
+                sparse = 1;
+                break;
+            case 'I':
+                useIndex = 1;
+                break;
+            case 'K':
+                keepFiles = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (scriptPath) {
+        if (loadScript(&script, scriptPath) == -1) {
+            perror(scriptPath);
+            return 1;
+        }
+    } else {
+        defaultScript(&script);
+    }
+
+    env.readInput = scriptRead;
+    env.writeOutput = countingWrite;
+    editorInit(SCREEN_ROWS, SCREEN_COLS);
+
+    // every run reads the whole file, unless asked, and nothing is left in the cache
+    if (!useIndex) {
+        env.indexDir = NULL;
+    }
+
+    createTab();
+    editorSwitchTab(0);
+
+    printf("%-8s %-10s %8s %12s %12s %12s\n", "size", "op", "count", "p50 us", "p99 us", "max us");
+
+    char *sizeList = strdup(sizes);
+
+    for (char *sizeName = strtok(sizeList, ","); sizeName; sizeName = strtok(NULL, ",")) {
+        size_t size = parseSize(sizeName);
+
+        if (size == 0) {
+            usage(argv[0]);
+        }
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/mithril-replay-%s.txt", dir, sizeName);
+
+        int generated = sparse ? generateSparseFile(path, size) : generateFile(path, size, lineLength, 42);
+
+        if (generated == -1) {
+            perror(path);
+            return 1;
+        }
+
+        struct Samples samples[NUM_OPERATIONS];
+        memset(samples, 0, sizeof(samples));
+
+        for (int run = 0; run < runs; ++run) {
+            replayOnce(path, samples);
+        }
+
+        printResults(sizeName, samples);
+        fflush(stdout);
+
+        for (int op = 0; op < NUM_OPERATIONS; ++op) {
+            samplesClear(&samples[op]);
+        }
+
+        if (!keepFiles) {
+            unlink(path);
+        }
+    }
+
+    free(sizeList);
+    return 0;
+}
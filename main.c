@@ -0,0 +1,31 @@
+//
+// Runs the editor in the terminal
+//
+#include "Mithril.h"
+
+int main(int argc, char *argv[]) {
+
+    setRawMode();
+    editorInit(0, 0);
+    editorStartThreads();
+
+    editorOpenFiles(argv + 1, argc - 1);
+
+    if (currentSession.numTabs < 1) {
+        createTab();
+    }
+    editorSwitchTab(0);
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wmissing-noreturn"
+    while (1) {
+        editorRefreshScreen();
+        processKeyPress();
+
+        // the keys typed while the frame was built go in before the next one
+        while (editorKeysPending()) {
+            processKeyPress();
+        }
+    }
+#pragma clang diagnostic pop
+}
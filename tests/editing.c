@@ -0,0 +1,653 @@
+//
+// Edits small files as if the keys were typed in
+// the terminal, and checks the rows after each step
+//
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "Mithril.h"
+
+char *rowChars(struct Row *row);
+
+void docHibernate(struct Document *doc);
+
+void docWakeUp(struct Document *doc);
+
+void rowMakeHot(struct Row *row);
+
+void docCoolRows(struct Document *doc, int64_t from, int64_t to);
+
+struct Document *docNew();
+
+int docReadFile(struct Document *doc);
+
+void docRelease(struct Document *doc);
+
+char *indexPath(const char *fileName);
+
+char *docRowsToString(struct Document *doc, size_t *bufLen);
+
+struct WrapLayout *docWrap(struct Document *doc);
+
+int64_t wrapLinesBefore(struct WrapLayout *wrap, int64_t idx);
+
+int64_t wrapRowAt(struct WrapLayout *wrap, int64_t line, int64_t *sub);
+
+struct DiffView *docDiff(struct Document *doc);
+
+enum DiffMark diffMark(struct DiffView *view, int64_t row);
+
+/**
+ * The keys being typed, as the terminal would send them
+ */
+struct Script {
+    const char *keys;
+    size_t len;
+    size_t pos;
+};
+
+struct Script script;
+
+int failures;
+
+ssize_t scriptRead(char *c) {
+    if (script.pos >= script.len) {
+        errno = EIO;
+        return -1;
+    }
+
+    *c = script.keys[script.pos++];
+    return 1;
+}
+
+ssize_t discardWrite(const char *buf, size_t len) {
+    (void) buf;
+    return (ssize_t) len;
+}
+
+/**
+ * Types the keys, a prompt takes the ones it needs
+ */
+void type(const char *keys) {
+    script.keys = keys;
+    script.len = strlen(keys);
+    script.pos = 0;
+
+    while (script.pos < script.len) {
+        processKeyPress();
+    }
+}
+
+/**
+ * @param expected the rows, each followed by a new line
+ */
+void expectRows(const char *step, const char *expected) {
+    size_t len;
+    char *rows = editorRowsToString(&len);
+
+    if (len != strlen(expected) || memcmp(rows, expected, len) != 0) {
+        fprintf(stderr, "%s: expected\n%s\ngot\n%.*s\n", step, expected, (int) len, rows);
+        ++failures;
+    }
+
+    free(rows);
+}
+
+void testPath(char *path, size_t size, const char *name) {
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    snprintf(path, size, "%s/mithril-test-%d-%s.txt", dir, (int) getpid(), name);
+}
+
+void writeFile(const char *path, const char *content) {
+    FILE *fp = fopen(path, "w");
+
+    if (!fp || fputs(content, fp) == EOF || fclose(fp) != 0) {
+        perror(path);
+        exit(1);
+    }
+}
+
+/**
+ * A new tab on the file, with the cursor at its start
+ */
+void openWith(const char *path, const char *content) {
+    writeFile(path, content);
+    editorOpen((char *) path, 1);
+}
+
+/**
+ * Changes the file behind the editor, and lets the idle ticks see it
+ */
+void rewrite(const char *path, const char *content) {
+    struct timespec later = {1, 0};
+
+    // the same size in the same second would look like the same file
+    nanosleep(&later, NULL);
+    writeFile(path, content);
+
+    for (int i = 0; i < 3; ++i) {
+        editorIdle();
+    }
+}
+
+/**
+ * Compresses all the rows of the current document, as if they were far from the cursor
+ */
+void coolAllRows() {
+    struct Document *doc = getCurrentDoc();
+
+    for (int64_t i = 0; i < doc->numRows; ++i) {
+        rowMakeHot(&doc->rows[i]);
+    }
+
+    docCoolRows(doc, 0, doc->numRows);
+}
+
+void expectCold(const char *step) {
+    struct Document *doc = getCurrentDoc();
+
+    for (int64_t i = 0; i < doc->numRows; ++i) {
+        if (NULL == doc->rows[i].cold) {
+            fprintf(stderr, "%s: row %ld is not cold anymore\n", step, (long) i);
+            ++failures;
+            return;
+        }
+    }
+}
+
+/**
+ * Checks the wrapped layout of the current document against the screen
+ * lines of its rows counted one by one, the rows are all ASCII
+ */
+void expectWrap(const char *step) {
+    struct Document *doc = getCurrentDoc();
+    struct WrapLayout *wrap = docWrap(doc);
+    int width = env.usableTextScreenCols;
+    int64_t line = 0;
+    int64_t sub;
+
+    for (int64_t i = 0; i < doc->numRows; ++i) {
+        int64_t size = doc->rows[i].rawSize;
+        int64_t lines = size <= 0 ? 1 : (size + width - 1) / width;
+
+        if (wrapLinesBefore(wrap, i) != line) {
+            fprintf(stderr, "%s: %ld lines before row %ld, expected %ld\n", step,
+                    (long) wrapLinesBefore(wrap, i), (long) i, (long) line);
+            ++failures;
+            return;
+        }
+
+        for (int64_t k = 0; k < lines; ++k) {
+            if (wrapRowAt(wrap, line + k, &sub) != i || sub != k) {
+                fprintf(stderr, "%s: line %ld is not line %ld of row %ld\n", step, (long) (line + k), (long) k,
+                        (long) i);
+                ++failures;
+                return;
+            }
+        }
+
+        line += lines;
+    }
+
+    if (wrapLinesBefore(wrap, doc->numRows) != line || wrapRowAt(wrap, line, &sub) != doc->numRows) {
+        fprintf(stderr, "%s: the layout does not end with the rows\n", step);
+        ++failures;
+    }
+}
+
+/**
+ * Checks the gutter of the current document, diffed as a frame would
+ * @param expected the mark of each row
+ */
+void expectDiff(const char *step, const enum DiffMark *expected, int64_t numRows) {
+    struct Document *doc = getCurrentDoc();
+    struct DiffView *view = docDiff(doc);
+
+    if (doc->numRows != numRows) {
+        fprintf(stderr, "%s: %ld rows, expected %ld\n", step, (long) doc->numRows, (long) numRows);
+        ++failures;
+        return;
+    }
+
+    for (int64_t i = 0; i < numRows; ++i) {
+        if (diffMark(view, i) != expected[i]) {
+            fprintf(stderr, "%s: row %ld is marked %d, expected %d\n", step, (long) i, (int) diffMark(view, i),
+                    (int) expected[i]);
+            ++failures;
+        }
+    }
+}
+
+/**
+ * Reads a file in a document of its own, the way a worker does
+ */
+struct Document *readAlone(const char *path) {
+    struct Document *doc = docNew();
+
+    doc->fileName = strdup(path);
+
+    if (docReadFile(doc) == -1) {
+        perror(path);
+        exit(1);
+    }
+
+    return doc;
+}
+
+/**
+ * Writes over the first line of the index of a file
+ */
+void spoilIndex(const char *path, uint64_t entry) {
+    char *index = indexPath(path);
+    FILE *fp = fopen(index, "r+");
+
+    // the lines follow the header, 9 fields of 8 bytes
+    if (!fp || fseek(fp, 72, SEEK_SET) != 0 || fwrite(&entry, sizeof(entry), 1, fp) != 1 || fclose(fp) != 0) {
+        perror(index);
+        exit(1);
+    }
+
+    free(index);
+}
+
+/**
+ * A file over 2GB with a line over 2GB, sparse so it takes no room: the
+ * line is edited past column 2^31 and the file saved. Skipped where the
+ * files can not be sparse.
+ */
+void testHugeLine(const char *path) {
+    const int64_t lineLen = ((int64_t) 1 << 31) + 64;
+    const int64_t column = ((int64_t) 1 << 31) + 8;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    struct stat st;
+
+    if (fd == -1 || write(fd, "first\n", 6) != 6 || ftruncate(fd, 6 + lineLen) == -1 ||
+        pwrite(fd, "\nlast\n", 6, 6 + lineLen) != 6 || fstat(fd, &st) == -1) {
+        perror(path);
+        exit(1);
+    }
+
+    close(fd);
+
+    if ((int64_t) st.st_blocks * 512 >= st.st_size / 2) {
+        fprintf(stderr, "huge line: skipped, the files are not sparse here\n");
+        unlink(path);
+        return;
+    }
+
+    editorOpen((char *) path, 1);
+    struct Document *doc = getCurrentDoc();
+
+    if (doc->numRows != 3 || doc->rows[1].rawSize != lineLen) {
+        fprintf(stderr, "huge line: %ld rows, the long one of %lld bytes\n", (long) doc->numRows,
+                doc->numRows > 1 ? (long long) doc->rows[1].rawSize : -1LL);
+        ++failures;
+        unlink(path);
+        return;
+    }
+
+    currentSession.cursorRow = 1;
+    currentSession.cursorCol = column;
+    type("X\x13");
+
+    char c = 0;
+    fd = open(path, O_RDONLY);
+
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size != 6 + lineLen + 1 + 6 ||
+        pread(fd, &c, 1, 6 + column) != 1 || c != 'X') {
+        fprintf(stderr, "huge line: saved %lld bytes, '%c' past column 2^31\n", (long long) st.st_size, c);
+        ++failures;
+    }
+
+    close(fd);
+    unlink(path);
+}
+
+int main() {
+    char path[4096];
+    char other[4096];
+    char sleeping[4096];
+    char changed[4096];
+    char cold[4096];
+    char followed[4096];
+    char tabbed[4096];
+    char reborn[4096];
+    char copies[4096];
+    char indexed[4096];
+    char saved[4096];
+    char huge[4096];
+    char indexDir[4096];
+    char wrapped[4096];
+    char diffed[4096];
+    testPath(path, sizeof(path), "transforms");
+    testPath(other, sizeof(other), "reload");
+    testPath(sleeping, sizeof(sleeping), "deleted");
+    testPath(changed, sizeof(changed), "changed");
+    testPath(cold, sizeof(cold), "cold");
+    testPath(followed, sizeof(followed), "followed");
+    testPath(tabbed, sizeof(tabbed), "tabbed");
+    testPath(reborn, sizeof(reborn), "reborn");
+    testPath(copies, sizeof(copies), "copies");
+    testPath(indexed, sizeof(indexed), "indexed");
+    testPath(saved, sizeof(saved), "saved");
+    testPath(huge, sizeof(huge), "huge");
+    testPath(indexDir, sizeof(indexDir), "index");
+    testPath(wrapped, sizeof(wrapped), "wrapped");
+    testPath(diffed, sizeof(diffed), "diffed");
+
+    env.readInput = scriptRead;
+    env.writeOutput = discardWrite;
+    editorInit(24, 80);
+    env.indexDir = NULL;
+
+    createTab();
+    editorSwitchTab(0);
+
+    openWith(path, "pear\napple\nfig\napple\n");
+    type("\x0b" "sort\n");
+    expectRows("sort", "apple\napple\nfig\npear\n");
+    type("\x0b" "undo\n");
+    expectRows("undo after sort", "pear\napple\nfig\napple\n");
+
+    type("\x0b" "drop ^a\n");
+    expectRows("drop", "pear\nfig\n");
+    type("\x0b" "undo\n");
+    expectRows("undo after drop", "pear\napple\nfig\napple\n");
+
+    type("\x0b" "| sort -r\n");
+    expectRows("pipe", "pear\nfig\napple\napple\n");
+    type("\x0b" "undo\n");
+    expectRows("undo after pipe", "pear\napple\nfig\napple\n");
+
+    // Esc stops a command that would run for long, the rows stay as they were
+    time_t start = time(NULL);
+    type("\x0b" "| sleep 10; echo late\n\x1b");
+    expectRows("pipe stopped", "pear\napple\nfig\napple\n");
+
+    if (time(NULL) - start > 5) {
+        fprintf(stderr, "pipe stopped: Esc did not stop the command\n");
+        ++failures;
+    }
+
+    // the file changes under an edit with as many lines, the edit stays until Ctrl-R
+    openWith(other, "one\ntwo\n");
+    type("x");
+    rewrite(other, "one\nTWO\n");
+    expectRows("changed on disk", "xone\ntwo\n");
+    type("\x12");
+    expectRows("reloaded", "one\nTWO\n");
+
+    // a Tab is an edit too
+    openWith(tabbed, "one\ntwo\n");
+    type("\t");
+    rewrite(tabbed, "one\nTWO\n");
+    expectRows("changed on disk after a Tab", "    one\ntwo\n");
+
+    // a document whose file is deleted while it hibernates gets its rows back
+    openWith(sleeping, "kept\nrows\n");
+    docHibernate(getCurrentDoc());
+    unlink(sleeping);
+    docWakeUp(getCurrentDoc());
+    expectRows("woken after its file was deleted", "kept\nrows\n");
+
+    // a new file that takes the inode of the deleted one is not that document
+    openWith(reborn, "new\nfile\n");
+    expectRows("a new file in the place of a deleted one", "new\nfile\n");
+
+    // and one whose file changed since it was read is packed instead,
+    // before the idle ticks see the change and read it again
+    struct timespec later = {1, 0};
+    openWith(changed, "first\n");
+    nanosleep(&later, NULL);
+    writeFile(changed, "second\n");
+    struct Document *doc = getCurrentDoc();
+    docHibernate(doc);
+
+    if (doc->hibernation != HIBERNATED_PACKED) {
+        fprintf(stderr, "hibernated: the file changed, it should have been packed\n");
+        ++failures;
+    }
+
+    docWakeUp(doc);
+
+    // an edit not saved yet is not dropped with the rows
+    openWith(sleeping, "alpha\nbeta\n");
+    type("\t");
+    docHibernate(getCurrentDoc());
+    docWakeUp(getCurrentDoc());
+    expectRows("woken with an unsaved Tab", "    alpha\nbeta\n");
+
+    // the wrapped rows move with the rows put in and taken out, over many blocks of them
+    static char wrapRows[1 << 20];
+    static char grown[sizeof(wrapRows) + 128];
+    char *end = wrapRows;
+
+    for (int i = 0; i < 1000; ++i) {
+        int len = i * 37 % 300;
+
+        memset(end, 'a' + i % 26, (size_t) len);
+
+        if (i % 4 == 0 && len > 0) {
+            end[len / 2] = '@';
+        }
+
+        end += len;
+        *end++ = '\n';
+    }
+
+    *end = '\0';
+    openWith(wrapped, wrapRows);
+    type("\x05");
+    expectWrap("wrapped");
+
+    char ys[101];
+    memset(ys, 'y', 100);
+    ys[100] = '\0';
+    type(ys);
+    expectWrap("a wrapped row grows");
+    type("\n");
+    expectWrap("a wrapped row is cut");
+    type("\x7f");
+    expectWrap("wrapped rows joined");
+    type("\x01" "@\n");
+    type("\n");
+
+    if (getCurrentDoc()->numRows != 1000 + 246) {
+        fprintf(stderr, "wrapped rows cut at many cursors: %ld rows\n", (long) getCurrentDoc()->numRows);
+        ++failures;
+    }
+
+    expectWrap("wrapped rows cut at many cursors");
+    type("\x7f");
+    expectWrap("wrapped rows joined at many cursors");
+    type("\x1b");
+    type("\x05");
+    snprintf(grown, sizeof(grown), "%s%s", ys, wrapRows);
+    expectRows("wrapped rows cut and joined", grown);
+
+    // the gutter follows each edit, only the rows around it are diffed again
+    enum DiffMark unchanged[10] = {DIFF_SAME};
+    enum DiffMark changedRow[10] = {DIFF_SAME, DIFF_CHANGED};
+    enum DiffMark removedRow[9] = {DIFF_SAME, DIFF_CHANGED, DIFF_SAME, DIFF_REMOVED};
+    enum DiffMark addedRow[10] = {DIFF_SAME, DIFF_CHANGED, DIFF_SAME, DIFF_REMOVED, DIFF_SAME, DIFF_SAME, DIFF_ADDED};
+
+    openWith(diffed, "one\ntwo\nthree\n\nfour\nfive\nsix\nseven\neight\nnine\n");
+    type("\x19");
+    expectDiff("diff of the file", unchanged, 10);
+    type("\x1b[Bx");
+    expectDiff("diff of a changed row", changedRow, 10);
+    type("\x1b[B\x1b[B\x1b[B\x1b[H\x7f");
+    expectDiff("diff of a removed row", removedRow, 9);
+    type("\x1b[B\x1b[B\x1b[B\x1b[Hadded\n");
+    expectDiff("diff of an added row", addedRow, 10);
+    expectRows("diffed rows", "one\nxtwo\nthree\nfour\nfive\nsix\nadded\nseven\neight\nnine\n");
+    type("\x13");
+    expectDiff("diff once saved", unchanged, 10);
+    type("\x19");
+
+    // the transforms read the cold rows where they are, they stay compressed
+    openWith(cold, "a long row, long enough to be cold: pear\n"
+                   "a long row, long enough to be cold: apple\n"
+                   "a long row, long enough to be cold: fig\n"
+                   "a long row, long enough to be cold: apple\n");
+    coolAllRows();
+    type("\x0b" "sort\n");
+    expectRows("sort cold rows", "a long row, long enough to be cold: apple\n"
+                                 "a long row, long enough to be cold: apple\n"
+                                 "a long row, long enough to be cold: fig\n"
+                                 "a long row, long enough to be cold: pear\n");
+    expectCold("sort cold rows");
+    type("\x0b" "uniq\n");
+    type("\x0b" "drop fig\n");
+    expectRows("uniq and drop cold rows", "a long row, long enough to be cold: apple\n"
+                                          "a long row, long enough to be cold: pear\n");
+    expectCold("uniq and drop cold rows");
+
+    // many copies of a few long rows, tied far past their prefixes
+    char longRow[2048];
+    FILE *fp = fopen(copies, "w");
+    memset(longRow, 'x', sizeof(longRow) - 1);
+    longRow[sizeof(longRow) - 1] = '\0';
+
+    for (int i = 0; i < 300; ++i) {
+        fprintf(fp, "%s%c\n", longRow, "bab"[i % 3]);
+    }
+
+    fclose(fp);
+    editorOpen(copies, 1);
+    coolAllRows();
+    type("\x0b" "uniq\n");
+    type("\x0b" "sort\n");
+
+    if (getCurrentDoc()->numRows != 2 || rowChars(&getCurrentDoc()->rows[0])[2047] != 'a' ||
+        rowChars(&getCurrentDoc()->rows[1])[2047] != 'b') {
+        fprintf(stderr, "uniq and sort copies of cold rows: %ld rows\n", (long) getCurrentDoc()->numRows);
+        ++failures;
+    }
+
+    // a save writes the rows as they are, cold or longer than what is written at once
+    fp = fopen(saved, "w");
+
+    for (int i = 0; i < 500; ++i) {
+        fprintf(fp, "%s row %d\n", i == 250 ? "" : "a cold", i);
+    }
+
+    for (int i = 0; i < 3 << 19; ++i) {
+        fputc('y', fp);
+    }
+
+    fputc('\n', fp);
+    fclose(fp);
+    editorOpen(saved, 1);
+    coolAllRows();
+    type("z\x13");
+
+    struct Document *reread = readAlone(saved);
+    size_t savedLen;
+    size_t rereadLen;
+    char *savedRows = editorRowsToString(&savedLen);
+    char *rereadRows = docRowsToString(reread, &rereadLen);
+
+    doc = getCurrentDoc();
+    int sameSnapshot = doc->snapshot.numChunks == reread->snapshot.numChunks &&
+                       doc->snapshot.numLines == reread->snapshot.numLines;
+
+    for (int c = 0; sameSnapshot && c < doc->snapshot.numChunks; ++c) {
+        sameSnapshot = doc->snapshot.chunks[c].hash == reread->snapshot.chunks[c].hash &&
+                       doc->snapshot.chunks[c].numLines == reread->snapshot.chunks[c].numLines &&
+                       doc->snapshot.chunks[c].numBytes == reread->snapshot.chunks[c].numBytes;
+    }
+
+    if (savedLen != rereadLen || memcmp(savedRows, rereadRows, savedLen) != 0 || !sameSnapshot) {
+        fprintf(stderr, "saved: the file or its snapshot is not what was read back\n");
+        ++failures;
+    }
+
+    free(savedRows);
+    free(rereadRows);
+    docRelease(reread);
+
+    // a big file is followed a part per tick, the rest comes with the next ones
+    openWith(followed, "");
+    fp = fopen(followed, "a");
+
+    for (int i = 0; i < 1000000; ++i) {
+        fprintf(fp, "line %d of the log\n", i);
+    }
+
+    fclose(fp);
+    type("\x06");
+    doc = getCurrentDoc();
+
+    if (doc->numRows >= 1000000 || !doc->followBehind) {
+        fprintf(stderr, "follow: %ld rows read in one tick\n", (long) doc->numRows);
+        ++failures;
+    }
+
+    for (int i = 0; i < 100 && doc->followBehind; ++i) {
+        editorIdle();
+    }
+
+    if (doc->numRows != 1000000) {
+        fprintf(stderr, "follow: %ld rows after the ticks, expected all of them\n", (long) doc->numRows);
+        ++failures;
+    }
+
+    type("\x06");
+
+    // a broken index is not believed, the file is read as if there was none
+    env.indexDir = indexDir;
+    env.indexMinSize = 0;
+    writeFile(indexed, "one\ntwo\nthree\n");
+    docRelease(readAlone(indexed));
+
+    uint64_t spoiled[] = {(uint64_t) 1 << 40 << 8, 9 << 8 | 10};
+
+    for (int i = 0; i < 2; ++i) {
+        spoilIndex(indexed, spoiled[i]);
+        doc = readAlone(indexed);
+
+        if (doc->numRows != 3 || doc->rows[2].rawSize != 5 || memcmp(rowChars(&doc->rows[2]), "three", 5) != 0) {
+            fprintf(stderr, "broken index %d: %ld rows\n", i, (long) doc->numRows);
+            ++failures;
+        }
+
+        docRelease(doc);
+    }
+
+    char *index = indexPath(indexed);
+    unlink(index);
+    free(index);
+    rmdir(indexDir);
+    unlink(indexed);
+    env.indexDir = NULL;
+
+    unlink(path);
+    unlink(other);
+    unlink(changed);
+    unlink(cold);
+    unlink(followed);
+    unlink(tabbed);
+    unlink(reborn);
+    unlink(copies);
+    unlink(saved);
+    unlink(sleeping);
+    unlink(wrapped);
+    unlink(diffed);
+
+    // last, its rows stay until the end
+    testHugeLine(huge);
+
+    if (failures > 0) {
+        fprintf(stderr, "%d failed\n", failures);
+        return 1;
+    }
+
+    return 0;
+}